@@ -7,9 +7,16 @@
 #include <array>
 #include <vector>
 #include <list>
+#include <algorithm>
+#include <type_traits>
 
 #include "common/types.hpp"
 
+namespace json
+{
+	struct Value;
+}
+
 namespace vtex2
 {
 
@@ -144,6 +151,45 @@ namespace vtex2
 			return m_opts;
 		}
 
+		/**
+		 * Serialize the values of all options into a string, skipping the indices listed in exclude
+		 * Used to identify the effective settings of a run, ie for the build cache
+		 */
+		std::string serialize(std::initializer_list<int> exclude = {}) const {
+			std::string out;
+			for (int i = 0; i < (int)m_opts.size(); ++i) {
+				if (std::find(exclude.begin(), exclude.end(), i) != exclude.end())
+					continue;
+
+				auto& o = m_opts[i];
+				out += o.m_name[1].empty() ? o.m_name[0] : o.m_name[1];
+				out += o.provided() ? "!=" : "=";
+				std::visit(
+					[&out](const auto& v)
+					{
+						using T = std::decay_t<decltype(v)>;
+						if constexpr (std::is_same_v<T, std::string>)
+							out += v;
+						else if constexpr (std::is_same_v<T, std::vector<std::string>>) {
+							for (auto& str : v)
+								out += str + ",";
+						}
+						else if constexpr (std::is_same_v<T, vec2>)
+							out += std::to_string(v.x) + "," + std::to_string(v.y);
+						else if constexpr (std::is_same_v<T, vec3>)
+							out += std::to_string(v.x) + "," + std::to_string(v.y) + "," + std::to_string(v.z);
+						else if constexpr (std::is_same_v<T, vec4>)
+							out += std::to_string(v.x) + "," + std::to_string(v.y) + "," + std::to_string(v.z) + "," +
+								   std::to_string(v.w);
+						else
+							out += std::to_string(v);
+					},
+					o.m_value);
+				out += ";";
+			}
+			return out;
+		}
+
 	private:
 		std::vector<ActionOption> m_opts;
 	};
@@ -196,4 +242,34 @@ namespace vtex2
 		virtual void cleanup() = 0;
 	};
 
+	/**
+	 * Find a registered action by name
+	 * @return nullptr if there is no action with that name
+	 */
+	BaseAction* find_action(const std::string& name);
+
+	enum class ParseResult {
+		Ok,
+		Help,		 // -? or --help was passed
+		BadArgs,	 // Unexpected or invalid argument
+		MissingArgs, // A required argument was not passed
+	};
+
+	/**
+	 * Parse the arguments following an action's name into opts, starting from the action's defaults.
+	 * Any errors are printed to stderr.
+	 */
+	ParseResult parse_action_args(BaseAction* action, int argc, char** argv, OptionList& opts);
+
+	/**
+	 * Same as above, for arguments that don't come from the command line (manifests, job files)
+	 */
+	ParseResult parse_action_args(BaseAction* action, std::vector<std::string> args, OptionList& opts);
+
+	/**
+	 * Read the "args" array of a manifest or job object into args. A missing array leaves args untouched
+	 * @returns false if "args" isn't an array of strings, numbers and booleans
+	 */
+	bool get_json_args(const json::Value& object, std::vector<std::string>& args);
+
 } // namespace vtex2
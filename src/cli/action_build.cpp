@@ -0,0 +1,432 @@
+/**
+ * Manifest driven builds
+ *
+ * {
+ *   "sources": [
+ *     {"source": "rock.png", "args": ["--srgb"], "outputs": [
+ *       {"path": "out/rock.vtf", "args": ["-f", "dxt1", "--quality", "best"]},
+ *       {"path": "out/rock_fast.vtf", "args": ["-f", "dxt1", "--quality", "fast"]},
+ *       {"path": "out/rock_preview.png", "args": ["--width", "256", "--height", "256"]}
+ *     ]}
+ *   ],
+ *   "pack": [
+ *     {"args": ["--normal", "--normal-map", "n.png", "--height-map", "h.png", "out/rock_n.vtf"]}
+ *   ]
+ * }
+ *
+ * Output args are convert args, appended to the source's shared args. Outputs that aren't VTFs are written as plain
+ * image previews, only --width and --height apply to those. All paths are relative to the manifest's directory.
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+
+#include "fmt/format.h"
+#include "VTFLib.h"
+
+#include "action_build.hpp"
+#include "action_convert.hpp"
+#include "action_pack.hpp"
+#include "common/image.hpp"
+#include "common/pipeline.hpp"
+#include "common/mapped_file.hpp"
+#include "common/parallel.hpp"
+#include "common/util.hpp"
+#include "common/vtftools.hpp"
+
+// Windows garbage!!
+#undef min
+#undef max
+
+using namespace VTFLib;
+using namespace vtex2;
+
+namespace opts
+{
+	static int manifest;
+	static int jobs;
+	static int keepgoing;
+	static int quiet;
+	static int cache;
+} // namespace opts
+
+struct ActionBuild::Source {
+	struct Output {
+		std::filesystem::path path;
+		std::vector<std::string> args;
+	};
+
+	std::filesystem::path path;
+	std::vector<std::string> args;
+	std::vector<Output> outputs;
+
+	util::MappedFile data;
+	bool isvtf = false;
+
+	// Decoded on first use and shared by all of the outputs
+	std::once_flag decodeOnce;
+	std::shared_ptr<imglib::Image> image;
+
+	BaseCache bases;
+
+	std::shared_ptr<imglib::Image> decode();
+};
+
+//
+// Decode the source once, no matter how many outputs ask for it. For VTF sources this is the first frame's base mip
+// as RGBA8888, which is all a preview needs
+//
+std::shared_ptr<imglib::Image> ActionBuild::Source::decode() {
+	std::call_once(
+		decodeOnce,
+		[this]
+		{
+			if (!isvtf) {
+				image = imglib::Image::load(data.data(), data.size());
+				return;
+			}
+
+			CVTFFile file;
+			if (!vtf::load(&file, data.data(), data.size()))
+				return;
+
+			auto rgba = std::make_shared<imglib::Image>(
+				imglib::ChannelType::UInt8, 4, file.GetWidth(), file.GetHeight(), false);
+			if (CVTFFile::ConvertToRGBA8888(
+					file.GetData(0, 0, 0, 0), rgba->data<vlByte>(), file.GetWidth(), file.GetHeight(),
+					file.GetFormat()))
+				image = rgba;
+		});
+	return image;
+}
+
+std::string ActionBuild::get_help() const {
+	return "Build every target in a JSON manifest, decoding each source only once";
+}
+
+const OptionList& ActionBuild::get_options() const {
+	static OptionList opts;
+	if (opts.empty()) {
+		opts::jobs = opts.add(
+			ActionOption()
+				.short_opt("-j")
+				.long_opt("--jobs")
+				.type(OptType::Int)
+				.value(0)
+				.help("Number of sources to build in parallel. 0=use all cores"));
+
+		opts::keepgoing = opts.add(
+			ActionOption()
+				.short_opt("-k")
+				.long_opt("--keep-going")
+				.type(OptType::Bool)
+				.value(false)
+				.help("Keep building the remaining targets after one fails"));
+
+		opts::quiet = opts.add(
+			ActionOption()
+				.short_opt("-q")
+				.long_opt("--quiet")
+				.type(OptType::Bool)
+				.value(false)
+				.help("Only print errors"));
+
+		opts::cache = opts.add(
+			ActionOption()
+				.long_opt("--cache")
+				.type(OptType::String)
+				.value("")
+				.help("Build cache manifest to use for all targets, including pack jobs that don't name their own"));
+
+		opts::manifest = opts.add(
+			ActionOption()
+				.metavar("manifest")
+				.type(OptType::String)
+				.value("")
+				.help("JSON build manifest")
+				.required(true)
+				.end_of_line(true));
+	};
+	return opts;
+}
+
+int ActionBuild::exec(const OptionList& opts) {
+	const auto manifestPath = std::filesystem::absolute(opts.get<std::string>(opts::manifest));
+	const bool keepGoing = opts.get<bool>(opts::keepgoing);
+	const bool quiet = opts.get<bool>(opts::quiet);
+	const int numThreads = util::resolve_thread_count(opts.get<int>(opts::jobs));
+
+	// Resolve this before changing directories, it's relative to where we were run from
+	auto cachePath = opts.get<std::string>(opts::cache);
+	if (!cachePath.empty())
+		cachePath = std::filesystem::absolute(cachePath).string();
+
+	std::ifstream stream(manifestPath, std::ios::binary);
+	if (!stream) {
+		std::cerr << fmt::format("Could not open manifest '{}'\n", manifestPath.string());
+		return 1;
+	}
+	std::stringstream text;
+	text << stream.rdbuf();
+
+	json::Value manifest;
+	std::string err;
+	if (!json::parse(text.str(), manifest, err) || !manifest.is_object()) {
+		std::cerr << fmt::format(
+			"Invalid manifest '{}': {}\n", manifestPath.string(), err.empty() ? "must be a JSON object" : err);
+		return 1;
+	}
+
+	std::vector<Source> sources;
+	if (!load_sources(manifest, sources))
+		return 1;
+
+	const auto* packJobs = manifest.find("pack");
+	if (packJobs && !packJobs->is_array()) {
+		std::cerr << "\"pack\" must be an array\n";
+		return 1;
+	}
+
+	// Everything in the manifest is relative to it. The working directory is restored once we're done, so serve mode
+	// can run several manifests back to back
+	std::error_code ec;
+	const auto prevDir = std::filesystem::current_path();
+	std::filesystem::current_path(manifestPath.parent_path(), ec);
+	if (ec) {
+		std::cerr << fmt::format("Could not enter '{}': {}\n", manifestPath.parent_path().string(), ec.message());
+		return 1;
+	}
+	auto restoreDir = util::cleanup(
+		[&prevDir]
+		{
+			std::error_code ec;
+			std::filesystem::current_path(prevDir, ec);
+		});
+
+	std::unique_ptr<cache::BuildCache> buildCache;
+	if (!cachePath.empty()) {
+		buildCache = std::make_unique<cache::BuildCache>();
+		if (!buildCache->load(cachePath)) {
+			std::cerr << fmt::format("Could not read build cache '{}'\n", cachePath);
+			return 1;
+		}
+	}
+
+	std::atomic<bool> stop = false;
+	std::atomic<std::size_t> numBuilt = 0;
+	std::mutex failMutex;
+	std::vector<std::filesystem::path> failures;
+
+	const auto startTime = std::chrono::steady_clock::now();
+
+	util::parallel_for(
+		sources.size(),
+		[&](std::size_t index)
+		{
+			if (stop)
+				return;
+
+			auto& source = sources[index];
+			if (build_source(source, opts, buildCache.get())) {
+				++numBuilt;
+				return;
+			}
+
+			std::lock_guard lock(failMutex);
+			failures.push_back(source.path);
+			if (!keepGoing)
+				stop = true;
+		},
+		numThreads);
+
+	// Pack jobs share the build cache, so it has to be written out before they load it
+	bool ok = failures.empty();
+	if (buildCache && !buildCache->save()) {
+		std::cerr << fmt::format("Could not write build cache '{}'\n", cachePath);
+		ok = false;
+	}
+
+	std::size_t numPacked = 0;
+	if (packJobs && (ok || keepGoing)) {
+		auto* pack = static_cast<ActionPack*>(find_action("pack"));
+		if (!pack->run_batch(packJobs->items, cachePath, numThreads, keepGoing, quiet, numPacked))
+			ok = false;
+	}
+
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+
+	if (!failures.empty()) {
+		std::cerr << fmt::format("{} source(s) failed to build:\n", failures.size());
+		for (auto& f : failures)
+			std::cerr << fmt::format("    {}\n", f.string());
+	}
+
+	if (!quiet) {
+		fmt::print(
+			"Built {} of {} source(s) and {} of {} pack job(s) in {:.2f}s\n", numBuilt.load(),
+			sources.size(), numPacked, packJobs ? packJobs->items.size() : 0, elapsed.count());
+	}
+
+	return ok ? 0 : 1;
+}
+
+void ActionBuild::cleanup() {
+}
+
+//
+// Validate the "sources" list up front, so a typo doesn't show up halfway through a build
+//
+bool ActionBuild::load_sources(const json::Value& manifest, std::vector<Source>& sources) {
+	const auto* list = manifest.find("sources");
+	if (!list)
+		return true;
+	if (!list->is_array()) {
+		std::cerr << "\"sources\" must be an array\n";
+		return false;
+	}
+
+	// Sources hold a once_flag and a mutex, so they can't be moved around once created
+	sources = std::vector<Source>(list->items.size());
+	for (std::size_t i = 0; i < list->items.size(); ++i) {
+		auto& entry = list->items[i];
+		auto& source = sources[i];
+
+		const auto* path = entry.find("source");
+		if (!path || !path->is_string() || path->str.empty()) {
+			std::cerr << fmt::format("Source {} is missing \"source\"\n", i);
+			return false;
+		}
+		source.path = path->str;
+		source.isvtf = source.path.extension() == ".vtf";
+
+		if (!get_json_args(entry, source.args)) {
+			std::cerr << fmt::format("{}: \"args\" must be an array of strings\n", path->str);
+			return false;
+		}
+
+		const auto* outputs = entry.find("outputs");
+		if (!outputs || !outputs->is_array() || outputs->items.empty()) {
+			std::cerr << fmt::format("{}: \"outputs\" must be a non-empty array\n", path->str);
+			return false;
+		}
+
+		for (auto& out : outputs->items) {
+			Source::Output output;
+			const auto* outPath = out.find("path");
+			if (!outPath || !outPath->is_string() || outPath->str.empty()) {
+				std::cerr << fmt::format("{}: output is missing \"path\"\n", path->str);
+				return false;
+			}
+			output.path = outPath->str;
+			if (!get_json_args(out, output.args)) {
+				std::cerr << fmt::format("{}: \"args\" must be an array of strings\n", outPath->str);
+				return false;
+			}
+			source.outputs.push_back(std::move(output));
+		}
+	}
+	return true;
+}
+
+//
+// Build every output of a single source. The source is read once, and the outputs fan out across the pool from there
+//
+bool ActionBuild::build_source(Source& source, const OptionList& opts, cache::BuildCache* buildCache) {
+	auto* convert = static_cast<ActionConvert*>(find_action("convert"));
+
+	if (!source.data.open(source.path.string())) {
+		std::cerr << fmt::format("Could not open {}\n", source.path.string());
+		return false;
+	}
+
+	std::atomic<bool> ok = true;
+	util::parallel_for(
+		source.outputs.size(),
+		[&](std::size_t index)
+		{
+			auto& output = source.outputs[index];
+
+			auto args = source.args;
+			args.insert(args.end(), output.args.begin(), output.args.end());
+
+			if (output.path.extension() != ".vtf") {
+				if (!build_preview(source, output.path, args))
+					ok = false;
+				return;
+			}
+
+			args.insert(args.end(), {"-o", output.path.string(), source.path.string()});
+			if (opts.get<bool>(opts::quiet))
+				args.insert(args.begin(), "-q");
+
+			OptionList convertOpts;
+			if (parse_action_args(convert, args, convertOpts) != ParseResult::Ok) {
+				std::cerr << fmt::format("{}: invalid arguments\n", output.path.string());
+				ok = false;
+				return;
+			}
+
+			ConvertJob job;
+			job.opts = &convertOpts;
+			job.cache = buildCache;
+			job.srcData = source.data.data();
+			job.srcSize = source.data.size();
+			job.bases = &source.bases;
+			if (!source.isvtf)
+				job.srcImage = [&source] { return source.decode(); };
+
+			if (!convert->process_file(job, source.path, output.path))
+				ok = false;
+			job.flush();
+		});
+
+	// Nothing else will need it, free it up while the other sources are still going
+	source.bases.clear();
+	source.image.reset();
+	source.data.close();
+	return ok;
+}
+
+//
+// Write a plain image of the source, ie a thumbnail for an asset browser
+//
+bool ActionBuild::build_preview(Source& source, const std::filesystem::path& out, const std::vector<std::string>& args) {
+	const auto format = imglib::image_get_format_from_file(out.string().c_str());
+	if (format == imglib::FileFormat::None) {
+		std::cerr << fmt::format("{}: unsupported output format\n", out.string());
+		return false;
+	}
+
+	// Take the same options as convert, so shared source args don't trip us up
+	OptionList previewOpts;
+	auto argsWithFile = args;
+	argsWithFile.push_back(source.path.string());
+	if (parse_action_args(find_action("convert"), argsWithFile, previewOpts) != ParseResult::Ok) {
+		std::cerr << fmt::format("{}: invalid arguments\n", out.string());
+		return false;
+	}
+
+	auto image = source.decode();
+	if (!image) {
+		std::cerr << fmt::format("Could not decode {}\n", source.path.string());
+		return false;
+	}
+
+	imglib::Pipeline pipeline;
+	const int width = previewOpts.find("--width")->get<int>();
+	const int height = previewOpts.find("--height")->get<int>();
+	if (width != -1 && height != -1)
+		pipeline.resize(width, height);
+	pipeline.convert(format == imglib::FileFormat::Hdr ? imglib::ChannelType::Float : imglib::ChannelType::UInt8);
+
+	auto result = pipeline.run(*image);
+	if (!result || !result->save(out.string().c_str(), format)) {
+		std::cerr << fmt::format("Could not save {}\n", out.string());
+		return false;
+	}
+	return true;
+}
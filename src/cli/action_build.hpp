@@ -0,0 +1,36 @@
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "action.hpp"
+#include "common/json.hpp"
+#include "common/cache.hpp"
+
+namespace vtex2
+{
+
+	/**
+	 * Builds every target listed in a JSON manifest in one go.
+	 * Each source is only decoded once, and outputs that only differ in format or quality also share the base mip
+	 * chain. The conversions fan out from there. Pack jobs run after all sources are done.
+	 */
+	class ActionBuild : public BaseAction {
+	public:
+		std::string get_name() const override {
+			return "build";
+		}
+		std::string get_help() const override;
+		const OptionList& get_options() const override;
+		int exec(const OptionList& opts) override;
+		void cleanup() override;
+
+	private:
+		struct Source;
+
+		bool load_sources(const json::Value& manifest, std::vector<Source>& sources);
+		bool build_source(Source& source, const OptionList& opts, cache::BuildCache* buildCache);
+		bool build_preview(Source& source, const std::filesystem::path& out, const std::vector<std::string>& args);
+	};
+
+} // namespace vtex2
@@ -2,24 +2,39 @@
  * Implements both convert and modify actions
  *  Lots of TODOs here:
  *   @TODO: Manual mips
- *   @TODO: Multi-frame
- *   @TODO: Multi-face
  *   @TODO: Thumbnail
  */
 #include <unordered_map>
 #include <functional>
 #include <iostream>
 #include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <string_view>
+#include <optional>
+#include <limits>
 
 #include "nameof.hpp"
 #include "fmt/format.h"
 #include "VTFLib.h"
 
 #include "action_convert.hpp"
+#include "profile.hpp"
 #include "common/enums.hpp"
 #include "common/image.hpp"
+#include "common/pipeline.hpp"
 #include "common/util.hpp"
+#include "common/mapped_file.hpp"
 #include "common/vtftools.hpp"
+#include "common/vtfheader.hpp"
+#include "common/parallel.hpp"
+#include "common/batchio.hpp"
+#include "common/cache.hpp"
+#include "common/metrics.hpp"
+#include "common/vtex2_version.h"
 
 // Windows garbage!!
 #undef min
@@ -46,10 +61,31 @@ namespace opts
 	static int width, height;
 	static int nomips;
 	static int toDX;
+	static int renormalize;
+	static int premultiply;
+	static int invert;
+	static int swizzle;
 	static int quiet;
+	static int jobs;
+	static int keepgoing;
+	static int cache;
+	static int quality;
+	static int budget;
+	static int prefetch;
+	static int dryrun;
+	static int reportquality;
+	static int minpsnr;
 } // namespace opts
 
 static bool get_version_from_str(const std::string& str, int& major, int& minor);
+static bool get_proc_flags(ConvertJob& job, imglib::ProcFlags& flags);
+static std::uint32_t get_user_flags(const OptionList& opts, int mips);
+static util::WriteBehind::Callback
+on_write(const ConvertJob& job, const std::filesystem::path& outFile, const cache::Key* cacheKey);
+static bool is_source_set(const std::filesystem::path& path);
+static bool is_gif(const ConvertJob& job, const std::filesystem::path& path);
+static bool find_source_set(ConvertJob& job, const std::filesystem::path& pattern);
+static std::filesystem::path source_set_output(const std::filesystem::path& pattern);
 
 std::string ActionConvert::get_help() const {
 	return "Convert a generic image file to VTF";
@@ -228,6 +264,34 @@ const OptionList& ActionConvert::get_options() const {
 				.type(OptType::Bool)
 				.help("Treat the incoming normal map as an OpenGL normal map"));
 
+		opts::renormalize = opts.add(
+			ActionOption()
+				.long_opt("--renormalize")
+				.value(false)
+				.type(OptType::Bool)
+				.help("Rescale the vectors of the incoming normal map to unit length"));
+
+		opts::premultiply = opts.add(
+			ActionOption()
+				.long_opt("--premultiply")
+				.value(false)
+				.type(OptType::Bool)
+				.help("Premultiply color by alpha"));
+
+		opts::invert = opts.add(
+			ActionOption()
+				.long_opt("--invert")
+				.type(OptType::String)
+				.value("")
+				.help("Channels to invert, any of r, g, b and a. For example --invert ga"));
+
+		opts::swizzle = opts.add(
+			ActionOption()
+				.long_opt("--swizzle")
+				.type(OptType::String)
+				.value("")
+				.help("Reorder channels, given as the source of each of r, g, b and a. For example --swizzle bgra"));
+
 		opts::quiet = opts.add(
 			ActionOption()
 				.long_opt("--quiet")
@@ -236,6 +300,79 @@ const OptionList& ActionConvert::get_options() const {
 				.type(OptType::Bool)
 				.help("Silence output messages that aren't errors")
 		);
+
+		opts::jobs = opts.add(
+			ActionOption()
+				.long_opt("--jobs")
+				.short_opt("-j")
+				.value(1)
+				.type(OptType::Int)
+				.help("Number of files to convert in parallel when processing a directory. 0=use all cores"));
+
+		opts::keepgoing = opts.add(
+			ActionOption()
+				.long_opt("--keep-going")
+				.short_opt("-k")
+				.value(false)
+				.type(OptType::Bool)
+				.help("Keep converting the remaining files after a failure and report all failures at the end"));
+
+		opts::quality = opts.add(
+			ActionOption()
+				.long_opt("--quality")
+				.type(OptType::String)
+				.value("normal")
+				.choices({"fast", "normal", "best"})
+				.help(
+					"Block compression quality for DXT1/DXT3/DXT5/ATI1N/ATI2N/BC7. fast for quick iteration, best for "
+					"release builds"));
+
+		opts::budget = opts.add(
+			ActionOption()
+				.long_opt("--memory-budget")
+				.type(OptType::Int)
+				.value(0)
+				.help("Working memory budget per file in MiB. Images that would need more are resized, converted and "
+					  "mipped band by band, straight into the output format. 0=unlimited"));
+
+		opts::dryrun = opts.add(
+			ActionOption()
+				.long_opt("--dry-run")
+				.value(false)
+				.type(OptType::Bool)
+				.help("Only list what would be converted, from each source's header. Nothing is decoded or written"));
+
+		opts::reportquality = opts.add(
+			ActionOption()
+				.long_opt("--report-quality")
+				.value(false)
+				.type(OptType::Bool)
+				.help("Report the PSNR and SSIM of each channel of every mip, between the processed image and what the "
+					  "output format actually stores"));
+
+		opts::minpsnr = opts.add(
+			ActionOption()
+				.long_opt("--min-psnr")
+				.type(OptType::Float)
+				.value(0)
+				.help("Fail files where any channel of the top mip has a PSNR below this many dB. Implies "
+					  "--report-quality. 0=off"));
+
+		opts::prefetch = opts.add(
+			ActionOption()
+				.long_opt("--prefetch")
+				.type(OptType::Int)
+				.value(4)
+				.help("Number of files to read ahead and write behind in the background when processing a directory, "
+					  "so I/O overlaps with the conversion. 0=off"));
+
+		opts::cache = opts.add(
+			ActionOption()
+				.long_opt("--cache")
+				.type(OptType::String)
+				.value("")
+				.help("Build cache manifest to use. Files whose source and options are unchanged since the last run "
+					  "are skipped"));
 	};
 	return opts;
 }
@@ -244,87 +381,359 @@ int ActionConvert::exec(const OptionList& opts) {
 	auto outfile = opts.get<std::string>(opts::output);
 	auto recursive = opts.get<bool>(opts::recursive);
 	auto file = opts.get<std::string>(opts::file);
+	auto cachePath = opts.get<std::string>(opts::cache);
+
+	// Optional build cache, outputs are skipped if they're already up to date
+	std::unique_ptr<cache::BuildCache> buildCache;
+	if (!cachePath.empty()) {
+		buildCache = std::make_unique<cache::BuildCache>();
+		if (!buildCache->load(cachePath)) {
+			std::cerr << fmt::format("Could not read build cache '{}'\n", cachePath);
+			return 1;
+		}
+	}
 
-	if (std::filesystem::is_directory(file)) {
-		if (recursive) {
-			auto it = std::filesystem::recursive_directory_iterator(file);
-			for (auto& dirent : it) {
-				if (dirent.is_directory())
-					continue;
-				// check that we're actually a convertable file
-				if (imglib::image_get_format_from_file(dirent.path().string().c_str()) == imglib::FileFormat::None)
-					continue;
-				if (!process_file(opts, dirent, ""))
-					return 1;
-			}
+	const auto saveCache = [&buildCache, &cachePath]() -> bool
+	{
+		if (buildCache && !buildCache->save()) {
+			std::cerr << fmt::format("Could not write build cache '{}'\n", cachePath);
+			return false;
 		}
-		else {
-			auto it = std::filesystem::directory_iterator(file);
-			for (auto& dirent : it) {
-				if (dirent.is_directory())
+		return true;
+	};
+
+	if (!std::filesystem::is_directory(file)) {
+		ConvertJob job;
+		job.opts = &opts;
+		job.cache = buildCache.get();
+		bool ok = process_file(job, file, outfile);
+		job.flush();
+		return ok && saveCache() ? 0 : 1;
+	}
+
+	// Gather all of the files up front, so they may be handed out to the workers
+	std::vector<std::filesystem::path> files;
+	const auto addFile = [&files](const std::filesystem::directory_entry& dirent)
+	{
+		if (dirent.is_directory())
+			return;
+		// check that we're actually a convertable file
+		if (imglib::image_get_format_from_file(dirent.path().string().c_str()) == imglib::FileFormat::None)
+			return;
+		files.push_back(dirent.path());
+	};
+
+	if (recursive) {
+		for (auto& dirent : std::filesystem::recursive_directory_iterator(file))
+			addFile(dirent);
+	}
+	else {
+		for (auto& dirent : std::filesystem::directory_iterator(file))
+			addFile(dirent);
+	}
+
+	int r = process_batch(opts, files, buildCache.get());
+	return saveCache() ? r : 1;
+}
+
+//
+// Convert a list of files, spread across -j worker threads
+// Each worker pulls the next unprocessed file as soon as it finishes its current one. Files are handed out in order,
+// so the prefetcher can read ahead of the workers while the finished VTFs are written out behind them
+//
+int ActionConvert::process_batch(
+	const OptionList& opts, const std::vector<std::filesystem::path>& files, cache::BuildCache* buildCache) {
+	const bool keepGoing = opts.get<bool>(opts::keepgoing);
+	const bool quiet = opts.get<bool>(opts::quiet);
+	const int numThreads = util::resolve_thread_count(opts.get<int>(opts::jobs));
+	const bool dryRun = opts.get<bool>(opts::dryrun);
+	const int prefetchDepth = dryRun ? 0 : opts.get<int>(opts::prefetch); // A dry run only reads headers
+
+	std::atomic<bool> stop = false;
+	std::atomic<std::size_t> nextFile = 0;
+	std::atomic<std::size_t> numDone = 0;
+	std::atomic<std::size_t> numUpToDate = 0;
+	std::atomic<std::uintmax_t> srcBytes = 0;
+
+	std::mutex failMutex;
+	std::vector<std::filesystem::path> failures;
+
+	const auto startTime = std::chrono::steady_clock::now();
+
+	std::optional<util::Prefetcher> prefetcher;
+	std::optional<util::WriteBehind> writer;
+	if (prefetchDepth > 0) {
+		prefetcher.emplace(files, prefetchDepth);
+		writer.emplace(prefetchDepth);
+	}
+
+	// Work within each file fans out on the same pool. Nested work never runs more threads than the pool has, so the
+	// threads aren't split up between files, and the last few files of a batch get every core
+	util::parallel_for(
+		numThreads,
+		[&](std::size_t)
+		{
+			std::size_t index;
+			while (!stop && (index = nextFile++) < files.size()) {
+				const auto& path = files[index];
+
+				// Files the prefetcher couldn't read are read as usual, so they fail with the usual errors
+				std::vector<std::uint8_t> data;
+				ConvertJob job;
+				job.opts = &opts;
+				job.cache = buildCache;
+				if (prefetcher && prefetcher->take(index, data)) {
+					job.srcData = data.data();
+					job.srcSize = data.size();
+				}
+				job.writer = writer ? &*writer : nullptr;
+
+				// Counted up front, so a write that fails in the background can take its file back out
+				std::error_code ec;
+				auto size = data.empty() ? std::filesystem::file_size(path, ec) : data.size();
+				size = ec ? 0 : size;
+				if (writer)
+					job.written = [&srcBytes, size](bool ok)
+					{
+						if (!ok)
+							srcBytes -= size;
+					};
+
+				const bool ok = process_file(job, path, "");
+				job.flush();
+
+				if (ok && job.upToDate) {
+					++numUpToDate;
 					continue;
-				// check that we're actually a convertable file
-				if (imglib::image_get_format_from_file(dirent.path().string().c_str()) == imglib::FileFormat::None)
+				}
+				else if (ok) {
+					srcBytes += size;
+					++numDone;
 					continue;
-				if (!process_file(opts, dirent, ""))
-					return 1;
+				}
+
+				std::lock_guard lock(failMutex);
+				failures.push_back(path);
+				if (!keepGoing) {
+					stop = true;
+					if (prefetcher)
+						prefetcher->stop();
+				}
 			}
+		},
+		numThreads);
+
+	// The run isn't done until everything is on disk
+	prefetcher.reset();
+	if (writer) {
+		for (auto& out : writer->flush()) {
+			std::cerr << fmt::format("Could not save file {}\n", out.string());
+			failures.push_back(out);
+			--numDone;
 		}
-		return 0;
 	}
-	else {
-		return process_file(opts, file, outfile) ? 0 : 1;
+
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+
+	if (!failures.empty()) {
+		std::cerr << fmt::format("{} file(s) failed to convert:\n", failures.size());
+		for (auto& f : failures)
+			std::cerr << fmt::format("    {}\n", f.string());
+	}
+
+	if (!quiet) {
+		const double secs = std::max(elapsed.count(), 1e-6);
+		fmt::print(
+			"{} {} of {} file(s) in {:.2f}s using {} thread(s) ({:.1f} files/s, {:.1f} MB/s)\n",
+			dryRun ? "Checked" : "Converted", numDone.load(), files.size(), elapsed.count(), numThreads, numDone / secs,
+			(srcBytes / (1024.0 * 1024.0)) / secs);
+		if (numUpToDate > 0)
+			fmt::print("{} file(s) were already up to date\n", numUpToDate.load());
 	}
+
+	return failures.empty() ? 0 : 1;
 }
 
 void ActionConvert::cleanup() {
 }
 
+BaseCache::Entry& BaseCache::get(const std::string& key) {
+	std::lock_guard lock(m_mutex);
+	auto& entry = m_entries[key];
+	if (!entry)
+		entry = std::make_unique<Entry>();
+	return *entry;
+}
+
+void BaseCache::clear() {
+	std::lock_guard lock(m_mutex);
+	m_entries.clear();
+}
+
+void ConvertJob::flush() {
+	static std::mutex outputMutex;
+	std::lock_guard lock(outputMutex);
+	if (!out.empty())
+		std::fwrite(out.data(), 1, out.size(), toStdout ? stderr : stdout);
+	if (!err.empty()) {
+		std::fflush(stdout);
+		std::cerr << err;
+	}
+	out.clear();
+	err.clear();
+}
+
 bool ActionConvert::process_file(
-	const OptionList& opts, const std::filesystem::path& srcFile, const std::filesystem::path& userOutputFile) {
+	ConvertJob& job, const std::filesystem::path& srcFile, const std::filesystem::path& userOutputFile) {
 
-	m_opts = &opts;
+	const auto& opts = *job.opts;
+	profile::Scope fileScope("convert", srcFile.string());
 
 	const auto formatStr = opts.get<std::string>(opts::format);
-	const auto srgb = opts.get<bool>(opts::srgb);
-	const auto thumbnail = opts.get<bool>(opts::thumbnail);
-	const auto verStr = opts.get<std::string>(opts::version);
-	const auto isNormal = opts.get<bool>(opts::normal);
 
 	auto nomips = opts.get<bool>(opts::nomips);
-	m_mips = nomips ? 1 : std::max(opts.get<int>(opts::mips), 1);
+	job.mips = nomips ? 1 : std::max(opts.get<int>(opts::mips), 1);
 	// If mips is not provided, we'll use a default later on
 	if (!opts.has(opts::mips) && !nomips)
-		m_mips = -1;
+		job.mips = -1;
 
-	m_width = opts.get<int>(opts::width);
-	m_height = opts.get<int>(opts::height);
+	job.width = opts.get<int>(opts::width);
+	job.height = opts.get<int>(opts::height);
 
-	if (!std::filesystem::exists(srcFile)) {
-		std::cerr << "Could not open " << srcFile << ": file does not exist\n";
+	if (!bcn::quality_from_string(opts.get<std::string>(opts::quality), job.quality)) {
+		job.err += fmt::format("Invalid quality '{}'! Valid options: fast, normal, best\n", opts.get<std::string>(opts::quality));
 		return false;
 	}
 
-	bool isvtf = srcFile.filename().extension() == ".vtf";
+	if (!get_proc_flags(job, job.procFlags))
+		return false;
+
+	// "-" reads the source from stdin. The output then defaults to stdout too, so vtex2 can sit in a pipe
+	const bool fromStdin = srcFile == "-";
+	std::vector<std::uint8_t> stdinData;
+	auto srcDataCleanup = util::cleanup(
+		[&job, fromStdin]
+		{
+			if (fromStdin)
+				job.srcData = nullptr;
+		});
+	if (fromStdin) {
+		util::set_binary_mode(stdin);
+		if (!util::read_stream(stdin, stdinData) || stdinData.empty()) {
+			job.err += "Could not read source image from stdin\n";
+			return false;
+		}
+		job.srcData = stdinData.data();
+		job.srcSize = stdinData.size();
+	}
+	// Frames and cubemap faces can come from a set of files, named by a pattern
+	else if (!job.srcData && !job.srcImage && is_source_set(srcFile)) {
+		if (!find_source_set(job, srcFile))
+			return false;
+	}
+	else if (!job.srcData && !job.srcImage && !std::filesystem::exists(srcFile)) {
+		job.err += fmt::format("Could not open {}: file does not exist\n", srcFile.string());
+		return false;
+	}
+
+	// There's no extension to go off of for stdin, so check the magic instead
+	bool isvtf = fromStdin ? stdinData.size() >= 4 && !memcmp(stdinData.data(), "VTF\0", 4)
+						   : srcFile.filename().extension() == ".vtf";
+	if (isvtf && !job.sourceSet.empty()) {
+		job.err += "Frames and faces can only be imported from images, not VTFs\n";
+		return false;
+	}
 
 	// If an out file name is not provided, we need to build our own
 	std::filesystem::path outFile;
 	if (userOutputFile.empty()) {
-		outFile = srcFile.parent_path() / srcFile.filename().replace_extension(".vtf");
+		outFile = fromStdin				   ? "-"
+				: !job.sourceSet.empty() ? source_set_output(srcFile)
+										 : srcFile.parent_path() / srcFile.filename().replace_extension(".vtf");
 	}
 	else {
 		outFile = userOutputFile;
 	}
+	job.toStdout = outFile == "-";
+
+	if (job.cache && (fromStdin || job.toStdout)) {
+		job.err += "--cache can't be used when reading from stdin or writing to stdout\n";
+		return false;
+	}
+
+	// Skip the file entirely if the cache says it's up to date. This only hashes the source bytes; nothing gets decoded
+	cache::Key cacheKey;
+	if (job.cache) {
+		cacheKey.opts = cache::fnv1a(
+			opts.serialize({opts::output, opts::file, opts::recursive, opts::quiet, opts::jobs, opts::keepgoing,
+							opts::cache, opts::budget, opts::prefetch, opts::dryrun, opts::reportquality}),
+			cache::fnv1a(VTEX2_VERSION));
+
+		bool hashed = true;
+		if (job.srcData)
+			cache::hash_data(job.srcData, job.srcSize, cacheKey);
+		else if (!job.sourceSet.empty()) {
+			for (auto& file : job.sourceSet)
+				hashed = hashed && cache::hash_file(file, cacheKey);
+		}
+		else
+			hashed = cache::hash_file(srcFile, cacheKey);
+
+		if (!hashed) {
+			job.err += fmt::format("Could not read {}\n", srcFile.string());
+			return false;
+		}
+
+		if (job.cache->up_to_date(outFile, cacheKey)) {
+			if (!opts.get<bool>(opts::quiet))
+				job.out += fmt::format("{} -> {} (up to date)\n", srcFile.string(), outFile.string());
+			job.upToDate = true;
+			return true;
+		}
+	}
 
 	auto format = ImageFormatFromUserString(formatStr.c_str());
-	auto vtfFile = std::make_unique<CVTFFile>();
+
+	if (opts.get<bool>(opts::dryrun))
+		return dry_run(job, srcFile, outFile, isvtf, format);
+
+	// VTFs that only get new metadata skip the decode, mip generation and encode entirely
+	if (isvtf) {
+		bool patched = false;
+		if (!patch_vtf(job, srcFile, outFile, format, job.cache ? &cacheKey : nullptr, patched))
+			return false;
+		if (patched)
+			return true; // patch_vtf keeps the cache up to date itself
+	}
 
 	// We will choose the best format to operate on here. This simplifies later code and lets us avoid extraneous
-	// conversions
+	// conversions. Uncompressed formats that map straight onto an image layout are processed as is, so the data isn't
+	// widened to RGBA and converted back at the end, and half float keeps its range
 	auto formatInfo = CVTFFile::GetImageFormatInfo(format);
 	imglib::ChannelType procChanType;
-	const auto procFormat = [formatInfo, &procChanType]() -> VTFImageFormat
+	int procComps = 4;
+	const auto procFormat = [format, formatInfo, &procChanType, &procComps]() -> VTFImageFormat
 	{
+		switch (format) {
+			case IMAGE_FORMAT_RGB888:
+				procChanType = imglib::ChannelType::UInt8;
+				procComps = 3;
+				return format;
+			case IMAGE_FORMAT_RGBA16161616F:
+				procChanType = imglib::ChannelType::Half;
+				return format;
+			case IMAGE_FORMAT_RGB323232F:
+				procChanType = imglib::ChannelType::Float;
+				procComps = 3;
+				return format;
+			case IMAGE_FORMAT_R32F:
+				procChanType = imglib::ChannelType::Float;
+				procComps = 1;
+				return format;
+			default:
+				break;
+		}
+
 		auto maxBpp = std::max(
 			std::max(formatInfo.uiRedBitsPerPixel, formatInfo.uiGreenBitsPerPixel),
 			std::max(formatInfo.uiBlueBitsPerPixel, formatInfo.uiAlphaBitsPerPixel));
@@ -342,110 +751,256 @@ bool ActionConvert::process_file(
 		}
 	}();
 
-	// If we're processing a VTF, let's add that VTF image data
-	size_t initialSize = 0;
-	if (isvtf) {
-		auto* srcVtf = init_from_file(srcFile, vtfFile.get(), procFormat);
-		if (!srcVtf) {
-			std::cerr << fmt::format("Could not open {}\n", srcFile.string());
+	// Under a memory budget, images whose processing format copy and mips wouldn't fit are built band by band straight
+	// into the output format instead. VTF sources are already fully in memory by the time we know their size, so
+	// they always take the regular path, like sources with more than one frame or face
+	std::shared_ptr<CVTFFile> vtfFile;
+	const auto budget = size_t(std::max(opts.get<int>(opts::budget), 0)) * 1024 * 1024;
+	auto prevSrcImage = job.srcImage;
+	auto srcImageCleanup = util::cleanup([&job, &prevSrcImage] { job.srcImage = prevSrcImage; });
+	const bool multiFrame = !job.sourceSet.empty() || is_gif(job, srcFile);
+	if (budget && !isvtf && !multiFrame) {
+		auto image = load_image(job, srcFile);
+		if (!image) {
+			job.err += fmt::format("Could not add image data from file {}\n", srcFile.string());
 			return false;
 		}
 
-		initialSize = srcVtf->GetSize();
+		const bool resizing = job.width != -1 && job.height != -1;
+		const int w = resizing ? job.width : image->width();
+		const int h = resizing ? job.height : image->height();
+		if (imglib::bytes_for_image(w, h, procChanType, procComps) / 3 * 4 > budget) {
+			if (!(vtfFile = build_streamed(job, srcFile, *image, format, procFormat, procChanType, procComps, budget)))
+				return false;
+		}
+		else
+			job.srcImage = [image] { return image; }; // Don't decode it a second time
+	}
 
-		if (!add_vtf_image_data(srcVtf, vtfFile.get(), procFormat)) {
-			delete srcVtf;
-			std::cerr << "Could not add image data\n";
+	// Everything up to the final format conversion only depends on the source and the processing options. Jobs that
+	// share a base cache and only differ in output format or quality build it once and convert from there
+	size_t initialSize = 0;
+	std::shared_ptr<CVTFFile> base;
+	if (!vtfFile && job.bases) {
+		auto& entry = job.bases->get(
+			srcFile.string() + "|" + std::to_string(procFormat) + "|" +
+			opts.serialize({opts::output, opts::file, opts::recursive, opts::quiet, opts::jobs, opts::keepgoing,
+							opts::cache, opts::budget, opts::prefetch, opts::dryrun, opts::reportquality, opts::minpsnr,
+							opts::format, opts::quality}));
+		std::call_once(
+			entry.once,
+			[&]
+			{
+				entry.file = build_base(job, srcFile, isvtf, procFormat, procChanType, procComps, entry.initialSize);
+			});
+		base = entry.file;
+		initialSize = entry.initialSize;
+		if (!base) {
+			job.err += fmt::format("Could not build {} from {}\n", outFile.string(), srcFile.string());
 			return false;
 		}
-		delete srcVtf;
 	}
-	// Add standard image data
-	else if (!add_image_data(srcFile, vtfFile.get(), procFormat, true)) {
-		std::cerr << "Could not add image data from file " << srcFile << "\n";
+	else if (!vtfFile && !(base = build_base(job, srcFile, isvtf, procFormat, procChanType, procComps, initialSize)))
 		return false;
-	}
-
-	// Process the image if necessary
-	if (isNormal && opts.get<bool>(opts::toDX)) {
-		auto image = std::make_shared<imglib::Image>(
-			vtfFile->GetData(0, 0, 0, 0), procChanType, 4, vtfFile->GetWidth(), vtfFile->GetHeight(), true);
-		if (!image->process(imglib::PROC_GL_TO_DX_NORM)) {
 
-			std::cerr << "Could not process vtf\n";
+	// Convert to desired image format. A shared base must be left untouched for the other jobs, so copy it if there's
+	// no conversion to do
+	if (base && base->GetFormat() != format) {
+		profile::Scope scope("vtf::convert");
+		vtfFile = vtf::convert(base.get(), format, job.quality, job.threads);
+		if (!vtfFile) {
+			job.err += fmt::format("Could not convert image data to {}: {}\n", formatStr, util::get_last_vtflib_error());
 			return false;
 		}
 	}
+	else if (base)
+		vtfFile = job.bases ? std::make_shared<CVTFFile>(*base) : base;
 
-	// Set the properties based on user input
-	if (!set_properties(vtfFile.get())) {
-		std::cerr << "Could not set properties on VTF\n";
+	// Measure the conversion while the processing format copy is still around. Streamed builds never have one
+	if (base && (opts.get<bool>(opts::reportquality) || opts.get<float>(opts::minpsnr) > 0) &&
+		!report_quality(job, base.get(), vtfFile.get(), procChanType, procComps, outFile))
 		return false;
-	}
+	base.reset();
 
-	// Generate thumbnail
-	if (thumbnail && !vtfFile->GenerateThumbnail(srgb)) {
-		std::cerr << fmt::format("Could not generate thumbnail: {}\n", util::get_last_vtflib_error());
-		return false;
+	// Embed the source CRC so the cache can verify the output later on
+	if (job.cache && vtfFile->GetSupportsResources()) {
+		auto crc = cacheKey.crc;
+		vtfFile->SetResourceData(VTF_RSRC_CRC, sizeof(crc), &crc);
 	}
 
-	// Generate mips
-	if (!vtfFile->GenerateMipmaps(MIPMAP_FILTER_CATROM, srgb)) {
-		std::cerr << "Could not generate mipmaps!\n";
-		return false;
+	// Save to disk finally, or serialize it and write it out in one go for stdout
+	// DEFLATE compression happens in here too, if it's enabled
+	profile::Scope saveScope(vtfFile->GetAuxCompressionLevel() > 0 ? "save+deflate" : "save");
+	if (job.toStdout) {
+		std::vector<std::uint8_t> data;
+		if (!vtf::save_to_memory(vtfFile.get(), data, job.threads)) {
+			job.err += fmt::format("Could not save file to stdout: {}\n", util::get_last_vtflib_error());
+			return false;
+		}
+		util::set_binary_mode(stdout);
+		if (std::fwrite(data.data(), 1, data.size(), stdout) != data.size() || std::fflush(stdout) != 0) {
+			job.err += "Could not write to stdout\n";
+			return false;
+		}
 	}
-
-	// Convert to desired image format
-	if (vtfFile->GetFormat() != format && !vtfFile->ConvertInPlace(format)) {
-		std::cerr << fmt::format("Could not convert image data to {}: {}\n", formatStr, util::get_last_vtflib_error());
-		return false;
+	else if (job.writer) {
+		// Only the serialization happens here, the writer reports the file if it can't be written
+		std::vector<std::uint8_t> data;
+		if (!vtf::save_to_memory(vtfFile.get(), data, job.threads)) {
+			job.err += fmt::format("Could not save file {}: {}\n", outFile.string(), util::get_last_vtflib_error());
+			return false;
+		}
+		job.writer->write(outFile, std::move(data), on_write(job, outFile, &cacheKey));
 	}
-
-	// Save to disk finally
-	if (!vtfFile->Save(outFile.string().c_str())) {
-		std::cerr << fmt::format("Could not save file {}: {}\n", outFile.string(), util::get_last_vtflib_error());
+	else if (!vtf::save(vtfFile.get(), outFile.string(), job.threads)) {
+		job.err += fmt::format("Could not save file {}: {}\n", outFile.string(), util::get_last_vtflib_error());
 		return false;
 	}
 
+	if (job.cache && !job.writer)
+		job.cache->update(outFile, cacheKey);
+
 	// Report file sizes
 	if (!opts.get<bool>(opts::quiet)) {
 		if (initialSize != 0) {
-			fmt::print(
+			job.out += fmt::format(
 				"{} ({} KiB) -> {} ({} KiB)\n", srcFile.string(), initialSize / 1024, outFile.string(), vtfFile->GetSize() / 1024);
 		}
 		else {
-			fmt::print("{} -> {} ({} KiB)\n", srcFile.string(), outFile.string(), vtfFile->GetSize() / 1024);
+			job.out += fmt::format("{} -> {} ({} KiB)\n", srcFile.string(), outFile.string(), vtfFile->GetSize() / 1024);
 		}
 	}
 
 	return true;
 }
 
+//
+// With a background writer, the output only counts as built once it's actually on disk
+//
+static util::WriteBehind::Callback
+on_write(const ConvertJob& job, const std::filesystem::path& outFile, const cache::Key* cacheKey) {
+	auto* cache = cacheKey ? job.cache : nullptr;
+	if (!cache && !job.written)
+		return nullptr;
+	return [cache, outFile, key = cacheKey ? *cacheKey : cache::Key{}, written = job.written](bool ok)
+	{
+		if (ok && cache)
+			cache->update(outFile, key);
+		if (written)
+			written(ok);
+	};
+}
+
+//
+// Build the VTF in the processing format: image data, processing, properties, thumbnail and mips.
+// Returns nullptr on failure, with the reason in job.err
+//
+std::shared_ptr<CVTFFile> ActionConvert::build_base(
+	ConvertJob& job, const std::filesystem::path& srcFile, bool isvtf, VTFImageFormat procFormat,
+	imglib::ChannelType procChanType, int procComps, size_t& initialSize) {
+	const auto& opts = *job.opts;
+	const auto srgb = opts.get<bool>(opts::srgb);
+	const auto thumbnail = opts.get<bool>(opts::thumbnail);
+
+	auto vtfFile = std::make_shared<CVTFFile>();
+
+	// If we're processing a VTF, let's add that VTF image data
+	if (isvtf) {
+		auto* srcVtf = init_from_file(job, srcFile, vtfFile.get(), procFormat);
+		if (!srcVtf) {
+			job.err += fmt::format("Could not open {}\n", srcFile.string());
+			return nullptr;
+		}
+
+		initialSize = srcVtf->GetSize();
+
+		if (!add_vtf_image_data(job, srcVtf, vtfFile.get(), procFormat)) {
+			delete srcVtf;
+			job.err += "Could not add image data\n";
+			return nullptr;
+		}
+		delete srcVtf;
+	}
+	// Add standard image data. Processing is folded into the load in this case
+	else if (!add_image_data(job, srcFile, vtfFile.get(), procFormat, procChanType, procComps, job.procFlags, true)) {
+		job.err += fmt::format("Could not add image data from file {}\n", srcFile.string());
+		return nullptr;
+	}
+
+	// Process the image if necessary
+	if (isvtf && job.procFlags) {
+		auto image = std::make_shared<imglib::Image>(
+			vtfFile->GetData(0, 0, 0, 0), procChanType, procComps, vtfFile->GetWidth(), vtfFile->GetHeight(), true);
+		if (!image->process(job.procFlags)) {
+
+			job.err += "Could not process vtf\n";
+			return nullptr;
+		}
+	}
+
+	// Set the properties based on user input
+	if (!set_properties(job, vtfFile.get())) {
+		job.err += "Could not set properties on VTF\n";
+		return nullptr;
+	}
+
+	// Generate thumbnail
+	if (thumbnail) {
+		profile::Scope scope("thumbnail");
+		if (!vtfFile->GenerateThumbnail(srgb)) {
+			job.err += fmt::format("Could not generate thumbnail: {}\n", util::get_last_vtflib_error());
+			return nullptr;
+		}
+	}
+
+	// Generate mips. VTFLib's generator is only used as a fallback for formats ours doesn't handle
+	profile::Scope mipScope("mipmaps");
+	if (!vtf::generate_mipmaps(vtfFile.get(), srgb, job.threads) && !vtfFile->GenerateMipmaps(MIPMAP_FILTER_CATROM, srgb)) {
+		job.err += "Could not generate mipmaps!\n";
+		return nullptr;
+	}
+
+	return vtfFile;
+}
+
 //
 // Loads a VTF from file, copies over flags and other properties to `file`
 // and then returns the newly loaded file
 // If load failed, we'll return nullptr
 //
-VTFLib::CVTFFile*
-ActionConvert::init_from_file(const std::filesystem::path& src, VTFLib::CVTFFile* file, VTFImageFormat newFormat) {
+VTFLib::CVTFFile* ActionConvert::init_from_file(
+	ConvertJob& job, const std::filesystem::path& src, VTFLib::CVTFFile* file, VTFImageFormat newFormat) {
 	auto srcFile = new CVTFFile();
-	if (!srcFile->Load(src.string().c_str(), false))
+	profile::Scope loadScope("vtf load");
+	util::MappedFile mapped;
+	if (!job.srcData && !mapped.open(src.string())) {
+		delete srcFile;
+		return nullptr;
+	}
+	const bool loaded = job.srcData ? vtf::load(srcFile, job.srcData, job.srcSize, false, job.threads)
+									: vtf::load(srcFile, mapped.data(), mapped.size(), false, job.threads);
+	if (!loaded) {
+		delete srcFile;
 		return nullptr;
+	}
 
 	// Convert immediately to the processing format, so we can match between src and dest
-	srcFile->ConvertInPlace(newFormat);
+	{
+		profile::Scope scope("ConvertInPlace");
+		srcFile->ConvertInPlace(newFormat);
+	}
 
 	// Determine buffer sizes
-	const auto width = (m_width == -1) ? srcFile->GetWidth() : m_width;
-	const auto height = (m_height == -1) ? srcFile->GetHeight() : m_height;
+	const auto width = (job.width == -1) ? srcFile->GetWidth() : job.width;
+	const auto height = (job.height == -1) ? srcFile->GetHeight() : job.height;
 
 	// If the width/height have been changed, we can't just pull the mip count from the source VTF
 	const bool bNeedsNewMips = width != srcFile->GetWidth() || height != srcFile->GetHeight();
 	const int nDefaultMips = CVTFFile::ComputeMipmapCount(width, height, 1);
 
 	// Use the mip count from the source file if the user hasn't specified it yet
-	auto mipCount = m_opts->has(opts::mips) || m_opts->has(opts::nomips) 
-		? m_mips 
+	auto mipCount = job.opts->has(opts::mips) || job.opts->has(opts::nomips) 
+		? job.mips 
 		: (bNeedsNewMips ? nDefaultMips : srcFile->GetMipmapCount());
 
 	// Init image with the desired parameters and processing format
@@ -465,16 +1020,17 @@ ActionConvert::init_from_file(const std::filesystem::path& src, VTFLib::CVTFFile
 //
 // Set properties for a VTF based on the user's input
 //
-bool ActionConvert::set_properties(VTFLib::CVTFFile* vtfFile) {
-	auto compressionLevel = m_opts->get<int>(opts::compress);
+bool ActionConvert::set_properties(ConvertJob& job, VTFLib::CVTFFile* vtfFile, bool computeReflectivity) {
+	const auto& opts = *job.opts;
+	auto compressionLevel = opts.get<int>(opts::compress);
 
 	// Set version if provided, or if we need it specifically to be 7.6
-	if (m_opts->has(opts::version) || compressionLevel > 0 || vtfFile->GetFormat() == IMAGE_FORMAT_BC7) {
-		auto verStr = m_opts->get<std::string>(opts::version);
+	if (opts.has(opts::version) || compressionLevel > 0 || vtfFile->GetFormat() == IMAGE_FORMAT_BC7) {
+		auto verStr = opts.get<std::string>(opts::version);
 
 		int majorVer, minorVer;
 		if (!get_version_from_str(verStr, majorVer, minorVer)) {
-			std::cerr << fmt::format("Invalid version '{}'! Valid versions: 7.1, 7.2, 7.3, 7.4, 7.5, 7.6\n", verStr);
+			job.err += fmt::format("Invalid version '{}'! Valid versions: 7.1, 7.2, 7.3, 7.4, 7.5, 7.6\n", verStr);
 			return false;
 		}
 
@@ -484,72 +1040,196 @@ bool ActionConvert::set_properties(VTFLib::CVTFFile* vtfFile) {
 
 	// Set the DEFLATE compression level
 	if (!vtfFile->SetAuxCompressionLevel(compressionLevel) && compressionLevel != 0) {
-		std::cerr << fmt::format("Could not set compression level to {}!\n", compressionLevel);
+		job.err += fmt::format("Could not set compression level to {}!\n", compressionLevel);
 		return false;
 	}
 
 	// These should be defaulted to off
 	// we're not going to set them explicitly to the value of the opts because we may have gotten them from another vtf
-	if (m_opts->get<bool>(opts::normal))
-		vtfFile->SetFlag(TEXTUREFLAGS_NORMAL, true);
-	if (m_opts->get<bool>(opts::clamps))
-		vtfFile->SetFlag(TEXTUREFLAGS_CLAMPS, true);
-	if (m_opts->get<bool>(opts::clamps))
-		vtfFile->SetFlag(TEXTUREFLAGS_CLAMPT, true);
-	if (m_opts->get<bool>(opts::clampt))
-		vtfFile->SetFlag(TEXTUREFLAGS_CLAMPU, true);
-	if (m_opts->get<bool>(opts::trilinear))
-		vtfFile->SetFlag(TEXTUREFLAGS_TRILINEAR, true);
-	if (m_opts->get<bool>(opts::pointsample))
-		vtfFile->SetFlag(TEXTUREFLAGS_POINTSAMPLE, true);
-	if (m_opts->get<bool>(opts::srgb))
-		vtfFile->SetFlag(TEXTUREFLAGS_SRGB, true);
-
-	// Mip count gets set earlier by user input
-	if (vtfFile->GetMipmapCount() == 1)
-		vtfFile->SetFlag(TEXTUREFLAGS_NOMIP, true);
+	vtfFile->SetFlags(vtfFile->GetFlags() | get_user_flags(opts, vtfFile->GetMipmapCount()));
 
 	// Same deal for the below issues- only override default if specified
-	if (m_opts->has(opts::startframe))
-		vtfFile->SetStartFrame(m_opts->get<int>(opts::startframe));
+	if (opts.has(opts::startframe))
+		vtfFile->SetStartFrame(opts.get<int>(opts::startframe));
 
-	vtfFile->ComputeReflectivity();
+	if (computeReflectivity)
+		vtfFile->ComputeReflectivity();
 
-	if (m_opts->has(opts::bumpscale))
-		vtfFile->SetBumpmapScale(m_opts->get<float>(opts::bumpscale));
+	if (opts.has(opts::bumpscale))
+		vtfFile->SetBumpmapScale(opts.get<float>(opts::bumpscale));
 
 	return true;
 }
 
+//
+// Load a imglib-compatible image, unless the caller already decoded it for us
+//
+std::shared_ptr<imglib::Image> ActionConvert::load_image(ConvertJob& job, const std::filesystem::path& imageSrc) {
+	profile::Scope scope("decode");
+	return job.srcImage ? job.srcImage()
+		 : job.srcData	? imglib::Image::load(job.srcData, job.srcSize)
+						: imglib::Image::load(imageSrc);
+}
+
+//
+// Decode every frame and face of the source, frame after frame. Each file of a source set is decoded on its own
+// thread, an animated GIF gives all of its frames, and anything else is a single image
+//
+bool ActionConvert::load_source_images(
+	ConvertJob& job, const std::filesystem::path& imageSrc, std::vector<std::shared_ptr<imglib::Image>>& images,
+	int& frames, int& faces) {
+	if (!job.sourceSet.empty()) {
+		profile::Scope scope("decode");
+		images.assign(job.sourceSet.size(), nullptr);
+		util::parallel_for(
+			images.size(), [&](std::size_t i) { images[i] = imglib::Image::load(job.sourceSet[i]); }, job.threads);
+		for (std::size_t i = 0; i < images.size(); ++i) {
+			if (!images[i]) {
+				job.err += fmt::format("Could not load {}\n", job.sourceSet[i].string());
+				return false;
+			}
+		}
+		frames = job.setFrames;
+		faces = job.setFaces;
+		return true;
+	}
+
+	faces = 1;
+	if (is_gif(job, imageSrc)) {
+		profile::Scope scope("decode");
+		util::MappedFile mapped;
+		if (!job.srcData && !mapped.open(imageSrc.string()))
+			return false;
+		images = job.srcData ? imglib::Image::load_frames(job.srcData, job.srcSize)
+							 : imglib::Image::load_frames(mapped.data(), mapped.size());
+		frames = int(images.size());
+		return !images.empty();
+	}
+
+	auto image = load_image(job, imageSrc);
+	if (!image)
+		return false;
+	images = {image};
+	frames = 1;
+	return true;
+}
+
+//
+// Resize + convert + process pipeline taking a source image to the VTF's base level, in the processing format
+//
+static imglib::Pipeline
+make_pipeline(const ConvertJob& job, imglib::ChannelType type, int comps, imglib::ProcFlags procFlags) {
+	imglib::Pipeline pipeline;
+	if (job.height != -1 && job.width != -1)
+		pipeline.resize(job.width, job.height);
+	pipeline.convert(type, comps);
+	if (procFlags)
+		pipeline.process(procFlags);
+	return pipeline;
+}
+
 //
 // Add base image data to the VTF's lowest mip level
 // imageSrc is a path to a imglib-compatible image
+// The image is resized, converted to format and processed in one go, straight into the VTF's image buffer
 //
 bool ActionConvert::add_image_data(
-	const std::filesystem::path& imageSrc, VTFLib::CVTFFile* file, VTFImageFormat format, bool create) {
+	ConvertJob& job, const std::filesystem::path& imageSrc, VTFLib::CVTFFile* file, VTFImageFormat format,
+	imglib::ChannelType type, int comps, imglib::ProcFlags procFlags, bool create) {
 
-	// Load the image
-	auto image = imglib::Image::load(imageSrc);
-	if (!image)
+	std::vector<std::shared_ptr<imglib::Image>> images;
+	int frames, faces;
+	if (!load_source_images(job, imageSrc, images, frames, faces))
 		return false;
 
-	// If width and height are specified, resize in place
-	if (m_height != -1 && m_width != -1) {
-		if (!image->resize(m_width, m_height))
+	const auto pipeline = make_pipeline(job, type, comps, procFlags);
+
+	const int w = pipeline.out_width(*images[0]);
+	const int h = pipeline.out_height(*images[0]);
+	for (auto& image : images) {
+		if (pipeline.out_width(*image) != w || pipeline.out_height(*image) != h) {
+			job.err += fmt::format(
+				"Every frame and face of {} must be the same size, or be resized with --width and --height\n",
+				imageSrc.string());
 			return false;
+		}
 	}
 
-	// Hack for VTFLib; Ensure we have an alpha channel because that's well supported in that horrible code
-	if (image->channels() < 4 && image->type() != imglib::ChannelType::UInt8) {
-		if (!image->convert(image->type(), 4)) {
-			std::cerr << fmt::format("Failed to convert {}\n", imageSrc.string());
+	// Create the file if we're told to do so
+	// This is done here because we don't actually know w/h until now
+	if (create) {
+		if (!file->Init(
+				w, h, frames, faces, 1, format, vlTrue, job.mips <= 0 ? CVTFFile::ComputeMipmapCount(w, h, 1) : job.mips)) {
+			job.err += fmt::format("Could not create VTF: {}\n", util::get_last_vtflib_error());
 			return false;
 		}
 	}
 
-	// Add the raw image data
-	return add_image_data_raw(
-		file, image->data(), format, image->vtf_format(), image->width(), image->height(), create);
+	if (file->GetFormat() != format || file->GetWidth() != vlUInt(w) || file->GetHeight() != vlUInt(h) ||
+		file->GetFrameCount() != vlUInt(frames) || file->GetFaceCount() != vlUInt(faces)) {
+		job.err += fmt::format("Image data for {} does not match the VTF\n", imageSrc.string());
+		return false;
+	}
+
+	// Every frame and face goes straight into its own slot of the VTF
+	profile::Scope scope(w != images[0]->width() || h != images[0]->height() ? "resize+convert" : "convert image");
+	std::atomic<bool> ok = true;
+	util::parallel_for(
+		images.size(),
+		[&](std::size_t i)
+		{
+			if (!pipeline.run(*images[i], file->GetData(vlUInt(i / faces), vlUInt(i % faces), 0, 0)))
+				ok = false;
+		},
+		job.threads);
+	if (!ok) {
+		job.err += fmt::format("Failed to convert {}\n", imageSrc.string());
+		return false;
+	}
+	return true;
+}
+
+//
+// Build the output VTF straight in its final format, a band of rows at a time. The band is run through the pipeline,
+// converted into the base level and reduced into every mip, so the full size processing format image and its mips
+// never exist. Used when those wouldn't fit in the memory budget
+//
+std::shared_ptr<CVTFFile> ActionConvert::build_streamed(
+	ConvertJob& job, const std::filesystem::path& srcFile, const imglib::Image& image, VTFImageFormat format,
+	VTFImageFormat procFormat, imglib::ChannelType procChanType, int procComps, size_t budget) {
+	const auto& opts = *job.opts;
+	const auto pipeline = make_pipeline(job, procChanType, procComps, job.procFlags);
+
+	const int w = pipeline.out_width(image);
+	const int h = pipeline.out_height(image);
+
+	auto vtfFile = std::make_shared<CVTFFile>();
+	if (!vtfFile->Init(
+			w, h, 1, 1, 1, format, opts.get<bool>(opts::thumbnail),
+			job.mips <= 0 ? CVTFFile::ComputeMipmapCount(w, h, 1) : job.mips)) {
+		job.err += fmt::format("Could not create VTF: {}\n", util::get_last_vtflib_error());
+		return nullptr;
+	}
+
+	// Reflectivity is accumulated as the bands go by, VTFLib would need the whole image for it
+	if (!set_properties(job, vtfFile.get(), false)) {
+		job.err += "Could not set properties on VTF\n";
+		return nullptr;
+	}
+
+	// In flight, a band plus the pipeline's temporaries and the mip chain's filter windows take a few times the band
+	const size_t rowBytes = imglib::bytes_for_image(w, 1, procChanType, procComps);
+	const int rowsPerBand = int(std::clamp<size_t>(budget / (rowBytes * 4), 4, std::max(h, 4)));
+
+	profile::Scope scope("streamed build");
+	if (!vtf::build_streamed(
+			vtfFile.get(), procFormat, rowsPerBand,
+			[&](int firstRow, int numRows, void* out) { return pipeline.run_rows(image, firstRow, numRows, out); },
+			opts.get<bool>(opts::srgb), job.quality, job.threads)) {
+		job.err += fmt::format("Could not build {}: {}\n", srcFile.string(), util::get_last_vtflib_error());
+		return nullptr;
+	}
+	return vtfFile;
 }
 
 //
@@ -558,7 +1238,8 @@ bool ActionConvert::add_image_data(
 //  file: Destination VTF
 //  format: Dest format of the data, file->GetFormat() will return this when this returns true
 //
-bool ActionConvert::add_vtf_image_data(CVTFFile* srcFile, VTFLib::CVTFFile* file, VTFImageFormat format) {
+bool ActionConvert::add_vtf_image_data(
+	ConvertJob& job, CVTFFile* srcFile, VTFLib::CVTFFile* file, VTFImageFormat format) {
 	const auto frameCount = srcFile->GetFrameCount();
 	const auto faceCount = srcFile->GetFaceCount();
 	const auto sliceCount = srcFile->GetDepth();
@@ -569,8 +1250,9 @@ bool ActionConvert::add_vtf_image_data(CVTFFile* srcFile, VTFLib::CVTFFile* file
 	assert(srcFile->GetFormat() == format);
 
 	// Resize VTF only if necessary (This is expensive and kinda crap)
-	if (m_width != -1 && m_height != -1 && (srcWidth != m_width || srcHeight != m_height)) {
-		return vtf::resize(srcFile, m_width, m_height, file);
+	if (job.width != -1 && job.height != -1 && (int(srcWidth) != job.width || int(srcHeight) != job.height)) {
+		profile::Scope scope("vtf::resize");
+		return vtf::resize(srcFile, job.width, job.height, file, job.threads);
 	}
 	else {
 		// Load all image data normally
@@ -587,47 +1269,363 @@ bool ActionConvert::add_vtf_image_data(CVTFFile* srcFile, VTFLib::CVTFFile* file
 }
 
 //
-// Add raw image data to the VTF
-//  file is the vtf to add to
-//  format is the desired format of the VTF- If set to NONE, we'll use the data format
+// --dry-run: report what converting srcFile would produce, going off of nothing but its header. Catches unreadable
+// sources and bad options without paying for a decode, so whole trees can be checked quickly
 //
-bool ActionConvert::add_image_data_raw(
-	VTFLib::CVTFFile* file, const void* data, VTFImageFormat format, VTFImageFormat dataFormat, int w, int h,
-	bool create) {
-	vlByte* dest = nullptr;
-
-	// Convert to requested format, if necessary
-	if (format != IMAGE_FORMAT_NONE && format != dataFormat) {
+bool ActionConvert::dry_run(
+	ConvertJob& job, const std::filesystem::path& srcFile, const std::filesystem::path& outFile, bool isvtf,
+	VTFImageFormat format) {
+	const auto& opts = *job.opts;
+	if (format == IMAGE_FORMAT_NONE) {
+		job.err += fmt::format("Invalid format '{}'\n", opts.get<std::string>(opts::format));
+		return false;
+	}
 
-		auto sizeRequired = CVTFFile::ComputeImageSize(w, h, 1, 1, format);
-		dest = (vlByte*)malloc(sizeRequired);
+	// Mapped, so only the pages holding the header are ever read. Source sets go off of their first file
+	const auto& headerFile = job.sourceSet.empty() ? srcFile : job.sourceSet[0];
+	util::MappedFile mapped;
+	const std::uint8_t* data = job.srcData;
+	std::size_t size = job.srcSize;
+	if (!data) {
+		if (!mapped.open(headerFile.string())) {
+			job.err += fmt::format("Could not open {}\n", headerFile.string());
+			return false;
+		}
+		data = mapped.data();
+		size = mapped.size();
+	}
 
-		if (!CVTFFile::Convert((vlByte*)data, dest, w, h, dataFormat, format)) {
-			std::cerr << fmt::format(
-				"Could not convert from {} to {}: {}\n", NAMEOF_ENUM(dataFormat), NAMEOF_ENUM(format),
-				util::get_last_vtflib_error());
-			free(dest);
+	int width, height, srcMips = 0, frames = job.setFrames, faces = job.setFaces;
+	std::string srcDesc;
+	if (isvtf) {
+		vtf::HeaderInfo info;
+		std::string err;
+		if (!vtf::read_header(data, size, info, err)) {
+			job.err += fmt::format("Could not read {}: {}\n", srcFile.string(), err);
 			return false;
 		}
+		width = info.width;
+		height = info.height;
+		srcMips = info.mips;
+		frames = info.frames;
+		faces = info.faces;
+		srcDesc = NAMEOF_ENUM(info.format);
 	}
 	else {
-		format = dataFormat;
+		imglib::ImageInfo_t info;
+		if (!imglib::image_info(data, size, info)) {
+			job.err += fmt::format("Could not read image info from {}\n", headerFile.string());
+			return false;
+		}
+		width = info.w;
+		height = info.h;
+		frames = job.sourceSet.empty() ? info.frames : frames;
+		srcDesc = fmt::format("{} channel {}", info.comps, NAMEOF_ENUM(info.type));
 	}
 
-	// Create the file if we're told to do so
-	// This is done here because we don't actually know w/h until now
-	if (create) {
-		if (!file->Init(w, h, 1, 1, 1, format, vlTrue, m_mips <= 0 ? CVTFFile::ComputeMipmapCount(w, h, 1) : m_mips)) {
-			std::cerr << "Could not create VTF: " << util::get_last_vtflib_error() << "\n";
-			free(dest);
+	// Same defaults as the real conversion: VTFs keep their mips unless they're resized
+	const int outWidth = job.width != -1 ? job.width : width;
+	const int outHeight = job.height != -1 ? job.height : height;
+	int mips = job.mips;
+	if (mips <= 0)
+		mips = (isvtf && outWidth == width && outHeight == height) ? srcMips
+																   : CVTFFile::ComputeMipmapCount(outWidth, outHeight, 1);
+
+	std::string layers;
+	if (frames > 1)
+		layers += fmt::format(", {} frames", frames);
+	if (faces > 1)
+		layers += fmt::format(", {} faces", faces);
+
+	if (!opts.get<bool>(opts::quiet)) {
+		job.out += fmt::format(
+			"{} ({}x{} {}) -> {} ({}x{} {}, {} mip(s){})\n", srcFile.string(), width, height, srcDesc, outFile.string(),
+			outWidth, outHeight, NAMEOF_ENUM(format), mips, layers);
+	}
+	return true;
+}
+
+//
+// Measure what the conversion to the output format lost, by decoding the output back to the processing format and
+// comparing it with the base it was converted from, mip by mip. Every frame, face and slice of a mip counts as one
+// image. Returns false if the top mip falls short of --min-psnr
+//
+bool ActionConvert::report_quality(
+	ConvertJob& job, CVTFFile* base, CVTFFile* file, imglib::ChannelType type, int comps,
+	const std::filesystem::path& outFile) {
+	profile::Scope scope("report_quality");
+	const auto& opts = *job.opts;
+	const bool report = opts.get<bool>(opts::reportquality) && !opts.get<bool>(opts::quiet);
+	const float minPsnr = opts.get<float>(opts::minpsnr);
+
+	if (base->GetFormat() == file->GetFormat()) {
+		if (report)
+			job.out += fmt::format("{}: lossless, output is in the processing format\n", outFile.string());
+		return true;
+	}
+
+	// The alpha of formats that don't store one is meaningless, so leave it out
+	const auto formatInfo = CVTFFile::GetImageFormatInfo(file->GetFormat());
+	const int channels = (comps == 4 && formatInfo.uiAlphaBitsPerPixel == 0) ? 3 : comps;
+	constexpr const char* CHANNEL_NAMES = "RGBA";
+
+	std::vector<std::uint8_t> decoded;
+	double worstTopPsnr = std::numeric_limits<double>::infinity();
+	for (vlUInt mip = 0; mip < file->GetMipmapCount(); ++mip) {
+		vlUInt w, h, d;
+		CVTFFile::ComputeMipmapDimensions(file->GetWidth(), file->GetHeight(), file->GetDepth(), mip, w, h, d);
+		decoded.resize(CVTFFile::ComputeImageSize(w, h, 1, base->GetFormat()));
+
+		imglib::ErrorStats stats;
+		for (vlUInt frame = 0; frame < file->GetFrameCount(); ++frame) {
+			for (vlUInt face = 0; face < file->GetFaceCount(); ++face) {
+				for (vlUInt slice = 0; slice < d; ++slice) {
+					if (!CVTFFile::Convert(
+							file->GetData(frame, face, slice, mip), decoded.data(), w, h, file->GetFormat(),
+							base->GetFormat())) {
+						job.err += fmt::format(
+							"Could not decode {} to measure its quality: {}\n", outFile.string(),
+							util::get_last_vtflib_error());
+						return false;
+					}
+					if (!imglib::compare(
+							base->GetData(frame, face, slice, mip), decoded.data(), type, comps, w, h, stats,
+							job.threads)) {
+						job.err += fmt::format("Could not measure the quality of {}\n", outFile.string());
+						return false;
+					}
+				}
+			}
+		}
+
+		std::string psnr, ssim;
+		for (int c = 0; c < channels; ++c) {
+			psnr += fmt::format(" {} {:.2f}", CHANNEL_NAMES[c], stats.psnr(c));
+			ssim += fmt::format(" {} {:.4f}", CHANNEL_NAMES[c], stats.mean_ssim(c));
+			if (mip == 0)
+				worstTopPsnr = std::min(worstTopPsnr, stats.psnr(c));
+		}
+		if (report)
+			job.out += fmt::format("{} mip {} ({}x{}): PSNR{} dB, SSIM{}\n", outFile.string(), mip, w, h, psnr, ssim);
+	}
+
+	if (minPsnr > 0 && worstTopPsnr < minPsnr) {
+		job.err += fmt::format(
+			"{}: PSNR of {:.2f} dB is below the minimum of {:.2f} dB\n", outFile.string(), worstTopPsnr, minPsnr);
+		return false;
+	}
+	return true;
+}
+
+//
+// Metadata only fast path for VTF sources. If the output keeps the format, size, mips and compression of the source
+// and nothing touches the pixels, only the header changes. It's rewritten in place when the output is the source,
+// otherwise the image data is copied over byte for byte. patched stays false if the full conversion is needed
+//
+bool ActionConvert::patch_vtf(
+	ConvertJob& job, const std::filesystem::path& srcFile, const std::filesystem::path& outFile,
+	VTFImageFormat format, const cache::Key* cacheKey, bool& patched) {
+	const auto& opts = *job.opts;
+	patched = false;
+	if (job.procFlags || job.srcImage)
+		return true;
+
+	// Anything we can't read is left for the full path to report
+	util::MappedFile mapped;
+	const std::uint8_t* data = job.srcData;
+	std::size_t size = job.srcSize;
+	if (!data) {
+		if (!mapped.open(srcFile.string()))
+			return true;
+		data = mapped.data();
+		size = mapped.size();
+	}
+
+	vtf::HeaderInfo info;
+	std::string err;
+	if (!vtf::read_header(data, size, info, err))
+		return true;
+
+	const int level = opts.get<int>(opts::compress);
+	if (info.format != format || (job.width != -1 && job.width != info.width) ||
+		(job.height != -1 && job.height != info.height) ||
+		((opts.has(opts::mips) || opts.has(opts::nomips)) && job.mips != info.mips) ||
+		(opts.get<bool>(opts::thumbnail) && info.thumbnailWidth <= 0) || level != info.compressionLevel)
+		return true;
+
+	// The source keeps its version unless --version or -c asks for another, same as a full conversion of it would.
+	// set_properties only applies the default version to BC7 on the processing format base, which never is BC7
+	int minor = int(info.minorVersion);
+	if (opts.has(opts::version) || level > 0) {
+		int major;
+		if (!get_version_from_str(opts.get<std::string>(opts::version), major, minor))
+			return true;
+		minor = (level > 0) ? 6 : minor;
+	}
+
+	vtf::HeaderPatch patch;
+	patch.minorVersion = minor;
+	patch.flags = info.flags | get_user_flags(opts, info.mips);
+	patch.startFrame = opts.has(opts::startframe) ? opts.get<int>(opts::startframe) : info.startFrame;
+	patch.bumpScale = opts.has(opts::bumpscale) ? opts.get<float>(opts::bumpscale) : info.bumpScale;
+	if (cacheKey && minor >= 3) {
+		patch.setCrc = true;
+		patch.crc = cacheKey->crc;
+	}
+
+	// Envmaps before 7.5 carry a sphere map face unless the start frame is -1, the face count has to stay the same
+	if (info.flags & TEXTUREFLAGS_ENVMAP) {
+		const int faces = (std::uint16_t(patch.startFrame) != 0xFFFF && minor < 5) ? 7 : 6;
+		if (faces != info.faces)
+			return true;
+	}
+
+	std::vector<std::uint8_t> header;
+	if (!vtf::patch_header(data, size, patch, header, err))
+		return true;
+
+	profile::Scope scope("patch");
+	patched = true;
+	const std::uint8_t* rest = data + info.headerSize;
+	const std::size_t restSize = size - info.headerSize;
+
+	std::error_code ec;
+	const bool sameFile = !job.srcData && !job.toStdout && std::filesystem::equivalent(srcFile, outFile, ec);
+	bool deferred = false; // The writer updates the cache once the file is on disk
+	if (job.toStdout) {
+		util::set_binary_mode(stdout);
+		if (std::fwrite(header.data(), 1, header.size(), stdout) != header.size() ||
+			std::fwrite(rest, 1, restSize, stdout) != restSize || std::fflush(stdout) != 0) {
+			job.err += "Could not write to stdout\n";
+			return false;
+		}
+	}
+	else if (job.writer && !sameFile) {
+		std::vector<std::uint8_t> file(header.size() + restSize);
+		std::memcpy(file.data(), header.data(), header.size());
+		std::memcpy(file.data() + header.size(), rest, restSize);
+		job.writer->write(outFile, std::move(file), on_write(job, outFile, cacheKey ? &*cacheKey : nullptr));
+		deferred = true;
+	}
+	else if (sameFile && header.size() == info.headerSize) {
+		// Same size, so the header can be overwritten and the rest of the file never moves
+		mapped.close();
+		FILE* fp = std::fopen(outFile.string().c_str(), "r+b");
+		const bool ok = fp && std::fwrite(header.data(), 1, header.size(), fp) == header.size();
+		if (!fp || std::fclose(fp) != 0 || !ok) {
+			job.err += fmt::format("Could not save file {}\n", outFile.string());
+			return false;
+		}
+	}
+	else {
+		// The source is still mapped, so overwriting it has to go through a temporary
+		auto tmpFile = outFile;
+		if (sameFile)
+			tmpFile += ".tmp";
+		FILE* fp = std::fopen(tmpFile.string().c_str(), "wb");
+		const bool ok = fp && std::fwrite(header.data(), 1, header.size(), fp) == header.size() &&
+						std::fwrite(rest, 1, restSize, fp) == restSize;
+		mapped.close();
+		if (!fp || std::fclose(fp) != 0 || !ok ||
+			(sameFile && (std::filesystem::rename(tmpFile, outFile, ec), ec))) {
+			job.err += fmt::format("Could not save file {}\n", outFile.string());
+			if (sameFile)
+				std::filesystem::remove(tmpFile, ec);
 			return false;
 		}
 	}
-	file->SetData(1, 1, 1, 0, dest ? dest : (vlByte*)data);
 
+	// Written in place or through a temporary even in batches, so the writer never sees these
+	if (cacheKey && job.cache && !deferred)
+		job.cache->update(outFile, *cacheKey);
+
+	if (!opts.get<bool>(opts::quiet)) {
+		job.out += fmt::format(
+			"{} -> {} ({} KiB, header only)\n", srcFile.string(), outFile.string(),
+			(header.size() + restSize) / 1024);
+	}
 	return true;
 }
 
+// Face names of Source skyboxes, in VTF face order
+static constexpr const char* CUBEMAP_SIDES[] = {"rt", "lf", "bk", "ft", "up", "dn"};
+
+//
+// Source sets are named by a pattern with {frame}, {face} or {side} in the file name. Anything else is a plain file
+//
+static bool is_source_set(const std::filesystem::path& path) {
+	const auto name = path.filename().string();
+	return name.find("{frame") != std::string::npos || name.find("{face") != std::string::npos ||
+		   name.find("{side") != std::string::npos;
+}
+
+static bool is_gif(const ConvertJob& job, const std::filesystem::path& path) {
+	if (job.srcData)
+		return job.srcSize >= 4 && !std::memcmp(job.srcData, "GIF8", 4);
+	return imglib::image_get_format_from_file(path.string().c_str()) == imglib::Gif;
+}
+
+//
+// Expand a source set pattern into job.sourceSet. {face} becomes 0-5 and {side} becomes rt, lf, bk, ft, up and dn,
+// either of which makes a cubemap. {frame} counts up from 0, or 1 if there's no frame 0, until the first missing
+// frame. They're formatted like fmt arguments, so {frame:03} gives 000, 001 and so on. This is the naming extract
+// --all uses, so its output can be imported again as is
+//
+static bool find_source_set(ConvertJob& job, const std::filesystem::path& pattern) {
+	const auto name = pattern.filename().string();
+	const bool animated = name.find("{frame") != std::string::npos;
+	const int faces = (name.find("{face") != std::string::npos || name.find("{side") != std::string::npos) ? 6 : 1;
+
+	const auto path = [&](int frame, int face) -> std::filesystem::path
+	{
+		const auto file = fmt::format(
+			fmt::runtime(name), fmt::arg("frame", frame), fmt::arg("face", face), fmt::arg("side", CUBEMAP_SIDES[face]));
+		return pattern.parent_path() / file;
+	};
+
+	job.sourceSet.clear();
+	try {
+		const int first = (animated && !std::filesystem::exists(path(0, 0))) ? 1 : 0;
+		for (int frame = first; frame == first || (animated && std::filesystem::exists(path(frame, 0))); ++frame) {
+			for (int face = 0; face < faces; ++face) {
+				auto file = path(frame, face);
+				if (!std::filesystem::exists(file)) {
+					job.err += fmt::format("Could not open {}: file does not exist\n", file.string());
+					return false;
+				}
+				job.sourceSet.push_back(std::move(file));
+			}
+		}
+	}
+	catch (const fmt::format_error& e) {
+		job.err += fmt::format("Invalid source pattern '{}': {}\n", name, e.what());
+		return false;
+	}
+
+	job.setFaces = faces;
+	job.setFrames = int(job.sourceSet.size()) / faces;
+	return true;
+}
+
+//
+// Default output for a source set: the pattern with its placeholders and any separators left dangling taken out,
+// so sky_{side}.tga gives sky.vtf
+//
+static std::filesystem::path source_set_output(const std::filesystem::path& pattern) {
+	std::string stem;
+	const auto name = pattern.stem().string();
+	for (std::size_t i = 0; i < name.size(); ++i) {
+		if (name[i] == '{') {
+			i = std::min(name.find('}', i), name.size());
+			continue;
+		}
+		stem += name[i];
+	}
+	while (!stem.empty() && (stem.back() == '_' || stem.back() == '-' || stem.back() == '.'))
+		stem.pop_back();
+	return pattern.parent_path() / ((stem.empty() ? "out" : stem) + ".vtf");
+}
+
 // Get VTF version from string ie 7.6
 static bool get_version_from_str(const std::string& str, int& major, int& minor) {
 	auto pos = str.find('.');
@@ -637,3 +1635,71 @@ static bool get_version_from_str(const std::string& str, int& major, int& minor)
 	auto minorVer = str.substr(pos + 1);
 	return util::strtoint(majorVer, major) && util::strtoint(minorVer, minor);
 }
+
+//
+// Processing ops from the command line. Fails if --invert or --swizzle can't be parsed
+//
+static bool get_proc_flags(ConvertJob& job, imglib::ProcFlags& flags) {
+	const auto& opts = *job.opts;
+	flags = 0;
+	if (opts.get<bool>(opts::normal) && opts.get<bool>(opts::toDX))
+		flags |= imglib::PROC_GL_TO_DX_NORM;
+	if (opts.get<bool>(opts::renormalize))
+		flags |= imglib::PROC_RENORMALIZE;
+	if (opts.get<bool>(opts::premultiply))
+		flags |= imglib::PROC_PREMULTIPLY_ALPHA;
+
+	static constexpr imglib::ProcFlags inverts[] = {
+		imglib::PROC_INVERT_R, imglib::PROC_INVERT_G, imglib::PROC_INVERT_B, imglib::PROC_INVERT_A};
+	const auto invert = opts.get<std::string>(opts::invert);
+	for (char c : invert) {
+		const auto chan = std::string_view("rgba").find(char(std::tolower(c)));
+		if (chan == std::string_view::npos) {
+			job.err += fmt::format("Invalid channels '{}' for --invert! Use any of r, g, b and a\n", invert);
+			return false;
+		}
+		flags |= inverts[chan];
+	}
+
+	const auto swizzle = opts.get<std::string>(opts::swizzle);
+	if (!swizzle.empty()) {
+		int src[4];
+		for (size_t i = 0; i < 4; ++i) {
+			const auto chan = i < swizzle.size() ? std::string_view("rgba").find(char(std::tolower(swizzle[i])))
+												 : std::string_view::npos;
+			if (swizzle.size() != 4 || chan == std::string_view::npos) {
+				job.err += fmt::format("Invalid swizzle '{}'! It must be 4 of r, g, b and a, like bgra\n", swizzle);
+				return false;
+			}
+			src[i] = int(chan);
+		}
+		flags |= imglib::proc_swizzle(src[0], src[1], src[2], src[3]);
+	}
+	return true;
+}
+
+//
+// Texture flags requested on the command line. These only ever get added to the flags a file already has
+//
+static std::uint32_t get_user_flags(const OptionList& opts, int mips) {
+	std::uint32_t flags = 0;
+	if (opts.get<bool>(opts::normal))
+		flags |= TEXTUREFLAGS_NORMAL;
+	if (opts.get<bool>(opts::clamps))
+		flags |= TEXTUREFLAGS_CLAMPS;
+	if (opts.get<bool>(opts::clamps))
+		flags |= TEXTUREFLAGS_CLAMPT;
+	if (opts.get<bool>(opts::clampt))
+		flags |= TEXTUREFLAGS_CLAMPU;
+	if (opts.get<bool>(opts::trilinear))
+		flags |= TEXTUREFLAGS_TRILINEAR;
+	if (opts.get<bool>(opts::pointsample))
+		flags |= TEXTUREFLAGS_POINTSAMPLE;
+	if (opts.get<bool>(opts::srgb))
+		flags |= TEXTUREFLAGS_SRGB;
+
+	// Mip count gets set earlier by user input
+	if (mips == 1)
+		flags |= TEXTUREFLAGS_NOMIP;
+	return flags;
+}
@@ -1,7 +1,16 @@
 
 #include <filesystem>
+#include <functional>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 
 #include "action.hpp"
+#include "common/cache.hpp"
+#include "common/image.hpp"
+#include "common/bcn.hpp"
 #include "VTFLib.h"
 
 namespace VTFLib
@@ -9,9 +18,85 @@ namespace VTFLib
 	class CVTFFile;
 }
 
+namespace util
+{
+	class WriteBehind;
+}
+
 namespace vtex2
 {
 
+	/**
+	 * Shared base VTFs, keyed on the source and every option that affects the image before the final format
+	 * conversion. Lets several outputs of the same source (different formats, qualities) decode and build mips once
+	 */
+	class BaseCache {
+	public:
+		struct Entry {
+			std::once_flag once;
+			std::shared_ptr<VTFLib::CVTFFile> file; // Null if building the base failed
+			std::size_t initialSize = 0;
+		};
+
+		/**
+		 * Returns the entry for key, creating it if needed. The entry stays valid for the lifetime of the cache
+		 */
+		Entry& get(const std::string& key);
+
+		/**
+		 * Drop all entries. Any references handed out by get() are invalidated
+		 */
+		void clear();
+
+	private:
+		std::mutex m_mutex;
+		std::unordered_map<std::string, std::unique_ptr<Entry>> m_entries;
+	};
+
+	/**
+	 * Per-file conversion state
+	 * Every file being converted gets its own job, so multiple files may be processed concurrently
+	 */
+	struct ConvertJob {
+		const OptionList* opts = nullptr;
+		int mips = 10;
+		int width = -1;
+		int height = -1;
+		bcn::Quality quality = bcn::Quality::Normal;
+		imglib::ProcFlags procFlags = 0; // Processing ops applied to the base level
+
+		cache::BuildCache* cache = nullptr; // Optional build cache, shared between all jobs
+		bool upToDate = false;				// Set if the build cache determined that this file can be skipped
+		int threads = 0;					// Threads to use for work within this file. <= 0 means all of them
+
+		// Source file contents when they don't come from disk (stdin, build manifests). If null, the source is read
+		// from its path
+		const std::uint8_t* srcData = nullptr;
+		std::size_t srcSize = 0;
+
+		// Decodes a non-VTF source on demand, so jobs sharing a source can share the decoded image as well. Takes
+		// precedence over srcData when set
+		std::function<std::shared_ptr<imglib::Image>()> srcImage;
+		BaseCache* bases = nullptr; // Optional, lets jobs with the same source share decode + mip generation
+
+		// Files making up every frame and face of the source, frame after frame, when the source is a pattern naming a
+		// numbered sequence or the faces of a cubemap (see find_source_set)
+		std::vector<std::filesystem::path> sourceSet;
+		int setFrames = 1;
+		int setFaces = 1;
+		bool toStdout = false; // The VTF is written to stdout, so progress messages go to stderr instead
+		util::WriteBehind* writer = nullptr; // Optional, the VTF is handed to it to be written out in the background
+		std::function<void(bool ok)> written; // Optional, called by the writer once it's done with the VTF
+
+		// Buffered output for this file. Flushed in one go once the file is done, so the output of
+		// concurrently processed files does not interleave
+		std::string out;
+		std::string err;
+
+		// Flush buffered output to stdout/stderr
+		void flush();
+	};
+
 	/**
 	 * Extract image data from a VTF and put it in a
 	 * generic image file
@@ -26,28 +111,50 @@ namespace vtex2
 		int exec(const OptionList& opts) override;
 		void cleanup() override;
 
-		bool set_properties(VTFLib::CVTFFile* file);
+		bool set_properties(ConvertJob& job, VTFLib::CVTFFile* file, bool computeReflectivity = true);
 
 		bool process_file(
-			const OptionList& opts, const std::filesystem::path& srcFile, const std::filesystem::path& outPath);
+			ConvertJob& job, const std::filesystem::path& srcFile, const std::filesystem::path& outPath);
+
+		std::shared_ptr<imglib::Image> load_image(ConvertJob& job, const std::filesystem::path& imageSrc);
+
+		bool load_source_images(
+			ConvertJob& job, const std::filesystem::path& imageSrc, std::vector<std::shared_ptr<imglib::Image>>& images,
+			int& frames, int& faces);
 
 		bool add_image_data(
-			const std::filesystem::path& imageSrc, VTFLib::CVTFFile* file, VTFImageFormat format, bool create);
+			ConvertJob& job, const std::filesystem::path& imageSrc, VTFLib::CVTFFile* file, VTFImageFormat format,
+			imglib::ChannelType type, int comps, imglib::ProcFlags procFlags, bool create);
+
+		std::shared_ptr<VTFLib::CVTFFile> build_streamed(
+			ConvertJob& job, const std::filesystem::path& srcFile, const imglib::Image& image, VTFImageFormat format,
+			VTFImageFormat procFormat, imglib::ChannelType procChanType, int procComps, std::size_t budget);
+
+		bool add_vtf_image_data(
+			ConvertJob& job, VTFLib::CVTFFile* srcImage, VTFLib::CVTFFile* file, VTFImageFormat format);
+
+		std::shared_ptr<VTFLib::CVTFFile> build_base(
+			ConvertJob& job, const std::filesystem::path& srcFile, bool isvtf, VTFImageFormat procFormat,
+			imglib::ChannelType procChanType, int procComps, std::size_t& initialSize);
+
+		bool dry_run(
+			ConvertJob& job, const std::filesystem::path& srcFile, const std::filesystem::path& outFile, bool isvtf,
+			VTFImageFormat format);
 
-		bool add_image_data_raw(
-			VTFLib::CVTFFile* file, const void* data, VTFImageFormat format, VTFImageFormat dataFormat, int w, int h,
-			bool create);
+		bool report_quality(
+			ConvertJob& job, VTFLib::CVTFFile* base, VTFLib::CVTFFile* file, imglib::ChannelType type, int comps,
+			const std::filesystem::path& outFile);
 
-		bool add_vtf_image_data(VTFLib::CVTFFile* srcImage, VTFLib::CVTFFile* file, VTFImageFormat format);
+		bool patch_vtf(
+			ConvertJob& job, const std::filesystem::path& srcFile, const std::filesystem::path& outFile,
+			VTFImageFormat format, const cache::Key* cacheKey, bool& patched);
 
-		VTFLib::CVTFFile*
-		init_from_file(const std::filesystem::path& src, VTFLib::CVTFFile* file, VTFImageFormat newFormat);
+		VTFLib::CVTFFile* init_from_file(
+			ConvertJob& job, const std::filesystem::path& src, VTFLib::CVTFFile* file, VTFImageFormat newFormat);
 
 	private:
-		int m_mips = 10;
-		int m_width = -1;
-		int m_height = -1;
-		const OptionList* m_opts = nullptr;
+		int process_batch(
+			const OptionList& opts, const std::vector<std::filesystem::path>& files, cache::BuildCache* buildCache);
 	};
 
 } // namespace vtex2
@@ -2,15 +2,22 @@
 #include <filesystem>
 #include <iostream>
 #include <functional>
+#include <atomic>
+#include <optional>
 
 #include "nameof.hpp"
 #include "fmt/format.h"
 
 #include "action_extract.hpp"
+#include "profile.hpp"
 #include "common/util.hpp"
+#include "common/mapped_file.hpp"
 #include "common/enums.hpp"
 #include "common/strtools.hpp"
 #include "common/image.hpp"
+#include "common/parallel.hpp"
+#include "common/batchio.hpp"
+#include "common/vtftools.hpp"
 
 #include "VTFLib.h"
 
@@ -25,6 +32,10 @@ namespace opts
 	static int recursive;
 	static int noalpha;
 	static int quiet;
+	static int all;
+	static int nameTemplate;
+	static int jobs;
+	static int prefetch;
 } // namespace opts
 
 std::string ActionExtract::get_help() const {
@@ -92,6 +103,39 @@ const OptionList& ActionExtract::get_options() const {
 				.value(false)
 				.help("Silence output messages that aren't errors")
 		);
+
+		opts::all = opts.add(
+			ActionOption()
+				.short_opt("-a")
+				.long_opt("--all")
+				.type(OptType::Bool)
+				.value(false)
+				.help("Extract every frame, face, slice and mip instead of a single image. -o names the output "
+					  "directory"));
+
+		opts::nameTemplate = opts.add(
+			ActionOption()
+				.long_opt("--name-template")
+				.type(OptType::String)
+				.value("")
+				.help("File name template for --all. Supports {name}, {frame}, {face}, {slice} and {mip}. "
+					  "Defaults to the VTF name followed by each index that varies"));
+
+		opts::jobs = opts.add(
+			ActionOption()
+				.short_opt("-j")
+				.long_opt("--jobs")
+				.type(OptType::Int)
+				.value(0)
+				.help("Number of images to encode in parallel with --all. 0=use all cores"));
+
+		opts::prefetch = opts.add(
+			ActionOption()
+				.long_opt("--prefetch")
+				.type(OptType::Int)
+				.value(4)
+				.help("Number of VTFs to read ahead and images to write behind in the background when processing a "
+					  "directory. 0=off"));
 	};
 	return opts;
 }
@@ -103,25 +147,22 @@ int ActionExtract::exec(const OptionList& opts) {
 	const bool recursive = opts.get<bool>(opts::recursive);
 
 	if (std::filesystem::is_directory(file)) {
+		std::vector<std::filesystem::path> files;
+		const auto addFile = [&files](const std::filesystem::directory_entry& dirent)
+		{
+			if (!dirent.is_directory() && dirent.path().extension() == ".vtf")
+				files.push_back(dirent.path());
+		};
+
 		if (recursive) {
-			auto it = std::filesystem::recursive_directory_iterator(file);
-			for (auto& dirent : it) {
-				if (dirent.is_directory() || dirent.path().extension() != ".vtf")
-					continue;
-				if (!extract_file(opts, dirent, ""))
-					return 1;
-			}
+			for (auto& dirent : std::filesystem::recursive_directory_iterator(file))
+				addFile(dirent);
 		}
 		else {
-			auto it = std::filesystem::directory_iterator(file);
-			for (auto& dirent : it) {
-				if (dirent.is_directory() || dirent.path().extension() != ".vtf")
-					continue;
-				if (!extract_file(opts, dirent, ""))
-					return 1;
-			}
+			for (auto& dirent : std::filesystem::directory_iterator(file))
+				addFile(dirent);
 		}
-		return 0;
+		return extract_batch(opts, files);
 	}
 	else {
 		return extract_file(opts, file, output) ? 0 : 1;
@@ -130,18 +171,56 @@ int ActionExtract::exec(const OptionList& opts) {
 	return 0;
 }
 
+//
+// Extract every VTF of a directory, one after the other, stopping at the first failure. The next few VTFs are read
+// in the background while the current one is decoded and encoded, and its images are written out behind it
+//
+int ActionExtract::extract_batch(const OptionList& opts, const std::vector<std::filesystem::path>& files) {
+	const int prefetchDepth = opts.get<int>(opts::prefetch);
+
+	std::optional<util::Prefetcher> prefetcher;
+	std::optional<util::WriteBehind> writer;
+	if (prefetchDepth > 0) {
+		prefetcher.emplace(files, prefetchDepth);
+		writer.emplace(prefetchDepth);
+	}
+	writer_ = writer ? &*writer : nullptr;
+	auto writerCleanup = util::cleanup([this] { writer_ = nullptr; });
+
+	bool ok = true;
+	for (std::size_t i = 0; ok && i < files.size(); ++i) {
+		std::vector<std::uint8_t> data;
+		const bool prefetched = prefetcher && prefetcher->take(i, data);
+		ok = extract_file(opts, files[i], "", prefetched ? &data : nullptr);
+	}
+
+	prefetcher.reset();
+	if (writer) {
+		for (auto& out : writer->flush()) {
+			std::cerr << fmt::format("Could not save image to '{}'!\n", out.string());
+			ok = false;
+		}
+	}
+	return ok ? 0 : 1;
+}
+
 void ActionExtract::cleanup() {
 	delete file_;
+	file_ = nullptr;
 }
 
 bool ActionExtract::extract_file(
-	const OptionList& opts, const std::filesystem::path& vtfPath, const std::filesystem::path& userOutputFile) {
-	if (!load_vtf(vtfPath))
+	const OptionList& opts, const std::filesystem::path& vtfPath, const std::filesystem::path& userOutputFile,
+	const std::vector<std::uint8_t>* data) {
+	profile::Scope fileScope("extract", vtfPath.string());
+	if (!load_vtf(vtfPath, data))
 		return false;
 
+	if (opts.get<bool>(opts::all))
+		return extract_all(opts, vtfPath, userOutputFile);
+
 	auto format = opts.get<std::string>(opts::format);
 	auto mip = opts.get<int>(opts::mip);
-	const bool noalpha = opts.get<bool>(opts::noalpha);
 
 	// If the user provided output file is empty, we'll determine a default
 	auto outFile = userOutputFile;
@@ -157,16 +236,17 @@ bool ActionExtract::extract_file(
 			return false;
 		}
 
-		// Now build a default file name
+		// Now build a default file name. Images read from stdin go back out to stdout
 		auto* ext = imglib::image_get_extension(imglib::image_get_format(format.c_str()));
-		outFile = vtfPath.parent_path() / vtfPath.filename().replace_extension(ext);
+		outFile = vtfPath == "-" ? "-" : vtfPath.parent_path() / vtfPath.filename().replace_extension(ext);
 	}
 
+	// Keep stdout clean when the image itself is going there
 	if (!opts.get<bool>(opts::quiet))
-		fmt::print("{} -> {}\n", vtfPath.string(), outFile.string());
+		fmt::print(outFile == "-" ? stderr : stdout, "{} -> {}\n", vtfPath.string(), outFile.string());
 
 	// Validate mipmap selection
-	if (mip > file_->GetMipmapCount()) {
+	if (mip < 0 || mip >= int(file_->GetMipmapCount())) {
 		std::cerr << fmt::format(
 			"Selected mip {} exceeds the total mip count of the image: {}\n", mip, file_->GetMipmapCount());
 		return false;
@@ -186,6 +266,125 @@ bool ActionExtract::extract_file(
 		return false;
 	}
 
+	std::string err;
+	if (!save_image(0, 0, 0, mip, opts.get<bool>(opts::noalpha), targetFmt, outFile, err)) {
+		std::cerr << err;
+		return false;
+	}
+	return true;
+}
+
+//
+// Write every frame, face, slice and mip of the loaded VTF out to its own file.
+// The VTF is decoded once, and the images are converted and encoded in parallel since the PNG deflate dominates
+//
+bool ActionExtract::extract_all(
+	const OptionList& opts, const std::filesystem::path& vtfPath, const std::filesystem::path& outputDir) {
+	auto format = opts.get<std::string>(opts::format);
+	auto nameTemplate = opts.get<std::string>(opts::nameTemplate);
+	const bool noalpha = opts.get<bool>(opts::noalpha);
+	const bool quiet = opts.get<bool>(opts::quiet);
+
+	if (outputDir == "-") {
+		std::cerr << "--all writes multiple files and can't be used with stdout\n";
+		return false;
+	}
+
+	// Directory batches need a format anyway, so default to png here too instead of erroring out
+	if (format.empty())
+		format = "png";
+	const auto targetFmt = imglib::image_get_format(format.c_str());
+	if (targetFmt == imglib::FileFormat::None) {
+		std::cerr << "Could not determine file format from --format parameter\n";
+		return false;
+	}
+	const auto* ext = imglib::image_get_extension(targetFmt);
+
+	const int frames = file_->GetFrameCount();
+	const int faces = file_->GetFaceCount();
+	const int mips = file_->GetMipmapCount();
+	const int depth = file_->GetDepth();
+
+	// By default, only name the indices that actually vary so a plain texture doesn't end up with a pile of _0s
+	if (nameTemplate.empty()) {
+		nameTemplate = "{name}";
+		if (frames > 1)
+			nameTemplate += "_frame{frame}";
+		if (faces > 1)
+			nameTemplate += "_face{face}";
+		if (depth > 1)
+			nameTemplate += "_slice{slice}";
+		if (mips > 1)
+			nameTemplate += "_mip{mip}";
+	}
+
+	auto dir = outputDir.empty() ? vtfPath.parent_path() : outputDir;
+	if (!outputDir.empty()) {
+		std::error_code ec;
+		std::filesystem::create_directories(dir, ec);
+		if (ec) {
+			std::cerr << fmt::format("Could not create output directory '{}': {}\n", dir.string(), ec.message());
+			return false;
+		}
+	}
+
+	struct ExtractTask {
+		int frame, face, slice, mip;
+		std::filesystem::path outFile;
+		std::string err;
+	};
+
+	const auto name = vtfPath.stem().string();
+	std::vector<ExtractTask> tasks;
+	for (int mip = 0; mip < mips; ++mip) {
+		vlUInt w, h, d;
+		file_->ComputeMipmapDimensions(file_->GetWidth(), file_->GetHeight(), depth, mip, w, h, d);
+		for (int frame = 0; frame < frames; ++frame) {
+			for (int face = 0; face < faces; ++face) {
+				for (int slice = 0; slice < int(d); ++slice) {
+					std::string fileName;
+					try {
+						fileName = fmt::format(
+							fmt::runtime(nameTemplate), fmt::arg("name", name), fmt::arg("frame", frame),
+							fmt::arg("face", face), fmt::arg("slice", slice), fmt::arg("mip", mip));
+					}
+					catch (const fmt::format_error& e) {
+						std::cerr << fmt::format("Invalid --name-template '{}': {}\n", nameTemplate, e.what());
+						return false;
+					}
+					tasks.push_back({frame, face, slice, mip, dir / (fileName + ext), {}});
+				}
+			}
+		}
+	}
+
+	std::atomic<bool> ok = true;
+	util::parallel_for(
+		tasks.size(),
+		[&](std::size_t i)
+		{
+			auto& task = tasks[i];
+			if (!save_image(task.frame, task.face, task.slice, task.mip, noalpha, targetFmt, task.outFile, task.err))
+				ok = false;
+		},
+		opts.get<int>(opts::jobs));
+
+	// Report in a stable order, regardless of which thread finished first
+	for (auto& task : tasks) {
+		if (!task.err.empty())
+			std::cerr << task.err;
+		else if (!quiet)
+			fmt::print("{} -> {}\n", vtfPath.string(), task.outFile.string());
+	}
+	return ok;
+}
+
+//
+// Decode a single image out of the loaded VTF and save it. Safe to call from several threads at once
+//
+bool ActionExtract::save_image(
+	int frame, int face, int slice, int mip, bool noalpha, imglib::FileFormat targetFmt,
+	const std::filesystem::path& outFile, std::string& err) const {
 	vlUInt w, h, d;
 	file_->ComputeMipmapDimensions(file_->GetWidth(), file_->GetHeight(), file_->GetDepth(), mip, w, h, d);
 
@@ -196,70 +395,105 @@ bool ActionExtract::extract_file(
 	if (noalpha)
 		comps = 3;
 
-	// Allocate buffer for image data
-	vlByte* imageData = nullptr;
-	auto imageDataClean = util::cleanup(
-		[imageData]
-		{
-			free(imageData);
-		});
-
 	// Only supported format for Hdr is 32-bit RGBA - everything else will be squashed down into 32 or 24bpp RGB/RGBA
-	bool destIsFloat = (targetFmt == imglib::Hdr);
-	bool ok = false;
-	if (destIsFloat) {
-		imageData = static_cast<vlByte*>(malloc(w * h * comps * sizeof(float)));
-		ok = VTFLib::CVTFFile::Convert(
-			file_->GetData(0, 0, 0, mip), imageData, w, h, file_->GetFormat(),
-			comps == 3 ? IMAGE_FORMAT_RGB323232F : IMAGE_FORMAT_RGBA32323232F);
-	}
-	else {
-		// comps = 3;
-		imageData = static_cast<vlByte*>(malloc(w * h * comps * sizeof(uint8_t)));
-		ok = VTFLib::CVTFFile::Convert(
-			file_->GetData(0, 0, 0, mip), imageData, w, h, file_->GetFormat(),
-			comps == 3 ? IMAGE_FORMAT_RGB888 : IMAGE_FORMAT_RGBA8888);
+	const bool destIsFloat = (targetFmt == imglib::Hdr);
+	VTFImageFormat destFmt;
+	if (destIsFloat)
+		destFmt = comps == 3 ? IMAGE_FORMAT_RGB323232F : IMAGE_FORMAT_RGBA32323232F;
+	else
+		destFmt = comps == 3 ? IMAGE_FORMAT_RGB888 : IMAGE_FORMAT_RGBA8888;
+
+	imglib::Image image(destIsFloat ? imglib::ChannelType::Float : imglib::ChannelType::UInt8, comps, w, h, false);
+	{
+		profile::Scope scope("CVTFFile::Convert");
+		if (!VTFLib::CVTFFile::Convert(
+				file_->GetData(frame, face, slice, mip), static_cast<vlByte*>(image.data()), w, h, file_->GetFormat(),
+				destFmt)) {
+			err = fmt::format(
+				"Could not convert image format '{}' -> '{}': {}\n", NAMEOF_ENUM(file_->GetFormat()),
+				NAMEOF_ENUM(destFmt), util::get_last_vtflib_error());
+			return false;
+		}
 	}
 
-	if (!ok) {
-		std::cerr << fmt::format(
-			"Could not convert image format '{}' -> '{}': {}\n", NAMEOF_ENUM(file_->GetFormat()),
-			destIsFloat ? "RGBA32323232F" : "RGBA8888", util::get_last_vtflib_error());
-		return false;
+	// "-" streams the encoded image to stdout instead of a file
+	profile::Scope saveScope("encode+save", outFile.string());
+	bool saved;
+	if (outFile == "-") {
+		util::set_binary_mode(stdout);
+		saved = image.save(
+					[](const void* data, size_t size)
+					{
+						fwrite(data, 1, size, stdout);
+					},
+					targetFmt) &&
+				fflush(stdout) == 0;
 	}
+	else if (writer_) {
+		std::vector<std::uint8_t> encoded;
+		saved = image.save(
+			[&encoded](const void* data, size_t size)
+			{
+				auto* bytes = static_cast<const std::uint8_t*>(data);
+				encoded.insert(encoded.end(), bytes, bytes + size);
+			},
+			targetFmt);
+		if (saved)
+			writer_->write(outFile, std::move(encoded));
+	}
+	else
+		saved = image.save(outFile.string().c_str(), targetFmt);
 
-	imglib::Image image(imageData, destIsFloat ? imglib::ChannelType::Float : imglib::ChannelType::UInt8, comps, w, h, true);
-	if (!image.save(outFile.string().c_str(), targetFmt)) {
-		std::cerr << fmt::format("Could not save image to '{}'!\n", outFile.string());
+	if (!saved) {
+		err = fmt::format("Could not save image to '{}'!\n", outFile.string());
 		return false;
 	}
-
 	return true;
 }
 
-bool ActionExtract::load_vtf(const std::filesystem::path& vtfFile) {
+bool ActionExtract::load_vtf(const std::filesystem::path& vtfFile, const std::vector<std::uint8_t>* data) {
+	profile::Scope scope("vtf load");
+
 	// Cleanup any existing files
-	if (file_)
-		delete file_;
-
-	// Load off disk
-	std::uint8_t* buf = nullptr;
-	auto numBytes = util::read_file(vtfFile.string(), buf);
-	auto bufCleanup = util::cleanup(
-		[&buf]
-		{
-			delete[] buf;
-		});
+	delete file_;
+	file_ = nullptr;
+
+	// "-" reads the VTF from stdin
+	if (vtfFile == "-") {
+		std::vector<std::uint8_t> data;
+		util::set_binary_mode(stdin);
+		if (!util::read_stream(stdin, data) || data.empty()) {
+			std::cerr << "Could not read VTF from stdin\n";
+			return false;
+		}
+
+		file_ = new VTFLib::CVTFFile();
+		if (!vtf::load(file_, data.data(), data.size())) {
+			std::cerr << fmt::format("Failed to load VTF from stdin: {}\n", util::get_last_vtflib_error());
+			return false;
+		}
+		return true;
+	}
+
+	if (data) {
+		file_ = new VTFLib::CVTFFile();
+		if (!vtf::load(file_, data->data(), data->size())) {
+			std::cerr << fmt::format("Failed to load VTF '{}': {}\n", vtfFile.string(), util::get_last_vtflib_error());
+			return false;
+		}
+		return true;
+	}
 
-	if (numBytes == 0 || !buf) {
+	// Map it rather than reading it, VTFLib makes its own copy of everything it needs anyway
+	util::MappedFile mapped;
+	if (!mapped.open(vtfFile.string())) {
 		std::cerr << fmt::format("Could not open file '{}'!\n", vtfFile.string());
-		delete[] buf;
 		return false;
 	}
 
 	// Create new file & load it with vtflib
 	file_ = new VTFLib::CVTFFile();
-	if (!file_->Load(buf, numBytes, false)) {
+	if (!vtf::load(file_, mapped.data(), mapped.size())) {
 		std::cerr << fmt::format("Failed to load VTF '{}': {}\n", vtfFile.string(), util::get_last_vtflib_error());
 		return false;
 	}
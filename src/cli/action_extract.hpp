@@ -1,13 +1,21 @@
 
+#include <cstdint>
 #include <filesystem>
+#include <vector>
 
 #include "action.hpp"
+#include "common/image.hpp"
 
 namespace VTFLib
 {
 	class CVTFFile;
 }
 
+namespace util
+{
+	class WriteBehind;
+}
+
 namespace vtex2
 {
 
@@ -25,12 +33,25 @@ namespace vtex2
 		int exec(const OptionList& opts) override;
 		void cleanup() override;
 
+		/**
+		 * @param data Contents of vtfFile if they're already in memory, otherwise it's read from disk
+		 */
 		bool extract_file(
-			const OptionList& opts, const std::filesystem::path& vtfFile, const std::filesystem::path& outFile);
-		bool load_vtf(const std::filesystem::path& vtfFile);
+			const OptionList& opts, const std::filesystem::path& vtfFile, const std::filesystem::path& outFile,
+			const std::vector<std::uint8_t>* data = nullptr);
+		bool load_vtf(const std::filesystem::path& vtfFile, const std::vector<std::uint8_t>* data = nullptr);
 
 	private:
+		int extract_batch(const OptionList& opts, const std::vector<std::filesystem::path>& files);
+		bool extract_all(
+			const OptionList& opts, const std::filesystem::path& vtfFile, const std::filesystem::path& outputDir);
+
+		bool save_image(
+			int frame, int face, int slice, int mip, bool noalpha, imglib::FileFormat targetFmt,
+			const std::filesystem::path& outFile, std::string& err) const;
+
 		VTFLib::CVTFFile* file_ = nullptr;
+		util::WriteBehind* writer_ = nullptr; // Set during directory batches, images are written out in the background
 	};
 
 } // namespace vtex2
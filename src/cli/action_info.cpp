@@ -1,9 +1,14 @@
-
 #include <iostream>
+#include <filesystem>
+#include <atomic>
 
 #include "action_info.hpp"
 #include "common/util.hpp"
 #include "common/enums.hpp"
+#include "common/parallel.hpp"
+#include "common/strtools.hpp"
+#include "common/vtfheader.hpp"
+#include "common/json.hpp"
 
 #include "VTFLib.h"
 
@@ -17,10 +22,131 @@ namespace opts
 	static int all;
 	static int file;
 	static int resources;
+	static int recursive;
+	static int jobs;
+	static int outputFormat;
 } // namespace opts
 
+namespace
+{
+	using OutputFormat = ActionInfo::OutputFormat;
+
+	// Files per batch in directory mode. Each batch is parsed in parallel and then printed in order, which keeps the
+	// output deterministic without holding the results for the entire tree in memory
+	constexpr std::size_t FILES_PER_BATCH = 4096;
+
+	bool has_compression_level(const vtf::HeaderInfo& info) {
+		return info.majorVersion >= 7 && info.minorVersion >= 6;
+	}
+
+	std::string csv_escape(const std::string& str) {
+		if (str.find_first_of(",\"\n") == std::string::npos)
+			return str;
+		std::string out = "\"";
+		for (char c : str) {
+			if (c == '"')
+				out += '"';
+			out += c;
+		}
+		return out + "\"";
+	}
+
+	std::string format_compact(const vtf::HeaderInfo& info) {
+		auto str = fmt::format(
+			FMT_STRING("VTF {}.{}, {} x {} x {}, {} frames, {} mipmaps, {} faces, image format {}"), info.majorVersion,
+			info.minorVersion, info.width, info.height, info.depth, info.frames, info.mips, info.faces,
+			NAMEOF_ENUM(info.format));
+		if (has_compression_level(info))
+			str += fmt::format(FMT_STRING(", DEFLATE compression level {}"), info.compressionLevel);
+		return str + "\n";
+	}
+
+	std::string format_detailed(const vtf::HeaderInfo& info, bool details, bool resources) {
+		std::string str;
+		str += fmt::format(FMT_STRING("VTF Version {}.{}\n"), info.majorVersion, info.minorVersion);
+		str += fmt::format(FMT_STRING("Image format: {}\n"), NAMEOF_ENUM(info.format));
+		str += fmt::format(FMT_STRING("Dimensions (WxHxD): {} x {} x {}\n"), info.width, info.height, info.depth);
+		str += fmt::format(FMT_STRING("{} frame(s), {} face(s), {} mipmaps\n"), info.frames, info.faces, info.mips);
+
+		if (has_compression_level(info))
+			str += fmt::format(FMT_STRING("DEFLATE compression level {}\n"), info.compressionLevel);
+
+		if (details) {
+			if (info.hasCrc)
+				str += fmt::format(FMT_STRING("Source CRC: 0x{:X}\n"), info.crc);
+			else
+				str += "Source CRC: None\n";
+
+			// Display list of texture flags
+			str += fmt::format(FMT_STRING("Flags: 0x{:X}\n"), info.flags);
+			for (auto& fl : TextureFlagsToStringVector(info.flags))
+				str += fmt::format(FMT_STRING("    {}\n"), fl);
+
+			str += fmt::format(FMT_STRING("Bumpscale: {}\n"), info.bumpScale);
+			str += fmt::format(
+				FMT_STRING("Reflectivity: ({} {} {})\n"), info.reflectivity[0], info.reflectivity[1],
+				info.reflectivity[2]);
+		}
+
+		if (resources) {
+			str += info.resources.empty() ? "No resource entries\n" : "Resource entries:\n";
+			for (auto& rsrc : info.resources) {
+				str += fmt::format(
+					FMT_STRING("    0x{:X} ({:c}{:c}{:c}) - {} bytes ({:1f} KiB)\n"), rsrc.type, char(rsrc.type & 0xFF),
+					char((rsrc.type >> 8) & 0xFF), char((rsrc.type >> 16) & 0xFF), rsrc.size, rsrc.size / 1024.f);
+			}
+		}
+
+		str += fmt::format(
+			FMT_STRING("{:2f} KiB image data ({:2f} MiB)\n"), info.imageSize / 1024.f,
+			info.imageSize / (1024.f * 1024.f));
+		return str;
+	}
+
+	std::string format_json(const std::string& path, const vtf::HeaderInfo& info, bool resources) {
+		auto str = fmt::format(
+			FMT_STRING("{{\"path\":\"{}\",\"version\":\"{}.{}\",\"width\":{},\"height\":{},\"depth\":{},"
+					   "\"format\":\"{}\",\"frames\":{},\"faces\":{},\"mips\":{},\"flags\":{},\"start_frame\":{},"
+					   "\"bumpscale\":{},\"reflectivity\":[{},{},{}],\"compression\":{},\"crc\":{},\"image_size\":{}"),
+			json::escape(path), info.majorVersion, info.minorVersion, info.width, info.height, info.depth,
+			NAMEOF_ENUM(info.format), info.frames, info.faces, info.mips, info.flags, info.startFrame, info.bumpScale,
+			info.reflectivity[0], info.reflectivity[1], info.reflectivity[2], info.compressionLevel,
+			info.hasCrc ? fmt::format(FMT_STRING("\"0x{:X}\""), info.crc) : "null", info.imageSize);
+
+		if (resources) {
+			str += ",\"resources\":[";
+			for (std::size_t i = 0; i < info.resources.size(); ++i) {
+				str += fmt::format(
+					FMT_STRING("{}{{\"type\":\"0x{:X}\",\"size\":{}}}"), i ? "," : "", info.resources[i].type,
+					info.resources[i].size);
+			}
+			str += "]";
+		}
+		return str + "}\n";
+	}
+
+	constexpr const char* CSV_HEADER =
+		"path,version,width,height,depth,format,frames,faces,mips,flags,compression,crc,image_size\n";
+
+	std::string format_csv(const std::string& path, const vtf::HeaderInfo& info) {
+		return fmt::format(
+			FMT_STRING("{},{}.{},{},{},{},{},{},{},{},0x{:X},{},{},{}\n"), csv_escape(path), info.majorVersion,
+			info.minorVersion, info.width, info.height, info.depth, NAMEOF_ENUM(info.format), info.frames, info.faces,
+			info.mips, info.flags, info.compressionLevel, info.hasCrc ? fmt::format(FMT_STRING("0x{:X}"), info.crc) : "",
+			info.imageSize);
+	}
+
+	OutputFormat parse_output_format(const std::string& str) {
+		if (!str::strcasecmp(str.c_str(), "json"))
+			return OutputFormat::Json;
+		if (!str::strcasecmp(str.c_str(), "csv"))
+			return OutputFormat::Csv;
+		return OutputFormat::Text;
+	}
+} // namespace
+
 std::string ActionInfo::get_help() const {
-	return "Displays info about a VTF file";
+	return "Displays info about a VTF file, or every VTF in a directory";
 }
 
 const OptionList& ActionInfo::get_options() const {
@@ -42,12 +168,35 @@ const OptionList& ActionInfo::get_options() const {
 				.value(false)
 				.help("List all resource entries in the VTF"));
 
+		opts::recursive = opts.add(
+			ActionOption()
+				.long_opt("--recursive")
+				.type(OptType::Bool)
+				.value(false)
+				.help("Recursively process directories"));
+
+		opts::jobs = opts.add(
+			ActionOption()
+				.long_opt("--jobs")
+				.short_opt("-j")
+				.value(0)
+				.type(OptType::Int)
+				.help("Number of files to read in parallel when processing a directory. 0=use all cores"));
+
+		opts::outputFormat = opts.add(
+			ActionOption()
+				.long_opt("--output-format")
+				.type(OptType::String)
+				.value("text")
+				.choices({"text", "json", "csv"})
+				.help("Output format. json and csv print one line per file"));
+
 		opts::file = opts.add(
 			ActionOption()
 				.metavar("file")
 				.type(OptType::String)
 				.value("")
-				.help("VTF file to process")
+				.help("VTF file or directory to process")
 				.end_of_line(true)
 				.required(true));
 	};
@@ -55,106 +204,103 @@ const OptionList& ActionInfo::get_options() const {
 }
 
 int ActionInfo::exec(const OptionList& opts) {
-
 	const auto file = opts.get<std::string>(opts::file);
-	const auto details = opts.get<bool>(opts::all);
-	const auto resources = opts.get<bool>(opts::resources) || details;
-
-	// Load off disk
-	std::uint8_t* buf = nullptr;
-	auto numBytes = util::read_file(file, buf);
-	auto bufCleanup = util::cleanup(
-		[&]
-		{
-			delete[] buf;
-		});
-
-	if (numBytes == 0 || !buf) {
-		std::cerr << fmt::format(FMT_STRING("Could not open file '{}'!\n"), file);
-		return 1;
-	}
+	const auto recursive = opts.get<bool>(opts::recursive);
 
-	// Load VTF with vtflib
-	file_ = new VTFLib::CVTFFile();
-	if (!file_->Load(buf, numBytes, false)) {
-		std::cerr << fmt::format(FMT_STRING("Failed to load VTF '{}': {}\n"), file, util::get_last_vtflib_error());
-		return 1;
-	}
+	details_ = opts.get<bool>(opts::all);
+	resources_ = opts.get<bool>(opts::resources) || details_;
+	format_ = parse_output_format(opts.get<std::string>(opts::outputFormat));
 
-	auto fmt = file_->GetFormat();
+	if (format_ == OutputFormat::Csv)
+		std::cout << CSV_HEADER;
 
-	// Basic compact info mode
-	if (!details) {
-		compact_info();
+	if (!std::filesystem::is_directory(file)) {
+		std::string out, err;
+		if (!describe_file(file, false, out, err)) {
+			std::cerr << err;
+			return 1;
+		}
+		std::cout << out;
 		return 0;
 	}
 
-	fmt::print(FMT_STRING("VTF Version {}.{}\n"), file_->GetMajorVersion(), file_->GetMinorVersion());
-	fmt::print(FMT_STRING("Image format: {}\n"), NAMEOF_ENUM(fmt));
-	fmt::print(
-		FMT_STRING("Dimensions (WxHxD): {} x {} x {}\n"), file_->GetWidth(), file_->GetHeight(), file_->GetDepth());
-	fmt::print(
-		FMT_STRING("{} frame(s), {} face(s), {} mipmaps\n"), file_->GetFrameCount(), file_->GetFaceCount(),
-		file_->GetMipmapCount());
+	// Gather all of the files up front, so they may be handed out to the workers
+	std::vector<std::string> files;
+	const auto addFile = [&files](const std::filesystem::directory_entry& dirent)
+	{
+		if (dirent.is_directory())
+			return;
+		auto path = dirent.path().string();
+		if (str::strcasecmp(str::get_ext(path.c_str()), ".vtf"))
+			return;
+		files.push_back(std::move(path));
+	};
 
-	if (file_->GetMajorVersion() >= 7 && file_->GetMinorVersion() >= 6) {
-		fmt::print(FMT_STRING("DEFLATE compression level {}\n"), file_->GetAuxCompressionLevel());
+	if (recursive) {
+		for (auto& dirent : std::filesystem::recursive_directory_iterator(file))
+			addFile(dirent);
+	}
+	else {
+		for (auto& dirent : std::filesystem::directory_iterator(file))
+			addFile(dirent);
 	}
 
-	if (details) {
-		vlUInt dataSize;
-		if (auto* crcPtr = file_->GetResourceData(VTF_RSRC_CRC, dataSize)) {
-			auto crc = *static_cast<std::uint32_t*>(crcPtr);
-			fmt::print(FMT_STRING("Source CRC: 0x{:X}\n"), crc);
-		}
-		else
-			fmt::print("Source CRC: None\n");
-
-		// Display list of texture flags
-		auto flags = TextureFlagsToStringVector(file_->GetFlags());
-		fmt::print(FMT_STRING("Flags: 0x{:X}\n"), file_->GetFlags());
-		for (auto& fl : flags) {
-			fmt::print(FMT_STRING("    {}\n"), fl);
-		}
+	const int numThreads = util::resolve_thread_count(opts.get<int>(opts::jobs));
+	std::atomic<std::size_t> numFailed = 0;
 
-		fmt::print(FMT_STRING("Bumpscale: {}\n"), file_->GetBumpmapScale());
-		vlSingle x, y, z;
-		file_->GetReflectivity(x, y, z);
-		fmt::print(FMT_STRING("Reflectivity: ({} {} {})\n"), x, y, z);
-	}
+	std::vector<std::string> out(std::min(files.size(), FILES_PER_BATCH));
+	std::vector<std::string> err(out.size());
+	for (std::size_t first = 0; first < files.size(); first += FILES_PER_BATCH) {
+		const std::size_t count = std::min(FILES_PER_BATCH, files.size() - first);
+		util::parallel_for(
+			count,
+			[&](std::size_t i)
+			{
+				out[i].clear();
+				err[i].clear();
+				if (!describe_file(files[first + i], true, out[i], err[i]))
+					++numFailed;
+			},
+			numThreads);
 
-	if (resources) {
-		const auto rsrcCount = file_->GetResourceCount();
-		rsrcCount > 0 ? fmt::print("Resource entries:\n") : fmt::print("No resource entries\n");
-
-		for (auto i = 0; i < rsrcCount; ++i) {
-			auto type = file_->GetResourceType(i);
-			vlUInt sz = 0;
-			file_->GetResourceData(type, sz);
-			fmt::print(
-				FMT_STRING("    0x{:X} ({:c}{:c}{:c}) - {} bytes ({:1f} KiB)\n"), type, type & 0xFF, (type >> 8) & 0xFF,
-				(type >> 16) & 0xFF, sz, sz / 1024.f);
+		for (std::size_t i = 0; i < count; ++i) {
+			std::cout << out[i];
+			std::cerr << err[i];
 		}
 	}
 
-	fmt::print(
-		FMT_STRING("{:2f} KiB image data ({:2f} MiB)\n"), file_->GetSize() / 1024.f,
-		file_->GetSize() / (1024.f * 1024.f));
-
+	if (numFailed) {
+		std::cerr << fmt::format("Failed to read {} of {} files\n", numFailed.load(), files.size());
+		return 1;
+	}
 	return 0;
 }
 
 void ActionInfo::cleanup() {
-	delete file_;
 }
 
-void ActionInfo::compact_info() {
-	fmt::print(
-		FMT_STRING("VTF {}.{}, {} x {} x {}, {} frames, {} mipmaps, {} faces, image format {}"),
-		file_->GetMajorVersion(), file_->GetMinorVersion(), file_->GetWidth(), file_->GetHeight(), file_->GetDepth(),
-		file_->GetFrameCount(), file_->GetMipmapCount(), file_->GetFaceCount(), NAMEOF_ENUM(file_->GetFormat()));
-	if (file_->GetMajorVersion() >= 7 && file_->GetMinorVersion() >= 6)
-		fmt::print(FMT_STRING(", DEFLATE compression level {}\n"), file_->GetAuxCompressionLevel());
-	else
-		std::cout << "\n";
+bool ActionInfo::describe_file(const std::string& path, bool showPath, std::string& out, std::string& err) const {
+	vtf::HeaderInfo info;
+	std::string error;
+	if (!vtf::read_header(path, info, error)) {
+		err = fmt::format(FMT_STRING("Failed to load VTF '{}': {}\n"), path, error);
+		return false;
+	}
+
+	switch (format_) {
+		case OutputFormat::Json:
+			out = format_json(path, info, resources_);
+			break;
+		case OutputFormat::Csv:
+			out = format_csv(path, info);
+			break;
+		default:
+			// Basic compact info mode
+			if (!details_ && !resources_)
+				out = showPath ? fmt::format(FMT_STRING("{}: {}"), path, format_compact(info)) : format_compact(info);
+			else
+				out = (showPath ? fmt::format(FMT_STRING("{}:\n"), path) : "") + format_detailed(info, details_, resources_);
+			break;
+	}
+	return true;
 }
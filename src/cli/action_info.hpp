@@ -1,19 +1,21 @@
 
 #include "action.hpp"
 
-namespace VTFLib
-{
-	class CVTFFile;
-}
-
 namespace vtex2
 {
 
 	/**
-	 * A simple action to display info about a VTF file
+	 * A simple action to display info about a VTF file, or every VTF in a directory.
+	 * Only the header and resource directory are read, so this is cheap even on huge files and trees
 	 */
 	class ActionInfo : public BaseAction {
 	public:
+		enum class OutputFormat {
+			Text,
+			Json, // One object per line
+			Csv,  // Header line, then one row per file
+		};
+
 		std::string get_name() const override {
 			return "info";
 		}
@@ -23,9 +25,15 @@ namespace vtex2
 		void cleanup() override;
 
 	private:
-		void compact_info();
+		/**
+		 * Describe a single file in the selected output format
+		 * @param showPath Prefix text output with the path, used when listing a directory
+		 */
+		bool describe_file(const std::string& path, bool showPath, std::string& out, std::string& err) const;
 
-		VTFLib::CVTFFile* file_ = nullptr;
+		bool details_ = false;
+		bool resources_ = false;
+		OutputFormat format_ = OutputFormat::Text;
 	};
 
 } // namespace vtex2
@@ -1,12 +1,26 @@
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <unordered_map>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
 
 #include "action_pack.hpp"
+#include "profile.hpp"
 #include "common/util.hpp"
 #include "common/enums.hpp"
 #include "common/pack.hpp"
+#include "common/pipeline.hpp"
+#include "common/parallel.hpp"
+#include "common/vtftools.hpp"
+#include "common/cache.hpp"
+#include "common/vtex2_version.h"
 
 #include "VTFLib.h"
 
@@ -30,7 +44,12 @@ namespace opts
 	static int width, height, mips;
 	static int mconst, rconst, aoconst, hconst;
 	static int toDX;
+	static int renormalize;
 	static int quiet;
+	static int cache;
+	static int batch;
+	static int jobs;
+	static int keepgoing;
 } // namespace opts
 
 std::string ActionPack::get_help() const {
@@ -178,6 +197,13 @@ const OptionList& ActionPack::get_options() const {
 				.type(OptType::Bool)
 				.help("Treat the incoming normal map as a OpenGL normal map"));
 
+		opts::renormalize = opts.add(
+			ActionOption()
+				.long_opt("--renormalize")
+				.value(false)
+				.type(OptType::Bool)
+				.help("Rescale the vectors of the incoming normal map to unit length"));
+
 		opts::quiet = opts.add(
 			ActionOption()
 				.long_opt("--quiet")
@@ -186,306 +212,442 @@ const OptionList& ActionPack::get_options() const {
 				.type(OptType::Bool)
 				.help("Silence output messages that aren't errors")
 		);
+
+		opts::cache = opts.add(
+			ActionOption()
+				.long_opt("--cache")
+				.type(OptType::String)
+				.value("")
+				.help("Build cache manifest to use. The pack is skipped if the inputs and options are unchanged since "
+					  "the last run"));
+
+		opts::batch = opts.add(
+			ActionOption()
+				.long_opt("--batch")
+				.type(OptType::String)
+				.value("")
+				.help("JSON manifest of packs to run, like {\"pack\": [{\"args\": [...]}, ...]}. Paths are relative to "
+					  "the manifest. --cache and --quiet apply to every pack"));
+
+		opts::jobs = opts.add(
+			ActionOption()
+				.long_opt("--jobs")
+				.short_opt("-j")
+				.value(0)
+				.type(OptType::Int)
+				.help("Number of packs to run in parallel with --batch. 0=use all cores"));
+
+		opts::keepgoing = opts.add(
+			ActionOption()
+				.long_opt("--keep-going")
+				.short_opt("-k")
+				.value(false)
+				.type(OptType::Bool)
+				.help("Keep running the remaining packs of a --batch after a failure"));
 	};
 	return opts;
 }
 
+void PackJob::flush() {
+	static std::mutex outputMutex;
+	std::lock_guard lock(outputMutex);
+	if (!out.empty())
+		std::fwrite(out.data(), 1, out.size(), stdout);
+	if (!err.empty()) {
+		std::fflush(stdout);
+		std::cerr << err;
+	}
+	out.clear();
+	err.clear();
+}
+
 int ActionPack::exec(const OptionList& opts) {
+	const bool quiet = opts.get<bool>(opts::quiet);
+
+	// Resolve this before changing directories, it's relative to where we were run from
+	auto cachePath = opts.get<std::string>(opts::cache);
+	if (!cachePath.empty())
+		cachePath = std::filesystem::absolute(cachePath).string();
+
+	const auto batchPath = opts.get<std::string>(opts::batch);
+	if (batchPath.empty()) {
+		PackJob job;
+		job.opts = &opts;
+		cache::BuildCache buildCache;
+		if (!cachePath.empty()) {
+			if (!buildCache.load(cachePath)) {
+				std::cerr << fmt::format("Could not read build cache '{}'\n", cachePath);
+				return 1;
+			}
+			job.cache = &buildCache;
+		}
+
+		const bool ok = run(job);
+		job.flush();
+		if (ok && job.cache && !buildCache.save()) {
+			std::cerr << fmt::format("Could not write build cache '{}'\n", cachePath);
+			return 1;
+		}
+		return ok ? 0 : 1;
+	}
+
+	const auto manifestPath = std::filesystem::absolute(batchPath);
+	std::ifstream stream(manifestPath, std::ios::binary);
+	if (!stream) {
+		std::cerr << fmt::format("Could not open batch manifest '{}'\n", manifestPath.string());
+		return 1;
+	}
+	std::stringstream text;
+	text << stream.rdbuf();
+
+	json::Value manifest;
+	std::string err;
+	if (!json::parse(text.str(), manifest, err) || !manifest.is_object()) {
+		std::cerr << fmt::format(
+			"Invalid batch manifest '{}': {}\n", manifestPath.string(), err.empty() ? "must be a JSON object" : err);
+		return 1;
+	}
+
+	const auto* packJobs = manifest.find("pack");
+	if (!packJobs || !packJobs->is_array()) {
+		std::cerr << "\"pack\" must be an array\n";
+		return 1;
+	}
+
+	// Paths in the manifest are relative to it, same as for build
+	std::error_code ec;
+	const auto prevDir = std::filesystem::current_path();
+	std::filesystem::current_path(manifestPath.parent_path(), ec);
+	if (ec) {
+		std::cerr << fmt::format("Could not enter '{}': {}\n", manifestPath.parent_path().string(), ec.message());
+		return 1;
+	}
+	auto restoreDir = util::cleanup(
+		[&prevDir]
+		{
+			std::error_code ec;
+			std::filesystem::current_path(prevDir, ec);
+		});
+
+	const auto startTime = std::chrono::steady_clock::now();
+	std::size_t numPacked = 0;
+	const bool ok = run_batch(
+		packJobs->items, cachePath, util::resolve_thread_count(opts.get<int>(opts::jobs)),
+		opts.get<bool>(opts::keepgoing), quiet, numPacked);
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+
+	if (!quiet)
+		fmt::print("Packed {} of {} material(s) in {:.2f}s\n", numPacked, packJobs->items.size(), elapsed.count());
+	return ok ? 0 : 1;
+}
+
+bool ActionPack::run_batch(
+	const std::vector<json::Value>& jobs, const std::string& cachePath, int threads, bool keepGoing, bool quiet,
+	std::size_t& numPacked) {
+	numPacked = 0;
+
+	// Parse every job up front, so a typo doesn't show up halfway through a batch
+	std::vector<OptionList> jobOpts(jobs.size());
+	for (std::size_t i = 0; i < jobs.size(); ++i) {
+		std::vector<std::string> args;
+		if (!jobs[i].is_object() || !get_json_args(jobs[i], args)) {
+			std::cerr << "Pack jobs must be objects with an array of string \"args\"\n";
+			return false;
+		}
+		if (quiet)
+			args.insert(args.begin(), "-q");
 
-	const auto file = opts.get<std::string>(opts::file);
+		if (parse_action_args(this, args, jobOpts[i]) != ParseResult::Ok) {
+			std::cerr << fmt::format("Invalid arguments for pack job {}\n", i + 1);
+			return false;
+		}
+		if (!jobOpts[i].get<std::string>(opts::batch).empty()) {
+			std::cerr << fmt::format("Pack job {} can't run a batch of its own\n", i + 1);
+			return false;
+		}
+	}
+
+	// Jobs that use the same cache manifest share a single copy of it, written back once everything is done
+	std::map<std::string, std::unique_ptr<cache::BuildCache>> caches;
+	std::vector<cache::BuildCache*> jobCaches(jobs.size(), nullptr);
+	for (std::size_t i = 0; i < jobs.size(); ++i) {
+		auto path = jobOpts[i].get<std::string>(opts::cache);
+		path = path.empty() ? cachePath : std::filesystem::absolute(path).string();
+		if (path.empty())
+			continue;
+
+		auto& buildCache = caches[path];
+		if (!buildCache) {
+			buildCache = std::make_unique<cache::BuildCache>();
+			if (!buildCache->load(path)) {
+				std::cerr << fmt::format("Could not read build cache '{}'\n", path);
+				return false;
+			}
+		}
+		jobCaches[i] = buildCache.get();
+	}
 
+	std::atomic<bool> stop = false;
+	std::atomic<std::size_t> packed = 0;
+	util::parallel_for(
+		jobs.size(),
+		[&](std::size_t index)
+		{
+			if (stop)
+				return;
+
+			PackJob job;
+			job.opts = &jobOpts[index];
+			job.cache = jobCaches[index];
+			const bool ok = run(job);
+			job.flush();
+			if (ok)
+				++packed;
+			else if (!keepGoing)
+				stop = true;
+		},
+		threads);
+	numPacked = packed;
+
+	bool ok = numPacked == jobs.size();
+	for (auto& [path, buildCache] : caches) {
+		if (!buildCache->save()) {
+			std::cerr << fmt::format("Could not write build cache '{}'\n", path);
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+//
+// Run a single pack, skipping it if the build cache says it's up to date
+//
+bool ActionPack::run(PackJob& job) {
+	const auto& opts = *job.opts;
 	const auto isNormal = opts.get<bool>(opts::normal);
 	const auto isMRAO = opts.get<bool>(opts::mrao);
 	const auto outpath = opts.get<std::string>(opts::file);
+	profile::Scope packScope("pack", outpath);
+
+	if (!isNormal && !isMRAO) {
+		job.err += "No action specified: please specify --mrao or --normal!\n";
+		return false;
+	}
+
+	cache::Key cacheKey;
+	if (job.cache) {
+		cacheKey.opts = cache::fnv1a(
+			opts.serialize({opts::quiet, opts::cache, opts::batch, opts::jobs, opts::keepgoing}),
+			cache::fnv1a(VTEX2_VERSION));
+
+		const auto inputs = isNormal ? std::vector<int>{opts::nmap, opts::hmap}
+									 : std::vector<int>{opts::mmap, opts::rmap, opts::aomap, opts::tmtex};
+		for (auto input : inputs) {
+			const auto path = opts.get<std::string>(input);
+			if (path.empty()) {
+				cacheKey.src = cache::fnv1a("<none>", cacheKey.src);
+				continue;
+			}
+			if (!cache::hash_file(path, cacheKey)) {
+				job.err += fmt::format("Could not load image '{}'\n", path);
+				return false;
+			}
+		}
+
+		if (job.cache->up_to_date(outpath, cacheKey)) {
+			if (!opts.get<bool>(opts::quiet))
+				job.out += fmt::format("{} is up to date\n", outpath);
+			return true;
+		}
+		job.srcCrc = cacheKey.crc;
+	}
 
+	bool ok = false;
 	if (isNormal) {
 		const auto n = opts.get<std::string>(opts::nmap);
 		const auto h = opts.get<std::string>(opts::hmap);
-		return pack_normal(outpath, n, h, opts) ? 0 : 1;
+		ok = pack_normal(job, outpath, n, h);
 	}
-	else if (isMRAO) {
+	else {
 		const auto r = opts.get<std::string>(opts::rmap);
 		const auto m = opts.get<std::string>(opts::mmap);
 		const auto ao = opts.get<std::string>(opts::aomap);
 		const auto tm = opts.get<std::string>(opts::tmtex);
-		return pack_mrao(outpath, m, r, ao, tm, opts) ? 0 : 1;
-	}
-	else {
-		std::cerr << "No action specified: please specify --mrao or --normal!\n";
+		ok = pack_mrao(job, outpath, m, r, ao, tm);
 	}
 
-	return 1;
+	if (ok && job.cache)
+		job.cache->update(outpath, cacheKey);
+	return ok;
 }
 
 //
-// Wrapper to load an image and display error if it can't be loaded
+// Decode all of the inputs at once, PNG inflate would dominate otherwise. Empty paths are skipped and leave their
+// image null
 //
-static std::shared_ptr<imglib::Image> load_image(const std::filesystem::path& path) {
-
-	auto img = imglib::Image::load(path); // Force UInt8 for packed images
-	if (!img)
-		std::cerr << fmt::format("Could not load image '{}'\n", path.string());
-	return img;
-}
-
-//
-// Ugly function to determine out size based on inputs
-//
-template <int N>
-static void determine_size(int* w, int* h, const std::shared_ptr<imglib::Image> (&datas)[N]) {
-	for (int i = 0; i < N; ++i) {
-		if (!datas[i])
-			continue;
-		if (w)
-			*w = std::max(*w, datas[i]->width());
-		if (h)
-			*h = std::max(*h, datas[i]->height());
+template <std::size_t N>
+static bool load_images(
+	PackJob& job, const std::array<std::filesystem::path, N>& files,
+	std::array<std::shared_ptr<imglib::Image>, N>& images) {
+	util::parallel_for(
+		N,
+		[&](std::size_t i)
+		{
+			if (files[i].empty())
+				return;
+			profile::Scope scope("decode", files[i].string());
+			images[i] = imglib::Image::load(files[i]);
+		});
+
+	for (std::size_t i = 0; i < N; ++i) {
+		if (!files[i].empty() && !images[i]) {
+			job.err += fmt::format("Could not load image '{}'\n", files[i].string());
+			return false;
+		}
 	}
+	return true;
 }
 
 //
-// Resize images if required and converts too!
+// Ugly function to determine out size based on inputs
+// -w/-h always win if given, otherwise it's the largest of the inputs
 //
-static bool resize_if_required(const std::shared_ptr<imglib::Image>& image, int w, int h) {
-	if (!image)
-		return true;
-
-	// @TODO: For now we're just going to force 8 bit per channel.
-	//  Sometimes we do get 16bpc images, mainly for height data, but we're cramming that into a RGBA8888 texture
-	//  anyways. It'd be best to eventually support RGBA16F normals for instances where you need precise height data.
-	if (image->type() != imglib::ChannelType::UInt8) {
-		if (!image->convert(imglib::ChannelType::UInt8)) {
-			std::cerr << "Failed to convert image\n";
+template <std::size_t N>
+static bool determine_size(PackJob& job, int& w, int& h, const std::array<std::shared_ptr<imglib::Image>, N>& datas) {
+	const auto clampw = job.opts->get<int>(opts::width);
+	const auto clamph = job.opts->get<int>(opts::height);
+	if (clampw > 0 || clamph > 0) {
+		if (!(clampw > 0 && clamph > 0)) {
+			job.err += "Both -w/--width and -h/--height must be specified to clamp the image.\n";
 			return false;
 		}
+		w = clampw;
+		h = clamph;
+		return true;
 	}
 
-	if (image->width() == w && image->height() == h)
-		return true;
-	return image->resize(w, h);
+	w = h = -1;
+	for (auto& data : datas) {
+		if (!data)
+			continue;
+		w = std::max(w, data->width());
+		h = std::max(h, data->height());
+	}
+	if (w <= 0 || h <= 0) {
+		job.err += "-w and -h are required to pack this image.\n";
+		return false;
+	}
+	return true;
 }
 
 //
 // Pack an MRAO map
 //
 bool ActionPack::pack_mrao(
-	const std::filesystem::path& outpath, const path& metalnessFile, const path& roughnessFile, const path& aoFile,
-	const path& tmask, const OptionList& opts) {
-	auto clampw = opts.get<int>(opts::width);
-	auto clamph = opts.get<int>(opts::height);
-
-	const bool usingR = !roughnessFile.empty();
-	const bool usingM = !metalnessFile.empty();
-	const bool usingAO = !aoFile.empty();
+	PackJob& job, const std::filesystem::path& outpath, const path& metalnessFile, const path& roughnessFile,
+	const path& aoFile, const path& tmask) {
+	const auto& opts = *job.opts;
 	const bool usingTMask = !tmask.empty();
 	const float rconst = opts.get<float>(opts::rconst);
 	const float mconst = opts.get<float>(opts::mconst);
 	const float aoconst = opts.get<float>(opts::aoconst);
 
-	std::shared_ptr<imglib::Image> roughnessData, aoData, metalnessData, tmaskData;
-
 	// Load all images
-	if (usingR && !(roughnessData = load_image(roughnessFile)))
+	std::array<std::shared_ptr<imglib::Image>, 4> images;
+	if (!load_images(job, std::array{roughnessFile, aoFile, metalnessFile, tmask}, images))
 		return false;
-	if (usingAO && !(aoData = load_image(aoFile)))
-		return false;
-	if (usingM && !(metalnessData = load_image(metalnessFile)))
-		return false;
-	if (usingTMask && !(tmaskData = load_image(tmask)))
-		return false;
-
-	// Determine width and height if not set
-	int w = -1, h = -1;
-	determine_size(&w, nullptr, {roughnessData, aoData, metalnessData, tmaskData});
-	determine_size(nullptr, &h, {roughnessData, aoData, metalnessData, tmaskData});
+	const auto& [roughnessData, aoData, metalnessData, tmaskData] = images;
 
-	if (w <= 0 || h <= 0) {
-		if (clampw <= 0 || clamph <= 0) {
-			std::cerr << ((clampw <= 0) ? "-w" : "-h") << " is required to pack this image.\n";
-			return false;
-		}
-		w = clampw;
-		h = clamph;
-	}
-
-	// Resize images if required
-	if (!resize_if_required(roughnessData, w, h))
-		return false;
-	if (!resize_if_required(metalnessData, w, h))
-		return false;
-	if (!resize_if_required(aoData, w, h))
-		return false;
-	if (!resize_if_required(tmaskData, w, h))
+	int w, h;
+	if (!determine_size(job, w, h, images))
 		return false;
 
-	// Packing config
-	pack::ChannelPack_t pack[] = {
-		{.srcChan = 0,
-		 .dstChan = 0,
-		 .srcData = metalnessData ? metalnessData->data<uint8_t>() : nullptr,
-		 .comps = metalnessData ? metalnessData->channels() : 1,
-		 .constant = mconst},
-		{.srcChan = 0,
-		 .dstChan = 1,
-		 .srcData = roughnessData ? roughnessData->data<uint8_t>() : nullptr,
-		 .comps = roughnessData ? roughnessData->channels() : 1,
-		 .constant = rconst},
-		{.srcChan = 0,
-		 .dstChan = 2,
-		 .srcData = aoData ? aoData->data<uint8_t>() : nullptr,
-		 .comps = aoData ? aoData->channels() : 1,
-		 .constant = aoconst},
-		{
-			.srcChan = 0,
-			.dstChan = 3,
-			.srcData = tmaskData ? tmaskData->data<uint8_t>() : nullptr,
-			.comps = tmaskData ? tmaskData->channels() : 1,
-			.constant = 1,
-		}};
+	// Packing config. Sources are resampled to w x h and converted as they're packed
+	pack::ImagePack_t pack[] = {
+		{.srcChan = 0, .dstChan = 0, .src = metalnessData.get(), .constant = mconst},
+		{.srcChan = 0, .dstChan = 1, .src = roughnessData.get(), .constant = rconst},
+		{.srcChan = 0, .dstChan = 2, .src = aoData.get(), .constant = aoconst},
+		{.srcChan = 0, .dstChan = 3, .src = tmaskData.get(), .constant = 1},
+	};
 
 	// tint mask texture is last in channels list, so skip it if we're not given a tint mask
 	const auto numSrcChans = usingTMask ? util::ArraySize(pack) : util::ArraySize(pack) - 1;
 	const auto numDstChans = usingTMask ? 4 : 3; // RGBA when using tint mask texture in mrao.w
 
 	// Finally, pack the darn thing
-	auto outImage = pack::pack_image(numDstChans, pack, numSrcChans, w, h);
+	std::shared_ptr<imglib::Image> outImage;
+	{
+		profile::Scope scope("pack_image");
+		outImage = pack::pack_images(numDstChans, pack, numSrcChans, w, h);
+	}
 	if (!outImage) {
-		std::cerr << "Packing failed!\n";
+		job.err += "Packing failed!\n";
 		return false;
 	}
 
 	// Free up some mem
-	if (roughnessData)
-		roughnessData->clear();
-	if (aoData)
-		aoData->clear();
-	if (metalnessData)
-		metalnessData->clear();
-	if (tmaskData)
-		tmaskData->clear();
-
-	// If user requested clamp, do that now
-	if (clampw > 0 || clamph > 0) {
-		if (!(clampw > 0 && clamph > 0)) {
-			std::cerr << "Both -w/--width and -h/--height must be specified to clamp the image.\n";
-			return false;
-		}
-		if (!outImage->resize(clampw, clamph)) {
-			std::cerr << "Image resize failed\n";
-			return false;
-		}
-	}
+	for (auto& image : images)
+		image.reset();
 
-	bool success = true;
-	if ((success = save_vtf(outpath, outImage, opts, false)))
-		if (!opts.get<bool>(opts::quiet))
-			std::cout << fmt::format("Finished {} ({} KiB)\n", outpath.string(), file_->GetSize() / 1024);
-	return success;
+	return save_vtf(job, outpath, outImage, false);
 }
 
 //
 // Pack height into normal
 //
 bool ActionPack::pack_normal(
-	const std::filesystem::path& outpath, const path& normalFile, const path& heightFile, const OptionList& opts) {
-	auto clampw = opts.get<int>(opts::width);
-	auto clamph = opts.get<int>(opts::height);
+	PackJob& job, const std::filesystem::path& outpath, const path& normalFile, const path& heightFile) {
+	const auto& opts = *job.opts;
 	const bool isGL = opts.get<bool>(opts::toDX);
+	const auto procFlags = (isGL ? imglib::PROC_GL_TO_DX_NORM : 0) |
+						   (opts.get<bool>(opts::renormalize) ? imglib::PROC_RENORMALIZE : 0);
 
-	const bool usingH = !heightFile.empty();
 	const float hconst = opts.get<float>(opts::hconst);
 
 	if (normalFile.empty()) {
-		std::cerr << "--normal-map must be specified!\n";
+		job.err += "--normal-map must be specified!\n";
 		return false;
 	}
 
-	std::shared_ptr<imglib::Image> heightData, normalData;
-
 	// Load all images
-	if (usingH && !(heightData = load_image(heightFile)))
+	std::array<std::shared_ptr<imglib::Image>, 2> images;
+	if (!load_images(job, std::array{normalFile, heightFile}, images))
 		return false;
-	if (!(normalData = load_image(normalFile)))
-		return false;
-
-	// Determine width and height if not set
-	int w = -1, h = -1;
-	determine_size(&w, nullptr, {normalData, heightData});
-	determine_size(nullptr, &h, {normalData, heightData});
+	const auto& [normalData, heightData] = images;
 
-	if (w <= 0 || h <= 0) {
-		if (clampw <= 0 || clamph <= 0) {
-			std::cerr << ((clampw <= 0) ? "-w" : "-h") << " is required to pack this image.\n";
-			return false;
-		}
-		w = clampw;
-		h = clamph;
-	}
-
-	// Resize images if required
-	if (!resize_if_required(normalData, w, h))
-		return false;
-	if (!resize_if_required(heightData, w, h))
+	int w, h;
+	if (!determine_size(job, w, h, images))
 		return false;
 
-	// Convert normal to DX if necessary
-	if (isGL)
-		normalData->process(imglib::PROC_GL_TO_DX_NORM);
-
-	// Packing config
-	pack::ChannelPack_t pack[] = {
-		{.srcChan = 0,
-		 .dstChan = 0,
-		 .srcData = normalData->data<uint8_t>(),
-		 .comps = normalData->channels(),
-		 .constant = 0.0f},
-		{.srcChan = 1,
-		 .dstChan = 1,
-		 .srcData = normalData->data<uint8_t>(),
-		 .comps = normalData->channels(),
-		 .constant = 0.0f},
-		{.srcChan = 2,
-		 .dstChan = 2,
-		 .srcData = normalData->data<uint8_t>(),
-		 .comps = normalData->channels(),
-		 .constant = 0.0f},
-		{.srcChan = 0,
-		 .dstChan = 3,
-		 .srcData = heightData->data<uint8_t>(),
-		 .comps = heightData->channels(),
-		 .constant = hconst}};
+	if (normalData->channels() < 3) {
+		job.err += fmt::format("Normal map '{}' must have at least 3 channels\n", normalFile.string());
+		return false;
+	}
 
-	std::shared_ptr<imglib::Image> outImage;
+	// Packing config. The normal is converted to DX and renormalized while it's resampled, if necessary
+	pack::ImagePack_t pack[] = {
+		{.srcChan = 0, .dstChan = 0, .src = normalData.get(), .constant = 0.0f, .flags = imglib::ProcFlags(procFlags)},
+		{.srcChan = 1, .dstChan = 1, .src = normalData.get(), .constant = 0.0f, .flags = imglib::ProcFlags(procFlags)},
+		{.srcChan = 2, .dstChan = 2, .src = normalData.get(), .constant = 0.0f, .flags = imglib::ProcFlags(procFlags)},
+		{.srcChan = 0, .dstChan = 3, .src = heightData.get(), .constant = hconst},
+	};
 
 	// Finally, pack the darn thing
-	bool success = true;
-	if (!(outImage = pack::pack_image(4, pack, util::ArraySize(pack), w, h))) {
-		success = false;
-		std::cerr << "Packing failed!\n";
+	std::shared_ptr<imglib::Image> outImage;
+	{
+		profile::Scope scope("pack_image");
+		outImage = pack::pack_images(4, pack, util::ArraySize(pack), w, h);
+	}
+	if (!outImage) {
+		job.err += "Packing failed!\n";
 		return false;
 	}
 
 	// Free up some mem
-	heightData->clear();
-	normalData->clear();
-
-	// If user requested clamp, do that now
-	if (clampw > 0 || clamph > 0) {
-		if (!(clampw > 0 && clamph > 0)) {
-			std::cerr << "Both -w/--width and -h/--height must be specified to clamp the image.\n";
-			return false;
-		}
-		if (!outImage->resize(clampw, clamph)) {
-			std::cerr << "Image resize failed\n";
-			return false;
-		}
-	}
+	for (auto& image : images)
+		image.reset();
 
-	success = save_vtf(outpath, outImage, opts, true);
-
-	if (success && !opts.get<bool>(opts::quiet))
-		std::cout << fmt::format("Finished {} ({} KiB)\n", outpath.string(), file_->GetSize() / 1024);
-	return success;
+	return save_vtf(job, outpath, outImage, true);
 }
 
 //
@@ -493,9 +655,8 @@ bool ActionPack::pack_normal(
 // Automatically determines the format to use on save based on channels in data
 //
 bool ActionPack::save_vtf(
-	const std::filesystem::path& out, const std::shared_ptr<imglib::Image>& image, const OptionList& opts,
-	bool normal) {
-	file_ = new CVTFFile();
+	PackJob& job, const std::filesystem::path& out, const std::shared_ptr<imglib::Image>& image, bool normal) {
+	auto file = std::make_unique<CVTFFile>();
 
 	SVTFInitOptions initOpts{};
 	initOpts.ImageFormat = image->channels() == 3 ? IMAGE_FORMAT_RGB888 : IMAGE_FORMAT_RGBA8888;
@@ -504,17 +665,35 @@ bool ActionPack::save_vtf(
 	initOpts.uiHeight = image->height();
 	initOpts.uiWidth = image->width();
 	initOpts.uiSlices = 1;
-	if (!file_->Init(initOpts)) {
-		std::cerr << fmt::format("Error while saving VTF: {}\n", util::get_last_vtflib_error());
-		return false; // Cleanup done in cleanup()
+	if (!file->Init(initOpts)) {
+		job.err += fmt::format("Error while saving VTF: {}\n", util::get_last_vtflib_error());
+		return false;
+	}
+	file->SetData(0, 0, 0, 0, image->data<vlByte>());
+	file->SetFlag(TEXTUREFLAGS_NORMAL, normal);
+
+	// Embed the source CRC so the build cache can verify this output later
+	if (job.srcCrc && file->GetSupportsResources()) {
+		auto crc = *job.srcCrc;
+		file->SetResourceData(VTF_RSRC_CRC, sizeof(crc), &crc);
+	}
+
+	{
+		profile::Scope scope("mipmaps");
+		if (!vtf::generate_mipmaps(file.get(), false))
+			file->GenerateMipmaps(MIPMAP_FILTER_CATROM, false);
+	}
+
+	{
+		profile::Scope scope("save");
+		if (!vtf::save(file.get(), out.string()))
+			return false;
 	}
-	file_->SetData(0, 0, 0, 0, image->data<vlByte>());
-	file_->SetFlag(TEXTUREFLAGS_NORMAL, normal);
 
-	file_->GenerateMipmaps(MIPMAP_FILTER_CATROM, false);
-	return file_->Save(out.string().c_str());
+	if (!job.opts->get<bool>(opts::quiet))
+		job.out += fmt::format("Finished {} ({} KiB)\n", out.string(), file->GetSize() / 1024);
+	return true;
 }
 
 void ActionPack::cleanup() {
-	delete file_;
 }
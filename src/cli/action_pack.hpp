@@ -1,6 +1,12 @@
 
+#include <optional>
+#include <string>
+#include <vector>
+
 #include "action.hpp"
 #include "common/image.hpp"
+#include "common/cache.hpp"
+#include "common/json.hpp"
 
 namespace VTFLib
 {
@@ -10,6 +16,21 @@ namespace VTFLib
 namespace vtex2
 {
 
+	/**
+	 * Everything about a single pack. Batches run several of these at once, so nothing lives in the action itself
+	 */
+	struct PackJob {
+		const OptionList* opts = nullptr;
+		cache::BuildCache* cache = nullptr;	  // Optional build cache, shared between all jobs
+		std::optional<std::uint32_t> srcCrc; // Source CRC to embed, set when using the build cache
+
+		// Buffered output, flushed in one go once the pack is done so concurrent packs don't interleave
+		std::string out;
+		std::string err;
+
+		void flush();
+	};
+
 	/**
 	 * A simple action to display info about a VTF file
 	 */
@@ -23,17 +44,25 @@ namespace vtex2
 		int exec(const OptionList& opts) override;
 		void cleanup() override;
 
+		/**
+		 * Run a list of pack jobs, each an object with the pack "args" to use, as many at a time as threads allows.
+		 * Paths in the args are relative to the working directory. Jobs without a --cache of their own use cachePath,
+		 * if set. Every job is validated before any of them run
+		 * @param numPacked Receives the number of jobs that succeeded
+		 * @returns true if every job succeeded
+		 */
+		bool run_batch(
+			const std::vector<json::Value>& jobs, const std::string& cachePath, int threads, bool keepGoing, bool quiet,
+			std::size_t& numPacked);
+
 	private:
 		using path = std::filesystem::path;
 
+		bool run(PackJob& job);
 		bool pack_mrao(
-			const path& outpath, const path& m, const path& r, const path& ao, const path& tmask,
-			const OptionList& opts);
-		bool pack_normal(const path& outpath, const path& n, const path& h, const OptionList& opts);
-		bool
-		save_vtf(const path& out, const std::shared_ptr<imglib::Image>& image, const OptionList& opts, bool normal);
-
-		VTFLib::CVTFFile* file_ = nullptr;
+			PackJob& job, const path& outpath, const path& m, const path& r, const path& ao, const path& tmask);
+		bool pack_normal(PackJob& job, const path& outpath, const path& n, const path& h);
+		bool save_vtf(PackJob& job, const path& out, const std::shared_ptr<imglib::Image>& image, bool normal);
 	};
 
 } // namespace vtex2
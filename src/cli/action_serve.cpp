@@ -0,0 +1,184 @@
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <exception>
+
+#ifdef _WIN32
+#include <io.h>
+#define dup _dup
+#define dup2 _dup2
+#define fileno _fileno
+#define fdopen _fdopen
+#else
+#include <unistd.h>
+#endif
+
+#include "fmt/format.h"
+
+#include "action_serve.hpp"
+#include "common/json.hpp"
+
+using namespace vtex2;
+
+namespace opts
+{
+	static int input;
+} // namespace opts
+
+std::string ActionServe::get_help() const {
+	return "Runs jobs read as JSON lines from stdin in a single process, for use by build systems";
+}
+
+const OptionList& ActionServe::get_options() const {
+	static OptionList opts;
+	if (opts.empty()) {
+		opts::input = opts.add(
+			ActionOption()
+				.short_opt("-i")
+				.long_opt("--input")
+				.type(OptType::String)
+				.value("-")
+				.help("File to read jobs from. - reads from stdin"));
+	};
+	return opts;
+}
+
+int ActionServe::exec(const OptionList& opts) {
+	const auto input = opts.get<std::string>(opts::input);
+
+	FILE* in = stdin;
+	m_stdinJobs = input == "-";
+	if (!m_stdinJobs) {
+		in = fopen(input.c_str(), "rb");
+		if (!in) {
+			std::cerr << fmt::format("Could not open '{}'\n", input);
+			return 1;
+		}
+	}
+
+	// Results get the real stdout to themselves. Everything else that would go to stdout, like the progress output of
+	// the actions, is pointed at stderr instead so it can't corrupt the result stream
+	fflush(stdout);
+	FILE* results = fdopen(dup(fileno(stdout)), "w");
+	if (!results) {
+		std::cerr << "Could not open result stream\n";
+		return 1;
+	}
+	dup2(fileno(stderr), fileno(stdout));
+
+	std::string line, result;
+	for (int c; (c = fgetc(in)) != EOF || !line.empty();) {
+		if (c != '\n' && c != EOF) {
+			line += char(c);
+			continue;
+		}
+
+		// Skip blank lines, handy for hand-written job files
+		if (line.find_first_not_of(" \t\r") != std::string::npos) {
+			run_job(line, result);
+
+			// Make sure everything the job printed is out before we say that it's done
+			std::cout.flush();
+			fflush(stdout);
+			std::cerr.flush();
+
+			fputs(result.c_str(), results);
+			fputc('\n', results);
+			fflush(results);
+		}
+		line.clear();
+
+		if (c == EOF)
+			break;
+	}
+
+	fclose(results);
+	if (in != stdin)
+		fclose(in);
+	return 0;
+}
+
+void ActionServe::cleanup() {
+}
+
+void ActionServe::run_job(const std::string& line, std::string& result) {
+	const auto startTime = std::chrono::steady_clock::now();
+
+	json::Value job;
+	std::string err;
+	const auto fail = [&](const std::string& id, const std::string& error)
+	{
+		result = fmt::format("{{\"id\":{},\"status\":-1,\"error\":\"{}\"}}", id, json::escape(error));
+	};
+
+	if (!json::parse(line, job, err) || job.type != json::Value::Type::Object) {
+		fail("null", err.empty() ? "Job must be a JSON object" : "Invalid JSON: " + err);
+		return;
+	}
+
+	const auto* idValue = job.find("id");
+	const std::string id = idValue ? idValue->raw : "null";
+
+	const auto* actionName = job.find("action");
+	if (!actionName || actionName->type != json::Value::Type::String) {
+		fail(id, "Missing \"action\"");
+		return;
+	}
+
+	auto* action = find_action(actionName->str);
+	if (!action || action == this) {
+		fail(id, fmt::format("Unknown action '{}'", actionName->str));
+		return;
+	}
+
+	// Arguments are exactly what would be passed on the command line after the action name
+	std::vector<std::string> args;
+	if (!get_json_args(job, args)) {
+		fail(id, "\"args\" must be an array of strings, numbers and booleans");
+		return;
+	}
+
+	OptionList opts;
+	switch (parse_action_args(action, args, opts)) {
+		case ParseResult::Ok:
+			break;
+		case ParseResult::Help:
+			fail(id, "Help is not available in serve mode");
+			return;
+		case ParseResult::MissingArgs:
+			fail(id, "Missing required argument");
+			return;
+		default:
+			fail(id, "Invalid arguments");
+			return;
+	}
+
+	// Jobs come in on stdin, so no job can read its data from there too. It would take the rest of the job stream
+	if (m_stdinJobs) {
+		for (auto& o : opts.opts()) {
+			const auto* list = std::get_if<std::vector<std::string>>(&o.m_value);
+			if (o.get<std::string>() == "-" || (list && std::find(list->begin(), list->end(), "-") != list->end())) {
+				fail(id, "- can't be used while jobs are read from stdin");
+				return;
+			}
+		}
+	}
+
+	// One bad job mustn't take down every job queued up behind it
+	int status;
+	try {
+		status = action->exec(opts);
+	}
+	catch (const std::exception& e) {
+		action->cleanup();
+		fail(id, e.what());
+		return;
+	}
+	action->cleanup();
+
+	const auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+	result = fmt::format("{{\"id\":{},\"status\":{},\"ms\":{:.2f}}}", id, status, ms);
+}
@@ -0,0 +1,39 @@
+
+#include <string>
+
+#include "action.hpp"
+
+namespace vtex2
+{
+
+	/**
+	 * Long running worker that reads jobs from stdin, one JSON object per line, and runs them through the other
+	 * actions. This avoids paying for process startup on every texture when driven by a build system.
+	 *
+	 * Job:    {"id": 1, "action": "convert", "args": ["-f", "dxt5", "-o", "out.vtf", "in.png"]}
+	 * Result: {"id": 1, "status": 0, "ms": 12.5}
+	 *
+	 * Results are written to stdout in job order. Anything the actions themselves print goes to stderr.
+	 * A job that throws fails with the exception's message, and the ones after it still run.
+	 */
+	class ActionServe : public BaseAction {
+	public:
+		std::string get_name() const override {
+			return "serve";
+		}
+		std::string get_help() const override;
+		const OptionList& get_options() const override;
+		int exec(const OptionList& opts) override;
+		void cleanup() override;
+
+	private:
+		/**
+		 * Run a single job line
+		 * @param result Receives the JSON result line, without the trailing newline
+		 */
+		void run_job(const std::string& line, std::string& result);
+
+		bool m_stdinJobs = false;
+	};
+
+} // namespace vtex2
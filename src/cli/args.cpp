@@ -0,0 +1,243 @@
+#include <cstring>
+#include <cassert>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+#include <iostream>
+
+#include "fmt/format.h"
+
+#include "action.hpp"
+#include "common/strtools.hpp"
+#include "common/json.hpp"
+
+using namespace vtex2;
+
+static bool handle_option(int argc, int& argIndex, char** argv, ActionOption& opt);
+static bool arg_compare(const char* arg, const char* argname);
+
+ParseResult vtex2::parse_action_args(BaseAction* action, int argc, char** argv, OptionList& opts) {
+	// Duplicate list of options, we'll set them as we go
+	opts = action->get_options();
+
+	for (int i = 0; i < argc; ++i) {
+		const char* arg = argv[i];
+
+		// Check if this is the implicit -? or --help
+		if (!std::strcmp(arg, "-?") || !std::strcmp(arg, "--help"))
+			return ParseResult::Help;
+
+		// If this doesn't start with a - or --, we'll assume it's an "end of line arg"
+		// A lone - is a value too, it means stdin/stdout
+		if (arg[0] != '-' || !arg[1]) {
+			// Find the end of line arg in the opts list and forward the rest of the args to it
+			ActionOption* opt = nullptr;
+			for (auto& o : opts.opts()) {
+				if (o.m_endOfLine) {
+					opt = &o;
+					break;
+				}
+			}
+
+			// Must be bad opt!
+			if (!opt) {
+				std::cerr << fmt::format("Unexpected argument '{}'!\n", arg);
+				return ParseResult::BadArgs;
+			}
+
+			// Forward all following options
+			std::vector<std::string> forwarded;
+			for (int m = i; m < argc; ++m) {
+				forwarded.push_back(argv[m]);
+			}
+			// @TODO: Remove this crap handling for string!
+			if (opt->m_type == OptType::String)
+				opt->m_value = forwarded.back();
+			else
+				opt->m_value = forwarded;
+			opt->m_handled = true;
+			break;
+		}
+
+		// Handle this argument as a part of the action args
+		for (auto& o : opts.opts()) {
+			if (arg_compare(arg, o.m_name[0].c_str()) || arg_compare(arg, o.m_name[1].c_str())) {
+				if (!handle_option(argc, i, argv, o))
+					return ParseResult::BadArgs;
+				break;
+			}
+		}
+	}
+
+	// Verify we have the min required args
+	for (auto& o : opts.opts()) {
+		if (!o.m_optional && !o.m_handled) {
+			std::cerr << fmt::format("Missing required argument '{}'!\n", o.m_name[0]);
+			return ParseResult::MissingArgs;
+		}
+	}
+	return ParseResult::Ok;
+}
+
+ParseResult vtex2::parse_action_args(BaseAction* action, std::vector<std::string> args, OptionList& opts) {
+	std::vector<char*> argv;
+	for (auto& arg : args)
+		argv.push_back(arg.data());
+	argv.push_back(nullptr);
+	return parse_action_args(action, int(args.size()), argv.data(), opts);
+}
+
+bool vtex2::get_json_args(const json::Value& object, std::vector<std::string>& args) {
+	const auto* value = object.find("args");
+	if (!value)
+		return true;
+	if (!value->is_array())
+		return false;
+
+	for (auto& arg : value->items) {
+		if (arg.type != json::Value::Type::String && arg.type != json::Value::Type::Number &&
+			arg.type != json::Value::Type::Bool)
+			return false;
+		args.push_back(arg.str);
+	}
+	return true;
+}
+
+/**
+ * Splits an arg by the contained =
+ * --opt=something
+ * -o=bruh
+ * Returns true if there was separating =.
+ * If false, value is not modified at all
+ */
+static bool split_arg(const char* arg, std::string& value) {
+	auto* s = strpbrk(arg, "=");
+	if (s)
+		value = s + 1;
+	return !!s;
+}
+
+/**
+ * Handle an action specific option
+ * Return false if failed to parse
+ * Options may be specified in multiple ways:
+ *  --option=thing
+ *  --option thing
+ *  -o thing
+ *  -o=thing
+ */
+bool handle_option(int argc, int& argIndex, char** argv, ActionOption& opt) {
+	// Get next arg or default
+	auto nextArg = [&](const char* def) -> const char*
+	{
+		if (argIndex + 1 >= argc)
+			return def;
+		return argv[++argIndex];
+	};
+
+	const char* arg = argv[argIndex];
+
+	std::string valueStr;
+	opt.m_handled = true;
+
+	switch (opt.m_type) {
+		case OptType::Bool:
+			{
+				if (split_arg(arg, valueStr)) {
+					if (!str::strcasecmp(valueStr.c_str(), "false")) {
+						opt.m_value = false;
+						return true;
+					}
+					else if (!str::strcasecmp(valueStr.c_str(), "true")) {
+						opt.m_value = true;
+						return true;
+					}
+				}
+				else {
+					opt.m_value = true; // Empty argument string indicates true, since we're literally just a flag.
+					return true;
+				}
+				std::cerr << fmt::format("Bad argument value '{}' for argument '{}'!\n", valueStr, arg);
+				return false;
+			}
+		case OptType::Float:
+			{
+				if (!split_arg(arg, valueStr)) {
+					valueStr = nextArg("");
+				}
+
+				// errno may be left over from anything earlier in the process, serve runs many jobs in one
+				char* end = nullptr;
+				errno = 0;
+				auto val = std::strtod(valueStr.c_str(), &end);
+				if (errno != 0 || end == valueStr.c_str() || *end) {
+					std::cerr << fmt::format("Bad argument value '{}' for argument '{}'\n", valueStr, arg);
+					return false;
+				}
+				opt.m_value = (float)val;
+				return true;
+			}
+		case OptType::Int:
+			{
+				if (!split_arg(arg, valueStr)) {
+					valueStr = nextArg("");
+				}
+
+				int base = 10;
+				if (valueStr[0] == '0' && valueStr[1] == 'x')
+					base = 16;
+				char* end = nullptr;
+				errno = 0;
+				auto val = std::strtol(valueStr.c_str(), &end, base);
+				if (errno != 0 || end == valueStr.c_str() || *end || val < INT_MIN || val > INT_MAX) {
+					std::cerr << fmt::format("Bad argument value '{}' for argument '{}'\n", valueStr, arg);
+					return false;
+				}
+				opt.m_value = (int)val;
+				return true;
+			}
+		case OptType::String:
+			{
+				if (!split_arg(arg, valueStr)) {
+					valueStr = nextArg("");
+				}
+
+				// Validate choices if the requested option has them
+				if (!opt.m_choices.empty()) {
+					bool foundValid = false;
+					for (auto& c : opt.m_choices) {
+						if (valueStr == c) {
+							foundValid = true;
+							break;
+						}
+					}
+
+					// Could not validate from list of valid choices
+					if (!foundValid) {
+						std::cerr << fmt::format("Bad value for option {}\nValid values are: ", arg);
+						for (auto& c : opt.m_choices)
+							std::cerr << fmt::format("{} ", c);
+						return false;
+					}
+				}
+
+				opt.m_value = valueStr;
+				return true;
+			}
+		default:
+			assert(0);
+	}
+
+	return false;
+}
+
+/**
+ * Simple arg compare
+ * match examples:
+ *  somearg=1 and somearg
+ *  somearg and somearg
+ */
+static bool arg_compare(const char* arg, const char* argname) {
+	const size_t len = std::strlen(argname);
+	return len && !std::strncmp(arg, argname, len) && (!arg[len] || arg[len] == '=');
+}
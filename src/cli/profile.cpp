@@ -0,0 +1,319 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "fmt/format.h"
+
+#include "profile.hpp"
+#include "common/json.hpp"
+#include "common/bufferpool.hpp"
+
+#ifdef _WIN32
+#include <malloc.h>
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#include <sys/resource.h>
+#else
+#include <malloc.h>
+#include <sys/resource.h>
+#endif
+
+// Windows garbage!!
+#undef min
+#undef max
+
+using namespace vtex2;
+
+namespace
+{
+	struct Stage {
+		const char* name;
+		int calls;
+		long long total; // ns
+		long long max;	 // ns
+		long long peakHeap;
+	};
+
+	struct Event {
+		const char* name;
+		std::string detail;
+		long long start; // ns since enable()
+		long long dur;	 // ns
+		int tid;
+	};
+
+	// Plain bool, it's only written once before any work starts
+	bool s_enabled = false;
+	std::string s_tracePath;
+	std::chrono::steady_clock::time_point s_epoch;
+
+	std::mutex s_mutex;
+	std::vector<Stage> s_stages; // In order of first completion
+	std::vector<Event> s_events; // Only filled when writing a trace
+
+	std::atomic<long long> s_heap{0};
+	std::atomic<long long> s_heapPeak{0};
+	std::atomic<int> s_nextTid{0};
+
+	thread_local long long t_heap = 0;	   // Bytes allocated minus bytes freed by this thread
+	thread_local long long t_heapPeak = 0; // Highest t_heap since the innermost scope started
+	thread_local int t_tid = -1;
+} // namespace
+
+//
+// Size of a block as malloc sees it. Used on both ends so allocations and frees always agree
+//
+static std::size_t usable_size(void* p, [[maybe_unused]] std::size_t align = 0) {
+#ifdef _WIN32
+	return align ? _aligned_msize(p, align, 0) : _msize(p);
+#elif defined(__APPLE__)
+	return malloc_size(p);
+#else
+	return malloc_usable_size(p);
+#endif
+}
+
+static void track_alloc(void* p, std::size_t align = 0) {
+	const auto size = (long long)usable_size(p, align);
+	t_heap += size;
+	t_heapPeak = std::max(t_heapPeak, t_heap);
+	const auto heap = s_heap.fetch_add(size, std::memory_order_relaxed) + size;
+	auto peak = s_heapPeak.load(std::memory_order_relaxed);
+	while (heap > peak && !s_heapPeak.compare_exchange_weak(peak, heap, std::memory_order_relaxed))
+		;
+}
+
+static void track_free(void* p, std::size_t align = 0) {
+	const auto size = (long long)usable_size(p, align);
+	t_heap -= size;
+	s_heap.fetch_sub(size, std::memory_order_relaxed);
+}
+
+//
+// Over-aligned blocks. Windows can't free these with free(), so they get their own pair of functions there
+//
+static void* aligned_malloc(std::size_t size, std::size_t align) {
+#ifdef _WIN32
+	return _aligned_malloc(size, align);
+#else
+	void* p = nullptr;
+	return posix_memalign(&p, std::max(align, sizeof(void*)), size) == 0 ? p : nullptr;
+#endif
+}
+
+static void aligned_free(void* p) {
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	std::free(p);
+#endif
+}
+
+//
+// Global allocation hooks. The array and sized forms forward to these, and the default nothrow forms call them
+//
+void* operator new(std::size_t size) {
+	void* p = std::malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	if (s_enabled)
+		track_alloc(p);
+	return p;
+}
+
+void* operator new[](std::size_t size) {
+	return ::operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+	if (p && s_enabled)
+		track_free(p);
+	std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+	::operator delete(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+	::operator delete(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+	::operator delete(p);
+}
+
+void* operator new(std::size_t size, std::align_val_t align) {
+	void* p = aligned_malloc(size ? size : 1, std::size_t(align));
+	if (!p)
+		throw std::bad_alloc();
+	if (s_enabled)
+		track_alloc(p, std::size_t(align));
+	return p;
+}
+
+void* operator new[](std::size_t size, std::align_val_t align) {
+	return ::operator new(size, align);
+}
+
+void operator delete(void* p, std::align_val_t align) noexcept {
+	if (p && s_enabled)
+		track_free(p, std::size_t(align));
+	aligned_free(p);
+}
+
+void operator delete[](void* p, std::align_val_t align) noexcept {
+	::operator delete(p, align);
+}
+
+void operator delete(void* p, std::size_t, std::align_val_t align) noexcept {
+	::operator delete(p, align);
+}
+
+void operator delete[](void* p, std::size_t, std::align_val_t align) noexcept {
+	::operator delete(p, align);
+}
+
+static long long now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - s_epoch).count();
+}
+
+//
+// Peak resident set size of the whole process, in bytes. 0 if unknown
+//
+static long long peak_rss() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return (long long)counters.PeakWorkingSetSize;
+#else
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#ifdef __APPLE__
+	return usage.ru_maxrss; // Bytes on macOS...
+#else
+	return usage.ru_maxrss * 1024ll; // ...and KiB everywhere else
+#endif
+#endif
+}
+
+static std::string format_bytes(long long bytes) {
+	if (bytes < 1024 * 1024)
+		return fmt::format("{:.1f} KiB", bytes / 1024.0);
+	return fmt::format("{:.1f} MiB", bytes / (1024.0 * 1024.0));
+}
+
+void profile::enable(const std::string& tracePath) {
+	s_tracePath = tracePath;
+	s_epoch = std::chrono::steady_clock::now();
+	s_enabled = true;
+}
+
+bool profile::enabled() {
+	return s_enabled;
+}
+
+profile::Scope::Scope(const char* name, const std::string& detail) {
+	if (!s_enabled)
+		return;
+
+	name_ = name;
+	if (!s_tracePath.empty())
+		detail_ = detail;
+	heapStart_ = t_heap;
+	outerPeak_ = t_heapPeak;
+	t_heapPeak = t_heap;
+	start_ = now();
+}
+
+profile::Scope::~Scope() {
+	if (!name_)
+		return;
+
+	const auto dur = now() - start_;
+	const auto peak = t_heapPeak - heapStart_;
+	t_heapPeak = std::max(outerPeak_, t_heapPeak); // Our peak counts towards the enclosing scope's too
+
+	if (t_tid < 0)
+		t_tid = s_nextTid++;
+
+	std::lock_guard lock(s_mutex);
+	auto it = std::find_if(
+		s_stages.begin(), s_stages.end(), [this](const Stage& s) { return !std::strcmp(s.name, name_); });
+	if (it == s_stages.end())
+		s_stages.push_back({name_, 1, dur, dur, peak});
+	else {
+		++it->calls;
+		it->total += dur;
+		it->max = std::max(it->max, dur);
+		it->peakHeap = std::max(it->peakHeap, peak);
+	}
+
+	if (!s_tracePath.empty())
+		s_events.push_back({name_, std::move(detail_), start_, dur, t_tid});
+}
+
+//
+// Chrome's trace event format. Complete ("X") events with microsecond timestamps
+//
+static bool write_trace(const std::string& path) {
+	FILE* fp = std::fopen(path.c_str(), "wb");
+	if (!fp)
+		return false;
+
+	std::fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", fp);
+	for (size_t i = 0; i < s_events.size(); ++i) {
+		auto& e = s_events[i];
+		auto line = fmt::format(
+			"{}\n{{\"name\":\"{}\",\"cat\":\"vtex2\",\"ph\":\"X\",\"pid\":1,\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f}",
+			i ? "," : "", json::escape(e.name), e.tid, e.start / 1000.0, e.dur / 1000.0);
+		if (!e.detail.empty())
+			line += fmt::format(",\"args\":{{\"detail\":\"{}\"}}", json::escape(e.detail));
+		line += "}";
+		std::fputs(line.c_str(), fp);
+	}
+	std::fputs("\n]}\n", fp);
+	return std::fclose(fp) == 0;
+}
+
+void profile::report() {
+	if (!s_enabled)
+		return;
+
+	const auto wall = now();
+	std::lock_guard lock(s_mutex);
+
+	if (!s_tracePath.empty()) {
+		if (!write_trace(s_tracePath))
+			std::cerr << fmt::format("Could not write profile trace to {}\n", s_tracePath);
+		return;
+	}
+
+	// Stages overlap when running with multiple jobs, so the totals can add up to more than the wall time
+	std::string str = fmt::format(
+		"\n{:<24} {:>7} {:>12} {:>10} {:>10} {:>12}\n", "Stage", "Calls", "Total ms", "Avg ms", "Max ms", "Peak heap");
+	for (auto& s : s_stages) {
+		str += fmt::format(
+			"{:<24} {:>7} {:>12.2f} {:>10.2f} {:>10.2f} {:>12}\n", s.name, s.calls, s.total / 1e6,
+			s.total / 1e6 / s.calls, s.max / 1e6, format_bytes(s.peakHeap));
+	}
+	const auto poolStats = imglib::pool::stats();
+	str += fmt::format(
+		"\nWall time {:.2f} ms, peak heap {}, peak RSS {}\n", wall / 1e6, format_bytes(s_heapPeak.load()),
+		format_bytes(peak_rss()));
+	str += fmt::format(
+		"Image buffers: {} allocated, {} reused from the pool, {} cached\n", poolStats.allocs, poolStats.reused,
+		format_bytes(poolStats.cachedBytes));
+	std::cerr << str;
+}
@@ -0,0 +1,53 @@
+/**
+ * profile.hpp - Per-stage timing and memory instrumentation
+ *
+ * Enabled with the global --profile flag. Stages are marked with a profile::Scope and aggregated by name over the
+ * whole run, so batch conversions report totals across every file.
+ */
+#pragma once
+
+#include <string>
+
+namespace vtex2::profile
+{
+
+	/**
+	 * Turn on instrumentation for the rest of the run
+	 * @param tracePath If not empty, write a Chrome trace (chrome://tracing, Perfetto) there instead of printing a table
+	 */
+	void enable(const std::string& tracePath = {});
+
+	bool enabled();
+
+	/**
+	 * Print the table or write the trace, whichever was asked for. Does nothing if profiling isn't enabled
+	 */
+	void report();
+
+	/**
+	 * Times the enclosing block as one stage, and tracks the peak heap growth on this thread while it runs.
+	 * Heap tracking covers operator new, which is what VTFLib and the standard containers use. Buffers that imglib and
+	 * stb allocate with malloc only show up in the process peak at the bottom of the report.
+	 * Costs a single branch when profiling is off.
+	 */
+	class Scope {
+	public:
+		/**
+		 * @param name Stage name. Must outlive the run, ie a string literal
+		 * @param detail Extra info for the trace, ie the file being processed. Not used in the table
+		 */
+		explicit Scope(const char* name, const std::string& detail = {});
+		~Scope();
+
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+	private:
+		const char* name_ = nullptr;
+		std::string detail_;
+		long long start_ = 0;
+		long long heapStart_ = 0;
+		long long outerPeak_ = 0;
+	};
+
+} // namespace vtex2::profile
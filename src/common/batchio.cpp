@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <cstdio>
+#include <utility>
+
+#include "batchio.hpp"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
+
+using namespace util;
+
+//
+// Read a whole file into out. The kernel is told to read ahead aggressively where it supports that, since the file is
+// going to be read front to back right away
+//
+static bool read_file(const std::filesystem::path& path, std::vector<std::uint8_t>& out) {
+	FILE* fp = std::fopen(path.string().c_str(), "rb");
+	if (!fp)
+		return false;
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+	posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	std::error_code ec;
+	const auto size = std::filesystem::file_size(path, ec);
+	out.resize(ec ? 0 : size);
+	bool ok = !ec && std::fread(out.data(), 1, out.size(), fp) == out.size();
+	std::fclose(fp);
+	return ok && !out.empty();
+}
+
+static bool write_file(const std::filesystem::path& path, const std::vector<std::uint8_t>& data) {
+	FILE* fp = std::fopen(path.string().c_str(), "wb");
+	if (!fp)
+		return false;
+	const bool ok = std::fwrite(data.data(), 1, data.size(), fp) == data.size();
+	return std::fclose(fp) == 0 && ok;
+}
+
+Prefetcher::Prefetcher(std::vector<std::filesystem::path> paths, std::size_t depth, std::size_t maxBytes)
+	: m_paths(std::move(paths)),
+	  m_depth(std::max<std::size_t>(depth, 1)),
+	  m_maxBytes(maxBytes) {
+	m_data.resize(m_paths.size());
+	m_state.resize(m_paths.size(), State::Pending);
+	m_thread = std::thread([this] { read_thread(); });
+}
+
+Prefetcher::~Prefetcher() {
+	stop();
+	m_thread.join();
+}
+
+void Prefetcher::stop() {
+	std::lock_guard lock(m_mutex);
+	m_stopped = true;
+	m_readCv.notify_all();
+	m_spaceCv.notify_all();
+}
+
+bool Prefetcher::take(std::size_t index, std::vector<std::uint8_t>& out) {
+	std::unique_lock lock(m_mutex);
+	m_readCv.wait(lock, [this, index] { return m_stopped || m_state[index] != State::Pending; });
+	if (m_state[index] != State::Ready)
+		return false;
+
+	out = std::move(m_data[index]);
+	m_state[index] = State::Taken;
+	--m_held;
+	m_heldBytes -= out.size();
+	m_spaceCv.notify_one();
+	return true;
+}
+
+void Prefetcher::read_thread() {
+	for (std::size_t i = 0; i < m_paths.size(); ++i) {
+		{
+			// The size of the next file isn't known until it's read, so only the files already held count
+			std::unique_lock lock(m_mutex);
+			m_spaceCv.wait(
+				lock, [this] { return m_stopped || m_held == 0 || (m_held < m_depth && m_heldBytes < m_maxBytes); });
+			if (m_stopped)
+				return;
+		}
+
+		std::vector<std::uint8_t> data;
+		const bool ok = read_file(m_paths[i], data);
+
+		std::lock_guard lock(m_mutex);
+		if (ok) {
+			m_heldBytes += data.size();
+			++m_held;
+			m_data[i] = std::move(data);
+		}
+		m_state[i] = ok ? State::Ready : State::Failed;
+		m_readCv.notify_all();
+	}
+}
+
+WriteBehind::WriteBehind(std::size_t depth, std::size_t maxBytes)
+	: m_depth(std::max<std::size_t>(depth, 1)),
+	  m_maxBytes(maxBytes) {
+	m_thread = std::thread([this] { write_thread(); });
+}
+
+WriteBehind::~WriteBehind() {
+	flush();
+	{
+		std::lock_guard lock(m_mutex);
+		m_stopped = true;
+		m_workCv.notify_all();
+	}
+	m_thread.join();
+}
+
+void WriteBehind::write(std::filesystem::path path, std::vector<std::uint8_t> data, Callback done) {
+	std::unique_lock lock(m_mutex);
+	m_spaceCv.wait(
+		lock, [this] { return m_queue.empty() || (m_queue.size() < m_depth && m_queuedBytes < m_maxBytes); });
+
+	m_queuedBytes += data.size();
+	++m_inFlight;
+	m_queue.push_back({std::move(path), std::move(data), std::move(done)});
+	m_workCv.notify_one();
+}
+
+std::vector<std::filesystem::path> WriteBehind::flush() {
+	std::unique_lock lock(m_mutex);
+	m_spaceCv.wait(lock, [this] { return m_inFlight == 0; });
+	return std::exchange(m_failures, {});
+}
+
+void WriteBehind::write_thread() {
+	std::unique_lock lock(m_mutex);
+	while (true) {
+		m_workCv.wait(lock, [this] { return m_stopped || !m_queue.empty(); });
+		if (m_queue.empty())
+			return;
+
+		auto write = std::move(m_queue.front());
+		m_queue.pop_front();
+		m_queuedBytes -= write.data.size();
+		m_spaceCv.notify_all();
+		lock.unlock();
+
+		const bool ok = write_file(write.path, write.data);
+		write.data = {};
+		if (write.done)
+			write.done(ok);
+
+		lock.lock();
+		if (!ok)
+			m_failures.push_back(std::move(write.path));
+		--m_inFlight;
+		m_spaceCv.notify_all();
+	}
+}
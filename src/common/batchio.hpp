@@ -0,0 +1,127 @@
+/**
+ * batchio.hpp - Read-ahead and write-behind for directory batch runs
+ *
+ * A batch that reads a file, processes it and saves it before moving on sits idle for every open, read and write.
+ * On network shares that's a large part of the run. These keep that I/O on their own threads, next to the pool: the
+ * next few sources are read into memory while the current ones are processed, and finished outputs are written out
+ * while the next ones are being built. Both queues are bounded, so memory use stays predictable however big the batch.
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace util
+{
+
+	/**
+	 * Read every file in a list into memory ahead of its use, in list order, on a background thread.
+	 * Reading stalls once `depth` files or `maxBytes` are held, until the oldest ones are taken, so consumers should
+	 * take files in roughly the order of the list.
+	 */
+	class Prefetcher {
+	public:
+		static constexpr std::size_t DEFAULT_MAX_BYTES = 256 * 1024 * 1024;
+
+		Prefetcher(std::vector<std::filesystem::path> paths, std::size_t depth, std::size_t maxBytes = DEFAULT_MAX_BYTES);
+		~Prefetcher();
+
+		Prefetcher(const Prefetcher&) = delete;
+		Prefetcher& operator=(const Prefetcher&) = delete;
+
+		/**
+		 * Wait for paths[index] to be read and take its contents. Each index may only be taken once.
+		 * Returns false if the file could not be read, or the prefetcher was stopped; callers should fall back to
+		 * reading it themselves so errors are reported as usual
+		 */
+		bool take(std::size_t index, std::vector<std::uint8_t>& out);
+
+		/**
+		 * Stop reading. Anyone waiting in take, now or later, returns straight away
+		 */
+		void stop();
+
+	private:
+		enum class State : std::uint8_t {
+			Pending,
+			Ready,
+			Failed,
+			Taken,
+		};
+
+		void read_thread();
+
+		std::vector<std::filesystem::path> m_paths;
+		std::vector<std::vector<std::uint8_t>> m_data;
+		std::vector<State> m_state;
+		std::size_t m_depth;
+		std::size_t m_maxBytes;
+		std::size_t m_held = 0; // Files read but not taken yet
+		std::size_t m_heldBytes = 0;
+		bool m_stopped = false;
+
+		std::mutex m_mutex;
+		std::condition_variable m_readCv;  // Signalled when a file has been read
+		std::condition_variable m_spaceCv; // Signalled when a file has been taken
+		std::thread m_thread;
+	};
+
+	/**
+	 * Write files out on a background thread, so the caller can get on with the next one.
+	 * write blocks once `depth` writes or `maxBytes` are queued, until the writer catches up.
+	 */
+	class WriteBehind {
+	public:
+		static constexpr std::size_t DEFAULT_MAX_BYTES = 256 * 1024 * 1024;
+
+		// Called on the writer thread once the file has been written, or has failed to
+		using Callback = std::function<void(bool ok)>;
+
+		explicit WriteBehind(std::size_t depth, std::size_t maxBytes = DEFAULT_MAX_BYTES);
+		~WriteBehind(); // Finishes every queued write first
+
+		WriteBehind(const WriteBehind&) = delete;
+		WriteBehind& operator=(const WriteBehind&) = delete;
+
+		/**
+		 * Queue data to be written to path, replacing whatever is there
+		 */
+		void write(std::filesystem::path path, std::vector<std::uint8_t> data, Callback done = {});
+
+		/**
+		 * Wait for every write queued so far to finish
+		 * @returns The paths that could not be written since the last flush
+		 */
+		std::vector<std::filesystem::path> flush();
+
+	private:
+		struct Write {
+			std::filesystem::path path;
+			std::vector<std::uint8_t> data;
+			Callback done;
+		};
+
+		void write_thread();
+
+		std::deque<Write> m_queue;
+		std::size_t m_depth;
+		std::size_t m_maxBytes;
+		std::size_t m_queuedBytes = 0;
+		std::size_t m_inFlight = 0; // Queued writes + the one being written
+		bool m_stopped = false;
+		std::vector<std::filesystem::path> m_failures;
+
+		std::mutex m_mutex;
+		std::condition_variable m_workCv;  // Signalled when a write is queued
+		std::condition_variable m_spaceCv; // Signalled when a write has finished
+		std::thread m_thread;
+	};
+
+} // namespace util
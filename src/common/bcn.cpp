@@ -0,0 +1,931 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+#include "bcn.hpp"
+#include "strtools.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#	define BCN_SSE2 1
+#	include <emmintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#	define BCN_NEON 1
+#	include <arm_neon.h>
+#endif
+
+using namespace bcn;
+
+namespace
+{
+	constexpr int BLOCK_PIXELS = 16;
+
+	//////////////////////////////////////////////////////////////////////////////////
+	// Index selection, shared by every format
+	//////////////////////////////////////////////////////////////////////////////////
+
+	//
+	// Four pixels of one channel, one per lane. SSE2 and NEON are baseline on every target that has them, so
+	// there's no need for the runtime dispatch lwiconv does
+	//
+	struct Vec4 {
+#if defined(BCN_SSE2)
+		__m128 v;
+		static Vec4 zero() { return {_mm_setzero_ps()}; }
+		static Vec4 set(float f) { return {_mm_set1_ps(f)}; }
+		static Vec4 load(const float* p) { return {_mm_load_ps(p)}; }
+		void store(float* p) const { _mm_store_ps(p, v); }
+		friend Vec4 operator+(Vec4 a, Vec4 b) { return {_mm_add_ps(a.v, b.v)}; }
+		friend Vec4 operator-(Vec4 a, Vec4 b) { return {_mm_sub_ps(a.v, b.v)}; }
+		friend Vec4 operator*(Vec4 a, Vec4 b) { return {_mm_mul_ps(a.v, b.v)}; }
+		friend Vec4 operator<(Vec4 a, Vec4 b) { return {_mm_cmplt_ps(a.v, b.v)}; }
+		// Lanes of a where mask is set, b elsewhere
+		static Vec4 select(Vec4 mask, Vec4 a, Vec4 b) {
+			return {_mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v))};
+		}
+#elif defined(BCN_NEON)
+		float32x4_t v;
+		static Vec4 zero() { return {vdupq_n_f32(0)}; }
+		static Vec4 set(float f) { return {vdupq_n_f32(f)}; }
+		static Vec4 load(const float* p) { return {vld1q_f32(p)}; }
+		void store(float* p) const { vst1q_f32(p, v); }
+		friend Vec4 operator+(Vec4 a, Vec4 b) { return {vaddq_f32(a.v, b.v)}; }
+		friend Vec4 operator-(Vec4 a, Vec4 b) { return {vsubq_f32(a.v, b.v)}; }
+		friend Vec4 operator*(Vec4 a, Vec4 b) { return {vmulq_f32(a.v, b.v)}; }
+		friend Vec4 operator<(Vec4 a, Vec4 b) { return {vreinterpretq_f32_u32(vcltq_f32(a.v, b.v))}; }
+		static Vec4 select(Vec4 mask, Vec4 a, Vec4 b) { return {vbslq_f32(vreinterpretq_u32_f32(mask.v), a.v, b.v)}; }
+#else
+		float v[4];
+		static Vec4 zero() { return {{0, 0, 0, 0}}; }
+		static Vec4 set(float f) { return {{f, f, f, f}}; }
+		static Vec4 load(const float* p) { return {{p[0], p[1], p[2], p[3]}}; }
+		void store(float* p) const { std::copy(v, v + 4, p); }
+		friend Vec4 operator+(Vec4 a, Vec4 b) { return {{a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3]}}; }
+		friend Vec4 operator-(Vec4 a, Vec4 b) { return {{a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2], a.v[3] - b.v[3]}}; }
+		friend Vec4 operator*(Vec4 a, Vec4 b) { return {{a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3]}}; }
+		friend Vec4 operator<(Vec4 a, Vec4 b) {
+			return {{float(a.v[0] < b.v[0]), float(a.v[1] < b.v[1]), float(a.v[2] < b.v[2]), float(a.v[3] < b.v[3])}};
+		}
+		static Vec4 select(Vec4 mask, Vec4 a, Vec4 b) {
+			return {{mask.v[0] != 0 ? a.v[0] : b.v[0], mask.v[1] != 0 ? a.v[1] : b.v[1], mask.v[2] != 0 ? a.v[2] : b.v[2],
+					 mask.v[3] != 0 ? a.v[3] : b.v[3]}};
+		}
+#endif
+	};
+
+	//
+	// A block with one plane per channel, so four pixels of a channel load at once
+	//
+	struct Block {
+		alignas(16) float c[4][BLOCK_PIXELS];
+
+		explicit Block(const uint8_t* rgba) {
+			for (int i = 0; i < BLOCK_PIXELS; ++i)
+				for (int ch = 0; ch < 4; ++ch)
+					c[ch][i] = rgba[i * 4 + ch];
+		}
+	};
+
+	//
+	// Pick the closest palette entry for each pixel, over numChannels channels of the block starting at firstChannel.
+	// pal[p][k] is the value of entry p for channel firstChannel + k. Ties go to the lowest index.
+	// Palettes and pixels are whole numbers well below 2^24, so the errors are exact in float.
+	// Returns the total squared error
+	//
+	int select_indices(
+		const Block& block, int firstChannel, int numChannels, const float (*pal)[4], int numEntries,
+		uint8_t* indices) {
+		Vec4 total = Vec4::zero();
+		for (int i = 0; i < BLOCK_PIXELS; i += 4) {
+			Vec4 px[4];
+			for (int k = 0; k < numChannels; ++k)
+				px[k] = Vec4::load(block.c[firstChannel + k] + i);
+
+			Vec4 bestErr = Vec4::set(FLT_MAX), best = Vec4::zero();
+			for (int p = 0; p < numEntries; ++p) {
+				Vec4 err = Vec4::zero();
+				for (int k = 0; k < numChannels; ++k) {
+					const Vec4 d = px[k] - Vec4::set(pal[p][k]);
+					err = err + d * d;
+				}
+				const Vec4 closer = err < bestErr;
+				bestErr = Vec4::select(closer, err, bestErr);
+				best = Vec4::select(closer, Vec4::set(float(p)), best);
+			}
+			total = total + bestErr;
+
+			alignas(16) float idx[4];
+			best.store(idx);
+			for (int k = 0; k < 4; ++k)
+				indices[i + k] = uint8_t(idx[k]);
+		}
+
+		alignas(16) float sum[4];
+		total.store(sum);
+		return int(sum[0] + sum[1] + sum[2] + sum[3]);
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////
+	// Color block (BC1, and the color half of BC2/BC3)
+	//////////////////////////////////////////////////////////////////////////////////
+
+	struct Vec3 {
+		float x, y, z;
+	};
+
+	inline uint16_t pack_565(const Vec3& c) {
+		const int r = std::clamp(int(c.x * (31.f / 255.f) + 0.5f), 0, 31);
+		const int g = std::clamp(int(c.y * (63.f / 255.f) + 0.5f), 0, 63);
+		const int b = std::clamp(int(c.z * (31.f / 255.f) + 0.5f), 0, 31);
+		return uint16_t((r << 11) | (g << 5) | b);
+	}
+
+	inline void unpack_565(uint16_t v, int out[3]) {
+		const int r = (v >> 11) & 31, g = (v >> 5) & 63, b = v & 31;
+		out[0] = (r << 3) | (r >> 2);
+		out[1] = (g << 2) | (g >> 4);
+		out[2] = (b << 3) | (b >> 2);
+	}
+
+	//
+	// Pick the closest 4-color palette entry for each pixel. Requires c0 > c1 (4-color mode)
+	// Returns the total squared error
+	//
+	int select_color_indices(const Block& block, uint16_t c0, uint16_t c1, uint32_t& indices) {
+		int ends[2][3];
+		unpack_565(c0, ends[0]);
+		unpack_565(c1, ends[1]);
+		float pal[4][4] = {};
+		for (int c = 0; c < 3; ++c) {
+			pal[0][c] = float(ends[0][c]);
+			pal[1][c] = float(ends[1][c]);
+			pal[2][c] = float((2 * ends[0][c] + ends[1][c]) / 3);
+			pal[3][c] = float((ends[0][c] + 2 * ends[1][c]) / 3);
+		}
+
+		uint8_t idx[BLOCK_PIXELS];
+		const int error = select_indices(block, 0, 3, pal, 4, idx);
+		indices = 0;
+		for (int i = 0; i < BLOCK_PIXELS; ++i)
+			indices |= uint32_t(idx[i]) << (i * 2);
+		return error;
+	}
+
+	struct ColorBlock {
+		uint16_t c0 = 0, c1 = 0;
+		uint32_t indices = 0;
+		int error = INT32_MAX;
+	};
+
+	//
+	// Quantize a pair of endpoints and build the block for them
+	//
+	ColorBlock make_color_block(const Block& block, const Vec3& e0, const Vec3& e1) {
+		ColorBlock b;
+		b.c0 = pack_565(e0);
+		b.c1 = pack_565(e1);
+		if (b.c0 < b.c1)
+			std::swap(b.c0, b.c1);
+
+		// Both endpoints quantized to the same color, index 0 everywhere. Anything else would select black in 3-color
+		// mode
+		if (b.c0 == b.c1) {
+			int color[3];
+			unpack_565(b.c0, color);
+			const float pal[1][4] = {{float(color[0]), float(color[1]), float(color[2]), 0}};
+			uint8_t idx[BLOCK_PIXELS];
+			b.indices = 0;
+			b.error = select_indices(block, 0, 3, pal, 1, idx);
+			return b;
+		}
+
+		b.error = select_color_indices(block, b.c0, b.c1, b.indices);
+		return b;
+	}
+
+	//
+	// Bounding box endpoints, with the diagonal picked from the sign of the covariance
+	//
+	void bbox_endpoints(const uint8_t* rgba, Vec3& e0, Vec3& e1) {
+		float mn[3] = {255, 255, 255}, mx[3] = {0, 0, 0}, mean[3] = {0, 0, 0};
+		for (int i = 0; i < BLOCK_PIXELS; ++i) {
+			for (int c = 0; c < 3; ++c) {
+				const float v = rgba[i * 4 + c];
+				mn[c] = std::min(mn[c], v);
+				mx[c] = std::max(mx[c], v);
+				mean[c] += v;
+			}
+		}
+		for (auto& m : mean)
+			m /= BLOCK_PIXELS;
+
+		// Flip G/B if they run against R (or G, when R is flat)
+		float covRG = 0, covRB = 0, covGB = 0;
+		for (int i = 0; i < BLOCK_PIXELS; ++i) {
+			const float r = rgba[i * 4] - mean[0], g = rgba[i * 4 + 1] - mean[1], b = rgba[i * 4 + 2] - mean[2];
+			covRG += r * g;
+			covRB += r * b;
+			covGB += g * b;
+		}
+		const bool flatR = mx[0] == mn[0];
+		if (!flatR && covRG < 0)
+			std::swap(mn[1], mx[1]);
+		if ((!flatR && covRB < 0) || (flatR && covGB < 0))
+			std::swap(mn[2], mx[2]);
+
+		// Inset slightly, the extremes are rarely the best endpoints
+		for (int c = 0; c < 3; ++c) {
+			const float inset = (mx[c] - mn[c]) / 16.f;
+			mx[c] -= inset;
+			mn[c] += inset;
+		}
+		e0 = {mx[0], mx[1], mx[2]};
+		e1 = {mn[0], mn[1], mn[2]};
+	}
+
+	//
+	// Endpoints along the principal axis of the block's colors
+	// Returns false if the block is a single color, in which case e0 == e1 == that color
+	//
+	bool pca_endpoints(const uint8_t* rgba, Vec3& e0, Vec3& e1) {
+		float mean[3] = {0, 0, 0};
+		for (int i = 0; i < BLOCK_PIXELS; ++i) {
+			for (int c = 0; c < 3; ++c)
+				mean[c] += rgba[i * 4 + c];
+		}
+		for (auto& m : mean)
+			m /= BLOCK_PIXELS;
+
+		float cov[6] = {0, 0, 0, 0, 0, 0}; // xx xy xz yy yz zz
+		for (int i = 0; i < BLOCK_PIXELS; ++i) {
+			const float r = rgba[i * 4] - mean[0], g = rgba[i * 4 + 1] - mean[1], b = rgba[i * 4 + 2] - mean[2];
+			cov[0] += r * r;
+			cov[1] += r * g;
+			cov[2] += r * b;
+			cov[3] += g * g;
+			cov[4] += g * b;
+			cov[5] += b * b;
+		}
+
+		// Power iteration, starting from the axis with the largest variance
+		float axis[3] = {1, 1, 1};
+		if (cov[0] >= cov[3] && cov[0] >= cov[5])
+			axis[0] = 2;
+		else if (cov[3] >= cov[5])
+			axis[1] = 2;
+		else
+			axis[2] = 2;
+		for (int iter = 0; iter < 8; ++iter) {
+			const float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+			const float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+			const float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+			const float len = std::max({std::abs(x), std::abs(y), std::abs(z)});
+			if (len < 1e-6f)
+				break;
+			axis[0] = x / len;
+			axis[1] = y / len;
+			axis[2] = z / len;
+		}
+
+		const float len2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+		float tmin = 0, tmax = 0;
+		for (int i = 0; i < BLOCK_PIXELS; ++i) {
+			const float t = (rgba[i * 4] - mean[0]) * axis[0] + (rgba[i * 4 + 1] - mean[1]) * axis[1] +
+							(rgba[i * 4 + 2] - mean[2]) * axis[2];
+			tmin = std::min(tmin, t);
+			tmax = std::max(tmax, t);
+		}
+
+		if (tmax - tmin < 1e-3f || len2 < 1e-6f) {
+			e0 = e1 = {mean[0], mean[1], mean[2]};
+			return false;
+		}
+
+		tmin /= len2;
+		tmax /= len2;
+		const auto clamp255 = [](float v) { return std::clamp(v, 0.f, 255.f); };
+		e0 = {clamp255(mean[0] + axis[0] * tmax), clamp255(mean[1] + axis[1] * tmax), clamp255(mean[2] + axis[2] * tmax)};
+		e1 = {clamp255(mean[0] + axis[0] * tmin), clamp255(mean[1] + axis[1] * tmin), clamp255(mean[2] + axis[2] * tmin)};
+		return true;
+	}
+
+	//
+	// Least squares fit of the endpoints to the block, given the current indices
+	//
+	bool refine_endpoints(const uint8_t* rgba, const ColorBlock& b, Vec3& e0, Vec3& e1) {
+		static constexpr float weights[4] = {1.f, 0.f, 2.f / 3.f, 1.f / 3.f};
+		float aa = 0, ab = 0, bb = 0;
+		float ax[3] = {0, 0, 0}, bx[3] = {0, 0, 0};
+		for (int i = 0; i < BLOCK_PIXELS; ++i) {
+			const float a = weights[(b.indices >> (i * 2)) & 3];
+			const float w = 1.f - a;
+			aa += a * a;
+			ab += a * w;
+			bb += w * w;
+			for (int c = 0; c < 3; ++c) {
+				ax[c] += a * rgba[i * 4 + c];
+				bx[c] += w * rgba[i * 4 + c];
+			}
+		}
+
+		const float det = aa * bb - ab * ab;
+		if (std::abs(det) < 1e-6f)
+			return false;
+
+		float r0[3], r1[3];
+		for (int c = 0; c < 3; ++c) {
+			r0[c] = std::clamp((ax[c] * bb - bx[c] * ab) / det, 0.f, 255.f);
+			r1[c] = std::clamp((bx[c] * aa - ax[c] * ab) / det, 0.f, 255.f);
+		}
+		e0 = {r0[0], r0[1], r0[2]};
+		e1 = {r1[0], r1[1], r1[2]};
+		return true;
+	}
+
+	void encode_color(Quality quality, const uint8_t* rgba, const Block& block, uint8_t* out) {
+		Vec3 e0, e1;
+		ColorBlock best;
+
+		if (quality == Quality::Fast) {
+			bbox_endpoints(rgba, e0, e1);
+			best = make_color_block(block, e0, e1);
+		}
+		else {
+			pca_endpoints(rgba, e0, e1);
+			best = make_color_block(block, e0, e1);
+
+			if (quality == Quality::Best && best.error > 0) {
+				// Bounding box occasionally beats PCA on blocks with outliers
+				bbox_endpoints(rgba, e0, e1);
+				if (auto b = make_color_block(block, e0, e1); b.error < best.error)
+					best = b;
+
+				for (int iter = 0; iter < 3 && best.error > 0; ++iter) {
+					if (!refine_endpoints(rgba, best, e0, e1))
+						break;
+					const auto b = make_color_block(block, e0, e1);
+					if (b.error >= best.error)
+						break;
+					best = b;
+				}
+			}
+		}
+
+		out[0] = uint8_t(best.c0);
+		out[1] = uint8_t(best.c0 >> 8);
+		out[2] = uint8_t(best.c1);
+		out[3] = uint8_t(best.c1 >> 8);
+		for (int i = 0; i < 4; ++i)
+			out[4 + i] = uint8_t(best.indices >> (i * 8));
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////
+	// Alpha blocks (BC2/BC3), and the single channel blocks BC4/BC5/ATI2 are made of
+	//////////////////////////////////////////////////////////////////////////////////
+
+	void encode_explicit_alpha(const uint8_t* rgba, uint8_t* out) {
+		for (int i = 0; i < BLOCK_PIXELS; i += 2) {
+			const int lo = (rgba[i * 4 + 3] * 15 + 127) / 255;
+			const int hi = (rgba[(i + 1) * 4 + 3] * 15 + 127) / 255;
+			out[i / 2] = uint8_t(lo | (hi << 4));
+		}
+	}
+
+	struct AlphaBlock {
+		uint8_t a0 = 0, a1 = 0;
+		uint64_t indices = 0;
+		int error = INT32_MAX;
+	};
+
+	//
+	// Build an interpolated alpha block of channel for the given endpoints. a0 > a1 selects the 8 value mode,
+	// otherwise the 6 value mode with explicit 0 and 255
+	//
+	AlphaBlock make_alpha_block(const Block& block, int channel, int a0, int a1) {
+		float pal[8][4] = {};
+		pal[0][0] = float(a0);
+		pal[1][0] = float(a1);
+		if (a0 > a1) {
+			for (int k = 1; k < 7; ++k)
+				pal[k + 1][0] = float(((7 - k) * a0 + k * a1 + 3) / 7);
+		}
+		else {
+			for (int k = 1; k < 5; ++k)
+				pal[k + 1][0] = float(((5 - k) * a0 + k * a1 + 2) / 5);
+			pal[6][0] = 0;
+			pal[7][0] = 255;
+		}
+
+		AlphaBlock b;
+		b.a0 = uint8_t(a0);
+		b.a1 = uint8_t(a1);
+		uint8_t idx[BLOCK_PIXELS];
+		b.error = select_indices(block, channel, 1, pal, 8, idx);
+		for (int i = 0; i < BLOCK_PIXELS; ++i)
+			b.indices |= uint64_t(idx[i]) << (i * 3);
+		return b;
+	}
+
+	void encode_interpolated_alpha(Quality quality, const Block& block, int channel, uint8_t* out) {
+		int mn = 255, mx = 0;
+		int mnInner = 255, mxInner = 0; // Ignoring fully transparent/opaque pixels
+		for (int i = 0; i < BLOCK_PIXELS; ++i) {
+			const int a = int(block.c[channel][i]);
+			mn = std::min(mn, a);
+			mx = std::max(mx, a);
+			if (a != 0 && a != 255) {
+				mnInner = std::min(mnInner, a);
+				mxInner = std::max(mxInner, a);
+			}
+		}
+
+		AlphaBlock best;
+		if (mn == mx) {
+			best = make_alpha_block(block, channel, mx, mn);
+		}
+		else {
+			best = make_alpha_block(block, channel, mx, mn);
+
+			// 6 value mode gets 0 and 255 for free, which helps blocks mixing hard and soft edges
+			if (quality != Quality::Fast && best.error > 0 && (mn == 0 || mx == 255)) {
+				const int lo = mnInner <= mxInner ? mnInner : mn;
+				const int hi = mnInner <= mxInner ? mxInner : mx;
+				if (auto b = make_alpha_block(block, channel, lo, hi); b.error < best.error)
+					best = b;
+			}
+
+			// Try pulling the endpoints in a little. The interpolated values often fit better than the extremes
+			if (quality == Quality::Best && best.error > 0) {
+				const int range = std::min(4, (mx - mn) / 2);
+				for (int d0 = 0; d0 <= range; ++d0) {
+					for (int d1 = 0; d1 <= range; ++d1) {
+						if (mx - d0 <= mn + d1)
+							continue;
+						if (auto b = make_alpha_block(block, channel, mx - d0, mn + d1); b.error < best.error)
+							best = b;
+					}
+				}
+			}
+		}
+
+		out[0] = best.a0;
+		out[1] = best.a1;
+		for (int i = 0; i < 6; ++i)
+			out[2 + i] = uint8_t(best.indices >> (i * 8));
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////
+	// BC7
+	// Only the single subset modes are used: mode 6 (RGBA endpoints, 4-bit indices) for every block, and at Best
+	// quality mode 5 (separate 2-bit alpha indices, one channel swapped with alpha) where it does better. The
+	// partitioned modes would mean searching up to 64 partitions per block, which is a different class of encoder
+	//////////////////////////////////////////////////////////////////////////////////
+
+	constexpr int BC7_WEIGHTS2[4] = {0, 21, 43, 64};
+	constexpr int BC7_WEIGHTS4[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+	inline int bc7_interpolate(int e0, int e1, int weight) {
+		return ((64 - weight) * e0 + weight * e1 + 32) >> 6;
+	}
+
+	//
+	// Little endian bit stream, filled from bit 0 of the first byte up. out has to start zeroed
+	//
+	struct BitWriter {
+		uint8_t* out;
+		int pos = 0;
+
+		void put(uint32_t value, int bits) {
+			for (int i = 0; i < bits; ++i, ++pos)
+				if ((value >> i) & 1)
+					out[pos >> 3] |= uint8_t(1 << (pos & 7));
+		}
+	};
+
+	//
+	// Bounding box endpoints over count channels of the block from first on. Channels running against the one with
+	// the largest range get their endpoints flipped
+	//
+	void bc7_bbox_endpoints(const Block& block, int first, int count, float e0[4], float e1[4]) {
+		float mean[4] = {};
+		int ref = first;
+		for (int c = first; c < first + count; ++c) {
+			e0[c - first] = 0;
+			e1[c - first] = 255;
+			for (int i = 0; i < BLOCK_PIXELS; ++i) {
+				e0[c - first] = std::max(e0[c - first], block.c[c][i]);
+				e1[c - first] = std::min(e1[c - first], block.c[c][i]);
+				mean[c - first] += block.c[c][i] / BLOCK_PIXELS;
+			}
+			if (e0[c - first] - e1[c - first] > e0[ref - first] - e1[ref - first])
+				ref = c;
+		}
+
+		for (int c = first; c < first + count; ++c) {
+			float cov = 0;
+			for (int i = 0; i < BLOCK_PIXELS; ++i)
+				cov += (block.c[ref][i] - mean[ref - first]) * (block.c[c][i] - mean[c - first]);
+			if (cov < 0)
+				std::swap(e0[c - first], e1[c - first]);
+		}
+	}
+
+	//
+	// Endpoints along the principal axis of count channels of the block from first on. Same as pca_endpoints, for
+	// any number of channels
+	//
+	void bc7_pca_endpoints(const Block& block, int first, int count, float e0[4], float e1[4]) {
+		float mean[4] = {};
+		for (int k = 0; k < count; ++k) {
+			for (int i = 0; i < BLOCK_PIXELS; ++i)
+				mean[k] += block.c[first + k][i];
+			mean[k] /= BLOCK_PIXELS;
+		}
+
+		float cov[4][4] = {};
+		for (int i = 0; i < BLOCK_PIXELS; ++i) {
+			float d[4];
+			for (int k = 0; k < count; ++k)
+				d[k] = block.c[first + k][i] - mean[k];
+			for (int j = 0; j < count; ++j)
+				for (int k = 0; k < count; ++k)
+					cov[j][k] += d[j] * d[k];
+		}
+
+		// Power iteration, starting from the axis with the largest variance
+		float axis[4] = {1, 1, 1, 1};
+		int largest = 0;
+		for (int k = 1; k < count; ++k)
+			if (cov[k][k] > cov[largest][largest])
+				largest = k;
+		axis[largest] = 2;
+		for (int iter = 0; iter < 8; ++iter) {
+			float next[4] = {}, len = 0;
+			for (int j = 0; j < count; ++j) {
+				for (int k = 0; k < count; ++k)
+					next[j] += cov[j][k] * axis[k];
+				len = std::max(len, std::abs(next[j]));
+			}
+			if (len < 1e-6f)
+				break;
+			for (int k = 0; k < count; ++k)
+				axis[k] = next[k] / len;
+		}
+
+		float len2 = 0, tmin = 0, tmax = 0;
+		for (int k = 0; k < count; ++k)
+			len2 += axis[k] * axis[k];
+		for (int i = 0; i < BLOCK_PIXELS; ++i) {
+			float t = 0;
+			for (int k = 0; k < count; ++k)
+				t += (block.c[first + k][i] - mean[k]) * axis[k];
+			tmin = std::min(tmin, t);
+			tmax = std::max(tmax, t);
+		}
+
+		if (tmax - tmin < 1e-3f || len2 < 1e-6f)
+			tmin = tmax = 0;
+		else {
+			tmin /= len2;
+			tmax /= len2;
+		}
+		for (int k = 0; k < count; ++k) {
+			e0[k] = std::clamp(mean[k] + axis[k] * tmax, 0.f, 255.f);
+			e1[k] = std::clamp(mean[k] + axis[k] * tmin, 0.f, 255.f);
+		}
+	}
+
+	//
+	// Least squares fit of the endpoints of count channels to the block, given the indices into a palette
+	// interpolated with weights (out of 64)
+	//
+	bool bc7_refine_endpoints(
+		const Block& block, int first, int count, const uint8_t* indices, const int* weights, float e0[4],
+		float e1[4]) {
+		float aa = 0, ab = 0, bb = 0;
+		float ax[4] = {}, bx[4] = {};
+		for (int i = 0; i < BLOCK_PIXELS; ++i) {
+			const float b = weights[indices[i]] / 64.f;
+			const float a = 1.f - b;
+			aa += a * a;
+			ab += a * b;
+			bb += b * b;
+			for (int k = 0; k < count; ++k) {
+				ax[k] += a * block.c[first + k][i];
+				bx[k] += b * block.c[first + k][i];
+			}
+		}
+
+		const float det = aa * bb - ab * ab;
+		if (std::abs(det) < 1e-6f)
+			return false;
+
+		for (int k = 0; k < count; ++k) {
+			e0[k] = std::clamp((ax[k] * bb - bx[k] * ab) / det, 0.f, 255.f);
+			e1[k] = std::clamp((bx[k] * aa - ax[k] * ab) / det, 0.f, 255.f);
+		}
+		return true;
+	}
+
+	struct Bc7Mode6 {
+		int q0[4] = {}, q1[4] = {}; // 7-bit endpoints
+		int p0 = 0, p1 = 0;			// P-bits, the low bit of every channel of an endpoint
+		uint8_t indices[BLOCK_PIXELS] = {};
+		int error = INT32_MAX;
+	};
+
+	//
+	// Quantize a pair of mode 6 endpoints with the given p-bits, and pick the indices for them
+	//
+	Bc7Mode6 bc7_make_mode6(const Block& block, const float e0[4], const float e1[4], int p0, int p1) {
+		Bc7Mode6 b;
+		b.p0 = p0;
+		b.p1 = p1;
+		float pal[16][4];
+		for (int c = 0; c < 4; ++c) {
+			b.q0[c] = std::clamp(int(std::lround((e0[c] - p0) / 2.f)), 0, 127);
+			b.q1[c] = std::clamp(int(std::lround((e1[c] - p1) / 2.f)), 0, 127);
+			for (int k = 0; k < 16; ++k)
+				pal[k][c] = float(bc7_interpolate((b.q0[c] << 1) | p0, (b.q1[c] << 1) | p1, BC7_WEIGHTS4[k]));
+		}
+		b.error = select_indices(block, 0, 4, pal, 16, b.indices);
+		return b;
+	}
+
+	//
+	// P-bit that quantizes an endpoint with the least error on its own
+	//
+	int bc7_closest_pbit(const float e[4]) {
+		float err[2] = {};
+		for (int p = 0; p < 2; ++p) {
+			for (int c = 0; c < 4; ++c) {
+				const int v = (std::clamp(int(std::lround((e[c] - p) / 2.f)), 0, 127) << 1) | p;
+				err[p] += (e[c] - v) * (e[c] - v);
+			}
+		}
+		return err[1] < err[0] ? 1 : 0;
+	}
+
+	Bc7Mode6 bc7_encode_mode6(Quality quality, const Block& block) {
+		float e0[4], e1[4];
+		if (quality == Quality::Fast)
+			bc7_bbox_endpoints(block, 0, 4, e0, e1);
+		else
+			bc7_pca_endpoints(block, 0, 4, e0, e1);
+
+		// Fast quantizes each endpoint on its own, the rest try every p-bit pair against the whole block
+		auto best_for = [&](const float* a, const float* b)
+		{
+			if (quality == Quality::Fast)
+				return bc7_make_mode6(block, a, b, bc7_closest_pbit(a), bc7_closest_pbit(b));
+			Bc7Mode6 best;
+			for (int p = 0; p < 4; ++p)
+				if (auto m = bc7_make_mode6(block, a, b, p & 1, p >> 1); m.error < best.error)
+					best = m;
+			return best;
+		};
+
+		Bc7Mode6 best = best_for(e0, e1);
+		const int iterations = quality == Quality::Best ? 3 : quality == Quality::Normal ? 1 : 0;
+		for (int iter = 0; iter < iterations && best.error > 0; ++iter) {
+			if (!bc7_refine_endpoints(block, 0, 4, best.indices, BC7_WEIGHTS4, e0, e1))
+				break;
+			const auto m = best_for(e0, e1);
+			if (m.error >= best.error)
+				break;
+			best = m;
+		}
+		return best;
+	}
+
+	void bc7_write_mode6(Bc7Mode6 b, uint8_t* out) {
+		// The first index is stored without its high bit, so it has to be clear
+		if (b.indices[0] & 8) {
+			std::swap(b.q0, b.q1);
+			std::swap(b.p0, b.p1);
+			for (auto& i : b.indices)
+				i = uint8_t(15 - i);
+		}
+
+		std::memset(out, 0, 16);
+		BitWriter w{out};
+		w.put(1 << 6, 7);
+		for (int c = 0; c < 4; ++c) {
+			w.put(b.q0[c], 7);
+			w.put(b.q1[c], 7);
+		}
+		w.put(b.p0, 1);
+		w.put(b.p1, 1);
+		w.put(b.indices[0], 3);
+		for (int i = 1; i < BLOCK_PIXELS; ++i)
+			w.put(b.indices[i], 4);
+	}
+
+	struct Bc7Mode5 {
+		int rotation = 0;			// Channel swapped with alpha before encoding, 1-3 for R, G, B
+		int c0[3] = {}, c1[3] = {}; // 7-bit color endpoints
+		int a0 = 0, a1 = 0;
+		uint8_t colorIndices[BLOCK_PIXELS] = {};
+		uint8_t alphaIndices[BLOCK_PIXELS] = {};
+		int error = INT32_MAX;
+	};
+
+	//
+	// Quantize a pair of mode 5 color endpoints, and pick the color indices for them
+	//
+	int bc7_make_mode5_color(const Block& block, const float e0[4], const float e1[4], Bc7Mode5& b) {
+		float pal[4][4] = {};
+		for (int c = 0; c < 3; ++c) {
+			b.c0[c] = std::clamp(int(std::lround(e0[c] * (127.f / 255.f))), 0, 127);
+			b.c1[c] = std::clamp(int(std::lround(e1[c] * (127.f / 255.f))), 0, 127);
+			const int v0 = (b.c0[c] << 1) | (b.c0[c] >> 6), v1 = (b.c1[c] << 1) | (b.c1[c] >> 6);
+			for (int k = 0; k < 4; ++k)
+				pal[k][c] = float(bc7_interpolate(v0, v1, BC7_WEIGHTS2[k]));
+		}
+		return select_indices(block, 0, 3, pal, 4, b.colorIndices);
+	}
+
+	//
+	// Encode a block that already has the rotation applied, so the channel to encode separately is in alpha
+	//
+	Bc7Mode5 bc7_encode_mode5(const Block& block, int rotation) {
+		Bc7Mode5 b;
+		b.rotation = rotation;
+
+		float e0[4], e1[4];
+		bc7_pca_endpoints(block, 0, 3, e0, e1);
+		int colorError = bc7_make_mode5_color(block, e0, e1, b);
+		for (int iter = 0; iter < 2 && colorError > 0; ++iter) {
+			Bc7Mode5 m = b;
+			if (!bc7_refine_endpoints(block, 0, 3, b.colorIndices, BC7_WEIGHTS2, e0, e1))
+				break;
+			const int err = bc7_make_mode5_color(block, e0, e1, m);
+			if (err >= colorError)
+				break;
+			b = m;
+			colorError = err;
+		}
+
+		// Alpha is stored at full precision, the endpoints only need to be fit
+		float a0[4] = {0}, a1[4] = {255};
+		for (int i = 0; i < BLOCK_PIXELS; ++i) {
+			a0[0] = std::max(a0[0], block.c[3][i]);
+			a1[0] = std::min(a1[0], block.c[3][i]);
+		}
+		int alphaError = INT32_MAX;
+		for (int iter = 0; iter < 3; ++iter) {
+			const int q0 = int(std::lround(a0[0])), q1 = int(std::lround(a1[0]));
+			float pal[4][4] = {};
+			for (int k = 0; k < 4; ++k)
+				pal[k][0] = float(bc7_interpolate(q0, q1, BC7_WEIGHTS2[k]));
+			uint8_t indices[BLOCK_PIXELS];
+			const int err = select_indices(block, 3, 1, pal, 4, indices);
+			if (err >= alphaError)
+				break;
+			b.a0 = q0;
+			b.a1 = q1;
+			std::memcpy(b.alphaIndices, indices, sizeof(indices));
+			alphaError = err;
+			if (!err || !bc7_refine_endpoints(block, 3, 1, b.alphaIndices, BC7_WEIGHTS2, a0, a1))
+				break;
+		}
+
+		b.error = colorError + alphaError;
+		return b;
+	}
+
+	void bc7_write_mode5(Bc7Mode5 b, uint8_t* out) {
+		// The first index of each set is stored without its high bit, so it has to be clear
+		if (b.colorIndices[0] & 2) {
+			std::swap(b.c0, b.c1);
+			for (auto& i : b.colorIndices)
+				i = uint8_t(3 - i);
+		}
+		if (b.alphaIndices[0] & 2) {
+			std::swap(b.a0, b.a1);
+			for (auto& i : b.alphaIndices)
+				i = uint8_t(3 - i);
+		}
+
+		std::memset(out, 0, 16);
+		BitWriter w{out};
+		w.put(1 << 5, 6);
+		w.put(b.rotation, 2);
+		for (int c = 0; c < 3; ++c) {
+			w.put(b.c0[c], 7);
+			w.put(b.c1[c], 7);
+		}
+		w.put(b.a0, 8);
+		w.put(b.a1, 8);
+		w.put(b.colorIndices[0], 1);
+		for (int i = 1; i < BLOCK_PIXELS; ++i)
+			w.put(b.colorIndices[i], 2);
+		w.put(b.alphaIndices[0], 1);
+		for (int i = 1; i < BLOCK_PIXELS; ++i)
+			w.put(b.alphaIndices[i], 2);
+	}
+
+	void encode_bc7(Quality quality, const Block& block, uint8_t* out) {
+		const auto mode6 = bc7_encode_mode6(quality, block);
+
+		// Mode 5 wins on blocks where one channel doesn't follow the others, like alpha or a mask packed into a color
+		// channel
+		if (quality == Quality::Best && mode6.error > 0) {
+			Bc7Mode5 best;
+			for (int rotation = 0; rotation < 4; ++rotation) {
+				Block rotated = block;
+				if (rotation)
+					std::swap(rotated.c[rotation - 1], rotated.c[3]);
+				if (auto m = bc7_encode_mode5(rotated, rotation); m.error < best.error)
+					best = m;
+			}
+			if (best.error < mode6.error) {
+				bc7_write_mode5(best, out);
+				return;
+			}
+		}
+
+		bc7_write_mode6(mode6, out);
+	}
+} // namespace
+
+bool bcn::quality_from_string(const std::string& str, Quality& quality) {
+	if (!str::strcasecmp(str.c_str(), "fast"))
+		quality = Quality::Fast;
+	else if (!str::strcasecmp(str.c_str(), "normal"))
+		quality = Quality::Normal;
+	else if (!str::strcasecmp(str.c_str(), "best"))
+		quality = Quality::Best;
+	else
+		return false;
+	return true;
+}
+
+const char* bcn::quality_name(Quality quality) {
+	switch (quality) {
+		case Quality::Fast:
+			return "fast";
+		case Quality::Best:
+			return "best";
+		default:
+			return "normal";
+	}
+}
+
+size_t bcn::block_size(Format format) {
+	return format == Format::BC1 || format == Format::BC4 ? 8 : 16;
+}
+
+void bcn::encode_block(Format format, Quality quality, const uint8_t* rgba, uint8_t* out) {
+	const Block block(rgba);
+	switch (format) {
+		case Format::BC1:
+			encode_color(quality, rgba, block, out);
+			break;
+		case Format::BC2:
+			encode_explicit_alpha(rgba, out);
+			encode_color(quality, rgba, block, out + 8);
+			break;
+		case Format::BC3:
+			encode_interpolated_alpha(quality, block, 3, out);
+			encode_color(quality, rgba, block, out + 8);
+			break;
+		case Format::BC4:
+			encode_interpolated_alpha(quality, block, 0, out);
+			break;
+		case Format::BC5:
+			encode_interpolated_alpha(quality, block, 0, out);
+			encode_interpolated_alpha(quality, block, 1, out + 8);
+			break;
+		case Format::ATI2:
+			encode_interpolated_alpha(quality, block, 1, out);
+			encode_interpolated_alpha(quality, block, 0, out + 8);
+			break;
+		case Format::BC7:
+			encode_bc7(quality, block, out);
+			break;
+	}
+}
+
+void bcn::encode_block_rows(
+	Format format, Quality quality, const uint8_t* rgba, int w, int h, int firstBlockRow, int numBlockRows,
+	uint8_t* out) {
+	const int blocksX = (w + 3) / 4;
+	const size_t blockSize = block_size(format);
+
+	uint8_t block[BLOCK_PIXELS * 4];
+	for (int by = firstBlockRow; by < firstBlockRow + numBlockRows; ++by) {
+		uint8_t* dst = out + size_t(by) * blocksX * blockSize;
+		for (int bx = 0; bx < blocksX; ++bx, dst += blockSize) {
+			// Gather the block, clamping at the image edges
+			for (int y = 0; y < 4; ++y) {
+				const int sy = std::min(by * 4 + y, h - 1);
+				for (int x = 0; x < 4; ++x) {
+					const int sx = std::min(bx * 4 + x, w - 1);
+					std::memcpy(block + (y * 4 + x) * 4, rgba + (size_t(sy) * w + sx) * 4, 4);
+				}
+			}
+			encode_block(format, quality, block, dst);
+		}
+	}
+}
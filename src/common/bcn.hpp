@@ -0,0 +1,65 @@
+/**
+ * bcn.hpp - Block compression encoders
+ *
+ * Encoders for BC1 (DXT1), BC2 (DXT3), BC3 (DXT5), BC4 (ATI1N), BC5, ATI2 (ATI2N) and BC7 from RGBA8888 data.
+ * Each 4x4 block is independent, so callers are free to encode any range of block rows concurrently.
+ * BC7 only uses the single subset modes 5 and 6. Palette index selection, where most of the time goes, runs on SSE2
+ * or NEON where available.
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+namespace bcn
+{
+
+	enum class Format {
+		BC1, // DXT1, opaque
+		BC2, // DXT3, explicit 4-bit alpha
+		BC3, // DXT5, interpolated alpha
+		BC4, // ATI1N, red only
+		BC5, // Red and green, ie. normal maps
+		// D3D9's ATI2, which VTF's ATI2N is: BC5 with green (Y) in the first 8 bytes of each block and red (X) in the
+		// second. VTFLib's DecompressATI2N reads it that way too, it comes from DevIL's DecompressAti2n
+		ATI2,
+		BC7, // RGBA, higher quality than BC3
+	};
+
+	enum class Quality {
+		Fast,	// Bounding box endpoints
+		Normal, // Principal axis endpoints
+		Best,	// Principal axis + least squares refinement, exhaustive-ish alpha search, BC7 mode 5
+	};
+
+	/**
+	 * Parse "fast", "normal" or "best". Returns false if str is none of those
+	 */
+	bool quality_from_string(const std::string& str, Quality& quality);
+
+	const char* quality_name(Quality quality);
+
+	/**
+	 * Size of a single encoded block, in bytes
+	 */
+	size_t block_size(Format format);
+
+	/**
+	 * Encode a single 4x4 block
+	 * @param rgba 16 RGBA8888 pixels, row-major
+	 * @param out block_size(format) bytes
+	 */
+	void encode_block(Format format, Quality quality, const uint8_t* rgba, uint8_t* out);
+
+	/**
+	 * Encode block rows [firstBlockRow, firstBlockRow + numBlockRows) of a w x h RGBA8888 image.
+	 * Blocks hanging off the right or bottom edge are padded by clamping to the edge pixels.
+	 * @param rgba Start of the full image
+	 * @param out Start of the full compressed image. Only the requested block rows are written
+	 */
+	void encode_block_rows(
+		Format format, Quality quality, const uint8_t* rgba, int w, int h, int firstBlockRow, int numBlockRows,
+		uint8_t* out);
+
+} // namespace bcn
@@ -0,0 +1,235 @@
+#include <bit>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "bufferpool.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+using namespace imglib;
+
+namespace
+{
+	// Sits in the ALIGNMENT bytes in front of every buffer
+	struct Header {
+		std::size_t capacity; // Usable bytes following the header
+		std::size_t mapped;	  // Size of the mapping if this came straight from the OS, 0 if it came from the heap
+	};
+	static_assert(sizeof(Header) <= pool::ALIGNMENT);
+
+	struct Pool {
+		std::mutex mutex;
+		std::unordered_map<std::size_t, std::vector<Header*>> cached; // Keyed by capacity
+		std::size_t cachedBytes = 0;
+		std::size_t limit = 256 * 1024 * 1024;
+		bool hugePages = false;
+		std::size_t allocs = 0;
+		std::size_t reused = 0;
+	};
+
+	// Never destroyed, images held in statics can still be released during exit
+	Pool& get_pool() {
+		static Pool* pool = new Pool();
+		return *pool;
+	}
+
+	constexpr std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+} // namespace
+
+static std::size_t round_up(std::size_t size, std::size_t multiple) {
+	return (size + multiple - 1) / multiple * multiple;
+}
+
+static void* user_ptr(Header* header) {
+	return reinterpret_cast<std::uint8_t*>(header) + pool::ALIGNMENT;
+}
+
+static Header* header_of(const void* p) {
+	return reinterpret_cast<Header*>(const_cast<std::uint8_t*>(static_cast<const std::uint8_t*>(p)) - pool::ALIGNMENT);
+}
+
+//
+// Rounds size up to its class. Classes are spaced at quarter steps between powers of two, so at most 25% of a buffer
+// goes unused, while similar sized images (ie 2048x2048 RGBA8888 vs RGBA16161616 mips) still end up sharing buffers
+//
+static std::size_t size_class(std::size_t size) {
+	if (size < pool::MIN_POOLED_SIZE)
+		return round_up(size, pool::ALIGNMENT);
+	return round_up(size, std::bit_floor(size) / 4);
+}
+
+//
+// Get memory for a buffer of capacity bytes plus its header from the heap, or from the OS when using huge pages
+//
+static Header* allocate_block(std::size_t capacity, bool hugePages) {
+	const auto total = capacity + pool::ALIGNMENT;
+	void* base = nullptr;
+	std::size_t mapped = 0;
+
+#ifdef _WIN32
+	const auto largePage = hugePages ? GetLargePageMinimum() : 0;
+	if (largePage && total >= largePage) {
+		mapped = round_up(total, largePage);
+		base = VirtualAlloc(nullptr, mapped, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		if (!base)
+			mapped = 0;
+	}
+	if (!base)
+		base = _aligned_malloc(total, pool::ALIGNMENT);
+#else
+#ifdef __linux__
+	// The kernel will only back huge page aligned ranges with huge pages, so overallocate and trim the ends off
+	if (hugePages && total >= HUGE_PAGE_SIZE) {
+		mapped = round_up(total, HUGE_PAGE_SIZE);
+		auto* raw = static_cast<std::uint8_t*>(
+			mmap(nullptr, mapped + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+		if (raw != MAP_FAILED) {
+			auto* aligned = reinterpret_cast<std::uint8_t*>(round_up(std::uintptr_t(raw), HUGE_PAGE_SIZE));
+			if (aligned != raw)
+				munmap(raw, aligned - raw);
+			if (aligned + mapped != raw + mapped + HUGE_PAGE_SIZE)
+				munmap(aligned + mapped, (raw + mapped + HUGE_PAGE_SIZE) - (aligned + mapped));
+			madvise(aligned, mapped, MADV_HUGEPAGE);
+			base = aligned;
+		}
+		else
+			mapped = 0;
+	}
+#endif
+	if (!base && posix_memalign(&base, pool::ALIGNMENT, total) != 0)
+		base = nullptr;
+#endif
+
+	if (!base)
+		return nullptr;
+
+	auto* header = static_cast<Header*>(base);
+	header->capacity = capacity;
+	header->mapped = mapped;
+	return header;
+}
+
+static void free_block(Header* header) {
+#ifdef _WIN32
+	if (header->mapped)
+		VirtualFree(header, 0, MEM_RELEASE);
+	else
+		_aligned_free(header);
+#else
+	if (header->mapped)
+		munmap(header, header->mapped);
+	else
+		std::free(header);
+#endif
+}
+
+// Drop cached buffers until we're under the limit. Caller holds the lock
+static void evict(Pool& pool) {
+	for (auto it = pool.cached.begin(); it != pool.cached.end() && pool.cachedBytes > pool.limit;) {
+		while (!it->second.empty() && pool.cachedBytes > pool.limit) {
+			pool.cachedBytes -= it->first;
+			free_block(it->second.back());
+			it->second.pop_back();
+		}
+		it = it->second.empty() ? pool.cached.erase(it) : std::next(it);
+	}
+}
+
+void* pool::alloc(std::size_t size) {
+	const auto capacity = size_class(size ? size : 1);
+
+	bool hugePages = false;
+	if (capacity >= MIN_POOLED_SIZE) {
+		auto& pool = get_pool();
+		std::lock_guard lock(pool.mutex);
+		++pool.allocs;
+
+		auto it = pool.cached.find(capacity);
+		if (it != pool.cached.end() && !it->second.empty()) {
+			auto* header = it->second.back();
+			it->second.pop_back();
+			pool.cachedBytes -= capacity;
+			++pool.reused;
+			return user_ptr(header);
+		}
+		hugePages = pool.hugePages;
+	}
+
+	auto* header = allocate_block(capacity, hugePages);
+	return header ? user_ptr(header) : nullptr;
+}
+
+void* pool::realloc(void* p, std::size_t size) {
+	if (!p)
+		return alloc(size);
+	if (size <= capacity(p))
+		return p;
+
+	void* result = alloc(size);
+	if (!result)
+		return nullptr; // p is left alone, like realloc()
+	std::memcpy(result, p, capacity(p));
+	release(p);
+	return result;
+}
+
+void pool::release(void* p) {
+	if (!p)
+		return;
+
+	auto* header = header_of(p);
+	if (header->capacity >= MIN_POOLED_SIZE) {
+		auto& pool = get_pool();
+		std::lock_guard lock(pool.mutex);
+		if (pool.cachedBytes + header->capacity <= pool.limit) {
+			pool.cached[header->capacity].push_back(header);
+			pool.cachedBytes += header->capacity;
+			return;
+		}
+	}
+	free_block(header);
+}
+
+std::size_t pool::capacity(const void* p) {
+	return header_of(p)->capacity;
+}
+
+void pool::trim() {
+	auto& pool = get_pool();
+	std::lock_guard lock(pool.mutex);
+	for (auto& [capacity, headers] : pool.cached)
+		for (auto* header : headers)
+			free_block(header);
+	pool.cached.clear();
+	pool.cachedBytes = 0;
+}
+
+void pool::set_limit(std::size_t bytes) {
+	auto& pool = get_pool();
+	std::lock_guard lock(pool.mutex);
+	pool.limit = bytes;
+	evict(pool);
+}
+
+void pool::set_huge_pages(bool enable) {
+	auto& pool = get_pool();
+	std::lock_guard lock(pool.mutex);
+	pool.hugePages = enable;
+}
+
+pool::Stats pool::stats() {
+	auto& pool = get_pool();
+	std::lock_guard lock(pool.mutex);
+	return {pool.allocs, pool.reused, pool.cachedBytes};
+}
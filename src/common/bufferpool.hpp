@@ -0,0 +1,67 @@
+/**
+ * bufferpool.hpp - Recycled storage for image buffers
+ *
+ * Converting a batch of textures allocates and frees a handful of multi-MB buffers per file, and they're almost always
+ * the same few sizes. Freed buffers are kept around by size class and handed back out to the next allocation that
+ * fits, instead of going back to the heap. All buffers are 64-byte aligned so SIMD loops can use aligned loads.
+ */
+#pragma once
+
+#include <cstddef>
+
+namespace imglib::pool
+{
+
+	inline constexpr std::size_t ALIGNMENT = 64;
+
+	/**
+	 * Allocations below this size go straight to the heap and aren't cached
+	 */
+	inline constexpr std::size_t MIN_POOLED_SIZE = 64 * 1024;
+
+	/**
+	 * Allocate size bytes, aligned to ALIGNMENT. Returns nullptr if out of memory.
+	 * The buffer must be returned with release(), never free()
+	 */
+	void* alloc(std::size_t size);
+
+	/**
+	 * Same semantics as realloc(). Growing within the buffer's size class is free
+	 */
+	void* realloc(void* p, std::size_t size);
+
+	/**
+	 * Return a buffer to the pool. nullptr is ignored
+	 */
+	void release(void* p);
+
+	/**
+	 * Usable size of a buffer from alloc(), which may be larger than requested
+	 */
+	std::size_t capacity(const void* p);
+
+	/**
+	 * Free all cached buffers
+	 */
+	void trim();
+
+	/**
+	 * Limit the number of bytes kept cached. Buffers released past the limit are freed right away. Default is 256 MiB
+	 */
+	void set_limit(std::size_t bytes);
+
+	/**
+	 * Back large buffers with huge pages where the OS allows it. Transparent huge pages on Linux, large pages on
+	 * Windows (needs SeLockMemoryPrivilege). Falls back to regular pages silently. Off by default
+	 */
+	void set_huge_pages(bool enable);
+
+	struct Stats {
+		std::size_t allocs;		 // Pooled allocations made
+		std::size_t reused;		 // ...of which were served from the cache
+		std::size_t cachedBytes; // Bytes currently sitting in the cache
+	};
+
+	Stats stats();
+
+} // namespace imglib::pool
@@ -0,0 +1,163 @@
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <array>
+#include <memory>
+
+#include "cache.hpp"
+
+#include "VTFLib.h"
+
+using namespace cache;
+
+static constexpr auto CRC_TABLE = []()
+{
+	std::array<std::uint32_t, 256> table{};
+	for (std::uint32_t i = 0; i < 256; ++i) {
+		std::uint32_t c = i;
+		for (int k = 0; k < 8; ++k)
+			c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+		table[i] = c;
+	}
+	return table;
+}();
+
+std::uint32_t cache::crc32(const void* data, std::size_t len, std::uint32_t crc) {
+	auto* p = static_cast<const std::uint8_t*>(data);
+	crc = ~crc;
+	for (std::size_t i = 0; i < len; ++i)
+		crc = CRC_TABLE[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+std::uint64_t cache::fnv1a(const void* data, std::size_t len, std::uint64_t hash) {
+	auto* p = static_cast<const std::uint8_t*>(data);
+	for (std::size_t i = 0; i < len; ++i) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+bool cache::hash_file(const std::filesystem::path& path, Key& key) {
+	FILE* fp = fopen(path.string().c_str(), "rb");
+	if (!fp)
+		return false;
+
+	// Stream the file through, we never need the whole thing in memory
+	auto buf = std::make_unique<std::uint8_t[]>(64 * 1024);
+	std::size_t read;
+	while ((read = fread(buf.get(), 1, 64 * 1024, fp)) > 0) {
+		key.src = fnv1a(buf.get(), read, key.src);
+		key.crc = crc32(buf.get(), read, key.crc);
+	}
+
+	bool ok = !ferror(fp);
+	fclose(fp);
+	return ok;
+}
+
+void cache::hash_data(const void* data, std::size_t size, Key& key) {
+	key.src = fnv1a(data, size, key.src);
+	key.crc = crc32(data, size, key.crc);
+}
+
+std::string BuildCache::normalize(const std::filesystem::path& path) {
+	std::error_code ec;
+	auto abs = std::filesystem::absolute(path, ec);
+	return (ec ? path : abs).lexically_normal().generic_string();
+}
+
+bool BuildCache::load(const std::filesystem::path& manifest) {
+	std::lock_guard lock(mutex_);
+	path_ = manifest;
+	entries_.clear();
+	dirty_ = false;
+
+	std::ifstream stream(manifest);
+	if (!stream.good())
+		return !std::filesystem::exists(manifest);
+
+	// Each line is: <source hash> <option hash> <source crc> <output path>
+	std::string line;
+	while (std::getline(stream, line)) {
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		std::istringstream ls(line);
+		Key key;
+		std::string output;
+		ls >> std::hex >> key.src >> key.opts >> key.crc;
+		if (ls.fail())
+			continue;
+
+		std::getline(ls >> std::ws, output);
+		if (!output.empty())
+			entries_[output] = key;
+	}
+	return true;
+}
+
+bool BuildCache::save() {
+	std::lock_guard lock(mutex_);
+	if (!dirty_ || path_.empty())
+		return true;
+
+	// Written to a temporary and renamed over the old manifest, so a crash or full disk halfway through leaves the last
+	// good manifest in place instead of a truncated one
+	auto tmpPath = path_;
+	tmpPath += ".tmp";
+	std::ofstream stream(tmpPath, std::ios::out | std::ios::trunc);
+	if (!stream.good())
+		return false;
+
+	stream << "# vtex2 build cache\n";
+	for (auto& [output, key] : entries_)
+		stream << std::hex << key.src << ' ' << key.opts << ' ' << key.crc << ' ' << output << '\n';
+	stream.flush();
+	stream.close();
+
+	std::error_code ec;
+	if (stream.fail() || (std::filesystem::rename(tmpPath, path_, ec), ec)) {
+		std::filesystem::remove(tmpPath, ec);
+		return false;
+	}
+
+	dirty_ = false;
+	return true;
+}
+
+bool BuildCache::up_to_date(const std::filesystem::path& output, const Key& key) const {
+	{
+		std::lock_guard lock(mutex_);
+		auto it = entries_.find(normalize(output));
+		if (it == entries_.end() || !(it->second == key))
+			return false;
+	}
+
+	if (!std::filesystem::exists(output))
+		return false;
+
+	if (output.extension() != ".vtf")
+		return true;
+
+	// Make sure the VTF on disk is really the one we built, in case something else has written over it
+	VTFLib::CVTFFile file;
+	if (!file.Load(output.string().c_str(), true))
+		return false;
+
+	// Pre-7.3 files have nowhere to put the CRC, so there's nothing to check. Any other VTF we built carries one, so
+	// if it's missing, something else wrote the file
+	if (!key.crc || !file.GetSupportsResources())
+		return true;
+
+	vlUInt size = 0;
+	auto* crc = static_cast<const std::uint32_t*>(file.GetResourceData(VTF_RSRC_CRC, size));
+	return crc && size >= sizeof(std::uint32_t) && *crc == key.crc;
+}
+
+void BuildCache::update(const std::filesystem::path& output, const Key& key) {
+	std::lock_guard lock(mutex_);
+	entries_[normalize(output)] = key;
+	dirty_ = true;
+}
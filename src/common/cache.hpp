@@ -0,0 +1,98 @@
+/**
+ * cache.hpp - Incremental build cache
+ *
+ * The cache is a manifest on disk that maps each output file to a hash of the source data and the options that were
+ * used to produce it. If neither have changed since the last run, the output can be skipped entirely.
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+
+namespace cache
+{
+
+	/**
+	 * Standard CRC32 (IEEE 802.3), as stored in the VTF_RSRC_CRC resource
+	 * @param crc Previous CRC, allows the CRC to be computed over several calls
+	 */
+	std::uint32_t crc32(const void* data, std::size_t len, std::uint32_t crc = 0);
+
+	/**
+	 * 64-bit FNV-1a hash
+	 * @param hash Previous hash, allows the hash to be computed over several calls
+	 */
+	inline constexpr std::uint64_t FNV_OFFSET = 0xcbf29ce484222325ull;
+	std::uint64_t fnv1a(const void* data, std::size_t len, std::uint64_t hash = FNV_OFFSET);
+
+	inline std::uint64_t fnv1a(const std::string& str, std::uint64_t hash = FNV_OFFSET) {
+		return fnv1a(str.data(), str.size(), hash);
+	}
+
+	/**
+	 * Key identifying a set of inputs into a build step
+	 */
+	struct Key {
+		std::uint64_t src = FNV_OFFSET; // Hash of all source file bytes
+		std::uint64_t opts = 0;			// Hash of all effective options
+		std::uint32_t crc = 0;			// CRC32 of the source bytes, embedded into the VTF
+
+		bool operator==(const Key& other) const {
+			return src == other.src && opts == other.opts && crc == other.crc;
+		}
+	};
+
+	/**
+	 * Hash the contents of a file into key. Multiple files may be hashed into the same key
+	 * Returns false if the file could not be read
+	 */
+	bool hash_file(const std::filesystem::path& path, Key& key);
+
+	/**
+	 * Same as hash_file, for file contents that are already in memory
+	 */
+	void hash_data(const void* data, std::size_t size, Key& key);
+
+	/**
+	 * Manifest of everything built so far
+	 * All methods are thread safe
+	 */
+	class BuildCache {
+	public:
+		/**
+		 * Load the manifest from disk. A missing manifest is not an error, it'll be created on save
+		 */
+		bool load(const std::filesystem::path& manifest);
+
+		/**
+		 * Write the manifest back to disk, if anything changed.
+		 * The old manifest is only replaced once the new one has been written in full
+		 */
+		bool save();
+
+		/**
+		 * Returns true if output was last built with the same key, and still exists on disk.
+		 * If the output is a VTF with an embedded source CRC, the CRC must match as well. Only the VTF header is
+		 * read for this check, never the image data.
+		 */
+		bool up_to_date(const std::filesystem::path& output, const Key& key) const;
+
+		/**
+		 * Record that output has been built with key
+		 */
+		void update(const std::filesystem::path& output, const Key& key);
+
+	private:
+		static std::string normalize(const std::filesystem::path& path);
+
+		std::filesystem::path path_;
+		std::unordered_map<std::string, Key> entries_;
+		mutable std::mutex mutex_;
+		bool dirty_ = false;
+	};
+
+} // namespace cache
@@ -3,30 +3,44 @@
 #include "util.hpp"
 #include "strtools.hpp"
 #include "lwiconv.hpp"
+#include "pipeline.hpp"
+#include "bufferpool.hpp"
+#include "mapped_file.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <cstring>
 #include <cassert>
+#include <utility>
 
 // STB stuff
+// Decoded images become our image buffers directly, so stb allocates out of the pool too
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
+#define STBI_MALLOC(sz) imglib::pool::alloc(sz)
+#define STBI_REALLOC(p, newsz) imglib::pool::realloc(p, newsz)
+#define STBI_FREE(p) imglib::pool::release(p)
+#define STBIW_MALLOC(sz) imglib::pool::alloc(sz)
+#define STBIW_REALLOC(p, newsz) imglib::pool::realloc(p, newsz)
+#define STBIW_FREE(p) imglib::pool::release(p)
 #include "stb/stb_image.h"
 #include "stb/stb_image_write.h"
 #include "stb/stb_image_resize.h"
 
 using namespace imglib;
 
-static ImageInfo_t image_info(FILE* fp);
+static ChannelType probe_channel_type(const stbi_uc* data, int size);
 
 inline void* imgalloc(ChannelType type, int channels, int w, int h) {
-	return malloc(imglib::bytes_for_image(w, h, type, channels));
+	return pool::alloc(imglib::bytes_for_image(w, h, type, channels));
 }
 
 Image::Image(void* data, ChannelType type, int channels, int w, int h, bool wrap)
 	: m_width(w),
 	  m_height(h),
-	  m_type(type),
-	  m_comps(channels) {
+	  m_comps(channels),
+	  m_type(type) {
 	if (wrap) {
 		m_data = data;
 		m_owned = false;
@@ -40,110 +54,183 @@ Image::Image(void* data, ChannelType type, int channels, int w, int h, bool wrap
 Image::Image(ChannelType type, int channels, int w, int h, bool clear)
 	: m_width(w),
 	  m_height(h),
-	  m_type(type),
-	  m_comps(channels) {
+	  m_comps(channels),
+	  m_type(type) {
 	const auto size = imglib::bytes_for_image(w, h, type, channels);
-	m_data = malloc(size);
+	m_data = pool::alloc(size);
 	if (clear)
 		memset(m_data, 0, size);
 }
 
 Image::~Image() {
 	if (m_owned)
-		free(m_data);
+		pool::release(m_data);
 }
 
 std::shared_ptr<Image> Image::load(const char* path, ChannelType convertOnLoad) {
-	FILE* fp = fopen(path, "rb");
-	if (!fp)
+	util::MappedFile file;
+	if (!file.open(path))
 		return nullptr;
-	auto img = load(fp, convertOnLoad);
-	fclose(fp);
-	return img;
+	return load(file.data(), file.size(), convertOnLoad);
 }
 
 std::shared_ptr<Image> Image::load(FILE* fp, ChannelType convertOnLoad) {
-	auto info = image_info(fp);
+	std::vector<std::uint8_t> data;
+	if (!util::read_stream(fp, data))
+		return nullptr;
+	return load(data.data(), data.size(), convertOnLoad);
+}
+
+std::shared_ptr<Image> Image::load(const void* data, size_t size, ChannelType convertOnLoad) {
+	if (!data || !size || size > size_t(INT32_MAX))
+		return nullptr;
+
+	const auto* buf = static_cast<const stbi_uc*>(data);
+	const int len = static_cast<int>(size);
+
+	// The decoder reports the size and channel count itself, only the channel type has to be known up front
+	const auto type = probe_channel_type(buf, len);
 	auto image = std::make_shared<Image>();
-	if (info.type == ChannelType::Float) {
-		image->m_data = stbi_loadf_from_file(fp, &image->m_width, &image->m_height, &image->m_comps, 0);
+	if (type == ChannelType::Float) {
+		image->m_data = stbi_loadf_from_memory(buf, len, &image->m_width, &image->m_height, &image->m_comps, 0);
 	}
-	else if (info.type == ChannelType::UInt16) {
-		image->m_data = stbi_load_from_file_16(fp, &image->m_width, &image->m_height, &image->m_comps, 0);
+	else if (type == ChannelType::UInt16) {
+		image->m_data = stbi_load_16_from_memory(buf, len, &image->m_width, &image->m_height, &image->m_comps, 0);
 	}
 	else {
-		image->m_data = stbi_load_from_file(fp, &image->m_width, &image->m_height, &image->m_comps, info.comps);
+		image->m_data = stbi_load_from_memory(buf, len, &image->m_width, &image->m_height, &image->m_comps, 0);
 	}
-	image->m_type = info.type;
+	image->m_type = type;
 
 	if (!image->m_data)
 		return nullptr;
 
-	if (convertOnLoad != ChannelType::None && convertOnLoad != info.type)
+	if (convertOnLoad != ChannelType::None && convertOnLoad != type)
 		if (!image->convert(convertOnLoad))
 			return nullptr;	// Convert on load failed
 
 	return image;
 }
 
+std::vector<std::shared_ptr<Image>> Image::load_frames(const void* data, size_t size, ChannelType convertOnLoad) {
+	std::vector<std::shared_ptr<Image>> frames;
+	if (!data || !size || size > size_t(INT32_MAX))
+		return frames;
+
+	const auto* buf = static_cast<const stbi_uc*>(data);
+	const int len = static_cast<int>(size);
+	if (len < 4 || memcmp(buf, "GIF8", 4)) {
+		if (auto image = load(data, size, convertOnLoad))
+			frames.push_back(std::move(image));
+		return frames;
+	}
+
+	// stb composites the frames for us, so each one is a full image rather than a patch over the previous one
+	int* delays = nullptr;
+	int w, h, count, comps;
+	auto* pixels = stbi_load_gif_from_memory(buf, len, &delays, &w, &h, &count, &comps, 4);
+	STBI_FREE(delays);
+	if (!pixels)
+		return frames;
+
+	const size_t frameSize = bytes_for_image(w, h, ChannelType::UInt8, 4);
+	for (int i = 0; i < count; ++i) {
+		auto image = std::make_shared<Image>(pixels + i * frameSize, ChannelType::UInt8, 4, w, h, false);
+		if (convertOnLoad != ChannelType::None && convertOnLoad != ChannelType::UInt8 && !image->convert(convertOnLoad)) {
+			frames.clear();
+			break;
+		}
+		frames.push_back(std::move(image));
+	}
+	STBI_FREE(pixels);
+	return frames;
+}
+
 void Image::clear() {
 	if (m_owned)
-		free(m_data);
+		pool::release(m_data);
 	m_data = nullptr;
 }
 
 bool Image::save(const char* file, FileFormat format) {
-	if (!file || !m_data || (format != Tga && format != Png && format != Jpeg && format != Bmp && format != Hdr))
+	if (!file)
+		return false;
+
+	FILE* fp = fopen(file, "wb");
+	if (!fp)
+		return false;
+
+	bool bOk = save(
+		[fp](const void* data, size_t size)
+		{
+			fwrite(data, 1, size, fp);
+		},
+		format);
+
+	bOk &= !ferror(fp);
+	bOk &= fclose(fp) == 0;
+	return bOk;
+}
+
+bool Image::save(const WriteFn& write, FileFormat format) {
+	if (!m_data || (format != Tga && format != Png && format != Jpeg && format != Bmp && format != Hdr))
 		return false;
 
+	// stb hands us the encoded file in chunks
+	const auto writeFunc = [](void* context, void* data, int size)
+	{
+		(*static_cast<const WriteFn*>(context))(data, size_t(size));
+	};
+	void* ctx = const_cast<WriteFn*>(&write);
+
 	bool bOk = false;
 	if (format == Hdr) {
 		// Convert if necessary. Needs to be float for HDR
 		auto* dataToUse = m_data;
 		bool dataIsOurs = false;
 		if (m_type != ChannelType::Float) {
-			dataToUse = malloc(m_width * m_height * sizeof(float) * m_comps);
+			dataToUse = imgalloc(ChannelType::Float, m_comps, m_width, m_height);
 			dataIsOurs = true;
 			if (!convert_formats(m_data, dataToUse, m_type, ChannelType::Float, m_width, m_height, m_comps, m_comps, pixel_size(), imglib::pixel_size(ChannelType::Float, m_comps))) {
-				free(dataToUse);
+				pool::release(dataToUse);
 				return false;
 			}
 		}
 
-		bOk |= !!stbi_write_hdr(file, m_width, m_height, m_comps, (const float*)dataToUse);
+		bOk |= !!stbi_write_hdr_to_func(writeFunc, ctx, m_width, m_height, m_comps, (const float*)dataToUse);
 
 		if (dataIsOurs)
-			free(dataToUse);
+			pool::release(dataToUse);
 	}
 	else {
 		// Convert to RGBX8 if not already in that format - required for the other writers
 		auto* dataToUse = m_data;
 		bool dataIsOurs = false;
 		if (m_type != ChannelType::UInt8) {
-			dataToUse = malloc(m_width * m_height * sizeof(uint8_t) * m_comps);
+			dataToUse = imgalloc(ChannelType::UInt8, m_comps, m_width, m_height);
 			dataIsOurs = true;
 			if (!convert_formats(m_data, dataToUse, m_type, ChannelType::UInt8, m_width, m_height, m_comps, m_comps, pixel_size(), imglib::pixel_size(ChannelType::UInt8, m_comps))) {
-				free(dataToUse);
+				pool::release(dataToUse);
 				return false;
 			}
 		}
 
 		// Write the stuff out
 		if (format == Png) {
-			bOk = !!stbi_write_png(file, m_width, m_height, m_comps, dataToUse, 0);
+			bOk = !!stbi_write_png_to_func(writeFunc, ctx, m_width, m_height, m_comps, dataToUse, 0);
 		}
 		else if (format == Tga) {
-			bOk = !!stbi_write_tga(file, m_width, m_height, m_comps, dataToUse);
+			bOk = !!stbi_write_tga_to_func(writeFunc, ctx, m_width, m_height, m_comps, dataToUse);
 		}
 		else if (format == Jpeg) {
-			bOk = !!stbi_write_jpg(file, m_width, m_height, m_comps, dataToUse, 100);
+			bOk = !!stbi_write_jpg_to_func(writeFunc, ctx, m_width, m_height, m_comps, dataToUse, 100);
 		}
 		else if (format == Bmp) {
-			bOk = !!stbi_write_bmp(file, m_width, m_height, m_comps, dataToUse);
+			bOk = !!stbi_write_bmp_to_func(writeFunc, ctx, m_width, m_height, m_comps, dataToUse);
 		}
 
 		if (dataIsOurs)
-			free(dataToUse);
+			pool::release(dataToUse);
 	}
 
 	return bOk;
@@ -155,8 +242,10 @@ bool Image::resize(int newW, int newH) {
 		return false;
 
 	// Free old data
-	free(m_data);
+	if (m_owned)
+		pool::release(m_data);
 	m_data = newData;
+	m_owned = true;
 	m_width = newW;
 	m_height = newH;
 	return true;
@@ -170,40 +259,86 @@ VTFImageFormat Image::vtf_format() const {
 		case ChannelType::Float:
 			return (m_comps == 3) ? IMAGE_FORMAT_RGB323232F
 								  : (m_comps == 1 ? IMAGE_FORMAT_R32F : IMAGE_FORMAT_RGBA32323232F);
+		case ChannelType::Half:
+			return IMAGE_FORMAT_RGBA16161616F; // The only half format VTF has
 		default:
+			if (m_comps == 2)
+				return IMAGE_FORMAT_IA88;
 			return (m_comps == 3) ? IMAGE_FORMAT_RGB888 : (m_comps == 1 ? IMAGE_FORMAT_I8 : IMAGE_FORMAT_RGBA8888);
 	}
 }
 
 bool imglib::resize(
 	void* indata, void** useroutdata, ChannelType srcType, int comps, int w, int h, int newW, int newH) {
-	stbir_datatype type;
-	switch (srcType) {
+	void* outdata = imgalloc(srcType, comps, newW, newH);
+
+	// Error :(
+	if (!resize_into(indata, outdata, srcType, comps, w, h, newW, newH)) {
+		pool::release(outdata);
+		return false;
+	}
+
+	*useroutdata = outdata;
+	return true;
+}
+
+static stbir_datatype stbir_type(ChannelType type) {
+	switch (type) {
 		case ChannelType::Float:
-			type = STBIR_TYPE_FLOAT;
-			break;
+			return STBIR_TYPE_FLOAT;
 		case ChannelType::UInt16:
-			type = STBIR_TYPE_UINT16;
-			break;
+			return STBIR_TYPE_UINT16;
 		default:
-			type = STBIR_TYPE_UINT8;
-			break;
+			return STBIR_TYPE_UINT8;
 	}
+}
+
+//
+// stb has no half support, so half images are resized as float. Converts indata to float, calls resize with
+// the float data and a float output buffer, then converts the result back into outdata
+//
+template <typename Fn>
+static bool resize_half(const void* indata, void* outdata, int comps, int w, int h, int newW, int outH, Fn&& resize) {
+	void* in = imgalloc(ChannelType::Float, comps, w, h);
+	void* out = imgalloc(ChannelType::Float, comps, newW, outH);
+	lwiconv::convert_generic<lwiconv::half, float>(indata, in, w, h, comps, comps);
+	const bool ok = resize(in, out);
+	if (ok)
+		lwiconv::convert_generic<float, lwiconv::half>(out, outdata, newW, outH, comps, comps);
+	pool::release(in);
+	pool::release(out);
+	return ok;
+}
 
-	void* outdata = malloc(bytes_for_image(newW, newH, srcType, comps));
+bool imglib::resize_into(
+	const void* indata, void* outdata, ChannelType srcType, int comps, int w, int h, int newW, int newH) {
+	if (srcType == ChannelType::Half) {
+		return resize_half(
+			indata, outdata, comps, w, h, newW, newH,
+			[&](const void* in, void* out) { return resize_into(in, out, ChannelType::Float, comps, w, h, newW, newH); });
+	}
 
-	int ret = stbir_resize(
-		indata, w, h, 0, outdata, newW, newH, 0, type, comps, comps > 3, STBIR_FLAG_ALPHA_PREMULTIPLIED,
+	return !!stbir_resize(
+		indata, w, h, 0, outdata, newW, newH, 0, stbir_type(srcType), comps, comps > 3, STBIR_FLAG_ALPHA_PREMULTIPLIED,
 		STBIR_EDGE_CLAMP, STBIR_EDGE_CLAMP, STBIR_FILTER_DEFAULT, STBIR_FILTER_DEFAULT, STBIR_COLORSPACE_LINEAR,
 		nullptr);
-	// Error :(
-	if (!ret) {
-		free(outdata);
-		return false;
+}
+
+bool imglib::resize_rows(
+	const void* indata, void* outdata, ChannelType srcType, int comps, int w, int h, int newW, int newH, int firstRow,
+	int numRows) {
+	if (srcType == ChannelType::Half) {
+		return resize_half(
+			indata, outdata, comps, w, h, newW, numRows,
+			[&](const void* in, void* out)
+			{ return resize_rows(in, out, ChannelType::Float, comps, w, h, newW, newH, firstRow, numRows); });
 	}
 
-	*useroutdata = outdata;
-	return true;
+	// Same scale as the full resize, with the output window shifted down to firstRow
+	return !!stbir_resize_subpixel(
+		indata, w, h, 0, outdata, newW, numRows, 0, stbir_type(srcType), comps, comps > 3,
+		STBIR_FLAG_ALPHA_PREMULTIPLIED, STBIR_EDGE_CLAMP, STBIR_EDGE_CLAMP, STBIR_FILTER_DEFAULT, STBIR_FILTER_DEFAULT,
+		STBIR_COLORSPACE_LINEAR, nullptr, float(newW) / w, float(newH) / h, 0.f, float(firstRow));
 }
 
 size_t imglib::bytes_for_image(int w, int h, ChannelType type, int comps) {
@@ -213,58 +348,53 @@ size_t imglib::bytes_for_image(int w, int h, ChannelType type, int comps) {
 			bpc = 4;
 			break;
 		case ChannelType::UInt16:
+		case ChannelType::Half:
 			bpc = 2;
 			break;
 		default:
 			bpc = 1;
 			break;
 	}
-	return w * h * comps * bpc;
+	return size_t(w) * h * comps * bpc;
+}
+
+template <typename Tin>
+static bool convert_formats_from(
+	const void* srcData, void* dstData, ChannelType dstChanType, int w, int h, int inComps, int outComps, int inStride,
+	int outStride, const lwiconv::PixelF& pdef) {
+	switch (dstChanType) {
+		case ChannelType::UInt8:
+			lwiconv::convert_generic<Tin, uint8_t>(srcData, dstData, w, h, inComps, outComps, inStride, outStride, pdef);
+			return true;
+		case ChannelType::UInt16:
+			lwiconv::convert_generic<Tin, uint16_t>(srcData, dstData, w, h, inComps, outComps, inStride, outStride, pdef);
+			return true;
+		case ChannelType::Float:
+			lwiconv::convert_generic<Tin, float>(srcData, dstData, w, h, inComps, outComps, inStride, outStride, pdef);
+			return true;
+		case ChannelType::Half:
+			lwiconv::convert_generic<Tin, lwiconv::half>(
+				srcData, dstData, w, h, inComps, outComps, inStride, outStride, pdef);
+			return true;
+		default:
+			return false;
+	}
 }
 
 bool convert_formats_internal(
 	const void* srcData, void* dstData, ChannelType srcChanType, ChannelType dstChanType, int w, int h, int inComps, int outComps, int inStride, int outStride, const lwiconv::PixelF& pdef) {
-
-	if (srcChanType == ChannelType::UInt8) {
-		// RGBX32
-		if (dstChanType == ChannelType::Float)
-			lwiconv::convert_generic<uint8_t, float>(srcData, dstData, w, h, inComps, outComps, inStride, outStride, pdef);
-		// RGBX16
-		else if (dstChanType == ChannelType::UInt16)
-			lwiconv::convert_generic<uint8_t, uint16_t>(srcData, dstData, w, h, inComps, outComps, inStride, outStride, pdef);
-		// RGBX8 (just adding/removing channel(s))
-		else if (dstChanType == ChannelType::UInt8)
-			lwiconv::convert_generic<uint8_t, uint8_t>(srcData, dstData, w, h, inComps, outComps, inStride, outStride, pdef);
-		return true;
-	}
-	// RGBX32 -> RGBX[8|16]
-	else if (srcChanType == ChannelType::Float) {
-		// RGBX16
-		if (dstChanType == ChannelType::UInt16)
-			lwiconv::convert_generic<float, uint16_t>(srcData, dstData, w, h, inComps, outComps, inStride, outStride, pdef);
-		// RGBX8
-		else if (dstChanType == ChannelType::UInt8)
-			lwiconv::convert_generic<float, uint8_t>(srcData, dstData, w, h, inComps, outComps, inStride, outStride, pdef);
-		// RGBX32 (just adding/removing channel(s))
-		else if (dstChanType == ChannelType::Float)
-			lwiconv::convert_generic<float, float>(srcData, dstData, w, h, inComps, outComps, inStride, outStride, pdef);
-		return true;
-	}
-	// RGBX16 -> RGBX[8|32F]
-	else if (srcChanType == ChannelType::UInt16) {
-		// RGBX8
-		if (dstChanType == ChannelType::UInt8)
-			lwiconv::convert_generic<uint16_t, uint8_t>(srcData, dstData, w, h, inComps, outComps, inStride, outStride, pdef);
-		// RGBX32
-		else if (dstChanType == ChannelType::Float)
-			lwiconv::convert_generic<uint16_t, float>(srcData, dstData, w, h, inComps, outComps, inStride, outStride, pdef);
-		// RGBX16 (just adding/removing channel(s))
-		else if (dstChanType == ChannelType::UInt16)
-			lwiconv::convert_generic<uint16_t, uint16_t>(srcData, dstData, w, h, inComps, outComps, inStride, outStride, pdef);
-		return true;
+	switch (srcChanType) {
+		case ChannelType::UInt8:
+			return convert_formats_from<uint8_t>(srcData, dstData, dstChanType, w, h, inComps, outComps, inStride, outStride, pdef);
+		case ChannelType::UInt16:
+			return convert_formats_from<uint16_t>(srcData, dstData, dstChanType, w, h, inComps, outComps, inStride, outStride, pdef);
+		case ChannelType::Float:
+			return convert_formats_from<float>(srcData, dstData, dstChanType, w, h, inComps, outComps, inStride, outStride, pdef);
+		case ChannelType::Half:
+			return convert_formats_from<lwiconv::half>(srcData, dstData, dstChanType, w, h, inComps, outComps, inStride, outStride, pdef);
+		default:
+			return false;
 	}
-
-	return false;
 }
 
 bool imglib::convert_formats(
@@ -278,15 +408,21 @@ bool imglib::convert_formats(
 
 bool Image::convert(ChannelType dstChanType, int channels, const lwiconv::PixelF& pdef) {
 	channels = channels <= 0 ? m_comps : channels;
-	void* dst = malloc(imglib::bytes_for_image(m_width, m_height, m_type, channels));
+	if (dstChanType == m_type && channels == m_comps)
+		return true;
 
-	if (!convert_formats(m_data, dst, m_type, dstChanType, m_width, m_height, m_comps, channels, pixel_size(), channels * channel_size(dstChanType), pdef)) {
-		free(dst);
+	void* dst = imgalloc(dstChanType, channels, m_width, m_height);
+	if (!Pipeline().convert(dstChanType, channels, pdef).run(*this, dst)) {
+		pool::release(dst);
 		return false;
 	}
 
-	free(m_data);
+	if (m_owned)
+		pool::release(m_data);
 	m_data = dst;
+	m_owned = true;
+	m_type = dstChanType;
+	m_comps = channels;
 	return true;
 }
 
@@ -299,31 +435,179 @@ constexpr uint16_t FULL_VAL<uint16_t> = UINT16_MAX;
 template <>
 constexpr uint8_t FULL_VAL<uint8_t> = UINT8_MAX;
 
-template <class T>
-static bool process_image_internal(void* indata, int comps, int w, int h, ProcFlags flags) {
-	T* data = static_cast<T*>(indata);
-	for (int i = 0; i < w * h * comps; i += comps) {
-		T* cur = data + i;
-		if (flags & PROC_GL_TO_DX_NORM)
-			cur[1] = FULL_VAL<T> - cur[1]; // Invert green channel
+namespace
+{
+	// The ops that need the pixel as float. These are contiguous so a combination of them can index a kernel table
+	constexpr int FLOAT_OPS_SHIFT = 5;
+	constexpr ProcFlags FLOAT_OPS = PROC_SRGB_TO_LINEAR | PROC_RENORMALIZE | PROC_PREMULTIPLY_ALPHA | PROC_LINEAR_TO_SRGB;
+	constexpr int NUM_FLOAT_KERNELS = (FLOAT_OPS >> FLOAT_OPS_SHIFT) + 1;
+	static_assert(FLOAT_OPS == ProcFlags(NUM_FLOAT_KERNELS - 1) << FLOAT_OPS_SHIFT);
+
+	//
+	// Swizzle and inverts, resolved from the flags once per call
+	//
+	struct ChannelOps {
+		int swizzle[MAX_CHANNELS];
+		bool invert[MAX_CHANNELS];
+		bool any;
+	};
+
+	ChannelOps channel_ops(ProcFlags flags, int comps) {
+		ChannelOps ops{{0, 1, 2, 3}, {}, false};
+		if (flags & PROC_SWIZZLE) {
+			for (int c = 0; c < comps; ++c) {
+				const int src = (flags >> (16 + c * 2)) & 3;
+				ops.swizzle[c] = src < comps ? src : c;
+				ops.any |= ops.swizzle[c] != c;
+			}
+		}
+
+		const bool invert[MAX_CHANNELS] = {
+			!!(flags & PROC_INVERT_R), !!(flags & (PROC_INVERT_G | PROC_GL_TO_DX_NORM)), !!(flags & PROC_INVERT_B),
+			!!(flags & PROC_INVERT_A)};
+		for (int c = 0; c < comps; ++c) {
+			ops.invert[c] = invert[c];
+			ops.any |= invert[c];
+		}
+		return ops;
 	}
-	return true;
-}
 
-bool Image::process(ProcFlags flags) {
-	switch (m_type) {
+	float srgb_to_linear(float v) {
+		return v <= 0.04045f ? v / 12.92f : std::pow((v + 0.055f) / 1.055f, 2.4f);
+	}
+
+	float linear_to_srgb(float v) {
+		v = std::clamp(v, 0.f, 1.f);
+		return v <= 0.0031308f ? v * 12.92f : 1.055f * std::pow(v, 1.f / 2.4f) - 0.055f;
+	}
+
+	// Integer formats round to nearest here, so ops that don't change a value like premultiplying by 1 are lossless
+	template <class T>
+	T store(float v) {
+		if constexpr (std::is_integral_v<T>)
+			return T(lwiconv::detail::saturate(v) * FULL_VAL<T> + 0.5f);
+		else
+			return lwiconv::detail::fromfloat<T>(v);
+	}
+
+	//
+	// Swizzle + invert only. Exact for every integer and float type, and simple enough for the compiler to vectorize
+	//
+	template <class T, int COMPS>
+	void process_channels(void* indata, size_t pixels, const ChannelOps& ops) {
+		T* data = static_cast<T*>(indata);
+		for (size_t i = 0; i < pixels; ++i, data += COMPS) {
+			T px[COMPS];
+			for (int c = 0; c < COMPS; ++c)
+				px[c] = data[ops.swizzle[c]];
+			for (int c = 0; c < COMPS; ++c)
+				data[c] = ops.invert[c] ? T(FULL_VAL<T> - px[c]) : px[c];
+		}
+	}
+
+	//
+	// Everything else. One instance per combination of float ops, so only the ops asked for are in the loop
+	//
+	template <class T, int COMPS, ProcFlags FLAGS>
+	void process_pixels(void* indata, size_t pixels, const ChannelOps& ops) {
+		constexpr bool rgb = COMPS >= 3;
+		constexpr int alpha = (COMPS == 2 || COMPS == 4) ? COMPS - 1 : -1;
+
+		T* data = static_cast<T*>(indata);
+		for (size_t i = 0; i < pixels; ++i, data += COMPS) {
+			float px[COMPS];
+			for (int c = 0; c < COMPS; ++c) {
+				px[c] = lwiconv::detail::tofloat(data[ops.swizzle[c]]);
+				if (ops.invert[c])
+					px[c] = 1.f - px[c];
+			}
+
+			if constexpr ((FLAGS & PROC_SRGB_TO_LINEAR) && rgb)
+				for (int c = 0; c < 3; ++c)
+					px[c] = srgb_to_linear(px[c]);
+
+			if constexpr ((FLAGS & PROC_RENORMALIZE) && rgb) {
+				const float x = px[0] * 2.f - 1.f, y = px[1] * 2.f - 1.f, z = px[2] * 2.f - 1.f;
+				const float len = std::sqrt(x * x + y * y + z * z);
+				if (len > 1e-6f) {
+					px[0] = x / len * 0.5f + 0.5f;
+					px[1] = y / len * 0.5f + 0.5f;
+					px[2] = z / len * 0.5f + 0.5f;
+				}
+			}
+
+			if constexpr ((FLAGS & PROC_PREMULTIPLY_ALPHA) && alpha >= 0)
+				for (int c = 0; c < alpha; ++c)
+					px[c] *= px[alpha];
+
+			if constexpr ((FLAGS & PROC_LINEAR_TO_SRGB) && rgb)
+				for (int c = 0; c < 3; ++c)
+					px[c] = linear_to_srgb(px[c]);
+
+			for (int c = 0; c < COMPS; ++c)
+				data[c] = store<T>(px[c]);
+		}
+	}
+
+	using KernelFn = void (*)(void*, size_t, const ChannelOps&);
+
+	template <class T, int COMPS, size_t... I>
+	constexpr std::array<KernelFn, sizeof...(I)> make_kernels(std::index_sequence<I...>) {
+		return {process_pixels<T, COMPS, ProcFlags(I) << FLOAT_OPS_SHIFT>...};
+	}
+
+	template <class T>
+	bool process_typed(void* data, int comps, size_t pixels, ProcFlags flags) {
+		static constexpr std::array<std::array<KernelFn, NUM_FLOAT_KERNELS>, MAX_CHANNELS> kernels = {
+			make_kernels<T, 1>(std::make_index_sequence<NUM_FLOAT_KERNELS>()),
+			make_kernels<T, 2>(std::make_index_sequence<NUM_FLOAT_KERNELS>()),
+			make_kernels<T, 3>(std::make_index_sequence<NUM_FLOAT_KERNELS>()),
+			make_kernels<T, 4>(std::make_index_sequence<NUM_FLOAT_KERNELS>()),
+		};
+
+		if (comps < 1 || comps > MAX_CHANNELS)
+			return false;
+
+		const auto ops = channel_ops(flags, comps);
+		const auto floatOps = (flags & FLOAT_OPS) >> FLOAT_OPS_SHIFT;
+		if (!floatOps && !ops.any)
+			return true;
+
+		// Half has no FULL_VAL, so it always goes through float
+		if constexpr (!std::is_same_v<T, lwiconv::half>) {
+			if (!floatOps) {
+				static constexpr KernelFn channelKernels[MAX_CHANNELS] = {
+					process_channels<T, 1>, process_channels<T, 2>, process_channels<T, 3>, process_channels<T, 4>};
+				channelKernels[comps - 1](data, pixels, ops);
+				return true;
+			}
+		}
+
+		kernels[comps - 1][floatOps](data, pixels, ops);
+		return true;
+	}
+} // namespace
+
+bool imglib::process(void* data, ChannelType type, int comps, size_t pixels, ProcFlags flags) {
+	switch (type) {
 		case ChannelType::UInt8:
-			return process_image_internal<uint8_t>(m_data, m_comps, m_width, m_height, flags);
+			return process_typed<uint8_t>(data, comps, pixels, flags);
 		case ChannelType::UInt16:
-			return process_image_internal<uint16_t>(m_data, m_comps, m_width, m_height, flags);
+			return process_typed<uint16_t>(data, comps, pixels, flags);
 		case ChannelType::Float:
-			return process_image_internal<float>(m_data, m_comps, m_width, m_height, flags);
+			return process_typed<float>(data, comps, pixels, flags);
+		case ChannelType::Half:
+			return process_typed<lwiconv::half>(data, comps, pixels, flags);
 		default:
 			assert(0);
 	}
 	return false;
 }
 
+bool Image::process(ProcFlags flags) {
+	return imglib::process(m_data, m_type, m_comps, size_t(m_width) * m_height, flags);
+}
+
 FileFormat imglib::image_get_format_from_file(const char* str) {
 	auto* ext = str::get_ext(str);
 	return image_get_format(ext);
@@ -368,20 +652,82 @@ const char* imglib::image_get_extension(FileFormat format) {
 	}
 }
 
-static ImageInfo_t image_info(FILE* fp) {
-	ImageInfo_t info{};
-	stbi_info_from_file(fp, &info.w, &info.h, &info.comps);
-	info.frames = 1; // @TODO: animated image support
+//
+// Channel type of an encoded image, from its magic and bit depth alone. stbi_is_16_bit and stbi_is_hdr each run a
+// header parser of their own, which would make the decode the third parse of the header
+//
+static ChannelType probe_channel_type(const stbi_uc* data, int size) {
+	// PNG: bit depth is the first byte after the IHDR's width and height
+	if (size >= 25 && !memcmp(data, "\x89PNG\r\n\x1a\n", 8) && !memcmp(data + 12, "IHDR", 4))
+		return data[24] == 16 ? ChannelType::UInt16 : ChannelType::UInt8;
+	// PSD: big endian bit depth after the signature, version, reserved bytes, channel count and size
+	if (size >= 24 && !memcmp(data, "8BPS", 4))
+		return ((data[22] << 8) | data[23]) == 16 ? ChannelType::UInt16 : ChannelType::UInt8;
+	// Radiance HDR, only a check of the magic
+	if (size >= 2 && data[0] == '#' && data[1] == '?')
+		return stbi_is_hdr_from_memory(data, size) ? ChannelType::Float : ChannelType::UInt8;
+	// PGM/PPM keep their max value in a text header, leave those to stb
+	if (size >= 2 && data[0] == 'P' && (data[1] == '5' || data[1] == '6'))
+		return stbi_is_16_bit_from_memory(data, size) ? ChannelType::UInt16 : ChannelType::UInt8;
+	return ChannelType::UInt8;
+}
 
-	// Determine channel type
-	if (stbi_is_16_bit_from_file(fp))
-		info.type = ChannelType::UInt16;
-	else if (stbi_is_hdr_from_file(fp))
-		info.type = ChannelType::Float;
-	else
-		info.type = ChannelType::UInt8;
+//
+// Count the frames of a GIF by hopping from block to block. Nothing is decompressed
+//
+static int gif_frame_count(const stbi_uc* data, int size) {
+	if (size < 13 || memcmp(data, "GIF8", 4))
+		return 1;
 
-	return info;
+	// Header and logical screen descriptor, then the global color table if there is one
+	int pos = 13;
+	if (data[10] & 0x80)
+		pos += 3 << ((data[10] & 7) + 1);
+
+	const auto skipSubBlocks = [&]
+	{
+		while (pos < size && data[pos])
+			pos += data[pos] + 1;
+		++pos;
+	};
+
+	int frames = 0;
+	while (pos < size) {
+		const int block = data[pos++];
+		if (block == 0x2C) {
+			// Image descriptor, local color table, LZW code size and then the image data
+			if (pos + 9 > size)
+				break;
+			const int flags = data[pos + 8];
+			pos += 9;
+			if (flags & 0x80)
+				pos += 3 << ((flags & 7) + 1);
+			++pos;
+			skipSubBlocks();
+			++frames;
+		}
+		else if (block == 0x21) {
+			++pos; // Extension label
+			skipSubBlocks();
+		}
+		else
+			break; // Trailer
+	}
+	return std::max(frames, 1);
+}
+
+bool imglib::image_info(const void* data, size_t size, ImageInfo_t& info) {
+	if (!data || !size || size > size_t(INT32_MAX))
+		return false;
+
+	const auto* buf = static_cast<const stbi_uc*>(data);
+	const int len = static_cast<int>(size);
+	info = {};
+	if (!stbi_info_from_memory(buf, len, &info.w, &info.h, &info.comps))
+		return false;
+	info.frames = gif_frame_count(buf, len);
+	info.type = probe_channel_type(buf, len);
+	return true;
 }
 
 size_t imglib::pixel_size(ChannelType type, int channels) {
@@ -393,6 +739,7 @@ size_t imglib::channel_size(ChannelType type) {
 	case imglib::ChannelType::UInt8:
 		return 1;
 	case imglib::ChannelType::UInt16:
+	case imglib::ChannelType::Half:
 		return 2;
 	case imglib::ChannelType::Float:
 		return 4;
@@ -4,7 +4,10 @@
 #pragma once
 
 #include <filesystem>
+#include <functional>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "lwiconv.hpp"
 
@@ -22,7 +25,8 @@ namespace imglib
 		None = -1,
 		UInt8,
 		UInt16,
-		Float // Generally a linear FP number (32-BPC)
+		Float, // Generally a linear FP number (32-BPC)
+		Half   // Linear FP number like Float, but 16-BPC. Stored as lwiconv::half
 	};
 
 	/**
@@ -46,8 +50,31 @@ namespace imglib
 		ChannelType type; // Per-channel type
 	};
 
+	/**
+	 * Per-pixel processing ops. Any combination can be applied in a single pass, in this order:
+	 * swizzle, channel inverts, sRGB -> linear, renormalize, premultiply alpha, linear -> sRGB
+	 * Channels are numbered as stored, so for 2 channel data the alpha is channel 1 (G)
+	 */
 	using ProcFlags = uint32_t;
-	inline constexpr ProcFlags PROC_GL_TO_DX_NORM = (1 << 0);
+	inline constexpr ProcFlags PROC_GL_TO_DX_NORM = (1 << 0); // Flip green, same as PROC_INVERT_G
+	inline constexpr ProcFlags PROC_INVERT_R = (1 << 1);
+	inline constexpr ProcFlags PROC_INVERT_G = (1 << 2);
+	inline constexpr ProcFlags PROC_INVERT_B = (1 << 3);
+	inline constexpr ProcFlags PROC_INVERT_A = (1 << 4);
+	inline constexpr ProcFlags PROC_SRGB_TO_LINEAR = (1 << 5);	  // RGB only, for 3 and 4 channel data
+	inline constexpr ProcFlags PROC_RENORMALIZE = (1 << 6);		  // Rescale normal map vectors to unit length
+	inline constexpr ProcFlags PROC_PREMULTIPLY_ALPHA = (1 << 7); // For 2 and 4 channel data
+	inline constexpr ProcFlags PROC_LINEAR_TO_SRGB = (1 << 8);	  // RGB only, for 3 and 4 channel data
+	inline constexpr ProcFlags PROC_SWIZZLE = (1 << 9);			  // Reorder channels, see proc_swizzle
+
+	/**
+	 * Returns the flags for a swizzle. Each parameter is the source channel for that output channel, so
+	 * proc_swizzle(2, 1, 0, 3) swaps red and blue. Sources past the image's channel count leave the channel as is
+	 */
+	constexpr ProcFlags proc_swizzle(int r, int g, int b, int a) {
+		return PROC_SWIZZLE | ProcFlags(r & 3) << 16 | ProcFlags(g & 3) << 18 | ProcFlags(b & 3) << 20 |
+			   ProcFlags(a & 3) << 22;
+	}
 
 	/**
 	 * Returns the number of bytes per pixel for the format
@@ -66,7 +93,8 @@ namespace imglib
 		/**
 		 * Given some data, create an image around it.
 		 * @param wrapData If true, we will act as a wrapper around *data. Thus, *data MUST be valid for the lifetime of
-		 * this object. if this is false, we'll malloc our own data and copy *data into that buffer
+		 * this object. if this is false, we'll allocate our own data from the buffer pool and copy *data into that
+		 * buffer
 		 */
 		Image(void* data, ChannelType type, int channels, int w, int h, bool wrapData = false);
 
@@ -84,20 +112,31 @@ namespace imglib
 
 		/**
 		 * Loads the image from the specified file
-		 * Optionally FILE* can be specified directly
+		 * Optionally FILE* can be specified directly. Either way, the file is read into memory once and decoded from
+		 * there, so its header is only ever parsed by the decoder itself
 		 */
 		static std::shared_ptr<Image> load(const char* file, ChannelType convertOnLoad = ChannelType::None);
 		static std::shared_ptr<Image> load(FILE* fp, ChannelType convertOnLoad = ChannelType::None);
 
+		/**
+		 * Loads the image from an encoded file in memory, such as one read from stdin
+		 */
+		static std::shared_ptr<Image> load(const void* data, size_t size, ChannelType convertOnLoad = ChannelType::None);
+
+		/**
+		 * Loads every frame of an animated GIF from an encoded file in memory, as RGBA8888. Anything else is loaded
+		 * like load does, as a single frame. Returns an empty list on failure
+		 */
+		static std::vector<std::shared_ptr<Image>>
+		load_frames(const void* data, size_t size, ChannelType convertOnLoad = ChannelType::None);
+
 		/**
 		 * @brief Clear internal data store, frees up some memory
 		 */
 		void clear();
 
 		/**
-		 * Apply processing effects to the image
-		 * Right now this only handles GL -> DX transforms, but more processing flags may be added in the future
-		 * Ideally all processing will be done in one go
+		 * Apply processing effects to the image, all in one go. See ProcFlags
 		 */
 		bool process(ProcFlags flags);
 
@@ -108,6 +147,13 @@ namespace imglib
 		 */
 		bool save(const char* path, FileFormat format);
 
+		/**
+		 * Encodes the image and hands the encoded file to write, in one or more chunks
+		 * Useful for writing to memory or stdout without going through a temporary file
+		 */
+		using WriteFn = std::function<void(const void* data, size_t size)>;
+		bool save(const WriteFn& write, FileFormat format);
+
 		/**
 		 * Resize the image in-place
 		 * @param w New width
@@ -204,10 +250,30 @@ namespace imglib
 
 	/**
 	 * Resize an image
-	 * Variant for raw data
+	 * Variant for raw data. *outData is allocated from the buffer pool, free it with pool::release
 	 */
 	bool resize(void* data, void** outData, ChannelType type, int channels, int w, int h, int newW, int newH);
 
+	/**
+	 * Resize an image into a caller provided buffer
+	 * outData must be at least bytes_for_image(newW, newH, type, channels) bytes
+	 */
+	bool resize_into(const void* data, void* outData, ChannelType type, int channels, int w, int h, int newW, int newH);
+
+	/**
+	 * Resize an image, producing only output rows [firstRow, firstRow + numRows)
+	 * outData must be at least bytes_for_image(newW, numRows, type, channels) bytes. Bands produced this way are
+	 * identical to the same rows of a full resize_into
+	 */
+	bool resize_rows(
+		const void* data, void* outData, ChannelType type, int channels, int w, int h, int newW, int newH, int firstRow,
+		int numRows);
+
+	/**
+	 * Apply processing effects to pixels of raw image data, in place. See Image::process
+	 */
+	bool process(void* data, ChannelType type, int channels, size_t pixels, ProcFlags flags);
+
 	/**
 	 * Return the number of bytes needed for the specified image
 	 */
@@ -215,14 +281,19 @@ namespace imglib
 
 	/**
 	 * Color conversion routines
-	 * names are formatted as convert_srcFormat_dstFormat
-	 * convert_formats can be used to convert between the 3 formats assuming they have the same
-	 * component count. @TODO: remove this restriction!
+	 * convert_formats converts between any two channel types, adding or removing channels as needed
 	 */
 
 	bool convert_formats(
 		const void* srcData, void* dstData, ChannelType srcChanType, ChannelType dstChanType, int w, int h, int inComps, int outComps, int inStride, int outStride, const lwiconv::PixelF& pdefaults = {0, 0, 0, 1});
 
+	/**
+	 * Read the size, channel count and channel type of an encoded image from a single parse of its header. Nothing is
+	 * decoded, so this is cheap enough to run over whole directories
+	 * @returns false if the data isn't an image that can be loaded
+	 */
+	bool image_info(const void* data, size_t size, ImageInfo_t& info);
+
 	/**
 	 * Get a compatible VTF image format for the image data
 	 */
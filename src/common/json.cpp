@@ -0,0 +1,308 @@
+#include <cctype>
+#include <cstdio>
+#include <string>
+
+#include "json.hpp"
+
+using namespace json;
+
+namespace
+{
+	class Parser {
+	public:
+		explicit Parser(const std::string& text)
+			: m_text(text) {
+		}
+
+		bool parse(Value& out, std::string& err) {
+			if (!value(out, 0)) {
+				err = std::string(m_err) + " at offset " + std::to_string(m_pos);
+				return false;
+			}
+			skip_ws();
+			if (m_pos != m_text.size()) {
+				err = "Trailing characters at offset " + std::to_string(m_pos);
+				return false;
+			}
+			return true;
+		}
+
+	private:
+		static constexpr int MAX_DEPTH = 32;
+
+		void skip_ws() {
+			while (m_pos < m_text.size() && (m_text[m_pos] == ' ' || m_text[m_pos] == '\t' || m_text[m_pos] == '\r' ||
+											 m_text[m_pos] == '\n'))
+				++m_pos;
+		}
+
+		bool fail(const char* err) {
+			m_err = err;
+			return false;
+		}
+
+		bool literal(const char* lit) {
+			const auto len = std::char_traits<char>::length(lit);
+			if (m_text.compare(m_pos, len, lit) != 0)
+				return fail("Invalid literal");
+			m_pos += len;
+			return true;
+		}
+
+		bool value(Value& out, int depth) {
+			if (depth > MAX_DEPTH)
+				return fail("Nested too deeply");
+
+			skip_ws();
+			if (m_pos >= m_text.size())
+				return fail("Unexpected end of input");
+
+			const auto start = m_pos;
+			bool ok;
+			switch (m_text[m_pos]) {
+				case '{':
+					out.type = Value::Type::Object;
+					ok = object(out, depth);
+					break;
+				case '[':
+					out.type = Value::Type::Array;
+					ok = array(out, depth);
+					break;
+				case '"':
+					out.type = Value::Type::String;
+					ok = string(out.str);
+					break;
+				case 't':
+					out.type = Value::Type::Bool;
+					ok = literal("true");
+					break;
+				case 'f':
+					out.type = Value::Type::Bool;
+					ok = literal("false");
+					break;
+				case 'n':
+					out.type = Value::Type::Null;
+					ok = literal("null");
+					break;
+				default:
+					out.type = Value::Type::Number;
+					ok = number();
+					break;
+			}
+
+			out.raw = m_text.substr(start, m_pos - start);
+			if (out.type == Value::Type::Number || out.type == Value::Type::Bool)
+				out.str = out.raw;
+			return ok;
+		}
+
+		bool object(Value& out, int depth) {
+			++m_pos; // {
+			skip_ws();
+			if (m_pos < m_text.size() && m_text[m_pos] == '}') {
+				++m_pos;
+				return true;
+			}
+
+			while (true) {
+				skip_ws();
+				std::string key;
+				if (m_pos >= m_text.size() || m_text[m_pos] != '"' || !string(key))
+					return fail("Expected a string key");
+
+				skip_ws();
+				if (m_pos >= m_text.size() || m_text[m_pos] != ':')
+					return fail("Expected ':'");
+				++m_pos;
+
+				Value v;
+				if (!value(v, depth + 1))
+					return false;
+				out.members.emplace_back(std::move(key), std::move(v));
+
+				skip_ws();
+				if (m_pos < m_text.size() && m_text[m_pos] == ',') {
+					++m_pos;
+					continue;
+				}
+				if (m_pos < m_text.size() && m_text[m_pos] == '}') {
+					++m_pos;
+					return true;
+				}
+				return fail("Expected ',' or '}'");
+			}
+		}
+
+		bool array(Value& out, int depth) {
+			++m_pos; // [
+			skip_ws();
+			if (m_pos < m_text.size() && m_text[m_pos] == ']') {
+				++m_pos;
+				return true;
+			}
+
+			while (true) {
+				Value v;
+				if (!value(v, depth + 1))
+					return false;
+				out.items.push_back(std::move(v));
+
+				skip_ws();
+				if (m_pos < m_text.size() && m_text[m_pos] == ',') {
+					++m_pos;
+					continue;
+				}
+				if (m_pos < m_text.size() && m_text[m_pos] == ']') {
+					++m_pos;
+					return true;
+				}
+				return fail("Expected ',' or ']'");
+			}
+		}
+
+		bool number() {
+			const auto start = m_pos;
+			while (m_pos < m_text.size() && (isdigit((unsigned char)m_text[m_pos]) || m_text[m_pos] == '-' ||
+											 m_text[m_pos] == '+' || m_text[m_pos] == '.' || m_text[m_pos] == 'e' ||
+											 m_text[m_pos] == 'E'))
+				++m_pos;
+			return m_pos != start || fail("Unexpected character");
+		}
+
+		void append_utf8(std::string& out, unsigned cp) {
+			if (cp < 0x80)
+				out += char(cp);
+			else if (cp < 0x800) {
+				out += char(0xC0 | (cp >> 6));
+				out += char(0x80 | (cp & 0x3F));
+			}
+			else if (cp < 0x10000) {
+				out += char(0xE0 | (cp >> 12));
+				out += char(0x80 | ((cp >> 6) & 0x3F));
+				out += char(0x80 | (cp & 0x3F));
+			}
+			else {
+				out += char(0xF0 | (cp >> 18));
+				out += char(0x80 | ((cp >> 12) & 0x3F));
+				out += char(0x80 | ((cp >> 6) & 0x3F));
+				out += char(0x80 | (cp & 0x3F));
+			}
+		}
+
+		bool hex4(unsigned& out) {
+			if (m_pos + 4 > m_text.size())
+				return fail("Truncated \\u escape");
+			out = 0;
+			for (int i = 0; i < 4; ++i) {
+				const char c = m_text[m_pos++];
+				out <<= 4;
+				if (c >= '0' && c <= '9')
+					out |= c - '0';
+				else if (c >= 'a' && c <= 'f')
+					out |= c - 'a' + 10;
+				else if (c >= 'A' && c <= 'F')
+					out |= c - 'A' + 10;
+				else
+					return fail("Invalid \\u escape");
+			}
+			return true;
+		}
+
+		bool string(std::string& out) {
+			++m_pos; // "
+			while (m_pos < m_text.size()) {
+				const char c = m_text[m_pos++];
+				if (c == '"')
+					return true;
+				if (c != '\\') {
+					out += c;
+					continue;
+				}
+
+				if (m_pos >= m_text.size())
+					break;
+				switch (const char e = m_text[m_pos++]) {
+					case '"':
+					case '\\':
+					case '/':
+						out += e;
+						break;
+					case 'b':
+						out += '\b';
+						break;
+					case 'f':
+						out += '\f';
+						break;
+					case 'n':
+						out += '\n';
+						break;
+					case 'r':
+						out += '\r';
+						break;
+					case 't':
+						out += '\t';
+						break;
+					case 'u':
+						{
+							unsigned cp;
+							if (!hex4(cp))
+								return false;
+							// Surrogate pair
+							if (cp >= 0xD800 && cp < 0xDC00 && m_text.compare(m_pos, 2, "\\u") == 0) {
+								m_pos += 2;
+								unsigned lo;
+								if (!hex4(lo))
+									return false;
+								cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+							}
+							append_utf8(out, cp);
+							break;
+						}
+					default:
+						return fail("Invalid escape");
+				}
+			}
+			return fail("Unterminated string");
+		}
+
+		const std::string& m_text;
+		std::size_t m_pos = 0;
+		const char* m_err = "";
+	};
+
+} // namespace
+
+bool json::parse(const std::string& text, Value& out, std::string& err) {
+	Parser parser(text);
+	return parser.parse(out, err);
+}
+
+std::string json::escape(const std::string& str) {
+	std::string out;
+	out.reserve(str.size());
+	for (char c : str) {
+		switch (c) {
+			case '"':
+				out += "\\\"";
+				break;
+			case '\\':
+				out += "\\\\";
+				break;
+			case '\n':
+				out += "\\n";
+				break;
+			case '\t':
+				out += "\\t";
+				break;
+			default:
+				if (static_cast<unsigned char>(c) < 0x20) {
+					char buf[8];
+					snprintf(buf, sizeof(buf), "\\u%04x", c);
+					out += buf;
+				}
+				else
+					out += c;
+		}
+	}
+	return out;
+}
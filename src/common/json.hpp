@@ -0,0 +1,66 @@
+/**
+ * json.hpp - Minimal JSON reader
+ *
+ * Just enough JSON for job files and manifests: objects, arrays, strings, numbers, booleans and null.
+ * Numbers are kept as text, callers convert them as needed.
+ */
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace json
+{
+
+	struct Value {
+		enum class Type {
+			Null,
+			Bool,
+			Number,
+			String,
+			Array,
+			Object,
+		};
+
+		Type type = Type::Null;
+		std::string str; // Decoded string, or the literal text of a number/bool
+		std::string raw; // Source text, so values can be echoed back untouched
+		std::vector<Value> items;
+		std::vector<std::pair<std::string, Value>> members;
+
+		/**
+		 * Look up an object member. Returns nullptr if missing or if this isn't an object
+		 */
+		const Value* find(const std::string& key) const {
+			for (auto& [k, v] : members)
+				if (k == key)
+					return &v;
+			return nullptr;
+		}
+
+		bool is_string() const {
+			return type == Type::String;
+		}
+
+		bool is_array() const {
+			return type == Type::Array;
+		}
+
+		bool is_object() const {
+			return type == Type::Object;
+		}
+	};
+
+	/**
+	 * Parse a complete JSON document
+	 * @param err Set to a description of the problem, including its offset, on failure
+	 */
+	bool parse(const std::string& text, Value& out, std::string& err);
+
+	/**
+	 * Escape str for use inside a JSON string literal
+	 */
+	std::string escape(const std::string& str);
+
+} // namespace json
@@ -0,0 +1,574 @@
+/**
+ * SIMD kernels for lwiconv
+ *
+ * Every kernel here must produce exactly the same output as lwiconv::convert_scalar. To guarantee that, the float
+ * paths perform the same operations in the same order as the scalar code: divide (not multiply by reciprocal) when
+ * normalizing, then saturate, scale and truncate when denormalizing.
+ */
+#include <cstring>
+#include <atomic>
+
+#include "lwiconv.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#	define LWICONV_X86 1
+#	include <immintrin.h>
+#	ifdef _MSC_VER
+#		include <intrin.h>
+#	endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#	define LWICONV_NEON 1
+#	include <arm_neon.h>
+#endif
+
+// GCC and clang need to be told which functions may use AVX2, MSVC allows the intrinsics anywhere
+#if defined(LWICONV_X86) && (defined(__GNUC__) || defined(__clang__))
+#	define LWICONV_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#	define LWICONV_TARGET_AVX2
+#endif
+
+using namespace lwiconv;
+using simd::Level;
+using simd::Type;
+
+namespace
+{
+	//
+	// Used to finish up whatever the vector loops couldn't process
+	//
+	template <typename Tin, typename Tout>
+	void convert_tail(const Tin* in, Tout* out, size_t count) {
+		for (size_t i = 0; i < count; ++i)
+			out[i] = detail::fromfloat<Tout>(detail::tofloat(in[i]));
+	}
+
+	inline void rgb_to_rgba_tail(const uint8_t* in, uint8_t* out, size_t count, uint8_t alpha) {
+		for (size_t i = 0; i < count; ++i, in += 3, out += 4) {
+			out[0] = in[0];
+			out[1] = in[1];
+			out[2] = in[2];
+			out[3] = alpha;
+		}
+	}
+
+	inline void rgba_to_rgb_tail(const uint8_t* in, uint8_t* out, size_t count) {
+		for (size_t i = 0; i < count; ++i, in += 4, out += 3) {
+			out[0] = in[0];
+			out[1] = in[1];
+			out[2] = in[2];
+		}
+	}
+
+	//
+	// Set of kernels for a single SIMD level. Counts are in elements for type conversions, pixels for RGB <-> RGBA
+	//
+	struct Kernels {
+		void (*u8_u16)(const uint8_t*, uint16_t*, size_t);
+		void (*u16_u8)(const uint16_t*, uint8_t*, size_t);
+		void (*u8_f32)(const uint8_t*, float*, size_t);
+		void (*f32_u8)(const float*, uint8_t*, size_t);
+		void (*u16_f32)(const uint16_t*, float*, size_t);
+		void (*f32_u16)(const float*, uint16_t*, size_t);
+		void (*rgb_rgba)(const uint8_t*, uint8_t*, size_t, uint8_t);
+		void (*rgba_rgb)(const uint8_t*, uint8_t*, size_t);
+	};
+
+#ifdef LWICONV_X86
+
+	// RGB <-> RGBA with overlapping 32-bit loads/stores, for tables whose instruction set has no byte shuffle. Plain
+	// C++ with no intrinsics, but the masking assumes a little-endian target
+	void rgb_rgba_scalar(const uint8_t* in, uint8_t* out, size_t n, uint8_t alpha) {
+		const uint32_t a = uint32_t(alpha) << 24;
+		size_t i = 0;
+		for (; i + 2 <= n; ++i) {
+			uint32_t px;
+			std::memcpy(&px, in + i * 3, sizeof(px));
+			px = (px & 0x00FFFFFFu) | a;
+			std::memcpy(out + i * 4, &px, sizeof(px));
+		}
+		rgb_to_rgba_tail(in + i * 3, out + i * 4, n - i, alpha);
+	}
+
+	void rgba_rgb_scalar(const uint8_t* in, uint8_t* out, size_t n) {
+		size_t i = 0;
+		for (; i + 2 <= n; ++i) {
+			// Writes one byte past this pixel, which is overwritten by the next one
+			std::memcpy(out + i * 3, in + i * 4, sizeof(uint32_t));
+		}
+		rgba_to_rgb_tail(in + i * 4, out + i * 3, n - i);
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////
+	// SSE2
+	//////////////////////////////////////////////////////////////////////////////////
+
+	void u8_u16_sse2(const uint8_t* in, uint16_t* out, size_t n) {
+		size_t i = 0;
+		// x * 257 == (x << 8) | x, which is exactly what the float path produces for every 8 bit value
+		for (; i + 16 <= n; i += 16) {
+			const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi8(v, v));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 8), _mm_unpackhi_epi8(v, v));
+		}
+		convert_tail(in + i, out + i, n - i);
+	}
+
+	void u16_u8_sse2(const uint16_t* in, uint8_t* out, size_t n) {
+		const __m128i zero = _mm_setzero_si128();
+		const __m128 norm = _mm_set1_ps(float(UINT16_MAX));
+		const __m128 scale = _mm_set1_ps(float(UINT8_MAX));
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16) {
+			const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+			const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 8));
+			__m128i q[4] = {
+				_mm_unpacklo_epi16(a, zero), _mm_unpackhi_epi16(a, zero), _mm_unpacklo_epi16(b, zero),
+				_mm_unpackhi_epi16(b, zero)};
+			for (auto& v : q)
+				v = _mm_cvttps_epi32(_mm_mul_ps(_mm_div_ps(_mm_cvtepi32_ps(v), norm), scale));
+			const __m128i lo = _mm_packs_epi32(q[0], q[1]);
+			const __m128i hi = _mm_packs_epi32(q[2], q[3]);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(lo, hi));
+		}
+		convert_tail(in + i, out + i, n - i);
+	}
+
+	void u8_f32_sse2(const uint8_t* in, float* out, size_t n) {
+		const __m128i zero = _mm_setzero_si128();
+		const __m128 norm = _mm_set1_ps(float(UINT8_MAX));
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16) {
+			const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+			const __m128i lo = _mm_unpacklo_epi8(v, zero);
+			const __m128i hi = _mm_unpackhi_epi8(v, zero);
+			_mm_storeu_ps(out + i, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), norm));
+			_mm_storeu_ps(out + i + 4, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), norm));
+			_mm_storeu_ps(out + i + 8, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), norm));
+			_mm_storeu_ps(out + i + 12, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), norm));
+		}
+		convert_tail(in + i, out + i, n - i);
+	}
+
+	// Saturate to [0,1] and scale. max_ps returns the second operand for NaN, so NaN becomes 0 like the scalar path
+	inline __m128i denorm_sse2(__m128 v, __m128 scale) {
+		v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.f));
+		return _mm_cvttps_epi32(_mm_mul_ps(v, scale));
+	}
+
+	void f32_u8_sse2(const float* in, uint8_t* out, size_t n) {
+		const __m128 scale = _mm_set1_ps(float(UINT8_MAX));
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16) {
+			const __m128i a = denorm_sse2(_mm_loadu_ps(in + i), scale);
+			const __m128i b = denorm_sse2(_mm_loadu_ps(in + i + 4), scale);
+			const __m128i c = denorm_sse2(_mm_loadu_ps(in + i + 8), scale);
+			const __m128i d = denorm_sse2(_mm_loadu_ps(in + i + 12), scale);
+			_mm_storeu_si128(
+				reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+		}
+		convert_tail(in + i, out + i, n - i);
+	}
+
+	void u16_f32_sse2(const uint16_t* in, float* out, size_t n) {
+		const __m128i zero = _mm_setzero_si128();
+		const __m128 norm = _mm_set1_ps(float(UINT16_MAX));
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+			_mm_storeu_ps(out + i, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)), norm));
+			_mm_storeu_ps(out + i + 4, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)), norm));
+		}
+		convert_tail(in + i, out + i, n - i);
+	}
+
+	void f32_u16_sse2(const float* in, uint16_t* out, size_t n) {
+		const __m128 scale = _mm_set1_ps(float(UINT16_MAX));
+		const __m128i bias32 = _mm_set1_epi32(0x8000);
+		const __m128i bias16 = _mm_set1_epi16(short(0x8000));
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			// SSE2 has no unsigned 32 -> 16 pack, so shift into signed range, pack, and shift back
+			const __m128i a = _mm_sub_epi32(denorm_sse2(_mm_loadu_ps(in + i), scale), bias32);
+			const __m128i b = _mm_sub_epi32(denorm_sse2(_mm_loadu_ps(in + i + 4), scale), bias32);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_xor_si128(_mm_packs_epi32(a, b), bias16));
+		}
+		convert_tail(in + i, out + i, n - i);
+	}
+
+	constexpr Kernels SSE2_KERNELS = {
+		u8_u16_sse2, u16_u8_sse2, u8_f32_sse2, f32_u8_sse2, u16_f32_sse2, f32_u16_sse2, rgb_rgba_scalar, rgba_rgb_scalar,
+	};
+
+	//////////////////////////////////////////////////////////////////////////////////
+	// AVX2
+	//////////////////////////////////////////////////////////////////////////////////
+
+	LWICONV_TARGET_AVX2 void u8_u16_avx2(const uint8_t* in, uint16_t* out, size_t n) {
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16) {
+			const __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_or_si256(v, _mm256_slli_epi16(v, 8)));
+		}
+		convert_tail(in + i, out + i, n - i);
+	}
+
+	LWICONV_TARGET_AVX2 void u16_u8_avx2(const uint16_t* in, uint8_t* out, size_t n) {
+		const __m256 norm = _mm256_set1_ps(float(UINT16_MAX));
+		const __m256 scale = _mm256_set1_ps(float(UINT8_MAX));
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16) {
+			const __m256i a = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+			const __m256i b = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 8)));
+			const __m256i qa = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_div_ps(_mm256_cvtepi32_ps(a), norm), scale));
+			const __m256i qb = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_div_ps(_mm256_cvtepi32_ps(b), norm), scale));
+			const __m128i lo = _mm_packs_epi32(_mm256_castsi256_si128(qa), _mm256_extracti128_si256(qa, 1));
+			const __m128i hi = _mm_packs_epi32(_mm256_castsi256_si128(qb), _mm256_extracti128_si256(qb, 1));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(lo, hi));
+		}
+		convert_tail(in + i, out + i, n - i);
+	}
+
+	LWICONV_TARGET_AVX2 void u8_f32_avx2(const uint8_t* in, float* out, size_t n) {
+		const __m256 norm = _mm256_set1_ps(float(UINT8_MAX));
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16) {
+			const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+			const __m256i a = _mm256_cvtepu8_epi32(v);
+			const __m256i b = _mm256_cvtepu8_epi32(_mm_srli_si128(v, 8));
+			_mm256_storeu_ps(out + i, _mm256_div_ps(_mm256_cvtepi32_ps(a), norm));
+			_mm256_storeu_ps(out + i + 8, _mm256_div_ps(_mm256_cvtepi32_ps(b), norm));
+		}
+		convert_tail(in + i, out + i, n - i);
+	}
+
+	LWICONV_TARGET_AVX2 void f32_u8_avx2(const float* in, uint8_t* out, size_t n) {
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 one = _mm256_set1_ps(1.f);
+		const __m256 scale = _mm256_set1_ps(float(UINT8_MAX));
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16) {
+			const __m256 fa = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(in + i), zero), one);
+			const __m256 fb = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(in + i + 8), zero), one);
+			const __m256i qa = _mm256_cvttps_epi32(_mm256_mul_ps(fa, scale));
+			const __m256i qb = _mm256_cvttps_epi32(_mm256_mul_ps(fb, scale));
+			const __m128i lo = _mm_packs_epi32(_mm256_castsi256_si128(qa), _mm256_extracti128_si256(qa, 1));
+			const __m128i hi = _mm_packs_epi32(_mm256_castsi256_si128(qb), _mm256_extracti128_si256(qb, 1));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(lo, hi));
+		}
+		convert_tail(in + i, out + i, n - i);
+	}
+
+	LWICONV_TARGET_AVX2 void u16_f32_avx2(const uint16_t* in, float* out, size_t n) {
+		const __m256 norm = _mm256_set1_ps(float(UINT16_MAX));
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			const __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+			_mm256_storeu_ps(out + i, _mm256_div_ps(_mm256_cvtepi32_ps(v), norm));
+		}
+		convert_tail(in + i, out + i, n - i);
+	}
+
+	LWICONV_TARGET_AVX2 void f32_u16_avx2(const float* in, uint16_t* out, size_t n) {
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 one = _mm256_set1_ps(1.f);
+		const __m256 scale = _mm256_set1_ps(float(UINT16_MAX));
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			const __m256 f = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(in + i), zero), one);
+			const __m256i q = _mm256_cvttps_epi32(_mm256_mul_ps(f, scale));
+			_mm_storeu_si128(
+				reinterpret_cast<__m128i*>(out + i),
+				_mm_packus_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1)));
+		}
+		convert_tail(in + i, out + i, n - i);
+	}
+
+	LWICONV_TARGET_AVX2 void rgb_rgba_avx2(const uint8_t* in, uint8_t* out, size_t n, uint8_t alpha) {
+		const __m128i shuf = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+		const __m128i amask = _mm_set1_epi32(int(uint32_t(alpha) << 24));
+		size_t i = 0;
+		// 4 pixels per iteration, but each load reads 16 bytes, so keep 6 pixels worth of input in bounds
+		for (; i + 6 <= n; i += 4) {
+			const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i * 3));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 4), _mm_or_si128(_mm_shuffle_epi8(v, shuf), amask));
+		}
+		rgb_to_rgba_tail(in + i * 3, out + i * 4, n - i, alpha);
+	}
+
+	LWICONV_TARGET_AVX2 void rgba_rgb_avx2(const uint8_t* in, uint8_t* out, size_t n) {
+		const __m128i shuf = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+		size_t i = 0;
+		// Each store writes 16 bytes for 12 bytes of output, the extra bytes are overwritten by the next iteration
+		for (; i + 6 <= n; i += 4) {
+			const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i * 4));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 3), _mm_shuffle_epi8(v, shuf));
+		}
+		rgba_to_rgb_tail(in + i * 4, out + i * 3, n - i);
+	}
+
+	constexpr Kernels AVX2_KERNELS = {
+		u8_u16_avx2, u16_u8_avx2, u8_f32_avx2, f32_u8_avx2, u16_f32_avx2, f32_u16_avx2, rgb_rgba_avx2, rgba_rgb_avx2,
+	};
+
+	bool cpu_has_avx2() {
+#	if defined(_MSC_VER) && !defined(__clang__)
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+			return false;
+		__cpuid(info, 1);
+		// OSXSAVE and AVX, then make sure the OS actually saves the YMM registers
+		if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+			return false;
+		if ((_xgetbv(0) & 0x6) != 0x6)
+			return false;
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#	else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+#	endif
+	}
+
+#endif // LWICONV_X86
+
+#ifdef LWICONV_NEON
+
+	//////////////////////////////////////////////////////////////////////////////////
+	// NEON (AArch64 only, we need vdivq_f32)
+	//////////////////////////////////////////////////////////////////////////////////
+
+	void u8_u16_neon(const uint8_t* in, uint16_t* out, size_t n) {
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16) {
+			const uint8x16_t v = vld1q_u8(in + i);
+			const uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+			const uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+			vst1q_u16(out + i, vorrq_u16(lo, vshlq_n_u16(lo, 8)));
+			vst1q_u16(out + i + 8, vorrq_u16(hi, vshlq_n_u16(hi, 8)));
+		}
+		convert_tail(in + i, out + i, n - i);
+	}
+
+	inline uint32x4_t denorm_neon(float32x4_t v, float32x4_t scale) {
+		// maxnm/minnm return the number when one operand is NaN, so NaN becomes 0 like the scalar path
+		v = vminnmq_f32(vmaxnmq_f32(v, vdupq_n_f32(0.f)), vdupq_n_f32(1.f));
+		return vcvtq_u32_f32(vmulq_f32(v, scale));
+	}
+
+	void u16_u8_neon(const uint16_t* in, uint8_t* out, size_t n) {
+		const float32x4_t norm = vdupq_n_f32(float(UINT16_MAX));
+		const float32x4_t scale = vdupq_n_f32(float(UINT8_MAX));
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			const uint16x8_t v = vld1q_u16(in + i);
+			const float32x4_t a = vdivq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(v))), norm);
+			const float32x4_t b = vdivq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(v))), norm);
+			const uint16x8_t q = vcombine_u16(vmovn_u32(denorm_neon(a, scale)), vmovn_u32(denorm_neon(b, scale)));
+			vst1_u8(out + i, vmovn_u16(q));
+		}
+		convert_tail(in + i, out + i, n - i);
+	}
+
+	void u8_f32_neon(const uint8_t* in, float* out, size_t n) {
+		const float32x4_t norm = vdupq_n_f32(float(UINT8_MAX));
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			const uint16x8_t v = vmovl_u8(vld1_u8(in + i));
+			vst1q_f32(out + i, vdivq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(v))), norm));
+			vst1q_f32(out + i + 4, vdivq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(v))), norm));
+		}
+		convert_tail(in + i, out + i, n - i);
+	}
+
+	void f32_u8_neon(const float* in, uint8_t* out, size_t n) {
+		const float32x4_t scale = vdupq_n_f32(float(UINT8_MAX));
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			const uint32x4_t a = denorm_neon(vld1q_f32(in + i), scale);
+			const uint32x4_t b = denorm_neon(vld1q_f32(in + i + 4), scale);
+			vst1_u8(out + i, vmovn_u16(vcombine_u16(vmovn_u32(a), vmovn_u32(b))));
+		}
+		convert_tail(in + i, out + i, n - i);
+	}
+
+	void u16_f32_neon(const uint16_t* in, float* out, size_t n) {
+		const float32x4_t norm = vdupq_n_f32(float(UINT16_MAX));
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			const uint16x8_t v = vld1q_u16(in + i);
+			vst1q_f32(out + i, vdivq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(v))), norm));
+			vst1q_f32(out + i + 4, vdivq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(v))), norm));
+		}
+		convert_tail(in + i, out + i, n - i);
+	}
+
+	void f32_u16_neon(const float* in, uint16_t* out, size_t n) {
+		const float32x4_t scale = vdupq_n_f32(float(UINT16_MAX));
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			const uint32x4_t a = denorm_neon(vld1q_f32(in + i), scale);
+			const uint32x4_t b = denorm_neon(vld1q_f32(in + i + 4), scale);
+			vst1q_u16(out + i, vcombine_u16(vmovn_u32(a), vmovn_u32(b)));
+		}
+		convert_tail(in + i, out + i, n - i);
+	}
+
+	void rgb_rgba_neon(const uint8_t* in, uint8_t* out, size_t n, uint8_t alpha) {
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16) {
+			const uint8x16x3_t v = vld3q_u8(in + i * 3);
+			uint8x16x4_t o;
+			o.val[0] = v.val[0];
+			o.val[1] = v.val[1];
+			o.val[2] = v.val[2];
+			o.val[3] = vdupq_n_u8(alpha);
+			vst4q_u8(out + i * 4, o);
+		}
+		rgb_to_rgba_tail(in + i * 3, out + i * 4, n - i, alpha);
+	}
+
+	void rgba_rgb_neon(const uint8_t* in, uint8_t* out, size_t n) {
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16) {
+			const uint8x16x4_t v = vld4q_u8(in + i * 4);
+			uint8x16x3_t o;
+			o.val[0] = v.val[0];
+			o.val[1] = v.val[1];
+			o.val[2] = v.val[2];
+			vst3q_u8(out + i * 3, o);
+		}
+		rgba_to_rgb_tail(in + i * 4, out + i * 3, n - i);
+	}
+
+	constexpr Kernels NEON_KERNELS = {
+		u8_u16_neon, u16_u8_neon, u8_f32_neon, f32_u8_neon, u16_f32_neon, f32_u16_neon, rgb_rgba_neon, rgba_rgb_neon,
+	};
+
+#endif // LWICONV_NEON
+
+	const Kernels* kernels_for(Level level) {
+		switch (level) {
+#ifdef LWICONV_X86
+			case Level::SSE2:
+				return &SSE2_KERNELS;
+			case Level::AVX2:
+				return &AVX2_KERNELS;
+#endif
+#ifdef LWICONV_NEON
+			case Level::NEON:
+				return &NEON_KERNELS;
+#endif
+			default:
+				return nullptr;
+		}
+	}
+
+	std::atomic<Level> s_level = simd::detect();
+} // namespace
+
+Level simd::detect() {
+#if defined(LWICONV_X86)
+	static const Level best = cpu_has_avx2() ? Level::AVX2 : Level::SSE2;
+	return best;
+#elif defined(LWICONV_NEON)
+	return Level::NEON;
+#else
+	return Level::Scalar;
+#endif
+}
+
+bool simd::supported(Level level) {
+	switch (level) {
+		case Level::Scalar:
+			return true;
+		case Level::SSE2:
+		case Level::AVX2:
+			return kernels_for(level) && int(level) <= int(detect());
+		case Level::NEON:
+			return kernels_for(level) != nullptr;
+		default:
+			return false;
+	}
+}
+
+Level simd::level() {
+	return s_level;
+}
+
+void simd::set_level(Level level) {
+	s_level = supported(level) ? level : detect();
+}
+
+const char* simd::level_name(Level level) {
+	switch (level) {
+		case Level::SSE2:
+			return "SSE2";
+		case Level::AVX2:
+			return "AVX2";
+		case Level::NEON:
+			return "NEON";
+		default:
+			return "Scalar";
+	}
+}
+
+bool simd::convert(
+	const void* in, void* out, size_t pixels, Type inType, Type outType, int inC, int outC,
+	const PixelF& channelDefaults) {
+	const Kernels* k = kernels_for(s_level);
+	if (!k)
+		return false;
+
+	// Channel type conversion with the same layout, we can treat the image as a flat array of elements
+	if (inC == outC) {
+		const size_t n = pixels * inC;
+		if (inType == outType) {
+			const size_t elemSize = inType == Type::UInt8 ? 1 : (inType == Type::Float ? 4 : 2);
+			std::memcpy(out, in, n * elemSize);
+			return true;
+		}
+		if (inType == Type::Half || outType == Type::Half)
+			return false;
+
+		switch (inType) {
+			case Type::UInt8:
+				if (outType == Type::UInt16)
+					k->u8_u16(static_cast<const uint8_t*>(in), static_cast<uint16_t*>(out), n);
+				else
+					k->u8_f32(static_cast<const uint8_t*>(in), static_cast<float*>(out), n);
+				return true;
+			case Type::UInt16:
+				if (outType == Type::UInt8)
+					k->u16_u8(static_cast<const uint16_t*>(in), static_cast<uint8_t*>(out), n);
+				else
+					k->u16_f32(static_cast<const uint16_t*>(in), static_cast<float*>(out), n);
+				return true;
+			case Type::Float:
+				if (outType == Type::UInt8)
+					k->f32_u8(static_cast<const float*>(in), static_cast<uint8_t*>(out), n);
+				else
+					k->f32_u16(static_cast<const float*>(in), static_cast<uint16_t*>(out), n);
+				return true;
+			default:
+				break;
+		}
+		return false;
+	}
+
+	// RGB8 <-> RGBA8
+	if (inType == Type::UInt8 && outType == Type::UInt8) {
+		if (inC == 3 && outC == 4) {
+			const auto alpha = detail::fromfloat<uint8_t>(channelDefaults.d[3]);
+			k->rgb_rgba(static_cast<const uint8_t*>(in), static_cast<uint8_t*>(out), pixels, alpha);
+			return true;
+		}
+		else if (inC == 4 && outC == 3) {
+			k->rgba_rgb(static_cast<const uint8_t*>(in), static_cast<uint8_t*>(out), pixels);
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -1,11 +1,14 @@
 /**
  * lwiconv: Lightweight Image Conversion library.
- * Not designed to be particularly fast, just simple.
+ * The generic path is designed to be simple rather than fast. The most common conversions have SIMD kernels
+ * (see lwiconv.cpp) which are picked at runtime and produce bit-identical results to the generic path.
  */
 #pragma once
 
 #include <cstdint>
 #include <cstddef>
+#include <cstring>
+#include <type_traits>
 
 namespace lwiconv
 {
@@ -18,6 +21,73 @@ struct PixelF {
 	float d[MAX_CHANNELS];
 };
 
+/**
+ * IEEE 754 half precision float, as stored in RGBA16161616F. Storage only, all math happens in float
+ */
+struct half {
+	uint16_t bits;
+};
+
+inline float half_to_float(half h) {
+	const uint32_t sign = uint32_t(h.bits & 0x8000) << 16;
+	const uint32_t exp = (h.bits >> 10) & 0x1F;
+	const uint32_t mant = h.bits & 0x3FF;
+
+	uint32_t bits;
+	if (exp == 0x1F) // Inf/NaN
+		bits = sign | 0x7F800000 | (mant << 13);
+	else if (exp != 0) // Normal
+		bits = sign | ((exp + 112) << 23) | (mant << 13);
+	else if (mant == 0) // Zero
+		bits = sign;
+	else {
+		// Denormal, renormalize it
+		int e = -1;
+		uint32_t m = mant;
+		do {
+			++e;
+			m <<= 1;
+		} while (!(m & 0x400));
+		bits = sign | uint32_t(112 - e) << 23 | ((m & 0x3FF) << 13);
+	}
+
+	float f;
+	std::memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+// Rounds to nearest even, values out of range become infinity
+inline half float_to_half(float f) {
+	uint32_t bits;
+	std::memcpy(&bits, &f, sizeof(bits));
+	const uint16_t sign = uint16_t((bits >> 16) & 0x8000);
+	const uint32_t absBits = bits & 0x7FFFFFFF;
+
+	if (absBits >= 0x7F800000) // Inf/NaN, keep NaNs quiet
+		return {uint16_t(sign | 0x7C00 | (absBits > 0x7F800000 ? 0x200 : 0))};
+	if (absBits >= 0x477FF000) // Rounds up past the largest half
+		return {uint16_t(sign | 0x7C00)};
+	if (absBits < 0x38800000) {
+		// Denormal or zero. Shift the mantissa (with its implicit 1) into place and round
+		if (absBits < 0x33000000)
+			return {sign};
+		const uint32_t shift = 126 - (absBits >> 23);
+		const uint32_t mant = (absBits & 0x7FFFFF) | 0x800000;
+		uint32_t h = mant >> shift;
+		const uint32_t rem = mant & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+		if (rem > halfway || (rem == halfway && (h & 1)))
+			++h;
+		return {uint16_t(sign | h)};
+	}
+
+	// Normal. Rebias the exponent and round the mantissa, carries ripple into the exponent as they should
+	uint32_t h = ((absBits >> 13) - (112 << 10));
+	const uint32_t rem = absBits & 0x1FFF;
+	if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+		++h;
+	return {uint16_t(sign | h)};
+}
+
 namespace detail {
 
 template <typename T>
@@ -35,21 +105,36 @@ template<> inline float tofloat<float>(const float& t) {
 	return t;
 }
 
+template<> inline float tofloat<half>(const half& t) {
+	return half_to_float(t);
+}
+
 template <typename T>
 inline T fromfloat(float p);
 
+// Clamp to [0,1], NaN becomes 0. Matches the behavior of the SIMD min/max sequence exactly
+inline float saturate(float p) {
+	p = p > 0.f ? p : 0.f;
+	return p < 1.f ? p : 1.f;
+}
+
 template<> inline uint8_t fromfloat<uint8_t>(float p) {
-	return uint8_t(p * UINT8_MAX);
+	return uint8_t(saturate(p) * UINT8_MAX);
 }
 
 template<> inline uint16_t fromfloat<uint16_t>(float p) {
-	return uint16_t(p * UINT16_MAX);
+	return uint16_t(saturate(p) * UINT16_MAX);
 }
 
 template<> inline float fromfloat<float>(float p) {
 	return p;
 }
 
+// Like float, not clamped
+template<> inline half fromfloat<half>(float p) {
+	return float_to_half(p);
+}
+
 template <typename T, int COMPS>
 inline PixelF pixel_from_data(const T* pin, const PixelF& defs) {
 	if constexpr (COMPS == 1)
@@ -88,21 +173,72 @@ inline void pixel_to_data(T* pout, const PixelF& p) {
 }
 
 /**
- * \brief Convert buffer from one color format to another
- * The input and output buffers are assumed to be the same dimensions.
- * \param in Pointer to the input buffer
- * \param out Pointer to the output buffer
- * \param w Width of the image
- * \param h Height of the image
- * \param inC Number of input channels
- * \param outC Number of output channels
- * \param inStride Input stride, in bytes. If set <= 0, it will be computed for you based on inC 
- * \param outStride Output stride, in bytes. If set <= 0, it will be computed for you based on outC
- * \param channelDefaults If inC < outC, the missing channel data from each input pixel will be defaulted to this. For example, if you're converting from
- *  an RGB_888 -> RGBA_8888 image, supplying {0,0,0,1} here will default the resulting alpha channel to 255
+ * SIMD acceleration for the common conversions
+ */
+namespace simd {
+
+enum class Level {
+	Scalar,
+	SSE2,
+	AVX2,
+	NEON,
+};
+
+/**
+ * Returns the best SIMD level supported by this CPU
+ */
+Level detect();
+
+/**
+ * Returns true if the CPU can run kernels at the specified level
+ */
+bool supported(Level level);
+
+/**
+ * Get/set the active SIMD level. Defaults to detect().
+ * Setting Level::Scalar disables the SIMD kernels entirely, mainly useful for testing
+ */
+Level level();
+void set_level(Level level);
+
+const char* level_name(Level level);
+
+enum class Type {
+	UInt8,
+	UInt16,
+	Float,
+	Half,
+};
+
+template <typename T>
+constexpr Type type_of() {
+	if constexpr (std::is_same_v<T, uint8_t>)
+		return Type::UInt8;
+	else if constexpr (std::is_same_v<T, uint16_t>)
+		return Type::UInt16;
+	else if constexpr (std::is_same_v<T, half>)
+		return Type::Half;
+	else {
+		static_assert(std::is_same_v<T, float>);
+		return Type::Float;
+	}
+}
+
+/**
+ * Convert tightly packed pixel data using the active SIMD kernels.
+ * Handles any channel type conversion where inC == outC, plus RGB8 <-> RGBA8. Half only has a kernel for copies.
+ * Returns false if there is no kernel for this conversion, in which case nothing was written.
+ */
+bool convert(const void* in, void* out, size_t pixels, Type inType, Type outType, int inC, int outC, const PixelF& channelDefaults);
+
+}
+
+/**
+ * \brief Reference implementation of convert_generic, one pixel at a time through PixelF
+ * Parameters are the same as convert_generic. Mainly exposed so the SIMD kernels can be checked against it
  */
 template <typename Tin, typename Tout>
-static void convert_generic(const void* in, void* out, int w, int h, int inC, int outC, int inStride = -1, int outStride = -1, const PixelF& channelDefaults = {0,0,0,0}) {
+static void convert_scalar(const void* in, void* out, int w, int h, int inC, int outC, int inStride = -1, int outStride = -1, const PixelF& channelDefaults = {0,0,0,0}) {
 	const Tin* pin = static_cast<const Tin*>(in);
 	Tout* pout = static_cast<Tout*>(out);
 
@@ -130,7 +266,7 @@ static void convert_generic(const void* in, void* out, int w, int h, int inC, in
 	};
 	const fnOutConv outConv = outConvFuncs[outC-1];
 
-	const size_t target = w * h;
+	const size_t target = size_t(w) * h;
 	const size_t isb = inStride / sizeof(Tin);
 	const size_t osb = outStride / sizeof(Tout);
 
@@ -138,4 +274,34 @@ static void convert_generic(const void* in, void* out, int w, int h, int inC, in
 		outConv(pout, inConv(pin, channelDefaults));
 }
 
+/**
+ * \brief Convert buffer from one color format to another
+ * The input and output buffers are assumed to be the same dimensions.
+ * \param in Pointer to the input buffer
+ * \param out Pointer to the output buffer
+ * \param w Width of the image
+ * \param h Height of the image
+ * \param inC Number of input channels
+ * \param outC Number of output channels
+ * \param inStride Input stride, in bytes. If set <= 0, it will be computed for you based on inC 
+ * \param outStride Output stride, in bytes. If set <= 0, it will be computed for you based on outC
+ * \param channelDefaults If inC < outC, the missing channel data from each input pixel will be defaulted to this. For example, if you're converting from
+ *  an RGB_888 -> RGBA_8888 image, supplying {0,0,0,1} here will default the resulting alpha channel to 255
+ */
+template <typename Tin, typename Tout>
+static void convert_generic(const void* in, void* out, int w, int h, int inC, int outC, int inStride = -1, int outStride = -1, const PixelF& channelDefaults = {0,0,0,0}) {
+	// Compute stride if not provided
+	if (inStride <= 0)
+		inStride = inC * sizeof(Tin);
+	if (outStride <= 0)
+		outStride = outC * sizeof(Tout);
+
+	// The SIMD kernels only deal with tightly packed data
+	if (inStride == int(inC * sizeof(Tin)) && outStride == int(outC * sizeof(Tout))
+		&& simd::convert(in, out, size_t(w) * h, simd::type_of<Tin>(), simd::type_of<Tout>(), inC, outC, channelDefaults))
+		return;
+
+	convert_scalar<Tin, Tout>(in, out, w, h, inC, outC, inStride, outStride, channelDefaults);
+}
+
 } // lwiconv
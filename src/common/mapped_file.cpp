@@ -0,0 +1,166 @@
+#include <cstdio>
+#include <utility>
+
+#include "mapped_file.hpp"
+#include "util.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace util;
+
+MappedFile::~MappedFile() {
+	close();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept {
+	swap(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+	if (this != &other) {
+		close();
+		swap(other);
+	}
+	return *this;
+}
+
+void MappedFile::swap(MappedFile& other) noexcept {
+	std::swap(m_data, other.m_data);
+	std::swap(m_size, other.m_size);
+	std::swap(m_mapped, other.m_mapped);
+	std::swap(m_buffer, other.m_buffer);
+#ifdef _WIN32
+	std::swap(m_mapping, other.m_mapping);
+#endif
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string& path) {
+	close();
+
+	HANDLE file = CreateFileA(
+		path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart <= 0) {
+		CloseHandle(file);
+		return false;
+	}
+
+	// The view keeps the file alive, so both handles can be closed once it's mapped
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (!mapping)
+		return read_fallback(path);
+
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!view) {
+		CloseHandle(mapping);
+		return read_fallback(path);
+	}
+
+	m_mapping = mapping;
+	m_data = static_cast<const std::uint8_t*>(view);
+	m_size = static_cast<std::size_t>(size.QuadPart);
+	m_mapped = true;
+	return true;
+}
+
+void MappedFile::close() {
+	if (m_mapped) {
+		UnmapViewOfFile(m_data);
+		CloseHandle(m_mapping);
+	}
+	m_mapping = nullptr;
+	m_buffer.clear();
+	m_buffer.shrink_to_fit();
+	m_data = nullptr;
+	m_size = 0;
+	m_mapped = false;
+}
+
+#else
+
+bool MappedFile::open(const std::string& path) {
+	close();
+
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		::close(fd);
+		return false;
+	}
+
+	// Pipes and character devices report no useful size, so read those instead
+	if (!S_ISREG(st.st_mode)) {
+		::close(fd);
+		return read_fallback(path);
+	}
+
+	if (st.st_size <= 0) {
+		::close(fd);
+		return false;
+	}
+
+	// The mapping holds its own reference to the file, so the descriptor is not needed afterwards
+	void* view = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (view == MAP_FAILED)
+		return read_fallback(path);
+
+	// Files are almost always parsed front to back, let the kernel read ahead aggressively
+	madvise(view, st.st_size, MADV_SEQUENTIAL);
+
+	m_data = static_cast<const std::uint8_t*>(view);
+	m_size = static_cast<std::size_t>(st.st_size);
+	m_mapped = true;
+	return true;
+}
+
+void MappedFile::close() {
+	if (m_mapped)
+		munmap(const_cast<std::uint8_t*>(m_data), m_size);
+	m_buffer.clear();
+	m_buffer.shrink_to_fit();
+	m_data = nullptr;
+	m_size = 0;
+	m_mapped = false;
+}
+
+#endif
+
+//
+// Read the whole file into memory, for anything that can't be mapped
+//
+bool MappedFile::read_fallback(const std::string& path) {
+	FILE* fp = fopen(path.c_str(), "rb");
+	if (!fp)
+		return false;
+
+	const bool ok = read_stream(fp, m_buffer) && !m_buffer.empty();
+	fclose(fp);
+	if (!ok) {
+		m_buffer.clear();
+		return false;
+	}
+
+	m_data = m_buffer.data();
+	m_size = m_buffer.size();
+	m_mapped = false;
+	return true;
+}
@@ -0,0 +1,71 @@
+/**
+ * mapped_file.hpp - Read-only memory mapped files
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace util
+{
+
+	/**
+	 * Read-only view of a whole file.
+	 * The file is memory mapped where possible, so nothing is read until it's touched and the pages are backed by the
+	 * page cache instead of our heap. If the file can't be mapped (pipes, some network filesystems) it is read into
+	 * memory instead, which is transparent to the user of this class.
+	 */
+	class MappedFile {
+	public:
+		MappedFile() = default;
+		explicit MappedFile(const std::string& path) {
+			open(path);
+		}
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+		MappedFile(MappedFile&& other) noexcept;
+		MappedFile& operator=(MappedFile&& other) noexcept;
+
+		/**
+		 * Map the file at path, closing any previously mapped file.
+		 * Returns false if the file could not be opened or is empty
+		 */
+		bool open(const std::string& path);
+
+		void close();
+
+		const std::uint8_t* data() const {
+			return m_data;
+		}
+
+		std::size_t size() const {
+			return m_size;
+		}
+
+		bool is_mapped() const {
+			return m_mapped;
+		}
+
+		explicit operator bool() const {
+			return m_data != nullptr;
+		}
+
+	private:
+		bool read_fallback(const std::string& path);
+		void swap(MappedFile& other) noexcept;
+
+		const std::uint8_t* m_data = nullptr;
+		std::size_t m_size = 0;
+		bool m_mapped = false;
+		std::vector<std::uint8_t> m_buffer; // Only used by the fallback path
+
+#ifdef _WIN32
+		void* m_mapping = nullptr;
+#endif
+	};
+
+} // namespace util
@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "metrics.hpp"
+#include "parallel.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#	define METRICS_SSE2 1
+#	include <emmintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#	define METRICS_NEON 1
+#	include <arm_neon.h>
+#endif
+
+using namespace imglib;
+
+namespace
+{
+	// SSIM stabilizers for a peak of 1: (0.01 * L)^2 and (0.03 * L)^2
+	constexpr float SSIM_C1 = 0.01f * 0.01f;
+	constexpr float SSIM_C2 = 0.03f * 0.03f;
+
+	constexpr int WINDOW = 8;
+	constexpr int WINDOW_STEP = 4;
+
+	//
+	// One RGBA pixel, with a channel per lane. SSE2 and NEON are baseline on every target that has them, so
+	// there's no need for the runtime dispatch lwiconv does
+	//
+	struct Vec4 {
+#if defined(METRICS_SSE2)
+		__m128 v;
+		static Vec4 zero() { return {_mm_setzero_ps()}; }
+		static Vec4 set(float f) { return {_mm_set1_ps(f)}; }
+		static Vec4 load(const float* p) { return {_mm_loadu_ps(p)}; }
+		void store(float* p) const { _mm_storeu_ps(p, v); }
+		friend Vec4 operator+(Vec4 a, Vec4 b) { return {_mm_add_ps(a.v, b.v)}; }
+		friend Vec4 operator-(Vec4 a, Vec4 b) { return {_mm_sub_ps(a.v, b.v)}; }
+		friend Vec4 operator*(Vec4 a, Vec4 b) { return {_mm_mul_ps(a.v, b.v)}; }
+		friend Vec4 operator/(Vec4 a, Vec4 b) { return {_mm_div_ps(a.v, b.v)}; }
+#elif defined(METRICS_NEON)
+		float32x4_t v;
+		static Vec4 zero() { return {vdupq_n_f32(0)}; }
+		static Vec4 set(float f) { return {vdupq_n_f32(f)}; }
+		static Vec4 load(const float* p) { return {vld1q_f32(p)}; }
+		void store(float* p) const { vst1q_f32(p, v); }
+		friend Vec4 operator+(Vec4 a, Vec4 b) { return {vaddq_f32(a.v, b.v)}; }
+		friend Vec4 operator-(Vec4 a, Vec4 b) { return {vsubq_f32(a.v, b.v)}; }
+		friend Vec4 operator*(Vec4 a, Vec4 b) { return {vmulq_f32(a.v, b.v)}; }
+		friend Vec4 operator/(Vec4 a, Vec4 b) { return {vdivq_f32(a.v, b.v)}; }
+#else
+		float v[4];
+		static Vec4 zero() { return {{0, 0, 0, 0}}; }
+		static Vec4 set(float f) { return {{f, f, f, f}}; }
+		static Vec4 load(const float* p) { return {{p[0], p[1], p[2], p[3]}}; }
+		void store(float* p) const { std::copy(v, v + 4, p); }
+		friend Vec4 operator+(Vec4 a, Vec4 b) { return {{a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3]}}; }
+		friend Vec4 operator-(Vec4 a, Vec4 b) { return {{a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2], a.v[3] - b.v[3]}}; }
+		friend Vec4 operator*(Vec4 a, Vec4 b) { return {{a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3]}}; }
+		friend Vec4 operator/(Vec4 a, Vec4 b) { return {{a.v[0] / b.v[0], a.v[1] / b.v[1], a.v[2] / b.v[2], a.v[3] / b.v[3]}}; }
+#endif
+	};
+
+	inline void add_lanes(double* out, Vec4 v) {
+		float f[4];
+		v.store(f);
+		for (int c = 0; c < 4; ++c)
+			out[c] += f[c];
+	}
+
+	//
+	// A few rows of both images as RGBA float. Float RGBA data is used in place
+	//
+	struct Rows {
+		const float* ref;
+		const float* test;
+		std::vector<float> refBuf, testBuf;
+
+		bool load(
+			const void* reference, const void* test, ChannelType type, int channels, int w, int firstRow, int numRows) {
+			const size_t offset = size_t(firstRow) * w * pixel_size(type, channels);
+			if (type == ChannelType::Float && channels == 4) {
+				this->ref = reinterpret_cast<const float*>(static_cast<const uint8_t*>(reference) + offset);
+				this->test = reinterpret_cast<const float*>(static_cast<const uint8_t*>(test) + offset);
+				return true;
+			}
+
+			refBuf.resize(size_t(w) * numRows * 4);
+			testBuf.resize(refBuf.size());
+			const auto* r = static_cast<const uint8_t*>(reference) + offset;
+			const auto* t = static_cast<const uint8_t*>(test) + offset;
+			if (!convert_formats(r, refBuf.data(), type, ChannelType::Float, w, numRows, channels, 4, -1, -1) ||
+				!convert_formats(t, testBuf.data(), type, ChannelType::Float, w, numRows, channels, 4, -1, -1))
+				return false;
+			this->ref = refBuf.data();
+			this->test = testBuf.data();
+			return true;
+		}
+	};
+
+	//
+	// SSIM of one window, per lane
+	//
+	Vec4 window_ssim(const float* ref, const float* test, int stride, int ww, int wh) {
+		Vec4 sx = Vec4::zero(), sy = sx, sxx = sx, syy = sx, sxy = sx;
+		for (int y = 0; y < wh; ++y) {
+			const float* r = ref + size_t(y) * stride;
+			const float* t = test + size_t(y) * stride;
+			for (int x = 0; x < ww; ++x) {
+				const Vec4 a = Vec4::load(r + x * 4);
+				const Vec4 b = Vec4::load(t + x * 4);
+				sx = sx + a;
+				sy = sy + b;
+				sxx = sxx + a * a;
+				syy = syy + b * b;
+				sxy = sxy + a * b;
+			}
+		}
+
+		const Vec4 inv = Vec4::set(1.f / float(ww * wh));
+		const Vec4 mx = sx * inv, my = sy * inv;
+		const Vec4 vx = sxx * inv - mx * mx;
+		const Vec4 vy = syy * inv - my * my;
+		const Vec4 cxy = sxy * inv - mx * my;
+		const Vec4 two = Vec4::set(2), c1 = Vec4::set(SSIM_C1), c2 = Vec4::set(SSIM_C2);
+		return ((two * mx * my + c1) * (two * cxy + c2)) / ((mx * mx + my * my + c1) * (vx + vy + c2));
+	}
+} // namespace
+
+void ErrorStats::add(const ErrorStats& other) {
+	channels = std::max(channels, other.channels);
+	for (int c = 0; c < MAX_CHANNELS; ++c) {
+		sse[c] += other.sse[c];
+		ssim[c] += other.ssim[c];
+	}
+	pixels += other.pixels;
+	windows += other.windows;
+}
+
+double ErrorStats::psnr(int channel) const {
+	if (!pixels || sse[channel] <= 0)
+		return std::numeric_limits<double>::infinity();
+	return 10.0 * std::log10(1.0 / (sse[channel] / double(pixels)));
+}
+
+double ErrorStats::mean_ssim(int channel) const {
+	return windows ? ssim[channel] / double(windows) : 1.0;
+}
+
+bool imglib::compare(
+	const void* reference, const void* test, ChannelType type, int channels, int w, int h, ErrorStats& stats,
+	int threads) {
+	if (type == ChannelType::None || channels < 1 || channels > MAX_CHANNELS || w <= 0 || h <= 0)
+		return false;
+
+	// Each band owns WINDOW_STEP rows of the squared error, and the row of windows starting at its first row.
+	// Windows shrink to the image on images smaller than one
+	const int ww = std::min(WINDOW, w), wh = std::min(WINDOW, h);
+	const int numBands = (h + WINDOW_STEP - 1) / WINDOW_STEP;
+	std::vector<ErrorStats> bands(numBands);
+	std::atomic<bool> ok = true;
+
+	util::parallel_for(
+		numBands,
+		[&](size_t band) {
+			const int y0 = int(band) * WINDOW_STEP;
+			const int errRows = std::min(WINDOW_STEP, h - y0);
+			const bool hasWindows = y0 + wh <= h;
+			const int numRows = hasWindows ? std::max(errRows, wh) : errRows;
+
+			Rows rows;
+			if (!rows.load(reference, test, type, channels, w, y0, numRows)) {
+				ok = false;
+				return;
+			}
+
+			auto& s = bands[band];
+			for (int y = 0; y < errRows; ++y) {
+				const float* r = rows.ref + size_t(y) * w * 4;
+				const float* t = rows.test + size_t(y) * w * 4;
+				Vec4 sum = Vec4::zero();
+				for (int x = 0; x < w; ++x) {
+					const Vec4 d = Vec4::load(r + x * 4) - Vec4::load(t + x * 4);
+					sum = sum + d * d;
+				}
+				add_lanes(s.sse, sum);
+			}
+			s.pixels = uint64_t(errRows) * w;
+
+			if (hasWindows) {
+				for (int x0 = 0; x0 + ww <= w; x0 += WINDOW_STEP) {
+					add_lanes(s.ssim, window_ssim(rows.ref + x0 * 4, rows.test + x0 * 4, w * 4, ww, wh));
+					++s.windows;
+				}
+			}
+		},
+		threads);
+
+	if (!ok)
+		return false;
+
+	// Reduce in band order so the result doesn't depend on scheduling
+	ErrorStats total;
+	for (auto& band : bands)
+		total.add(band);
+	total.channels = channels;
+	stats.add(total);
+	return true;
+}
@@ -0,0 +1,53 @@
+/**
+ * metrics.hpp - Image quality metrics
+ *
+ * PSNR and SSIM between a reference image and a lossy copy of it, per channel. Both images are compared as normalized
+ * floats a band of rows at a time, on four wide vectors with one channel per lane, so it's cheap enough to run
+ * on every texture of a build.
+ */
+#pragma once
+
+#include <cstdint>
+
+#include "image.hpp"
+
+namespace imglib
+{
+
+	/**
+	 * Running error totals, so several images (ie. every frame and face of a mip level) can be measured as one
+	 */
+	struct ErrorStats {
+		int channels = 0;
+		double sse[MAX_CHANNELS] = {};	// Sum of squared errors
+		double ssim[MAX_CHANNELS] = {}; // Sum of the SSIM of every window
+		std::uint64_t pixels = 0;
+		std::uint64_t windows = 0;
+
+		void add(const ErrorStats& other);
+
+		/**
+		 * Peak signal to noise ratio in dB, with a peak of 1. Infinity if the images are identical
+		 */
+		double psnr(int channel) const;
+
+		/**
+		 * Mean structural similarity, 1 if the images are identical
+		 */
+		double mean_ssim(int channel) const;
+	};
+
+	/**
+	 * Compare two tightly packed images with the same layout, and add the result to stats.
+	 * Values are normalized to [0, 1] first, so float data is measured against a peak of 1. SSIM is computed on each
+	 * channel on its own, over 8x8 windows every 4 pixels (or the whole image, if it's smaller than that)
+	 * @param reference The original image
+	 * @param test The image to measure
+	 * @param threads Max number of threads to use. <= 0 means use all hardware threads
+	 * @returns false if the channel type or count isn't supported
+	 */
+	bool compare(
+		const void* reference, const void* test, ChannelType type, int channels, int w, int h, ErrorStats& stats,
+		int threads = 0);
+
+} // namespace imglib
@@ -1,56 +1,164 @@
 
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
 #include "pack.hpp"
+#include "bufferpool.hpp"
+#include "parallel.hpp"
+#include "pipeline.hpp"
 #include "util.hpp"
 
 using namespace pack;
 
-template <int N>
-void pack_channel(uint8_t* dstData, int destChannels, ChannelPack_t* channels, int w, int h) {
+namespace
+{
+	// Below this many pixels, threading costs more than it saves
+	constexpr size_t PARALLEL_MIN_PIXELS = 512 * 512;
+	constexpr int ROWS_PER_BAND = 64;
 
-	ChannelPack_t *chan0, *chan1, *chan2, *chan3;
-	float chan0const, chan1const, chan2const, chan3const;
-	if constexpr (N > 0) {
-		chan0 = &channels[0];
-		chan0const = chan0->constant * 255.f;
-	}
-	if constexpr (N > 1) {
-		chan1 = &channels[1];
-		chan1const = chan1->constant * 255.f;
+	//
+	// Resolved source for a single destination channel.
+	// Either a pointer to the first source byte + the source stride, or a constant value
+	//
+	struct ChannelSource {
+		const uint8_t* src = nullptr;
+		int stride = 0;
+		uint8_t value = 0;
+	};
+
+	//
+	// Per-pack plan, resolved once before any pixels are touched.
+	// rgbSrc is set when dest RGB comes straight from the RGB of a single 3 or 4 component source (ie. a normal map),
+	// in which case those channels are moved in bulk and only the remaining channels go through the per-channel path
+	//
+	struct PackPlan {
+		int dstComps = 0;
+		ChannelSource chans[imglib::MAX_CHANNELS];
+		const uint8_t* rgbSrc = nullptr;
+		int rgbComps = 0;
+	};
+
+	using fnCopyChannel = void (*)(uint8_t*, const uint8_t*, size_t);
+	using fnFillChannel = void (*)(uint8_t*, uint8_t, size_t);
+
+	// Compile-time strides let the compiler unroll and vectorize these
+	template <int DstC, int SrcC>
+	void copy_channel(uint8_t* dst, const uint8_t* src, size_t count) {
+		for (size_t i = 0; i < count; ++i)
+			dst[i * DstC] = src[i * SrcC];
 	}
-	if constexpr (N > 2) {
-		chan2 = &channels[2];
-		chan2const = chan2->constant * 255.f;
+
+	template <int DstC>
+	void fill_channel(uint8_t* dst, uint8_t value, size_t count) {
+		if constexpr (DstC == 1)
+			std::memset(dst, value, count);
+		else {
+			for (size_t i = 0; i < count; ++i)
+				dst[i * DstC] = value;
+		}
 	}
-	if constexpr (N > 3) {
-		chan3 = &channels[3];
-		chan3const = chan3->constant * 256.f;
+
+	template <int DstC>
+	constexpr fnCopyChannel copyFuncs[] = {
+		copy_channel<DstC, 1>,
+		copy_channel<DstC, 2>,
+		copy_channel<DstC, 3>,
+		copy_channel<DstC, 4>,
+	};
+
+	constexpr const fnCopyChannel* copyTable[] = {
+		copyFuncs<1>,
+		copyFuncs<2>,
+		copyFuncs<3>,
+		copyFuncs<4>,
+	};
+
+	constexpr fnFillChannel fillTable[] = {
+		fill_channel<1>,
+		fill_channel<2>,
+		fill_channel<3>,
+		fill_channel<4>,
+	};
+
+	PackPlan make_plan(int destChannels, const ChannelPack_t* channels, int numChannels) {
+		PackPlan plan;
+		plan.dstComps = destChannels;
+
+		// Later entries win if several of them target the same dest channel
+		for (int i = 0; i < numChannels; ++i) {
+			auto& c = channels[i];
+			auto& dst = plan.chans[c.dstChan];
+			if (c.srcData) {
+				dst.src = c.srcData + c.srcChan;
+				dst.stride = c.comps;
+			}
+			else {
+				dst.src = nullptr;
+				dst.value = lwiconv::detail::fromfloat<uint8_t>(c.constant);
+			}
+		}
+
+		// Check for RGB coming straight out of a single RGB/RGBA image
+		if (destChannels >= 3) {
+			auto& r = plan.chans[0];
+			const int comps = r.stride;
+			const uint8_t* base = r.src;
+			if (base && (comps == 3 || comps == 4) && plan.chans[1].src == base + 1 && plan.chans[1].stride == comps &&
+				plan.chans[2].src == base + 2 && plan.chans[2].stride == comps) {
+				plan.rgbSrc = base;
+				plan.rgbComps = comps;
+			}
+		}
+		return plan;
 	}
 
-	// This is pretty awful for performance. Not a lot of data locality and a lot of branching.
-	// If this becomes a significant bottleneck, it should be reworked
-	const int size = (w * h);
-	for (int i = 0; i < size; ++i) {
-		uint8_t* const pos = dstData + (i * destChannels);
-
-		if constexpr (N > 0)
-			pos[chan0->dstChan] = chan0->srcData ? chan0->srcData[(i * chan0->comps) + chan0->srcChan] : chan0const;
-		if constexpr (N > 1)
-			pos[chan1->dstChan] = chan1->srcData ? chan1->srcData[(i * chan1->comps) + chan1->srcChan] : chan1const;
-		if constexpr (N > 2)
-			pos[chan2->dstChan] = chan2->srcData ? chan2->srcData[(i * chan2->comps) + chan2->srcChan] : chan2const;
-		if constexpr (N > 3)
-			pos[chan3->dstChan] = chan3->srcData ? chan3->srcData[(i * chan3->comps) + chan3->srcChan] : chan3const;
+	//
+	// Pack pixels [first, first + count) of the image
+	//
+	void pack_range(const PackPlan& plan, uint8_t* dstData, size_t first, size_t count) {
+		const int dstC = plan.dstComps;
+		uint8_t* const dst = dstData + first * dstC;
+
+		int c = 0;
+		if (plan.rgbSrc) {
+			const uint8_t* src = plan.rgbSrc + first * plan.rgbComps;
+			if (plan.rgbComps == dstC)
+				std::memcpy(dst, src, count * dstC);
+			else {
+				// RGB <-> RGBA, goes through the lwiconv SIMD shuffles. The alpha written here is replaced below
+				lwiconv::convert_generic<uint8_t, uint8_t>(src, dst, int(count), 1, plan.rgbComps, dstC);
+			}
+			c = 3;
+			// Alpha is already in place when the source is RGBA with alpha in the right spot
+			if (plan.rgbComps == 4 && dstC == 4 && plan.chans[3].src == plan.rgbSrc + 3 && plan.chans[3].stride == 4)
+				c = 4;
+		}
+
+		for (; c < dstC; ++c) {
+			auto& chan = plan.chans[c];
+			if (chan.src)
+				copyTable[dstC - 1][chan.stride - 1](dst + c, chan.src + first * chan.stride, count);
+			else
+				fillTable[dstC - 1](dst + c, chan.value, count);
+		}
 	}
-}
+} // namespace
 
 std::shared_ptr<imglib::Image>
 pack::pack_image(int destChannels, ChannelPack_t* channels, int numChannels, int w, int h) {
 
 	// Validate input data
+	if (destChannels < 1 || destChannels > imglib::MAX_CHANNELS)
+		return nullptr;
 	for (int i = 0; i < numChannels; ++i) {
+		if (channels[i].dstChan < 0 || channels[i].dstChan >= destChannels)
+			return nullptr;
 		if (!channels[i].srcData)
 			continue;
-		if (channels[i].srcChan < channels[i].comps && channels[i].dstChan < destChannels)
+		if (channels[i].comps >= 1 && channels[i].comps <= imglib::MAX_CHANNELS && channels[i].srcChan >= 0 &&
+			channels[i].srcChan < channels[i].comps)
 			continue;
 		return nullptr;
 	}
@@ -58,14 +166,136 @@ pack::pack_image(int destChannels, ChannelPack_t* channels, int numChannels, int
 	// Allocate image
 	std::shared_ptr<imglib::Image> result = std::make_shared<imglib::Image>(imglib::ChannelType::UInt8, destChannels, w, h, false);
 
-	if (numChannels == 1)
-		pack_channel<1>(result->data<uint8_t>(), destChannels, channels, w, h);
-	else if (numChannels == 2)
-		pack_channel<2>(result->data<uint8_t>(), destChannels, channels, w, h);
-	else if (numChannels == 3)
-		pack_channel<3>(result->data<uint8_t>(), destChannels, channels, w, h);
-	else if (numChannels == 4)
-		pack_channel<4>(result->data<uint8_t>(), destChannels, channels, w, h);
+	// Anything not covered by channels ends up as 0
+	const PackPlan plan = make_plan(destChannels, channels, numChannels);
+	uint8_t* const dstData = result->data<uint8_t>();
+	if (!dstData)
+		return nullptr;
+
+	const size_t pixels = size_t(w) * h;
+	if (pixels < PARALLEL_MIN_PIXELS) {
+		pack_range(plan, dstData, 0, pixels);
+		return result;
+	}
+
+	// Split large images into bands of rows
+	const size_t bandPixels = size_t(w) * ROWS_PER_BAND;
+	const size_t bands = (pixels + bandPixels - 1) / bandPixels;
+	util::parallel_for(
+		bands,
+		[&](size_t band)
+		{
+			const size_t first = band * bandPixels;
+			pack_range(plan, dstData, first, std::min(bandPixels, pixels - first));
+		});
 
 	return result;
 }
+
+std::shared_ptr<imglib::Image>
+pack::pack_images(int destChannels, const ImagePack_t* channels, int numChannels, int w, int h) {
+
+	// Validate input data
+	if (destChannels < 1 || destChannels > imglib::MAX_CHANNELS || numChannels > imglib::MAX_CHANNELS || w <= 0 ||
+		h <= 0)
+		return nullptr;
+
+	//
+	// A source is each distinct src + flags pair. Everything that isn't already in the right shape goes through a
+	// pipeline into a band sized scratch buffer
+	//
+	struct Source {
+		const imglib::Image* image;
+		imglib::ProcFlags flags;
+		imglib::Pipeline pipeline;
+		bool direct;
+	};
+	std::vector<Source> sources;
+	int sourceOf[imglib::MAX_CHANNELS];
+
+	for (int i = 0; i < numChannels; ++i) {
+		auto& c = channels[i];
+		sourceOf[i] = -1;
+		if (c.dstChan < 0 || c.dstChan >= destChannels)
+			return nullptr;
+		if (!c.src)
+			continue;
+		if (!c.src->data() || c.srcChan < 0 || c.srcChan >= c.src->channels())
+			return nullptr;
+
+		auto it = std::find_if(
+			sources.begin(), sources.end(), [&c](const Source& s) { return s.image == c.src && s.flags == c.flags; });
+		if (it == sources.end()) {
+			const bool direct = c.src->type() == imglib::ChannelType::UInt8 && c.src->width() == w &&
+								c.src->height() == h && !c.flags;
+			sources.push_back(
+				{c.src, c.flags, imglib::Pipeline().convert(imglib::ChannelType::UInt8).resize(w, h).process(c.flags),
+				 direct});
+			it = sources.end() - 1;
+		}
+		sourceOf[i] = int(it - sources.begin());
+	}
+
+	// Allocate image
+	std::shared_ptr<imglib::Image> result = std::make_shared<imglib::Image>(imglib::ChannelType::UInt8, destChannels, w, h, false);
+	uint8_t* const dstData = result->data<uint8_t>();
+	if (!dstData)
+		return nullptr;
+
+	const size_t pixels = size_t(w) * h;
+	const int bands = (h + ROWS_PER_BAND - 1) / ROWS_PER_BAND;
+	std::atomic<bool> ok = true;
+	util::parallel_for(
+		bands,
+		[&](size_t band)
+		{
+			if (!ok)
+				return;
+
+			const int firstRow = int(band) * ROWS_PER_BAND;
+			const int numRows = std::min(ROWS_PER_BAND, h - firstRow);
+			const size_t first = size_t(firstRow) * w, count = size_t(numRows) * w;
+
+			// Sample every source at the output resolution for just these rows
+			const uint8_t* bandData[imglib::MAX_CHANNELS] = {};
+			void* scratch[imglib::MAX_CHANNELS] = {};
+			bool bandOk = true;
+			for (size_t s = 0; s < sources.size(); ++s) {
+				auto& src = sources[s];
+				if (src.direct) {
+					bandData[s] = src.image->data<uint8_t>() + first * src.image->channels();
+					continue;
+				}
+				scratch[s] = imglib::pool::alloc(count * src.image->channels());
+				if (!scratch[s] || !src.pipeline.run_rows(*src.image, firstRow, numRows, scratch[s])) {
+					bandOk = false;
+					break;
+				}
+				bandData[s] = static_cast<const uint8_t*>(scratch[s]);
+			}
+
+			if (bandOk) {
+				ChannelPack_t bandChannels[imglib::MAX_CHANNELS];
+				for (int i = 0; i < numChannels; ++i) {
+					auto& c = channels[i];
+					bandChannels[i] = {
+						.srcChan = c.srcChan,
+						.dstChan = c.dstChan,
+						.srcData = sourceOf[i] >= 0 ? bandData[sourceOf[i]] : nullptr,
+						.comps = c.src ? c.src->channels() : 1,
+						.constant = c.constant};
+				}
+				const PackPlan plan = make_plan(destChannels, bandChannels, numChannels);
+				pack_range(plan, dstData + first * destChannels, 0, count);
+			}
+			else
+				ok = false;
+
+			for (auto* p : scratch)
+				if (p)
+					imglib::pool::release(p);
+		},
+		pixels < PARALLEL_MIN_PIXELS ? 1 : 0);
+
+	return ok ? result : nullptr;
+}
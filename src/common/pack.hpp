@@ -3,7 +3,7 @@
  *
  * Limitations:
  *  - For simplicity's sake, we only support RGB/A 888/8 targets
- *  - All source images must be the same size
+ *  - pack_image sources must all be the same size, pack_images resamples them instead
  *
  */
 
@@ -29,7 +29,26 @@ namespace pack
 	 * Requires all input image data be RGBA, and all input images be the same size
 	 * w and h must also match the input image sizes
 	 * destChannels is the number of channels in the output image
+	 * Dest channels not covered by any entry in channels are set to 0. Large images are packed across multiple threads
 	 */
 	std::shared_ptr<imglib::Image> pack_image(int destChannels, ChannelPack_t* channels, int numChannels, int w, int h);
 
+	struct ImagePack_t {
+		int srcChan;				 // Src channel index (0=R, 1=G, 2=B, 3=A)
+		int dstChan;				 // Dest channel index (0=R, 1=G, 2=B, 3=A)
+		const imglib::Image* src;	 // Source image of any size or channel type
+		float constant;				 // If src is nullptr, use this float constant (converted to RGBA8888)
+		imglib::ProcFlags flags = 0; // Processing applied to src before it's packed, see Image::process
+	};
+
+	/**
+	 * Channel pack an image straight from the source images
+	 * Each source is converted to UInt8, resampled to w x h and processed one band of rows at a time as it's packed,
+	 * so at most one resample happens per source and no full size intermediate is ever allocated. Entries that share
+	 * the same src and flags share the work too. Sources that are already UInt8 and w x h are read in place
+	 * Dest channels not covered by any entry in channels are set to 0. At most MAX_CHANNELS entries may be given
+	 */
+	std::shared_ptr<imglib::Image>
+	pack_images(int destChannels, const ImagePack_t* channels, int numChannels, int w, int h);
+
 } // namespace pack
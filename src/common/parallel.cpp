@@ -0,0 +1,521 @@
+#include <thread>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <exception>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <filesystem>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "parallel.hpp"
+
+namespace util::detail
+{
+	struct GroupState {
+		std::atomic<std::size_t> pending = 0;
+		std::atomic<unsigned> generation = 0; // Bumped by cancel()
+		std::exception_ptr error;			  // First exception thrown by a task, guarded by mutex
+		std::mutex mutex;
+		std::condition_variable finished;
+	};
+} // namespace util::detail
+
+namespace
+{
+	using util::detail::GroupState;
+
+	// -j may exceed the core count, but not by this much
+	constexpr int MAX_WORKERS = 512;
+
+	//
+	// A single parallel_for call or TaskGroup task. Its range gets split into tasks that live on the worker queues
+	//
+	struct Batch {
+		const std::function<void(std::size_t)>* fn = nullptr;
+		std::function<void(std::size_t)> owned; // TaskGroup tasks own their function, fn points at it
+		std::size_t grain = 1;					// Ranges this size or smaller aren't split any further
+		int limit = 1;							// Max threads working on this batch at once
+
+		std::atomic<int> active = 0;
+		std::atomic<std::size_t> pending = 0; // Items that haven't finished yet
+		std::atomic<bool> failed = false;	  // Set once fn throws, the rest of the items are skipped
+
+		std::shared_ptr<GroupState> group;
+		unsigned generation = 0; // Group generation at submit. The batch is dropped if it changed by the time it runs
+
+		std::mutex mutex;
+		std::condition_variable released; // Signaled whenever a thread is done with a range
+		std::uint64_t releases = 0;		  // Guarded by mutex
+		std::exception_ptr error;		  // First exception fn threw, guarded by mutex. Group tasks use the group's
+
+		// Claim one of the batch's thread slots
+		bool acquire() {
+			int n = active.load();
+			while (n < limit) {
+				if (active.compare_exchange_weak(n, n + 1))
+					return true;
+			}
+			return false;
+		}
+	};
+
+	struct Task {
+		std::shared_ptr<Batch> batch;
+		std::size_t begin = 0, end = 0;
+	};
+
+	struct Queue {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	// Queue this thread pushes to. Pool threads each have their own, every other thread shares queue 0
+	thread_local int t_queue = 0;
+
+#ifdef _WIN32
+	struct Cpu {
+		WORD group;
+		BYTE number;
+	};
+
+	//
+	// Every CPU, group by group. Windows fills processor groups one NUMA node at a time, so that's node order too
+	//
+	std::vector<Cpu> cpu_order() {
+		std::vector<Cpu> order;
+		for (WORD group = 0; group < GetActiveProcessorGroupCount(); ++group) {
+			for (DWORD number = 0; number < GetActiveProcessorCount(group); ++number)
+				order.push_back({group, BYTE(number)});
+		}
+		return order;
+	}
+
+	void pin_thread(const Cpu& cpu) {
+		GROUP_AFFINITY affinity{};
+		affinity.Group = cpu.group;
+		affinity.Mask = KAFFINITY(1) << cpu.number;
+		SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+	}
+#elif defined(__linux__)
+	using Cpu = int;
+
+	//
+	// CPUs this process may run on, node by node
+	//
+	std::vector<Cpu> cpu_order() {
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+			return {};
+
+		std::vector<int> nodes;
+		std::error_code ec;
+		for (auto& entry : std::filesystem::directory_iterator("/sys/devices/system/node", ec)) {
+			const auto name = entry.path().filename().string();
+			int node;
+			if (!name.compare(0, 4, "node") && std::sscanf(name.c_str() + 4, "%d", &node) == 1)
+				nodes.push_back(node);
+		}
+		std::sort(nodes.begin(), nodes.end());
+
+		std::vector<Cpu> order;
+		std::vector<bool> seen(CPU_SETSIZE);
+		const auto add = [&](int cpu)
+		{
+			if (cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed) && !seen[cpu]) {
+				seen[cpu] = true;
+				order.push_back(cpu);
+			}
+		};
+
+		// CPU lists look like 0-15,32-47
+		for (int node : nodes) {
+			std::ifstream list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+			std::string range;
+			while (std::getline(list, range, ',')) {
+				int first, last;
+				const int n = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+				for (int cpu = first; n >= 1 && cpu <= (n == 2 ? last : first); ++cpu)
+					add(cpu);
+			}
+		}
+
+		// No NUMA info, or CPUs that weren't listed in it
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+			add(cpu);
+		return order;
+	}
+
+	void pin_thread(Cpu cpu) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+#else
+	using Cpu = int;
+
+	std::vector<Cpu> cpu_order() {
+		return {};
+	}
+
+	void pin_thread(Cpu) {
+	}
+#endif
+
+	//
+	// Worker threads are started on first use and kept around for the lifetime of the process, so repeated
+	// parallel_for calls (and long running processes like vtex2 serve) don't pay for thread startup every time
+	//
+	class Pool {
+	public:
+		static Pool& get() {
+			static Pool pool;
+			return pool;
+		}
+
+		Pool() {
+			m_queues[0] = std::make_unique<Queue>();
+		}
+
+		~Pool() {
+			{
+				std::lock_guard lock(m_sleepMutex);
+				m_quit = true;
+			}
+			m_wake.notify_all();
+			for (auto& t : m_threads)
+				t.join();
+		}
+
+		std::atomic<int> limit = 0;
+		std::atomic<bool> affinity = false;
+
+		int max_workers() const {
+			const int l = limit;
+			return l > 0 ? std::min(l - 1, MAX_WORKERS) : MAX_WORKERS;
+		}
+
+		//
+		// Grow to whatever the largest request so far asked for, within the limit
+		//
+		void ensure_workers(int count) {
+			count = std::min(count, max_workers());
+			if (m_numQueues - 1 >= count)
+				return;
+
+			std::lock_guard lock(m_startMutex);
+			while (m_numQueues - 1 < count) {
+				const int index = m_numQueues;
+				m_queues[index] = std::make_unique<Queue>();
+				m_numQueues = index + 1;
+				m_threads.emplace_back([this, index] { worker(index); });
+			}
+		}
+
+		void push(Task task) {
+			auto& queue = *m_queues[t_queue];
+			{
+				std::lock_guard lock(queue.mutex);
+				queue.tasks.push_back(std::move(task));
+			}
+			if (m_sleepers > 0) {
+				std::lock_guard lock(m_sleepMutex);
+				++m_epoch;
+				m_wake.notify_one();
+			}
+		}
+
+		//
+		// Take a task whose batch matches and has a free thread slot. The newest one from our own queue, it's the most
+		// likely to still be in cache. Otherwise steal the oldest, largest one from a neighbor, nearest first
+		//
+		template <typename Pred>
+		bool find(const Pred& pred, Task& out) {
+			const int numQueues = m_numQueues;
+			const int self = t_queue;
+			for (int k = 0; k < numQueues; ++k) {
+				auto& queue = *m_queues[(self + k) % numQueues];
+				std::lock_guard lock(queue.mutex);
+				if (k == 0) {
+					for (auto it = queue.tasks.rbegin(); it != queue.tasks.rend(); ++it) {
+						if (pred(*it->batch) && it->batch->acquire()) {
+							out = std::move(*it);
+							queue.tasks.erase(std::next(it).base());
+							return true;
+						}
+					}
+				}
+				else {
+					for (auto it = queue.tasks.begin(); it != queue.tasks.end(); ++it) {
+						if (pred(*it->batch) && it->batch->acquire()) {
+							out = std::move(*it);
+							queue.tasks.erase(it);
+							return true;
+						}
+					}
+				}
+			}
+			return false;
+		}
+
+		//
+		// Run a task we hold a slot for. The upper half of the range is split off for anyone idle until only a
+		// grain is left, and that is what this thread runs.
+		// Never throws: an exception from fn is kept for whoever waits on the batch, and the range still counts as
+		// finished so the wait can end
+		//
+		void execute(Task task) {
+			auto& batch = *task.batch;
+			if (!batch.failed && (!batch.group || batch.group->generation == batch.generation)) {
+				try {
+					while (task.end - task.begin > batch.grain) {
+						const auto mid = task.begin + (task.end - task.begin) / 2;
+						push({task.batch, mid, task.end});
+						task.end = mid;
+					}
+					for (auto i = task.begin; i < task.end; ++i)
+						(*batch.fn)(i);
+				}
+				catch (...) {
+					batch.failed = true;
+					std::lock_guard lock(batch.group ? batch.group->mutex : batch.mutex);
+					auto& error = batch.group ? batch.group->error : batch.error;
+					if (!error)
+						error = std::current_exception();
+				}
+			}
+
+			const auto count = task.end - task.begin;
+			const bool done = batch.pending.fetch_sub(count) == count;
+			{
+				std::lock_guard lock(batch.mutex);
+				--batch.active;
+				++batch.releases;
+			}
+			batch.released.notify_all();
+
+			if (done && batch.group && batch.group->pending.fetch_sub(1) == 1) {
+				std::lock_guard lock(batch.group->mutex);
+				batch.group->finished.notify_all();
+			}
+		}
+
+		//
+		// Help with batch until it's done. Only its own tasks are run here, so waiting never nests any deeper
+		//
+		void wait(const std::shared_ptr<Batch>& batch) {
+			while (batch->pending > 0) {
+				std::uint64_t releases;
+				{
+					std::lock_guard lock(batch->mutex);
+					releases = batch->releases;
+				}
+
+				Task task;
+				if (find([&batch](const Batch& b) { return &b == batch.get(); }, task)) {
+					execute(std::move(task));
+					continue;
+				}
+
+				// Everything left is either running, or waiting on a thread slot. Either way, look again once one of
+				// the threads working on it is done with its range
+				std::unique_lock lock(batch->mutex);
+				batch->released.wait(lock, [&] { return batch->pending == 0 || batch->releases != releases; });
+			}
+		}
+
+	private:
+		void worker(int index) {
+			t_queue = index;
+			if (affinity) {
+				// The first CPU is left to the thread that started the work
+				static const auto order = cpu_order();
+				if (!order.empty())
+					pin_thread(order[index % order.size()]);
+			}
+
+			const auto any = [](const Batch&) { return true; };
+			while (true) {
+				Task task;
+				if (find(any, task)) {
+					execute(std::move(task));
+					continue;
+				}
+
+				std::unique_lock lock(m_sleepMutex);
+				if (m_quit)
+					return;
+				const auto epoch = m_epoch;
+				++m_sleepers;
+				lock.unlock();
+
+				// Something may have been pushed in between the last look and registering as a sleeper
+				if (find(any, task)) {
+					--m_sleepers;
+					execute(std::move(task));
+					continue;
+				}
+
+				lock.lock();
+				m_wake.wait(lock, [&] { return m_quit || m_epoch != epoch; });
+				--m_sleepers;
+			}
+		}
+
+		std::unique_ptr<Queue> m_queues[MAX_WORKERS + 1];
+		std::atomic<int> m_numQueues = 1;
+		std::mutex m_startMutex;
+		std::vector<std::thread> m_threads;
+
+		std::mutex m_sleepMutex;
+		std::condition_variable m_wake;
+		std::atomic<int> m_sleepers = 0;
+		std::uint64_t m_epoch = 0;
+		bool m_quit = false;
+	};
+} // namespace
+
+namespace util
+{
+	int hardware_threads() {
+		return std::max(1, (int)std::thread::hardware_concurrency());
+	}
+
+	void set_thread_limit(int threads) {
+		Pool::get().limit = std::max(threads, 0);
+	}
+
+	int thread_limit() {
+		const int limit = Pool::get().limit;
+		return limit > 0 ? limit : hardware_threads();
+	}
+
+	void set_affinity(bool enabled) {
+		Pool::get().affinity = enabled;
+	}
+
+	int resolve_thread_count(int jobs) {
+		const int limit = Pool::get().limit;
+		if (jobs <= 0)
+			return limit > 0 ? limit : hardware_threads();
+		return limit > 0 ? std::min(jobs, limit) : jobs;
+	}
+
+	void parallel_for(std::size_t count, const std::function<void(std::size_t)>& fn, int threads) {
+		if (count == 0)
+			return;
+
+		const auto numThreads = std::min<std::size_t>(resolve_thread_count(threads), count);
+
+		// Trivial case, avoid the scheduling cost entirely
+		if (numThreads <= 1) {
+			for (std::size_t i = 0; i < count; ++i)
+				fn(i);
+			return;
+		}
+
+		auto& pool = Pool::get();
+		pool.ensure_workers(int(numThreads) - 1);
+
+		// A handful of ranges per thread is plenty to balance uneven items, any more is just overhead
+		auto batch = std::make_shared<Batch>();
+		batch->fn = &fn;
+		batch->limit = int(numThreads);
+		batch->grain = std::max<std::size_t>(1, count / (numThreads * 8));
+		batch->pending = count;
+
+		// The calling thread works too, starting on the whole range. This also keeps nested calls from workers safe:
+		// if every pool thread is busy, the caller simply ends up doing all of the work itself
+		batch->active = 1;
+		pool.execute({batch, 0, count});
+		pool.wait(batch);
+
+		// Nobody can be calling fn anymore, so it's safe to unwind
+		if (batch->error)
+			std::rethrow_exception(batch->error);
+	}
+
+	TaskGroup::TaskGroup()
+		: m_state(std::make_shared<detail::GroupState>()) {
+	}
+
+	TaskGroup::~TaskGroup() {
+		cancel();
+		try {
+			wait();
+		}
+		catch (...) {
+			// Nowhere left to report it
+		}
+	}
+
+	void TaskGroup::run(std::function<void()> fn) {
+		auto& pool = Pool::get();
+		if (pool.max_workers() == 0) {
+			// Limited to a single thread, there's nobody else to run it. Errors still come out of wait()
+			try {
+				fn();
+			}
+			catch (...) {
+				std::lock_guard lock(m_state->mutex);
+				if (!m_state->error)
+					m_state->error = std::current_exception();
+			}
+			return;
+		}
+		pool.ensure_workers(thread_limit() - 1);
+
+		auto batch = std::make_shared<Batch>();
+		batch->owned = [fn = std::move(fn)](std::size_t) { fn(); };
+		batch->fn = &batch->owned;
+		batch->pending = 1;
+		batch->group = m_state;
+		batch->generation = m_state->generation;
+
+		++m_state->pending;
+		pool.push({batch, 0, 1});
+	}
+
+	void TaskGroup::cancel() {
+		++m_state->generation;
+	}
+
+	void TaskGroup::wait() {
+		auto& pool = Pool::get();
+		while (m_state->pending > 0) {
+			Task task;
+			if (pool.find([this](const Batch& b) { return b.group == m_state; }, task)) {
+				pool.execute(std::move(task));
+				continue;
+			}
+
+			std::unique_lock lock(m_state->mutex);
+			m_state->finished.wait(lock, [this] { return m_state->pending == 0; });
+		}
+
+		// Reported once, the group stays usable afterwards
+		std::exception_ptr error;
+		{
+			std::lock_guard lock(m_state->mutex);
+			std::swap(error, m_state->error);
+		}
+		if (error)
+			std::rethrow_exception(error);
+	}
+} // namespace util
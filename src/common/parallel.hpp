@@ -0,0 +1,90 @@
+/**
+ * parallel.hpp - Simple helpers for running work across multiple threads
+ *
+ * Everything here runs on a single process wide work-stealing pool. Each worker keeps its own queue of ranges and
+ * splits them as it goes, idle workers steal from the others. Calls nest freely: a thread waiting on its own work
+ * helps with it rather than blocking, so per-file jobs can fan out into per-mip or per-row work without ever running
+ * more threads than the pool has.
+ */
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+namespace util
+{
+
+	/**
+	 * Returns the number of hardware threads available, never less than 1
+	 */
+	int hardware_threads();
+
+	/**
+	 * Process wide cap on the number of threads working at once, for vtex2's global --threads.
+	 * "Use all cores" requests resolve to this, and the pool never grows past it. Unset by default, in which case any
+	 * explicit thread count is honored and thread_limit() is hardware_threads()
+	 * @param threads <= 0 removes the cap
+	 */
+	void set_thread_limit(int threads);
+	int thread_limit();
+
+	/**
+	 * Pin pool threads to CPUs, filling one NUMA node before moving on to the next. Workers steal from their
+	 * neighbors first, so most stealing stays within a node. Only affects pool threads started after the call
+	 */
+	void set_affinity(bool enabled);
+
+	/**
+	 * Resolve a user provided job count into a real thread count
+	 * <= 0 means "use all hardware threads". Never more than the thread limit, if one is set
+	 */
+	int resolve_thread_count(int jobs);
+
+	/**
+	 * Run fn(i) for every i in [0, count) on up to `threads` worker threads.
+	 * Work is handed out dynamically, so uneven work items balance out across the workers.
+	 * The calling thread participates in the work and this only returns once every item has completed.
+	 * If fn throws, the items that haven't started yet are skipped and the first exception is rethrown here once
+	 * every thread is done with fn.
+	 * @param threads Max number of threads to use. <= 0 means use all hardware threads
+	 */
+	void parallel_for(std::size_t count, const std::function<void(std::size_t)>& fn, int threads = 0);
+
+	namespace detail
+	{
+		struct GroupState;
+	}
+
+	/**
+	 * Tasks that run on the pool in the background, for callers that can't block on parallel_for (ie. vtfview)
+	 */
+	class TaskGroup {
+	public:
+		TaskGroup();
+		~TaskGroup(); // Cancels anything that hasn't started, then waits for the rest
+
+		TaskGroup(const TaskGroup&) = delete;
+		TaskGroup& operator=(const TaskGroup&) = delete;
+
+		/**
+		 * Queue fn to run on the pool. Returns immediately
+		 */
+		void run(std::function<void()> fn);
+
+		/**
+		 * Drop every task that hasn't started yet. Tasks already running finish normally
+		 */
+		void cancel();
+
+		/**
+		 * Wait for every task to finish, running queued ones on the calling thread in the meantime
+		 * Rethrows the first exception any task threw since the last wait
+		 */
+		void wait();
+
+	private:
+		std::shared_ptr<detail::GroupState> m_state;
+	};
+
+} // namespace util
@@ -0,0 +1,180 @@
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+
+#include "pipeline.hpp"
+#include "parallel.hpp"
+#include "bufferpool.hpp"
+
+using namespace imglib;
+
+namespace
+{
+	// Below this many pixels, threading costs more than it saves
+	constexpr size_t PARALLEL_MIN_PIXELS = 512 * 512;
+	constexpr int ROWS_PER_BAND = 64;
+
+	//
+	// Run fn(firstRow, numRows) over bands of rows, splitting large images across threads
+	//
+	template <typename Fn>
+	void for_each_band(int w, int h, Fn&& fn) {
+		if (size_t(w) * h < PARALLEL_MIN_PIXELS) {
+			fn(0, h);
+			return;
+		}
+
+		const int bands = (h + ROWS_PER_BAND - 1) / ROWS_PER_BAND;
+		util::parallel_for(
+			bands,
+			[&](size_t band)
+			{
+				const int first = int(band) * ROWS_PER_BAND;
+				fn(first, std::min(ROWS_PER_BAND, h - first));
+			});
+	}
+
+	//
+	// Convert + process between two tightly packed buffers with the same dimensions, one band at a time
+	//
+	bool convert_and_process(
+		const void* src, void* dst, int w, int h, ChannelType srcType, int srcComps, ChannelType dstType, int dstComps,
+		const lwiconv::PixelF& pdef, ProcFlags flags) {
+		const size_t srcRow = size_t(w) * pixel_size(srcType, srcComps);
+		const size_t dstRow = size_t(w) * pixel_size(dstType, dstComps);
+		const bool needsConvert = srcType != dstType || srcComps != dstComps;
+
+		std::atomic<bool> ok = true;
+		for_each_band(
+			w, h,
+			[&](int first, int rows)
+			{
+				const auto* in = static_cast<const uint8_t*>(src) + first * srcRow;
+				auto* out = static_cast<uint8_t*>(dst) + first * dstRow;
+
+				if (!needsConvert) {
+					if (in != out)
+						memcpy(out, in, rows * dstRow);
+				}
+				else if (!convert_formats(
+							 in, out, srcType, dstType, w, rows, srcComps, dstComps, pixel_size(srcType, srcComps),
+							 pixel_size(dstType, dstComps), pdef))
+					ok = false;
+
+				if (flags && !imglib::process(out, dstType, dstComps, size_t(w) * rows, flags))
+					ok = false;
+			});
+		return ok;
+	}
+} // namespace
+
+Pipeline& Pipeline::resize(int w, int h) {
+	m_width = w;
+	m_height = h;
+	return *this;
+}
+
+Pipeline& Pipeline::convert(ChannelType type, int channels, const lwiconv::PixelF& pdef) {
+	m_type = type;
+	m_comps = channels;
+	m_pdef = pdef;
+	return *this;
+}
+
+Pipeline& Pipeline::process(ProcFlags flags) {
+	m_flags |= flags;
+	return *this;
+}
+
+int Pipeline::out_width(const Image& src) const {
+	return m_width > 0 ? m_width : src.width();
+}
+
+int Pipeline::out_height(const Image& src) const {
+	return m_height > 0 ? m_height : src.height();
+}
+
+int Pipeline::out_channels(const Image& src) const {
+	return m_comps > 0 ? m_comps : src.channels();
+}
+
+ChannelType Pipeline::out_type(const Image& src) const {
+	return m_type != ChannelType::None ? m_type : src.type();
+}
+
+size_t Pipeline::out_size(const Image& src) const {
+	return bytes_for_image(out_width(src), out_height(src), out_type(src), out_channels(src));
+}
+
+bool Pipeline::run(const Image& src, void* dst) const {
+	if (!src.data() || !dst)
+		return false;
+
+	const int srcW = src.width(), srcH = src.height();
+	const int dstW = out_width(src), dstH = out_height(src);
+	const ChannelType srcType = src.type(), dstType = out_type(src);
+	const int srcComps = src.channels(), dstComps = out_channels(src);
+
+	// No resize, so everything happens in a single pass straight into dst
+	if (srcW == dstW && srcH == dstH)
+		return convert_and_process(src.data(), dst, dstW, dstH, srcType, srcComps, dstType, dstComps, m_pdef, m_flags);
+
+	// Nothing to convert, resize straight into dst and process in place
+	if (srcType == dstType && srcComps == dstComps) {
+		if (!resize_into(src.data(), dst, srcType, srcComps, srcW, srcH, dstW, dstH))
+			return false;
+		return convert_and_process(dst, dst, dstW, dstH, dstType, dstComps, dstType, dstComps, m_pdef, m_flags);
+	}
+
+	// Resize in whichever format is smaller, which keeps the intermediate buffer and resize cost down
+	bool ok = false;
+	if (pixel_size(srcType, srcComps) <= pixel_size(dstType, dstComps)) {
+		void* tmp = pool::alloc(bytes_for_image(dstW, dstH, srcType, srcComps));
+		if (resize_into(src.data(), tmp, srcType, srcComps, srcW, srcH, dstW, dstH))
+			ok = convert_and_process(tmp, dst, dstW, dstH, srcType, srcComps, dstType, dstComps, m_pdef, m_flags);
+		pool::release(tmp);
+	}
+	else {
+		// Processing has to see the resized image (renormalize after averaging, etc.), so it runs in place at the end
+		void* tmp = pool::alloc(bytes_for_image(srcW, srcH, dstType, dstComps));
+		if (convert_and_process(src.data(), tmp, srcW, srcH, srcType, srcComps, dstType, dstComps, m_pdef, 0) &&
+			resize_into(tmp, dst, dstType, dstComps, srcW, srcH, dstW, dstH))
+			ok = convert_and_process(dst, dst, dstW, dstH, dstType, dstComps, dstType, dstComps, m_pdef, m_flags);
+		pool::release(tmp);
+	}
+	return ok;
+}
+
+std::shared_ptr<Image> Pipeline::run(const Image& src) const {
+	auto image = std::make_shared<Image>(out_type(src), out_channels(src), out_width(src), out_height(src), false);
+	if (!run(src, image->data()))
+		return nullptr;
+	return image;
+}
+
+bool Pipeline::run_rows(const Image& src, int firstRow, int numRows, void* dst) const {
+	const int dstW = out_width(src), dstH = out_height(src);
+	if (!src.data() || !dst || firstRow < 0 || numRows <= 0 || firstRow + numRows > dstH)
+		return false;
+
+	const int srcW = src.width(), srcH = src.height();
+	const ChannelType srcType = src.type(), dstType = out_type(src);
+	const int srcComps = src.channels(), dstComps = out_channels(src);
+
+	if (srcW == dstW && srcH == dstH) {
+		const auto* in = static_cast<const uint8_t*>(src.data()) + size_t(firstRow) * srcW * src.pixel_size();
+		return convert_and_process(in, dst, dstW, numRows, srcType, srcComps, dstType, dstComps, m_pdef, m_flags);
+	}
+
+	if (srcType == dstType && srcComps == dstComps) {
+		if (!resize_rows(src.data(), dst, srcType, srcComps, srcW, srcH, dstW, dstH, firstRow, numRows))
+			return false;
+		return convert_and_process(dst, dst, dstW, numRows, dstType, dstComps, dstType, dstComps, m_pdef, m_flags);
+	}
+
+	void* tmp = pool::alloc(bytes_for_image(dstW, numRows, srcType, srcComps));
+	bool ok = resize_rows(src.data(), tmp, srcType, srcComps, srcW, srcH, dstW, dstH, firstRow, numRows) &&
+			  convert_and_process(tmp, dst, dstW, numRows, srcType, srcComps, dstType, dstComps, m_pdef, m_flags);
+	pool::release(tmp);
+	return ok;
+}
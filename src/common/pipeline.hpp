@@ -0,0 +1,73 @@
+/**
+ * pipeline.hpp - Fused image processing
+ *
+ * Describes a resize -> convert -> process chain, and runs it in as few passes over the image as possible.
+ * Conversion and processing are done together one band of rows at a time while the data is still in cache.
+ * At most one intermediate buffer is ever allocated, and none at all if the image doesn't need resizing.
+ */
+#pragma once
+
+#include <memory>
+
+#include "image.hpp"
+
+namespace imglib
+{
+
+	class Pipeline {
+	public:
+		/**
+		 * Resize the image to w x h
+		 */
+		Pipeline& resize(int w, int h);
+
+		/**
+		 * Convert the image to the specified channel type
+		 * @param channels New channel count. If < 0, the source channel count is kept
+		 * @param pdef Default pixel fill for channels missing from the source
+		 */
+		Pipeline& convert(ChannelType type, int channels = -1, const lwiconv::PixelF& pdef = {0, 0, 0, 1});
+
+		/**
+		 * Apply processing effects to the final image. See Image::process
+		 */
+		Pipeline& process(ProcFlags flags);
+
+		/**
+		 * Properties of the image this pipeline produces for src
+		 */
+		int out_width(const Image& src) const;
+		int out_height(const Image& src) const;
+		int out_channels(const Image& src) const;
+		ChannelType out_type(const Image& src) const;
+		size_t out_size(const Image& src) const;
+
+		/**
+		 * Run the pipeline on src, writing the result into dst
+		 * dst must be at least out_size(src) bytes, and must not overlap src
+		 */
+		bool run(const Image& src, void* dst) const;
+
+		/**
+		 * Run the pipeline on src, returning a new image
+		 */
+		std::shared_ptr<Image> run(const Image& src) const;
+
+		/**
+		 * Run the pipeline for output rows [firstRow, firstRow + numRows) only, writing them tightly packed into dst
+		 * Lets callers stream the result out in bands without holding the whole output image. When resizing, the
+		 * resize always happens in the source format, so bands can differ slightly from run() if the output format
+		 * is smaller than the source
+		 */
+		bool run_rows(const Image& src, int firstRow, int numRows, void* dst) const;
+
+	private:
+		int m_width = -1;
+		int m_height = -1;
+		ChannelType m_type = ChannelType::None;
+		int m_comps = -1;
+		lwiconv::PixelF m_pdef = {0, 0, 0, 1};
+		ProcFlags m_flags = 0;
+	};
+
+} // namespace imglib
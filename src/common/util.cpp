@@ -1,5 +1,10 @@
 #include "VTFLib.h"
 
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
 #include "util.hpp"
 
 namespace util
@@ -13,4 +18,20 @@ namespace util
 
 		return "Unknown error";
 	}
+
+	bool read_stream(FILE* fp, std::vector<std::uint8_t>& out) {
+		std::uint8_t chunk[64 * 1024];
+		std::size_t read;
+		while ((read = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+			out.insert(out.end(), chunk, chunk + read);
+		return !ferror(fp);
+	}
+
+	void set_binary_mode(FILE* fp) {
+#ifdef _WIN32
+		_setmode(_fileno(fp), _O_BINARY);
+#else
+		(void)fp;
+#endif
+	}
 } // namespace util
@@ -4,11 +4,13 @@
 #pragma once
 
 #include <cstdint>
+#include <cstdio>
 #include <cstring>
 #include <fstream>
 #include <string>
 #include <memory>
 #include <charconv>
+#include <vector>
 
 #include "strtools.hpp"
 
@@ -19,7 +21,7 @@ namespace util
 	/**
 	 * Helper to quickly read a file off disk
 	 */
-	static std::size_t read_file(const std::string& path, std::uint8_t*& outPtr) {
+	inline std::size_t read_file(const std::string& path, std::uint8_t*& outPtr) {
 		std::ifstream stream(path, std::ios::in | std::ios::binary);
 		outPtr = nullptr;
 		if (!stream.good())
@@ -38,7 +40,19 @@ namespace util
 		return size;
 	}
 
-	static inline bool strtoint(const std::string& str, int& out) {
+	/**
+	 * Read everything left in fp, such as a pipe on stdin, and append it to out
+	 * @returns false on a read error
+	 */
+	bool read_stream(FILE* fp, std::vector<std::uint8_t>& out);
+
+	/**
+	 * Put a standard stream into binary mode, so image data piped through stdin/stdout isn't mangled.
+	 * Only does anything on Windows
+	 */
+	void set_binary_mode(FILE* fp);
+
+	inline bool strtoint(const std::string& str, int& out) {
 		auto [p, err] = std::from_chars(str.c_str(), str.c_str() + str.length(), out);
 		return err == std::errc();
 	}
@@ -62,7 +76,7 @@ namespace util
 	};
 
 	template <class T, std::size_t N>
-	constexpr std::size_t ArraySize(T (&arr)[N]) {
+	constexpr std::size_t ArraySize(T (&)[N]) {
 		return N;
 	}
 
@@ -71,8 +85,8 @@ namespace util
 		return (value < min ? min : (value > max ? max : value));
 	}
 
-	static std::string& tolower(std::string& str) {
-		for (int i = 0; i < str.size(); ++i)
+	inline std::string& tolower(std::string& str) {
+		for (size_t i = 0; i < str.size(); ++i)
 			str[i] = std::tolower(str[i]);
 		return str;
 	}
@@ -0,0 +1,355 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#ifdef VTEX2_MINIZ
+#include "miniz.h"
+#else
+#include <zlib.h>
+#endif
+
+#include "vtfdeflate.hpp"
+#include "vtfheader.hpp"
+#include "parallel.hpp"
+
+// Windows garbage!!
+#undef min
+#undef max
+
+using namespace vtf;
+
+namespace
+{
+	// Byte offsets into the on-disk header, see vtfheader.cpp
+	constexpr std::size_t OFS_HEADER_SIZE = 12;
+	constexpr std::size_t OFS_RSRC_COUNT = 68;
+	constexpr std::size_t OFS_RSRC_DIR = 80;
+	constexpr std::size_t RSRC_ENTRY_SIZE = 8;
+	constexpr std::uint32_t RSRC_NO_DATA_CHUNK = 0x02000000;
+
+	// Streams bigger than this are split into blocks that compress in parallel. Each block starts with an empty
+	// window, which costs well under 1% of compression ratio at this size
+	constexpr std::size_t BLOCK_SIZE = 1024 * 1024;
+
+	// Older VTFLib versions cut off the streams of mips up to this big (16x16 RGBA8888) when they don't compress
+	constexpr std::size_t MAX_TRUNCATED_CHUNK = 1024;
+
+	struct Chunk {
+		std::size_t offset; // Into the uncompressed image data
+		std::size_t size;
+	};
+
+	void put_u32(std::vector<std::uint8_t>& out, std::uint32_t v) {
+		const auto pos = out.size();
+		out.resize(pos + sizeof(v));
+		std::memcpy(out.data() + pos, &v, sizeof(v));
+	}
+
+	std::uint32_t get_u32(const std::uint8_t* p) {
+		std::uint32_t v;
+		std::memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	//
+	// One zlib stream for every mip, frame and face, in file order: smallest mip first, then frames, then faces.
+	// The slices of a volume texture share their mip's stream
+	//
+	std::vector<Chunk> image_chunks(const HeaderInfo& info) {
+		std::vector<Chunk> chunks;
+		std::size_t offset = 0;
+		for (int mip = info.mips - 1; mip >= 0; --mip) {
+			vlUInt w, h, d;
+			VTFLib::CVTFFile::ComputeMipmapDimensions(info.width, info.height, info.depth, mip, w, h, d);
+			const std::size_t size = VTFLib::CVTFFile::ComputeImageSize(w, h, d, info.format);
+			for (int i = 0; i < info.frames * info.faces; ++i) {
+				chunks.push_back({offset, size});
+				offset += size;
+			}
+		}
+		return chunks;
+	}
+
+	const ResourceInfo* find_resource(const HeaderInfo& info, std::uint32_t type) {
+		auto it = std::find_if(
+			info.resources.begin(), info.resources.end(), [type](const ResourceInfo& r) { return r.type == type; });
+		return it == info.resources.end() ? nullptr : &*it;
+	}
+
+	//
+	// Write a copy of the file with its image data replaced by the concatenation of image, and its AXC
+	// resource data replaced by axc, or dropped if axc is empty. Everything else is carried over as is, in the same
+	// order. srcImageSize is the size of the image data currently in the file.
+	//
+	bool rebuild(
+		const std::uint8_t* data, std::size_t size, const HeaderInfo& info, std::size_t srcImageSize,
+		const std::vector<std::uint8_t>& axc, const std::vector<std::vector<std::uint8_t>>& image,
+		std::vector<std::uint8_t>& out, std::string& err) {
+		std::vector<ResourceInfo> entries;
+		for (auto& rsrc : info.resources)
+			if (rsrc.type != VTF_RSRC_AUX_COMPRESSION_INFO)
+				entries.push_back(rsrc);
+		if (!axc.empty())
+			entries.push_back({VTF_RSRC_AUX_COMPRESSION_INFO, std::uint32_t(axc.size()), 0});
+
+		// Data chunks in the order they appear in the source, with the AXC data going right before the image
+		struct Section {
+			std::uint64_t srcOffset;
+			std::size_t size;
+			std::size_t entry;
+		};
+		std::vector<Section> sections;
+		for (std::size_t i = 0; i < entries.size(); ++i) {
+			const auto& rsrc = entries[i];
+			if (rsrc.type == VTF_RSRC_AUX_COMPRESSION_INFO || (rsrc.type & RSRC_NO_DATA_CHUNK))
+				continue;
+
+			std::size_t len = sizeof(std::uint32_t) + rsrc.size; // Size prefix + data
+			if (rsrc.type == VTF_LEGACY_RSRC_LOW_RES_IMAGE)
+				len = rsrc.size;
+			else if (rsrc.type == VTF_LEGACY_RSRC_IMAGE)
+				len = srcImageSize;
+
+			if (std::uint64_t(rsrc.value) + len > size) {
+				err = "Truncated resource data";
+				return false;
+			}
+			sections.push_back({rsrc.value, len, i});
+		}
+		std::sort(
+			sections.begin(), sections.end(), [](const Section& a, const Section& b) { return a.srcOffset < b.srcOffset; });
+
+		const std::size_t headerSize = OFS_RSRC_DIR + entries.size() * RSRC_ENTRY_SIZE;
+		out.assign(data, data + OFS_RSRC_DIR);
+		out.resize(headerSize);
+
+		for (auto& section : sections) {
+			auto& rsrc = entries[section.entry];
+			if (rsrc.type == VTF_LEGACY_RSRC_IMAGE) {
+				if (!axc.empty()) {
+					entries.back().value = std::uint32_t(out.size());
+					out.insert(out.end(), axc.begin(), axc.end());
+				}
+				rsrc.value = std::uint32_t(out.size());
+				for (auto& piece : image)
+					out.insert(out.end(), piece.begin(), piece.end());
+			}
+			else {
+				rsrc.value = std::uint32_t(out.size());
+				out.insert(out.end(), data + section.srcOffset, data + section.srcOffset + section.size);
+			}
+		}
+
+		const auto headerSize32 = std::uint32_t(headerSize);
+		const auto count = std::uint32_t(entries.size());
+		std::memcpy(out.data() + OFS_HEADER_SIZE, &headerSize32, sizeof(headerSize32));
+		std::memcpy(out.data() + OFS_RSRC_COUNT, &count, sizeof(count));
+		for (std::size_t i = 0; i < entries.size(); ++i) {
+			std::memcpy(out.data() + OFS_RSRC_DIR + i * RSRC_ENTRY_SIZE, &entries[i].type, sizeof(std::uint32_t));
+			std::memcpy(out.data() + OFS_RSRC_DIR + i * RSRC_ENTRY_SIZE + 4, &entries[i].value, sizeof(std::uint32_t));
+		}
+		return true;
+	}
+
+	//
+	// Raw DEFLATE one block of a stream. Blocks other than the last end on a sync flush, which byte aligns them
+	// without ending the stream, so they can simply be concatenated
+	//
+	bool deflate_block(const std::uint8_t* data, std::size_t size, int level, bool last, std::vector<std::uint8_t>& out) {
+		z_stream zs{};
+		if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return false;
+
+		out.resize(deflateBound(&zs, uLong(size)) + 16);
+		zs.next_in = const_cast<Bytef*>(data);
+		zs.avail_in = uInt(size);
+		zs.next_out = out.data();
+		zs.avail_out = uInt(out.size());
+		const int ret = ::deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+		const bool ok = last ? ret == Z_STREAM_END : ret == Z_OK && zs.avail_in == 0;
+		out.resize(zs.total_out);
+		deflateEnd(&zs);
+		return ok;
+	}
+
+	// zlib stream header for the level, the same one compress2 would write
+	std::uint16_t zlib_header(int level) {
+		const int levelFlags = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+		std::uint16_t header = (0x78 << 8) | (levelFlags << 6);
+		return header + 31 - header % 31;
+	}
+} // namespace
+
+bool vtf::deflate(
+	const void* data, std::size_t size, int level, std::vector<std::uint8_t>& out, std::string& err, int threads) {
+	const auto* bytes = static_cast<const std::uint8_t*>(data);
+	HeaderInfo info;
+	if (!read_header(data, size, info, err))
+		return false;
+
+	if (info.minorVersion < 6) {
+		err = "DEFLATE compression requires VTF 7.6";
+		return false;
+	}
+	if (info.compressionLevel != 0) {
+		err = "Image data is already compressed";
+		return false;
+	}
+	if (level < 1 || level > 9) {
+		err = "Invalid compression level " + std::to_string(level);
+		return false;
+	}
+
+	const auto* imageRsrc = find_resource(info, VTF_LEGACY_RSRC_IMAGE);
+	if (!imageRsrc || std::uint64_t(imageRsrc->value) + info.imageSize > size) {
+		err = "Missing or truncated image data";
+		return false;
+	}
+	const auto* image = bytes + imageRsrc->value;
+
+	// Split every stream into blocks, and compress all of them at once
+	struct Block {
+		std::size_t chunk;
+		std::size_t offset;
+		std::size_t size;
+		bool last;
+	};
+	const auto chunks = image_chunks(info);
+	std::vector<Block> blocks;
+	for (std::size_t i = 0; i < chunks.size(); ++i) {
+		const auto& chunk = chunks[i];
+		for (std::size_t ofs = 0; ofs == 0 || ofs < chunk.size; ofs += BLOCK_SIZE)
+			blocks.push_back(
+				{i, chunk.offset + ofs, std::min(BLOCK_SIZE, chunk.size - ofs), ofs + BLOCK_SIZE >= chunk.size});
+	}
+
+	// Pieces of the output image data: zlib header, blocks, and the Adler-32 trailer for every stream
+	std::vector<std::vector<std::uint8_t>> compressed(blocks.size());
+	std::vector<std::uint32_t> checksums(chunks.size());
+	std::atomic<bool> ok = true;
+	util::parallel_for(
+		blocks.size() + chunks.size(),
+		[&](std::size_t i)
+		{
+			if (i < blocks.size()) {
+				auto& block = blocks[i];
+				if (!deflate_block(image + block.offset, block.size, level, block.last, compressed[i]))
+					ok = false;
+			}
+			else {
+				auto& chunk = chunks[i - blocks.size()];
+				checksums[i - blocks.size()] =
+					std::uint32_t(adler32(adler32(0, nullptr, 0), image + chunk.offset, uInt(chunk.size)));
+			}
+		},
+		threads);
+	if (!ok) {
+		err = "DEFLATE compression failed";
+		return false;
+	}
+
+	std::vector<std::vector<std::uint8_t>> pieces;
+	std::vector<std::uint32_t> streamSizes(chunks.size(), 0);
+	const auto header = zlib_header(level);
+	for (std::size_t i = 0; i < blocks.size(); ++i) {
+		const auto chunk = blocks[i].chunk;
+		if (blocks[i].offset == chunks[chunk].offset)
+			pieces.push_back({std::uint8_t(header >> 8), std::uint8_t(header & 0xFF)});
+		streamSizes[chunk] += std::uint32_t(compressed[i].size());
+		pieces.push_back(std::move(compressed[i]));
+		if (blocks[i].last) {
+			const auto adler = checksums[chunk];
+			pieces.push_back(
+				{std::uint8_t(adler >> 24), std::uint8_t(adler >> 16), std::uint8_t(adler >> 8), std::uint8_t(adler)});
+			streamSizes[chunk] += 2 + 4;
+		}
+	}
+
+	// AXC resource: size prefix, compression level, then the compressed size of every stream
+	std::vector<std::uint8_t> axc;
+	put_u32(axc, std::uint32_t(sizeof(std::int32_t) + streamSizes.size() * sizeof(std::uint32_t)));
+	put_u32(axc, std::uint32_t(level));
+	for (auto streamSize : streamSizes)
+		put_u32(axc, streamSize);
+
+	return rebuild(bytes, size, info, info.imageSize, axc, pieces, out, err);
+}
+
+bool vtf::inflate_chunk(const void* data, std::size_t size, void* out, std::size_t outSize) {
+	z_stream zs{};
+	if (inflateInit(&zs) != Z_OK)
+		return false;
+
+	zs.next_in = const_cast<Bytef*>(static_cast<const Bytef*>(data));
+	zs.avail_in = uInt(size);
+	zs.next_out = static_cast<Bytef*>(out);
+	zs.avail_out = uInt(outSize);
+	const int ret = ::inflate(&zs, Z_FINISH);
+	const std::size_t written = zs.total_out;
+	inflateEnd(&zs);
+
+	if (ret == Z_STREAM_END && written == outSize)
+		return true;
+
+	// Short output is only one of those truncated tiny mips if all of the input was used up. Anything else is
+	// corrupt, and would otherwise load as a partly black image
+	if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) || zs.avail_in != 0 || outSize > MAX_TRUNCATED_CHUNK)
+		return false;
+	std::memset(static_cast<std::uint8_t*>(out) + written, 0, outSize - written);
+	return true;
+}
+
+bool vtf::inflate(
+	const void* data, std::size_t size, std::vector<std::uint8_t>& out, int& level, std::string& err, int threads) {
+	const auto* bytes = static_cast<const std::uint8_t*>(data);
+	HeaderInfo info;
+	if (!read_header(data, size, info, err))
+		return false;
+
+	const auto* axcRsrc = find_resource(info, VTF_RSRC_AUX_COMPRESSION_INFO);
+	const auto* imageRsrc = find_resource(info, VTF_LEGACY_RSRC_IMAGE);
+	if (!axcRsrc || !imageRsrc || info.compressionLevel == 0) {
+		err = "Image data is not compressed";
+		return false;
+	}
+
+	const auto chunks = image_chunks(info);
+	if (axcRsrc->size != sizeof(std::int32_t) + chunks.size() * sizeof(std::uint32_t) ||
+		std::uint64_t(axcRsrc->value) + sizeof(std::uint32_t) + axcRsrc->size > size) {
+		err = "Invalid AXC resource";
+		return false;
+	}
+	const auto* streamSizes = bytes + axcRsrc->value + sizeof(std::uint32_t) + sizeof(std::int32_t);
+
+	std::vector<std::uint64_t> streamOffsets(chunks.size());
+	std::uint64_t compressedSize = 0;
+	for (std::size_t i = 0; i < chunks.size(); ++i) {
+		streamOffsets[i] = imageRsrc->value + compressedSize;
+		compressedSize += get_u32(streamSizes + i * sizeof(std::uint32_t));
+	}
+	if (imageRsrc->value + compressedSize > size) {
+		err = "Truncated image data";
+		return false;
+	}
+
+	std::vector<std::vector<std::uint8_t>> image(1);
+	image[0].resize(info.imageSize);
+	std::atomic<bool> ok = true;
+	util::parallel_for(
+		chunks.size(),
+		[&](std::size_t i)
+		{
+			if (!inflate_chunk(
+					bytes + streamOffsets[i], get_u32(streamSizes + i * sizeof(std::uint32_t)),
+					image[0].data() + chunks[i].offset, chunks[i].size))
+				ok = false;
+		},
+		threads);
+	if (!ok) {
+		err = "Corrupt compressed image data";
+		return false;
+	}
+
+	level = info.compressionLevel;
+	return rebuild(bytes, size, info, compressedSize, {}, image, out, err);
+}
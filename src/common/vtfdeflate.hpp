@@ -0,0 +1,50 @@
+/**
+ * vtfdeflate.hpp - Multithreaded DEFLATE for VTF 7.6 image data
+ *
+ * 7.6 files can store their high res image data DEFLATE compressed, as one zlib stream per mip, frame and face,
+ * with the compressed sizes listed in the AXC resource. VTFLib (de)compresses these one after the other during
+ * Save/Load, which ends up dominating save times at high levels. These work on serialized files instead: every
+ * stream is (de)compressed on its own thread, and the base mip is split further into independently compressed
+ * blocks, pigz style, so its single stream still compresses on every core.
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace vtf
+{
+	/**
+	 * Compress the image data of an uncompressed 7.6 VTF
+	 * The output is the same file with an AXC resource added (or updated), readable by VTFLib and the engine.
+	 * @param data Complete VTF file
+	 * @param level DEFLATE level, 1-9
+	 * @param threads Max number of threads to use. <= 0 means use all hardware threads
+	 * @param err Set to a description of the problem on failure
+	 */
+	bool deflate(
+		const void* data, std::size_t size, int level, std::vector<std::uint8_t>& out, std::string& err,
+		int threads = 0);
+
+	/**
+	 * Decompress the image data of a compressed 7.6 VTF, the reverse of deflate
+	 * The output has its AXC resource dropped, so VTFLib loads it without decompressing anything.
+	 * @param level Receives the compression level the file was saved with
+	 * @param threads Max number of threads to use. <= 0 means use all hardware threads
+	 * @param err Set to a description of the problem on failure
+	 */
+	bool inflate(
+		const void* data, std::size_t size, std::vector<std::uint8_t>& out, int& level, std::string& err,
+		int threads = 0);
+
+	/**
+	 * Decompress a single zlib stream of image data into out, which must hold exactly the uncompressed size.
+	 * Older VTFLib versions truncate the streams of tiny mips that don't compress, so a stream that runs out of input
+	 * early is accepted for images up to 1 KiB, and the rest of out is zeroed. Any other short, long or corrupt stream
+	 * fails
+	 */
+	bool inflate_chunk(const void* data, std::size_t size, void* out, std::size_t outSize);
+
+} // namespace vtf
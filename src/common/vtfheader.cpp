@@ -0,0 +1,477 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include "vtfheader.hpp"
+#include "vtfdeflate.hpp"
+
+// Windows garbage!!
+#undef min
+#undef max
+
+using namespace vtf;
+
+namespace
+{
+	// Byte offsets into the on-disk header, see SVTFHeader in VTFLib. The header is packed, hence no structs
+	constexpr std::size_t OFS_VERSION = 4;
+	constexpr std::size_t OFS_HEADER_SIZE = 12;
+	constexpr std::size_t OFS_WIDTH = 16;
+	constexpr std::size_t OFS_HEIGHT = 18;
+	constexpr std::size_t OFS_FLAGS = 20;
+	constexpr std::size_t OFS_FRAMES = 24;
+	constexpr std::size_t OFS_START_FRAME = 26;
+	constexpr std::size_t OFS_REFLECTIVITY = 32;
+	constexpr std::size_t OFS_BUMPSCALE = 48;
+	constexpr std::size_t OFS_FORMAT = 52;
+	constexpr std::size_t OFS_MIPS = 56;
+	constexpr std::size_t OFS_THUMB_FORMAT = 57;
+	constexpr std::size_t OFS_THUMB_WIDTH = 61;
+	constexpr std::size_t OFS_THUMB_HEIGHT = 62;
+	constexpr std::size_t OFS_DEPTH = 63;	   // 7.2+
+	constexpr std::size_t OFS_RSRC_COUNT = 68; // 7.3+
+	constexpr std::size_t OFS_RSRC_DIR = 80;   // 7.3+
+
+	constexpr std::size_t HEADER_SIZE_70 = 64;
+	constexpr std::size_t RSRC_ENTRY_SIZE = 8;
+	constexpr std::uint32_t RSRC_NO_DATA_CHUNK = 0x02000000;
+
+	// Largest header we'll ever need to read, to cover a full resource directory
+	constexpr std::size_t MAX_HEADER_SIZE = OFS_RSRC_DIR + VTF_RSRC_MAX_DICTIONARY_ENTRIES * RSRC_ENTRY_SIZE;
+
+	template <typename T>
+	T read(const std::uint8_t* p, std::size_t ofs) {
+		T v;
+		std::memcpy(&v, p + ofs, sizeof(T));
+		return v;
+	}
+
+	template <typename T>
+	void write(std::uint8_t* p, std::size_t ofs, T v) {
+		std::memcpy(p + ofs, &v, sizeof(T));
+	}
+
+	//
+	// Reads a value at an absolute offset into the file, for resource data beyond the header
+	//
+	using ReadAtFn = bool (*)(void* ctx, std::uint64_t ofs, void* out, std::size_t len);
+
+	bool read_header_impl(
+		const std::uint8_t* hdr, std::size_t hdrSize, ReadAtFn readAt, void* ctx, HeaderInfo& info, std::string& err) {
+		if (hdrSize < HEADER_SIZE_70 || std::memcmp(hdr, "VTF\0", 4) != 0) {
+			err = "Not a VTF file";
+			return false;
+		}
+
+		info = {};
+		info.majorVersion = read<std::uint32_t>(hdr, OFS_VERSION);
+		info.minorVersion = read<std::uint32_t>(hdr, OFS_VERSION + 4);
+		info.headerSize = read<std::uint32_t>(hdr, OFS_HEADER_SIZE);
+		if (info.majorVersion != 7) {
+			err = "Unsupported VTF version " + std::to_string(info.majorVersion) + "." + std::to_string(info.minorVersion);
+			return false;
+		}
+
+		info.width = read<std::uint16_t>(hdr, OFS_WIDTH);
+		info.height = read<std::uint16_t>(hdr, OFS_HEIGHT);
+		info.flags = read<std::uint32_t>(hdr, OFS_FLAGS);
+		info.frames = read<std::uint16_t>(hdr, OFS_FRAMES);
+		info.startFrame = read<std::uint16_t>(hdr, OFS_START_FRAME);
+		for (int i = 0; i < 3; ++i)
+			info.reflectivity[i] = read<float>(hdr, OFS_REFLECTIVITY + i * 4);
+		info.bumpScale = read<float>(hdr, OFS_BUMPSCALE);
+		info.format = static_cast<VTFImageFormat>(read<std::int32_t>(hdr, OFS_FORMAT));
+		info.mips = hdr[OFS_MIPS];
+		info.thumbnailFormat = static_cast<VTFImageFormat>(read<std::int32_t>(hdr, OFS_THUMB_FORMAT));
+		info.thumbnailWidth = hdr[OFS_THUMB_WIDTH];
+		info.thumbnailHeight = hdr[OFS_THUMB_HEIGHT];
+
+		if (info.minorVersion >= 2) {
+			if (hdrSize < OFS_DEPTH + 2) {
+				err = "Truncated header";
+				return false;
+			}
+			info.depth = read<std::uint16_t>(hdr, OFS_DEPTH);
+		}
+		if (info.depth == 0)
+			info.depth = 1;
+
+		if (info.format < 0 || info.format >= IMAGE_FORMAT_COUNT) {
+			err = "Invalid image format " + std::to_string(info.format);
+			return false;
+		}
+
+		// Same rules as CVTFFile::GetFaceCount. Pre-7.5 envmaps carry an extra sphere map face
+		if (info.flags & TEXTUREFLAGS_ENVMAP)
+			info.faces = (info.startFrame != 0xFFFF && info.minorVersion < 5) ? 7 : 6;
+
+		info.imageSize = std::uint64_t(VTFLib::CVTFFile::ComputeImageSize(
+							 info.width, info.height, info.depth, info.mips, info.format)) *
+						 info.frames * info.faces;
+
+		if (info.minorVersion < 3)
+			return true;
+
+		if (hdrSize < OFS_RSRC_DIR) {
+			err = "Truncated header";
+			return false;
+		}
+
+		const auto count = read<std::uint32_t>(hdr, OFS_RSRC_COUNT);
+		if (count > VTF_RSRC_MAX_DICTIONARY_ENTRIES || hdrSize < OFS_RSRC_DIR + count * RSRC_ENTRY_SIZE) {
+			err = "Invalid resource directory";
+			return false;
+		}
+
+		for (std::uint32_t i = 0; i < count; ++i) {
+			ResourceInfo rsrc;
+			rsrc.type = read<std::uint32_t>(hdr, OFS_RSRC_DIR + i * RSRC_ENTRY_SIZE);
+			rsrc.value = read<std::uint32_t>(hdr, OFS_RSRC_DIR + i * RSRC_ENTRY_SIZE + 4);
+
+			// Image data sizes are implied by the header. Everything else is either inline or has a size prefix
+			if (rsrc.type == VTF_LEGACY_RSRC_IMAGE)
+				rsrc.size = std::uint32_t(info.imageSize);
+			else if (rsrc.type == VTF_LEGACY_RSRC_LOW_RES_IMAGE) {
+				if (info.thumbnailFormat >= 0 && info.thumbnailFormat < IMAGE_FORMAT_COUNT)
+					rsrc.size = VTFLib::CVTFFile::ComputeImageSize(
+						info.thumbnailWidth, info.thumbnailHeight, 1, info.thumbnailFormat);
+			}
+			else if (rsrc.type & RSRC_NO_DATA_CHUNK)
+				rsrc.size = sizeof(std::uint32_t);
+			else if (!readAt(ctx, rsrc.value, &rsrc.size, sizeof(rsrc.size)))
+				rsrc.size = 0;
+
+			if (rsrc.type == VTF_RSRC_CRC) {
+				info.hasCrc = true;
+				info.crc = rsrc.value;
+			}
+			else if (rsrc.type == VTF_RSRC_AUX_COMPRESSION_INFO && rsrc.size >= sizeof(std::int32_t)) {
+				// Compression level is the first field of the AXC data, right after the size
+				std::int32_t level = 0;
+				if (readAt(ctx, std::uint64_t(rsrc.value) + 4, &level, sizeof(level)))
+					info.compressionLevel = level;
+			}
+
+			info.resources.push_back(rsrc);
+		}
+		return true;
+	}
+
+	struct MemoryCtx {
+		const std::uint8_t* data;
+		std::size_t size;
+	};
+
+	bool read_at_memory(void* ctx, std::uint64_t ofs, void* out, std::size_t len) {
+		auto* mem = static_cast<MemoryCtx*>(ctx);
+		if (ofs + len > mem->size)
+			return false;
+		std::memcpy(out, mem->data + ofs, len);
+		return true;
+	}
+
+	bool read_at_file(void* ctx, std::uint64_t ofs, void* out, std::size_t len) {
+		auto* fp = static_cast<FILE*>(ctx);
+#ifdef _WIN32
+		if (_fseeki64(fp, std::int64_t(ofs), SEEK_SET) != 0)
+#else
+		if (fseeko(fp, off_t(ofs), SEEK_SET) != 0)
+#endif
+			return false;
+		return fread(out, 1, len, fp) == len;
+	}
+
+	bool has_thumbnail(const HeaderInfo& info) {
+		return info.thumbnailFormat >= 0 && info.thumbnailFormat < IMAGE_FORMAT_COUNT && info.thumbnailWidth > 0 &&
+			   info.thumbnailHeight > 0;
+	}
+
+	std::uint64_t thumbnail_size(const HeaderInfo& info) {
+		return has_thumbnail(info) ? VTFLib::CVTFFile::ComputeImageSize(
+										 info.thumbnailWidth, info.thumbnailHeight, 1, info.thumbnailFormat)
+								   : 0;
+	}
+
+	//
+	// Where the thumbnail, high res image data and AXC resource start. Pre-7.3 files simply store the thumbnail and
+	// image data back to back after the header
+	//
+	struct DataOffsets {
+		std::uint64_t thumbnail = 0;
+		std::uint64_t image = 0;
+		std::uint64_t axc = 0;
+		bool hasImage = false;
+	};
+
+	DataOffsets data_offsets(const HeaderInfo& info) {
+		DataOffsets ofs;
+		ofs.thumbnail = info.headerSize;
+		ofs.image = info.headerSize + thumbnail_size(info);
+		ofs.hasImage = info.minorVersion < 3;
+		for (auto& rsrc : info.resources) {
+			if (rsrc.type == VTF_LEGACY_RSRC_LOW_RES_IMAGE)
+				ofs.thumbnail = rsrc.value;
+			else if (rsrc.type == VTF_LEGACY_RSRC_IMAGE) {
+				ofs.image = rsrc.value;
+				ofs.hasImage = true;
+			}
+			else if (rsrc.type == VTF_RSRC_AUX_COMPRESSION_INFO)
+				ofs.axc = rsrc.value;
+		}
+		return ofs;
+	}
+} // namespace
+
+bool vtf::read_header(const void* data, std::size_t size, HeaderInfo& info, std::string& err) {
+	MemoryCtx ctx{static_cast<const std::uint8_t*>(data), size};
+	return read_header_impl(ctx.data, size, read_at_memory, &ctx, info, err);
+}
+
+bool vtf::read_header(const std::string& path, HeaderInfo& info, std::string& err) {
+	FILE* fp = fopen(path.c_str(), "rb");
+	if (!fp) {
+		err = "Could not open file";
+		return false;
+	}
+
+	// A single read covers the header and the largest possible resource directory
+	std::uint8_t hdr[MAX_HEADER_SIZE];
+	const std::size_t numRead = fread(hdr, 1, sizeof(hdr), fp);
+
+	bool ok = read_header_impl(hdr, numRead, read_at_file, fp, info, err);
+	fclose(fp);
+	return ok;
+}
+
+bool vtf::read_preview(const std::string& path, int minSize, PreviewImage& out, std::string& err) {
+	HeaderInfo info;
+	if (!read_header(path, info, err))
+		return false;
+
+	const bool hasThumbnail = has_thumbnail(info);
+	const std::uint64_t thumbnailSize = thumbnail_size(info);
+	const auto ofs = data_offsets(info);
+	const std::uint64_t thumbnailOfs = ofs.thumbnail;
+	const std::uint64_t imageOfs = ofs.image;
+	const std::uint64_t axcOfs = ofs.axc;
+	const bool hasImage = ofs.hasImage;
+
+	// Pick the smallest mip that is still big enough. Mips are stored smallest first, and within each mip it's
+	// frames, then faces, then slices. So the first frame, face and slice of a mip is right at its start.
+	// Compressed files have one stream per mip, frame and face instead, so count those to find the mip's stream
+	int mip = 0;
+	std::uint64_t mipOfs = imageOfs;
+	std::size_t mipStream = 0;
+	for (int m = info.mips - 1; m >= 0; --m) {
+		vlUInt w, h, d;
+		VTFLib::CVTFFile::ComputeMipmapDimensions(info.width, info.height, info.depth, m, w, h, d);
+		if (int(std::max(w, h)) >= minSize || m == 0) {
+			mip = m;
+			break;
+		}
+		mipOfs += std::uint64_t(VTFLib::CVTFFile::ComputeImageSize(w, h, d, info.format)) * info.frames * info.faces;
+		mipStream += std::size_t(info.frames) * info.faces;
+	}
+
+	vlUInt mipWidth, mipHeight, mipDepth;
+	VTFLib::CVTFFile::ComputeMipmapDimensions(info.width, info.height, info.depth, mip, mipWidth, mipHeight, mipDepth);
+
+	const bool compressed = info.compressionLevel != 0;
+	const bool thumbnailBigEnough = std::max(info.thumbnailWidth, info.thumbnailHeight) >= minSize;
+	const bool useMip = hasImage && (!compressed || axcOfs) && (!hasThumbnail || !thumbnailBigEnough);
+	if (!useMip && !hasThumbnail) {
+		err = "No thumbnail, and the image data can't be read directly";
+		return false;
+	}
+
+	FILE* fp = fopen(path.c_str(), "rb");
+	if (!fp) {
+		err = "Could not open file";
+		return false;
+	}
+
+	bool ok;
+	if (useMip) {
+		out.format = info.format;
+		out.width = mipWidth;
+		out.height = mipHeight;
+		out.data.resize(VTFLib::CVTFFile::ComputeImageSize(mipWidth, mipHeight, 1, info.format));
+
+		if (compressed) {
+			// Sum up the sizes of the streams in front of ours, from the AXC resource. Its data is the size prefix,
+			// the compression level, then the compressed size of every stream
+			std::vector<std::uint32_t> sizes(mipStream + 1);
+			ok = read_at_file(fp, axcOfs + 8, sizes.data(), sizes.size() * sizeof(std::uint32_t));
+
+			std::uint64_t streamOfs = imageOfs;
+			for (std::size_t i = 0; i < mipStream; ++i)
+				streamOfs += sizes[i];
+
+			// The stream holds every slice, we only want the first
+			std::vector<std::uint8_t> stream(ok ? sizes[mipStream] : 0);
+			std::vector<std::uint8_t> mipData(
+				VTFLib::CVTFFile::ComputeImageSize(mipWidth, mipHeight, mipDepth, info.format));
+			ok = ok && read_at_file(fp, streamOfs, stream.data(), stream.size()) &&
+				 inflate_chunk(stream.data(), stream.size(), mipData.data(), mipData.size());
+			if (ok)
+				std::memcpy(out.data.data(), mipData.data(), out.data.size());
+		}
+		else
+			ok = read_at_file(fp, mipOfs, out.data.data(), out.data.size());
+	}
+	else {
+		out.format = info.thumbnailFormat;
+		out.width = info.thumbnailWidth;
+		out.height = info.thumbnailHeight;
+		out.data.resize(thumbnailSize);
+		ok = read_at_file(fp, thumbnailOfs, out.data.data(), out.data.size());
+	}
+	fclose(fp);
+
+	if (!ok) {
+		err = "Truncated image data";
+		return false;
+	}
+	return true;
+}
+
+bool vtf::locate_image(
+	const void* data, std::size_t size, const HeaderInfo& info, int frame, int face, int mip, ImageLocation& out,
+	std::string& err) {
+	if (frame < 0 || frame >= info.frames || face < 0 || face >= info.faces || mip < 0 || mip >= info.mips) {
+		err = "No such image";
+		return false;
+	}
+
+	const auto ofs = data_offsets(info);
+	const bool compressed = info.compressionLevel != 0;
+	if (!ofs.hasImage || (compressed && !ofs.axc)) {
+		err = "No image data";
+		return false;
+	}
+
+	// Same layout as read_preview: mips smallest first, then frames, faces and slices. Compressed files have one
+	// stream per mip, frame and face, in the same order
+	std::uint64_t offset = ofs.image;
+	std::size_t stream = 0;
+	for (int m = info.mips - 1; m > mip; --m) {
+		vlUInt w, h, d;
+		VTFLib::CVTFFile::ComputeMipmapDimensions(info.width, info.height, info.depth, m, w, h, d);
+		offset += std::uint64_t(VTFLib::CVTFFile::ComputeImageSize(w, h, d, info.format)) * info.frames * info.faces;
+		stream += std::size_t(info.frames) * info.faces;
+	}
+
+	vlUInt w, h, d;
+	VTFLib::CVTFFile::ComputeMipmapDimensions(info.width, info.height, info.depth, mip, w, h, d);
+	const std::size_t index = std::size_t(frame) * info.faces + face;
+	out.imageSize = VTFLib::CVTFFile::ComputeImageSize(w, h, d, info.format);
+	out.compressed = compressed;
+
+	if (compressed) {
+		// Compressed sizes follow the size prefix and the compression level in the AXC data
+		std::vector<std::uint32_t> sizes(stream + index + 1);
+		MemoryCtx ctx{static_cast<const std::uint8_t*>(data), size};
+		if (!read_at_memory(&ctx, ofs.axc + 8, sizes.data(), sizes.size() * sizeof(std::uint32_t))) {
+			err = "Truncated compression info";
+			return false;
+		}
+		out.offset = ofs.image;
+		for (std::size_t i = 0; i + 1 < sizes.size(); ++i)
+			out.offset += sizes[i];
+		out.size = sizes.back();
+	}
+	else {
+		out.offset = offset + out.imageSize * index;
+		out.size = out.imageSize;
+	}
+
+	if (out.offset + out.size > size) {
+		err = "Truncated image data";
+		return false;
+	}
+	return true;
+}
+
+bool vtf::locate_thumbnail(std::size_t size, const HeaderInfo& info, ImageLocation& out, std::string& err) {
+	if (!has_thumbnail(info)) {
+		err = "No thumbnail";
+		return false;
+	}
+
+	out.offset = data_offsets(info).thumbnail;
+	out.size = out.imageSize = thumbnail_size(info);
+	out.compressed = false;
+	if (out.offset + out.size > size) {
+		err = "Truncated thumbnail";
+		return false;
+	}
+	return true;
+}
+
+bool vtf::patch_header(
+	const void* data, std::size_t size, const HeaderPatch& patch, std::vector<std::uint8_t>& header,
+	std::string& err) {
+	HeaderInfo info;
+	if (!read_header(data, size, info, err))
+		return false;
+	if (info.headerSize < HEADER_SIZE_70 || info.headerSize > size ||
+		(info.minorVersion >= 3 && info.headerSize < OFS_RSRC_DIR + info.resources.size() * RSRC_ENTRY_SIZE)) {
+		err = "Truncated header";
+		return false;
+	}
+	if (patch.minorVersion != info.minorVersion &&
+		(patch.minorVersion < 3 || patch.minorVersion > 6 || info.minorVersion < 3)) {
+		err = "Can't change the header layout between 7." + std::to_string(info.minorVersion) + " and 7." +
+			  std::to_string(patch.minorVersion);
+		return false;
+	}
+	if (patch.setCrc && info.minorVersion < 3) {
+		err = "Resources require VTF 7.3 or later";
+		return false;
+	}
+
+	const auto* src = static_cast<const std::uint8_t*>(data);
+	header.assign(src, src + info.headerSize);
+	write<std::uint32_t>(header.data(), OFS_VERSION + 4, patch.minorVersion);
+	write<std::uint32_t>(header.data(), OFS_FLAGS, patch.flags);
+	write<std::uint16_t>(header.data(), OFS_START_FRAME, std::uint16_t(patch.startFrame));
+	write<float>(header.data(), OFS_BUMPSCALE, patch.bumpScale);
+
+	if (!patch.setCrc)
+		return true;
+
+	// CRCs are stored inline in the directory, so an existing one only needs its value replaced
+	const auto count = info.resources.size();
+	for (std::size_t i = 0; i < count; ++i) {
+		if (info.resources[i].type == VTF_RSRC_CRC) {
+			write<std::uint32_t>(header.data(), OFS_RSRC_DIR + i * RSRC_ENTRY_SIZE + 4, patch.crc);
+			return true;
+		}
+	}
+
+	if (count >= VTF_RSRC_MAX_DICTIONARY_ENTRIES) {
+		err = "Resource directory is full";
+		return false;
+	}
+
+	// Otherwise it goes at the end of the directory. Everything after that moves down by an entry, data offsets too
+	for (std::size_t i = 0; i < count; ++i) {
+		auto& rsrc = info.resources[i];
+		if (rsrc.type & RSRC_NO_DATA_CHUNK)
+			continue;
+		if (rsrc.value < info.headerSize) {
+			err = "Resource data overlaps the header";
+			return false;
+		}
+		write<std::uint32_t>(
+			header.data(), OFS_RSRC_DIR + i * RSRC_ENTRY_SIZE + 4, rsrc.value + std::uint32_t(RSRC_ENTRY_SIZE));
+	}
+
+	std::uint8_t entry[RSRC_ENTRY_SIZE];
+	write<std::uint32_t>(entry, 0, VTF_RSRC_CRC);
+	write<std::uint32_t>(entry, 4, patch.crc);
+	header.insert(header.begin() + OFS_RSRC_DIR + count * RSRC_ENTRY_SIZE, entry, entry + RSRC_ENTRY_SIZE);
+	write<std::uint32_t>(header.data(), OFS_RSRC_COUNT, std::uint32_t(count + 1));
+	write<std::uint32_t>(header.data(), OFS_HEADER_SIZE, info.headerSize + std::uint32_t(RSRC_ENTRY_SIZE));
+	return true;
+}
@@ -0,0 +1,132 @@
+/**
+ * vtfheader.hpp - Header-only VTF parsing
+ *
+ * Reads the VTF header and resource directory without loading any image data. This is much cheaper than a full
+ * CVTFFile::Load when all you want to know is what's in the file.
+ * read_preview goes one step further and pulls in a single small image, for thumbnails, and locate_image finds any
+ * single image so it can be read on its own.
+ * patch_header rewrites the metadata of a file without touching its image data.
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "VTFLib.h"
+
+namespace vtf
+{
+	struct ResourceInfo {
+		std::uint32_t type = 0;	  // Resource type, including flags. Same as CVTFFile::GetResourceType
+		std::uint32_t size = 0;	  // Size of the resource data. Same as CVTFFile::GetResourceData
+		std::uint32_t value = 0;  // Raw directory value. Inline data if the resource has no data chunk, otherwise its offset
+	};
+
+	struct HeaderInfo {
+		std::uint32_t majorVersion = 0;
+		std::uint32_t minorVersion = 0;
+		std::uint32_t headerSize = 0;
+
+		int width = 0;
+		int height = 0;
+		int depth = 1;
+		int frames = 1;
+		int faces = 1;
+		int mips = 1;
+		int startFrame = 0;
+		std::uint32_t flags = 0;
+
+		float reflectivity[3] = {0, 0, 0};
+		float bumpScale = 1;
+
+		VTFImageFormat format = IMAGE_FORMAT_NONE;
+		VTFImageFormat thumbnailFormat = IMAGE_FORMAT_NONE;
+		int thumbnailWidth = 0;
+		int thumbnailHeight = 0;
+
+		int compressionLevel = 0;	   // DEFLATE level from the AXC resource, 0 if uncompressed
+		bool hasCrc = false;
+		std::uint32_t crc = 0;		   // Source CRC from the CRC resource, if hasCrc
+		std::uint64_t imageSize = 0;   // Uncompressed size of all high res image data. Same as CVTFFile::GetSize
+
+		std::vector<ResourceInfo> resources;
+	};
+
+	/**
+	 * Parse the header and resource directory of the VTF at path.
+	 * Only the header and the few bytes of each resource's size prefix are read, image data is never touched.
+	 * @param err Set to a description of the problem on failure
+	 */
+	bool read_header(const std::string& path, HeaderInfo& info, std::string& err);
+
+	struct PreviewImage {
+		VTFImageFormat format = IMAGE_FORMAT_NONE;
+		int width = 0;
+		int height = 0;
+		std::vector<std::uint8_t> data; // Raw image data, in format
+	};
+
+	/**
+	 * Read a small image of the VTF at path without loading the rest of it.
+	 * The embedded thumbnail is used if it's at least minSize pixels on its longest side. Otherwise it's the smallest
+	 * mip of the first frame that is, or the base mip if none are. For DEFLATE compressed files only that mip's
+	 * stream is decompressed.
+	 * @param err Set to a description of the problem on failure
+	 */
+	bool read_preview(const std::string& path, int minSize, PreviewImage& out, std::string& err);
+
+	/**
+	 * Parse the header and resource directory of a VTF in memory
+	 * @param data Start of the file, must hold at least the header. Resource sizes beyond size are reported as 0
+	 */
+	bool read_header(const void* data, std::size_t size, HeaderInfo& info, std::string& err);
+
+	struct ImageLocation {
+		std::uint64_t offset = 0;	 // Start of the stored data within the file
+		std::uint64_t size = 0;		 // Size of the stored data
+		std::uint64_t imageSize = 0; // Size once uncompressed, in the file's format
+		bool compressed = false;	 // The stored data is a zlib stream, for inflate_chunk
+	};
+
+	/**
+	 * Find where one frame, face and mip of a VTF in memory is stored, every slice of it, without touching any image
+	 * data. For DEFLATE compressed files that's the stream holding it.
+	 * @param data Complete file, which info was read from
+	 * @param err Set to a description of the problem on failure
+	 */
+	bool locate_image(
+		const void* data, std::size_t size, const HeaderInfo& info, int frame, int face, int mip, ImageLocation& out,
+		std::string& err);
+
+	/**
+	 * Find where the thumbnail of a VTF of size bytes is stored. Thumbnails are never compressed
+	 * @param err Set to a description of the problem on failure
+	 */
+	bool locate_thumbnail(std::size_t size, const HeaderInfo& info, ImageLocation& out, std::string& err);
+
+	/**
+	 * Header fields patch_header can change without touching the image data
+	 */
+	struct HeaderPatch {
+		std::uint32_t minorVersion = 0;
+		std::uint32_t flags = 0;
+		int startFrame = 0;
+		float bumpScale = 1;
+		bool setCrc = false;   // Set or add the CRC resource
+		std::uint32_t crc = 0;
+	};
+
+	/**
+	 * Build a new header for the VTF in data, with the fields in patch.
+	 * The new file is header followed by everything from the HeaderInfo::headerSize of data onward, unchanged. The
+	 * minor version can only change between 7.3 and up, which all share the same layout. Adding a CRC resource grows
+	 * the header by a directory entry, otherwise it stays the same size.
+	 * @param err Set to a description of the problem on failure
+	 */
+	bool patch_header(
+		const void* data, std::size_t size, const HeaderPatch& patch, std::vector<std::uint8_t>& header,
+		std::string& err);
+
+} // namespace vtf
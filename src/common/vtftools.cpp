@@ -1,6 +1,19 @@
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <vector>
+
 #include "vtftools.hpp"
+#include "bcn.hpp"
 #include "image.hpp"
+#include "parallel.hpp"
+#include "vtfdeflate.hpp"
+#include "vtfheader.hpp"
 
 #include "VTFLib.h"
 
@@ -9,7 +22,57 @@
 
 using namespace VTFLib;
 
-bool vtf::resize(const CVTFFile* srcFile, int newWidth, int newHeight, CVTFFile* file) {
+namespace
+{
+	//
+	// Uncompressed formats we can operate on directly
+	//
+	struct MipFormat {
+		imglib::ChannelType type;
+		int comps;
+	};
+
+	// Float data is linear already, so it's never sRGB decoded
+	bool is_float(imglib::ChannelType type) {
+		return type == imglib::ChannelType::Float || type == imglib::ChannelType::Half;
+	}
+
+	bool get_mip_format(VTFImageFormat format, MipFormat& out) {
+		switch (format) {
+			case IMAGE_FORMAT_RGBA8888:
+				out = {imglib::ChannelType::UInt8, 4};
+				return true;
+			case IMAGE_FORMAT_RGB888:
+				out = {imglib::ChannelType::UInt8, 3};
+				return true;
+			case IMAGE_FORMAT_IA88:
+				out = {imglib::ChannelType::UInt8, 2};
+				return true;
+			case IMAGE_FORMAT_I8:
+				out = {imglib::ChannelType::UInt8, 1};
+				return true;
+			case IMAGE_FORMAT_RGBA16161616:
+				out = {imglib::ChannelType::UInt16, 4};
+				return true;
+			case IMAGE_FORMAT_RGBA16161616F:
+				out = {imglib::ChannelType::Half, 4};
+				return true;
+			case IMAGE_FORMAT_RGBA32323232F:
+				out = {imglib::ChannelType::Float, 4};
+				return true;
+			case IMAGE_FORMAT_RGB323232F:
+				out = {imglib::ChannelType::Float, 3};
+				return true;
+			case IMAGE_FORMAT_R32F:
+				out = {imglib::ChannelType::Float, 1};
+				return true;
+			default:
+				return false;
+		}
+	}
+} // namespace
+
+bool vtf::resize(const CVTFFile* srcFile, int newWidth, int newHeight, CVTFFile* file, int threads) {
 
 	const int frameCount = srcFile->GetFrameCount();
 	const int faceCount = srcFile->GetFaceCount();
@@ -17,42 +80,925 @@ bool vtf::resize(const CVTFFile* srcFile, int newWidth, int newHeight, CVTFFile*
 	const int srcWidth = srcFile->GetWidth();
 	const int srcHeight = srcFile->GetHeight();
 
-	// Choose the best channel type for this
-	auto fmtinfo = srcFile->GetImageFormatInfo(srcFile->GetFormat());
-	auto maxBpp = std::max(
-		std::max(fmtinfo.uiAlphaBitsPerPixel, fmtinfo.uiBlueBitsPerPixel),
-		std::max(fmtinfo.uiGreenBitsPerPixel, fmtinfo.uiRedBitsPerPixel));
-
-	// Choose the best image format type for this, so we dont lose image depth!
-	// We'll just switch between RGBA8/16/32F for simplicity, although it will require 33% more mem.
-	imglib::ChannelType type = imglib::ChannelType::UInt8;
-	if (maxBpp > 16)
-		type = imglib::ChannelType::Float;
-	else if (maxBpp > 8)
-		type = imglib::ChannelType::UInt16;
-
-	// Create a working buffer to hold our data when we want to convert it
-	auto convSize = CVTFFile::ComputeImageSize(newWidth, newHeight, 1, file->GetFormat());
-	auto convBuffer = std::make_unique<vlByte[]>(convSize);
-
-	// Resize all base level mips for each frame, face and slice.
-	for (vlUInt uiFrame = 0; uiFrame < frameCount; ++uiFrame) {
-		for (vlUInt uiFace = 0; uiFace < faceCount; ++uiFace) {
-			for (vlUInt uiSlice = 0; uiSlice < sliceCount; ++uiSlice) {
-				// Get & resize the data now
-				void* data = srcFile->GetData(uiFrame, uiFace, uiSlice, 0);
-				void* newData = nullptr;
-				if (!imglib::resize(data, &newData, type, 4, srcWidth, srcHeight, newWidth, newHeight)) {
-					return false;
+	// Source and dest must share a format we can resize directly, since we resize straight into the dest
+	MipFormat fmt;
+	if (srcFile->GetFormat() != file->GetFormat() || !get_mip_format(srcFile->GetFormat(), fmt))
+		return false;
+	if (file->GetWidth() != vlUInt(newWidth) || file->GetHeight() != vlUInt(newHeight) ||
+		file->GetFrameCount() < vlUInt(frameCount) || file->GetFaceCount() < vlUInt(faceCount) ||
+		file->GetDepth() < vlUInt(sliceCount))
+		return false;
+
+	// Resize all base level mips for each frame, face and slice. Each one is independent, so they're spread across
+	// threads and written directly into the dest file's storage
+	std::atomic<bool> ok = true;
+	util::parallel_for(
+		size_t(frameCount) * faceCount * sliceCount,
+		[&](size_t index)
+		{
+			const vlUInt uiSlice = index % sliceCount;
+			const vlUInt uiFace = (index / sliceCount) % faceCount;
+			const vlUInt uiFrame = index / (size_t(sliceCount) * faceCount);
+
+			const void* data = srcFile->GetData(uiFrame, uiFace, uiSlice, 0);
+			void* dest = file->GetData(uiFrame, uiFace, uiSlice, 0);
+			if (!imglib::resize_into(data, dest, fmt.type, fmt.comps, srcWidth, srcHeight, newWidth, newHeight))
+				ok = false;
+		},
+		threads);
+
+	return ok;
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// Mipmap generation
+//////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	constexpr int MIP_ROWS_PER_BAND = 32;
+
+	//
+	// Filter taps for a single output pixel, indexes into contribs.taps
+	//
+	struct Tap {
+		int index;
+		float weight;
+	};
+
+	struct Contribs {
+		std::vector<int> start; // First tap for each output pixel, with one extra entry at the end
+		std::vector<Tap> taps;
+
+		int first(int o) const {
+			return start[o];
+		}
+		int last(int o) const {
+			return start[o + 1];
+		}
+	};
+
+	float catrom(float x) {
+		x = std::abs(x);
+		if (x < 1.f)
+			return 1.5f * x * x * x - 2.5f * x * x + 1.f;
+		if (x < 2.f)
+			return -0.5f * x * x * x + 2.5f * x * x - 4.f * x + 2.f;
+		return 0.f;
+	}
+
+	//
+	// Build normalized Catmull-Rom weights for downsampling inSize pixels to outSize. Edges are clamped
+	//
+	Contribs make_contribs(int inSize, int outSize) {
+		Contribs c;
+		c.start.reserve(outSize + 1);
+		if (inSize == outSize) {
+			for (int o = 0; o < outSize; ++o) {
+				c.start.push_back(int(c.taps.size()));
+				c.taps.push_back({o, 1.f});
+			}
+			c.start.push_back(int(c.taps.size()));
+			return c;
+		}
+
+		const float scale = float(inSize) / outSize;
+		const float support = 2.f * scale;
+		for (int o = 0; o < outSize; ++o) {
+			c.start.push_back(int(c.taps.size()));
+			const float center = (o + 0.5f) * scale;
+			const int lo = int(std::floor(center - support));
+			const int hi = int(std::ceil(center + support));
+
+			float sum = 0;
+			const auto begin = c.taps.size();
+			for (int i = lo; i <= hi; ++i) {
+				const float w = catrom((i + 0.5f - center) / scale);
+				if (w == 0.f)
+					continue;
+				c.taps.push_back({std::clamp(i, 0, inSize - 1), w});
+				sum += w;
+			}
+			for (auto t = begin; t < c.taps.size(); ++t)
+				c.taps[t].weight /= sum;
+		}
+		c.start.push_back(int(c.taps.size()));
+		return c;
+	}
+
+	float srgb_to_linear(float v) {
+		return v <= 0.04045f ? v / 12.92f : std::pow((v + 0.055f) / 1.055f, 2.4f);
+	}
+
+	float linear_to_srgb(float v) {
+		v = std::clamp(v, 0.f, 1.f);
+		return v <= 0.0031308f ? v * 12.92f : 1.055f * std::pow(v, 1.f / 2.4f) - 0.055f;
+	}
+
+	//
+	// Everything needed to build one mip level from the previous one
+	//
+	struct MipLevel {
+		const CVTFFile* file;
+		MipFormat fmt;
+		bool srgb;			   // Only applied to RGB channels of integer formats
+		int level;			   // Level being generated
+		int srcW, srcH, srcD;
+		int dstW, dstH, dstD;
+		Contribs cx, cy, cz;
+	};
+
+	//
+	// Decode a row of source pixels into linear float
+	//
+	void decode_row(const MipLevel& m, const vlByte* row, float* out) {
+		static const auto srgbTable = []()
+		{
+			std::array<float, 256> t{};
+			for (int i = 0; i < 256; ++i)
+				t[i] = srgb_to_linear(i / 255.f);
+			return t;
+		}();
+
+		const int comps = m.fmt.comps;
+		const int n = m.srcW * comps;
+		// Only for RGB, intensity and alpha are left alone
+		const int srgbComps = (m.srgb && comps >= 3) ? 3 : 0;
+		switch (m.fmt.type) {
+			case imglib::ChannelType::UInt8:
+				for (int i = 0; i < n; ++i)
+					out[i] = (i % comps) < srgbComps ? srgbTable[row[i]] : row[i] / 255.f;
+				break;
+			case imglib::ChannelType::UInt16: {
+				auto* p = reinterpret_cast<const uint16_t*>(row);
+				for (int i = 0; i < n; ++i)
+					out[i] = (i % comps) < srgbComps ? srgb_to_linear(p[i] / 65535.f) : p[i] / 65535.f;
+				break;
+			}
+			case imglib::ChannelType::Half: {
+				auto* p = reinterpret_cast<const lwiconv::half*>(row);
+				for (int i = 0; i < n; ++i)
+					out[i] = lwiconv::half_to_float(p[i]);
+				break;
+			}
+			default:
+				std::memcpy(out, row, n * sizeof(float));
+				break;
+		}
+	}
+
+	//
+	// Encode a row of linear float pixels into the destination format
+	//
+	void encode_row(const MipLevel& m, const float* in, vlByte* row) {
+		const int comps = m.fmt.comps;
+		const int n = m.dstW * comps;
+		const int srgbComps = (m.srgb && comps >= 3) ? 3 : 0;
+		switch (m.fmt.type) {
+			case imglib::ChannelType::UInt8:
+				for (int i = 0; i < n; ++i) {
+					const float v = (i % comps) < srgbComps ? linear_to_srgb(in[i]) : std::clamp(in[i], 0.f, 1.f);
+					row[i] = vlByte(v * 255.f + 0.5f);
+				}
+				break;
+			case imglib::ChannelType::UInt16: {
+				auto* p = reinterpret_cast<uint16_t*>(row);
+				for (int i = 0; i < n; ++i) {
+					const float v = (i % comps) < srgbComps ? linear_to_srgb(in[i]) : std::clamp(in[i], 0.f, 1.f);
+					p[i] = uint16_t(v * 65535.f + 0.5f);
+				}
+				break;
+			}
+			case imglib::ChannelType::Half: {
+				auto* p = reinterpret_cast<lwiconv::half*>(row);
+				for (int i = 0; i < n; ++i)
+					p[i] = lwiconv::float_to_half(in[i]);
+				break;
+			}
+			default:
+				std::memcpy(row, in, n * sizeof(float));
+				break;
+		}
+	}
+
+	//
+	// Generate rows [y0, y1) of slice z for a single frame/face
+	// The source rows needed by the band are decoded and filtered horizontally once, then combined vertically
+	//
+	void generate_band(const MipLevel& m, int frame, int face, int z, int y0, int y1) {
+		const int comps = m.fmt.comps;
+		const size_t srcRowBytes = imglib::pixel_size(m.fmt.type, comps) * m.srcW;
+		const size_t dstRowBytes = imglib::pixel_size(m.fmt.type, comps) * m.dstW;
+		const int rowFloats = m.dstW * comps;
+
+		// Range of source rows this band touches
+		int rowLo = m.srcH, rowHi = -1;
+		for (int y = y0; y < y1; ++y) {
+			for (int t = m.cy.first(y); t < m.cy.last(y); ++t) {
+				rowLo = std::min(rowLo, m.cy.taps[t].index);
+				rowHi = std::max(rowHi, m.cy.taps[t].index);
+			}
+		}
+		const int numRows = rowHi - rowLo + 1;
+
+		// Horizontally filtered source rows, already blended across the source slices for z
+		std::vector<float> hrows(size_t(numRows) * rowFloats, 0.f);
+		std::vector<float> decoded(size_t(m.srcW) * comps);
+		for (int tz = m.cz.first(z); tz < m.cz.last(z); ++tz) {
+			const auto& zt = m.cz.taps[tz];
+			const vlByte* slice = m.file->GetData(frame, face, zt.index, m.level - 1);
+			for (int r = 0; r < numRows; ++r) {
+				decode_row(m, slice + (rowLo + r) * srcRowBytes, decoded.data());
+
+				float* out = hrows.data() + size_t(r) * rowFloats;
+				for (int x = 0; x < m.dstW; ++x) {
+					for (int t = m.cx.first(x); t < m.cx.last(x); ++t) {
+						const float w = m.cx.taps[t].weight * zt.weight;
+						const float* px = decoded.data() + m.cx.taps[t].index * comps;
+						for (int c = 0; c < comps; ++c)
+							out[x * comps + c] += px[c] * w;
+					}
+				}
+			}
+		}
+
+		// Vertical pass
+		vlByte* dst = m.file->GetData(frame, face, z, m.level);
+		std::vector<float> row(rowFloats);
+		for (int y = y0; y < y1; ++y) {
+			std::fill(row.begin(), row.end(), 0.f);
+			for (int t = m.cy.first(y); t < m.cy.last(y); ++t) {
+				const float w = m.cy.taps[t].weight;
+				const float* src = hrows.data() + size_t(m.cy.taps[t].index - rowLo) * rowFloats;
+				for (int i = 0; i < rowFloats; ++i)
+					row[i] += src[i] * w;
+			}
+			encode_row(m, row.data(), dst + y * dstRowBytes);
+		}
+	}
+} // namespace
+
+bool vtf::generate_mipmaps(CVTFFile* file, bool srgb, int threads) {
+	MipFormat fmt;
+	if (!get_mip_format(file->GetFormat(), fmt))
+		return false;
+
+	const int frames = file->GetFrameCount();
+	const int faces = file->GetFaceCount();
+	const int mipCount = file->GetMipmapCount();
+
+	vlUInt srcW = file->GetWidth(), srcH = file->GetHeight(), srcD = file->GetDepth();
+
+	// Levels depend on each other, so they're done in order. Everything within a level can run in parallel
+	for (int level = 1; level < mipCount; ++level) {
+		vlUInt dstW, dstH, dstD;
+		CVTFFile::ComputeMipmapDimensions(file->GetWidth(), file->GetHeight(), file->GetDepth(), level, dstW, dstH, dstD);
+
+		MipLevel m{
+			.file = file,
+			.fmt = fmt,
+			.srgb = srgb && !is_float(fmt.type),
+			.level = level,
+			.srcW = int(srcW),
+			.srcH = int(srcH),
+			.srcD = int(srcD),
+			.dstW = int(dstW),
+			.dstH = int(dstH),
+			.dstD = int(dstD),
+			.cx = make_contribs(srcW, dstW),
+			.cy = make_contribs(srcH, dstH),
+			.cz = make_contribs(srcD, dstD),
+		};
+
+		const int bands = (m.dstH + MIP_ROWS_PER_BAND - 1) / MIP_ROWS_PER_BAND;
+		const size_t tasks = size_t(frames) * faces * m.dstD * bands;
+		util::parallel_for(
+			tasks,
+			[&](size_t task)
+			{
+				const int band = int(task % bands);
+				task /= bands;
+				const int z = int(task % m.dstD);
+				task /= m.dstD;
+				const int face = int(task % faces);
+				const int frame = int(task / faces);
+
+				const int y0 = band * MIP_ROWS_PER_BAND;
+				generate_band(m, frame, face, z, y0, std::min(y0 + MIP_ROWS_PER_BAND, m.dstH));
+			},
+			// Tiny levels aren't worth spinning up threads for
+			size_t(m.dstW) * m.dstH * m.dstD * frames * faces < 64 * 64 ? 1 : threads);
+
+		srcW = dstW;
+		srcH = dstH;
+		srcD = dstD;
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// Format conversion
+//////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	constexpr int CONVERT_ROWS_PER_BAND = 64; // Must be a multiple of 4, so bands line up with block rows
+
+	bool get_bcn_format(VTFImageFormat format, bcn::Format& out) {
+		switch (format) {
+			case IMAGE_FORMAT_DXT1:
+				out = bcn::Format::BC1;
+				return true;
+			case IMAGE_FORMAT_DXT3:
+				out = bcn::Format::BC2;
+				return true;
+			case IMAGE_FORMAT_DXT5:
+				out = bcn::Format::BC3;
+				return true;
+			case IMAGE_FORMAT_ATI1N:
+				out = bcn::Format::BC4;
+				return true;
+			case IMAGE_FORMAT_ATI2N:
+				out = bcn::Format::ATI2;
+				return true;
+			case IMAGE_FORMAT_BC7:
+				out = bcn::Format::BC7;
+				return true;
+			default:
+				return false;
+		}
+	}
+
+	//
+	// Carry all properties and resources over from src to dst, except for the image data itself
+	//
+	void copy_properties(const CVTFFile* src, CVTFFile* dst) {
+		dst->SetVersion(src->GetMajorVersion(), src->GetMinorVersion());
+
+		// Alpha flags depend on the format, so keep the ones Init gave us
+		constexpr vlUInt alphaFlags = TEXTUREFLAGS_ONEBITALPHA | TEXTUREFLAGS_EIGHTBITALPHA;
+		dst->SetFlags((src->GetFlags() & ~alphaFlags) | (dst->GetFlags() & alphaFlags));
+
+		dst->SetStartFrame(src->GetStartFrame());
+		dst->SetBumpmapScale(src->GetBumpmapScale());
+
+		vlSingle r, g, b;
+		src->GetReflectivity(r, g, b);
+		dst->SetReflectivity(r, g, b);
+
+		if (src->GetHasThumbnail() && src->GetThumbnailData() && dst->GetHasThumbnail() &&
+			src->GetThumbnailFormat() == dst->GetThumbnailFormat() &&
+			src->GetThumbnailWidth() == dst->GetThumbnailWidth() &&
+			src->GetThumbnailHeight() == dst->GetThumbnailHeight())
+			dst->SetThumbnailData(src->GetThumbnailData());
+
+		dst->SetAuxCompressionLevel(src->GetAuxCompressionLevel());
+
+		if (src->GetSupportsResources() && dst->GetSupportsResources()) {
+			for (vlUInt i = 0; i < src->GetResourceCount(); ++i) {
+				const auto type = src->GetResourceType(i);
+				// Image data is ours, and aux compression info is regenerated on save
+				if (type == VTF_LEGACY_RSRC_IMAGE || type == VTF_LEGACY_RSRC_LOW_RES_IMAGE ||
+					type == VTF_RSRC_AUX_COMPRESSION_INFO)
+					continue;
+
+				vlUInt size = 0;
+				if (auto* data = src->GetResourceData(type, size))
+					dst->SetResourceData(type, size, data);
+			}
+		}
+	}
+
+	//
+	// Convert numRows tightly packed rows of uncompressed srcFormat data. dst points at the first of those rows within
+	// the dest image, which has to be on a block row boundary for compressed formats
+	//
+	bool convert_rows(
+		const vlByte* src, vlByte* dst, int width, int numRows, VTFImageFormat srcFormat, VTFImageFormat format,
+		bcn::Quality quality) {
+		// Our block encoder handles the DXT formats, ATI1N, ATI2N and BC7, everything else goes through VTFLib
+		bcn::Format bcnFormat;
+		if (srcFormat == IMAGE_FORMAT_RGBA8888 && get_bcn_format(format, bcnFormat)) {
+			bcn::encode_block_rows(bcnFormat, quality, src, width, numRows, 0, (numRows + 3) / 4, dst);
+			return true;
+		}
+		return CVTFFile::Convert(const_cast<vlByte*>(src), dst, width, numRows, srcFormat, format);
+	}
+
+	//
+	// Offset of row within a width wide image in format. Must be a multiple of 4 for compressed formats
+	//
+	size_t row_offset(int width, int row, VTFImageFormat format) {
+		return CVTFFile::GetImageFormatInfo(format).bIsCompressed
+				   ? size_t(row / 4) * CVTFFile::ComputeImageSize(width, 4, 1, format)
+				   : size_t(row) * CVTFFile::ComputeImageSize(width, 1, 1, format);
+	}
+
+	//
+	// Band of rows of a single image within the file
+	//
+	struct ConvertTask {
+		vlUInt frame, face, slice, mip;
+		int width, height;
+		int firstRow, numRows;
+	};
+} // namespace
+
+std::unique_ptr<CVTFFile>
+vtf::convert(const CVTFFile* srcFile, VTFImageFormat format, bcn::Quality quality, int threads) {
+	const auto srcFormat = srcFile->GetFormat();
+	const int frames = srcFile->GetFrameCount();
+	const int faces = srcFile->GetFaceCount();
+	const int mips = srcFile->GetMipmapCount();
+
+	auto file = std::make_unique<CVTFFile>();
+	if (!file->Init(
+			srcFile->GetWidth(), srcFile->GetHeight(), frames, faces, srcFile->GetDepth(), format,
+			srcFile->GetHasThumbnail(), mips))
+		return nullptr;
+	copy_properties(srcFile, file.get());
+
+	// Compressed sources can't be split into bands, VTFLib has to convert those a whole image at a time
+	const bool srcCompressed = CVTFFile::GetImageFormatInfo(srcFormat).bIsCompressed;
+
+	std::vector<ConvertTask> tasks;
+	for (int mip = 0; mip < mips; ++mip) {
+		vlUInt w, h, d;
+		CVTFFile::ComputeMipmapDimensions(srcFile->GetWidth(), srcFile->GetHeight(), srcFile->GetDepth(), mip, w, h, d);
+		const int rowsPerBand = srcCompressed ? int(h) : CONVERT_ROWS_PER_BAND;
+		for (int frame = 0; frame < frames; ++frame)
+			for (int face = 0; face < faces; ++face)
+				for (vlUInt slice = 0; slice < d; ++slice)
+					for (int row = 0; row < int(h); row += rowsPerBand)
+						tasks.push_back(
+							{vlUInt(frame), vlUInt(face), slice, vlUInt(mip), int(w), int(h), row,
+							 std::min(rowsPerBand, int(h) - row)});
+	}
+
+	std::atomic<bool> ok = true;
+	util::parallel_for(
+		tasks.size(),
+		[&](size_t index)
+		{
+			const auto& t = tasks[index];
+			const vlByte* src = srcFile->GetData(t.frame, t.face, t.slice, t.mip);
+			vlByte* dst = file->GetData(t.frame, t.face, t.slice, t.mip);
+
+			if (srcCompressed) {
+				if (!CVTFFile::Convert(const_cast<vlByte*>(src), dst, t.width, t.height, srcFormat, format))
+					ok = false;
+				return;
+			}
+
+			// Offsets of this band within the source and dest images
+			if (!convert_rows(
+					src + row_offset(t.width, t.firstRow, srcFormat), dst + row_offset(t.width, t.firstRow, format),
+					t.width, t.numRows, srcFormat, format, quality))
+				ok = false;
+		},
+		threads);
+
+	if (!ok)
+		return nullptr;
+	return file;
+}
+
+std::unique_ptr<CVTFFile> vtf::convert(
+	const CVTFFile* srcFile, const ImageSource& source, VTFImageFormat format, bcn::Quality quality, int threads) {
+	const auto srcFormat = srcFile->GetFormat();
+	const int frames = srcFile->GetFrameCount();
+	const int faces = srcFile->GetFaceCount();
+	const int mips = srcFile->GetMipmapCount();
+
+	auto file = std::make_unique<CVTFFile>();
+	if (!file->Init(
+			srcFile->GetWidth(), srcFile->GetHeight(), frames, faces, srcFile->GetDepth(), format,
+			srcFile->GetHasThumbnail(), mips))
+		return nullptr;
+	copy_properties(srcFile, file.get());
+
+	const bool srcCompressed = CVTFFile::GetImageFormatInfo(srcFormat).bIsCompressed;
+	std::vector<ConvertTask> tasks;
+	for (int mip = 0; mip < mips; ++mip) {
+		vlUInt w, h, d;
+		CVTFFile::ComputeMipmapDimensions(srcFile->GetWidth(), srcFile->GetHeight(), srcFile->GetDepth(), mip, w, h, d);
+		const auto sliceSize = CVTFFile::ComputeImageSize(w, h, 1, srcFormat);
+
+		for (int frame = 0; frame < frames; ++frame) {
+			for (int face = 0; face < faces; ++face) {
+				const auto src = source(frame, face, mip);
+				if (!src)
+					return nullptr;
+
+				if (srcFormat == format) {
+					std::memcpy(file->GetData(frame, face, 0, mip), src.get(), size_t(sliceSize) * d);
+					continue;
+				}
+
+				// Same bands as the whole file conversion, over just this image
+				const int rowsPerBand = srcCompressed ? int(h) : CONVERT_ROWS_PER_BAND;
+				tasks.clear();
+				for (vlUInt slice = 0; slice < d; ++slice)
+					for (int row = 0; row < int(h); row += rowsPerBand)
+						tasks.push_back(
+							{vlUInt(frame), vlUInt(face), slice, vlUInt(mip), int(w), int(h), row,
+							 std::min(rowsPerBand, int(h) - row)});
+
+				std::atomic<bool> ok = true;
+				util::parallel_for(
+					tasks.size(),
+					[&](size_t index)
+					{
+						const auto& t = tasks[index];
+						const vlByte* srcSlice = src.get() + size_t(sliceSize) * t.slice;
+						vlByte* dst = file->GetData(t.frame, t.face, t.slice, t.mip);
+						if (!convert_rows(
+								srcSlice + row_offset(t.width, t.firstRow, srcFormat),
+								dst + row_offset(t.width, t.firstRow, format), t.width, t.numRows, srcFormat, format,
+								quality))
+							ok = false;
+					},
+					threads);
+				if (!ok)
+					return nullptr;
+			}
+		}
+	}
+	return file;
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// Streamed building
+//////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	//
+	// Collects rows of one level in the processing format and converts them into the file's format a few bands at a
+	// time. Only whole block rows are converted until the level is complete
+	//
+	struct LevelWriter {
+		CVTFFile* file;
+		int level;
+		int width, height;
+		VTFImageFormat procFormat;
+		bcn::Quality quality;
+		size_t rowBytes; // In procFormat
+
+		std::vector<vlByte> pending;
+		int pendingFirst = 0; // Row of the first pending row
+		int pendingRows = 0;
+
+		std::vector<vlByte>* keep = nullptr; // If set, every row is copied in here as well
+
+		bool add(const vlByte* rows, int numRows, int threads) {
+			pending.insert(pending.end(), rows, rows + numRows * rowBytes);
+			pendingRows += numRows;
+			if (keep)
+				keep->insert(keep->end(), rows, rows + numRows * rowBytes);
+
+			const bool done = pendingFirst + pendingRows == height;
+			const int toWrite = done ? pendingRows : pendingRows / CONVERT_ROWS_PER_BAND * CONVERT_ROWS_PER_BAND;
+			if (!toWrite)
+				return true;
+
+			const auto format = file->GetFormat();
+			vlByte* dst = file->GetData(0, 0, 0, level);
+			const int bands = (toWrite + CONVERT_ROWS_PER_BAND - 1) / CONVERT_ROWS_PER_BAND;
+			std::atomic<bool> ok = true;
+			util::parallel_for(
+				bands,
+				[&](size_t band)
+				{
+					const int first = int(band) * CONVERT_ROWS_PER_BAND;
+					if (!convert_rows(
+							pending.data() + first * rowBytes, dst + row_offset(width, pendingFirst + first, format),
+							width, std::min(CONVERT_ROWS_PER_BAND, toWrite - first), procFormat, format, quality))
+						ok = false;
+				},
+				threads);
+
+			pending.erase(pending.begin(), pending.begin() + toWrite * rowBytes);
+			pendingFirst += toWrite;
+			pendingRows -= toWrite;
+			return ok;
+		}
+	};
+
+	//
+	// One level below the base. Holds horizontally filtered rows of the level above until the vertical filter is done
+	// with them
+	//
+	struct StreamLevel {
+		MipLevel m;
+		LevelWriter writer;
+		std::deque<std::vector<float>> window;
+		int windowFirst = 0; // Row of the level above that window.front() belongs to
+		int nextRow = 0;	 // Next row of this level to produce
+	};
+
+	//
+	// Hand rows [first, first + numRows) of the level above levels[index], decoded to linear float, down the chain
+	// Filters exactly like generate_band, so the results are identical
+	//
+	bool feed_level(std::vector<StreamLevel>& levels, size_t index, const float* rows, int first, int numRows, int threads) {
+		auto& s = levels[index];
+		const auto& m = s.m;
+		const int comps = m.fmt.comps;
+		const int srcFloats = m.srcW * comps;
+		const int rowFloats = m.dstW * comps;
+
+		// Horizontal pass
+		const size_t base = s.window.size();
+		s.window.resize(base + numRows);
+		util::parallel_for(
+			numRows,
+			[&](size_t r)
+			{
+				auto& out = s.window[base + r];
+				out.assign(rowFloats, 0.f);
+				const float* decoded = rows + r * srcFloats;
+				for (int x = 0; x < m.dstW; ++x) {
+					for (int t = m.cx.first(x); t < m.cx.last(x); ++t) {
+						const float w = m.cx.taps[t].weight;
+						const float* px = decoded + m.cx.taps[t].index * comps;
+						for (int c = 0; c < comps; ++c)
+							out[x * comps + c] += px[c] * w;
+					}
 				}
+			},
+			threads);
+
+		// Every row whose taps are all in by now can be finished. Taps only ever move down as rows do
+		const int available = first + numRows;
+		int count = 0;
+		while (s.nextRow + count < m.dstH && m.cy.taps[m.cy.last(s.nextRow + count) - 1].index < available)
+			++count;
+
+		if (count) {
+			const size_t dstRowBytes = imglib::pixel_size(m.fmt.type, comps) * m.dstW;
+			std::vector<vlByte> encoded(count * dstRowBytes);
+			util::parallel_for(
+				count,
+				[&](size_t i)
+				{
+					const int y = s.nextRow + int(i);
+					std::vector<float> row(rowFloats, 0.f);
+					for (int t = m.cy.first(y); t < m.cy.last(y); ++t) {
+						const float w = m.cy.taps[t].weight;
+						const float* src = s.window[m.cy.taps[t].index - s.windowFirst].data();
+						for (int c = 0; c < rowFloats; ++c)
+							row[c] += src[c] * w;
+					}
+					encode_row(m, row.data(), encoded.data() + i * dstRowBytes);
+				},
+				threads);
 
-				// Load the image data into the dest now
-				file->SetData(uiFrame, uiFace, uiSlice, 0, static_cast<vlByte*>(newData));
+			if (!s.writer.add(encoded.data(), count, threads))
+				return false;
 
-				free(newData);
+			// The next level filters this one as stored, quantization and all, same as generate_mipmaps
+			if (index + 1 < levels.size()) {
+				const auto& next = levels[index + 1].m;
+				std::vector<float> decoded(size_t(count) * next.srcW * comps);
+				for (int i = 0; i < count; ++i)
+					decode_row(next, encoded.data() + i * dstRowBytes, decoded.data() + size_t(i) * next.srcW * comps);
+				if (!feed_level(levels, index + 1, decoded.data(), s.nextRow, count, threads))
+					return false;
 			}
+			s.nextRow += count;
+		}
+
+		// Drop the rows no remaining output row needs
+		const int keepFrom = s.nextRow < m.dstH ? m.cy.taps[m.cy.first(s.nextRow)].index : available;
+		while (!s.window.empty() && s.windowFirst < keepFrom) {
+			s.window.pop_front();
+			++s.windowFirst;
 		}
+		return true;
 	}
 
+	//
+	// Running sums for CVTFFile::ComputeReflectivity, which averages the gamma 2.2 decoded colour of the base level
+	//
+	struct Reflectivity {
+		double sum[3] = {};
+		size_t pixels = 0;
+
+		void add(const vlByte* rows, int numPixels, const MipFormat& fmt) {
+			static const auto table = []()
+			{
+				std::array<float, 256> t{};
+				for (int i = 0; i < 256; ++i)
+					t[i] = std::pow(i / 255.f, 2.2f);
+				return t;
+			}();
+
+			// Intensity formats expand to grey, like VTFLib's conversion to RGBA8888 does
+			for (int i = 0; i < numPixels; ++i) {
+				for (int c = 0; c < 3; ++c) {
+					const int index = i * fmt.comps + (fmt.comps >= 3 ? c : 0);
+					switch (fmt.type) {
+						case imglib::ChannelType::UInt8:
+							sum[c] += table[rows[index]];
+							break;
+						case imglib::ChannelType::UInt16:
+							sum[c] += table[reinterpret_cast<const uint16_t*>(rows)[index] >> 8];
+							break;
+						case imglib::ChannelType::Half: {
+							const float v = lwiconv::half_to_float(reinterpret_cast<const lwiconv::half*>(rows)[index]);
+							sum[c] += table[int(std::clamp(v, 0.f, 1.f) * 255.f)];
+							break;
+						}
+						default:
+							sum[c] += table[int(std::clamp(reinterpret_cast<const float*>(rows)[index], 0.f, 1.f) * 255.f)];
+							break;
+					}
+				}
+			}
+			pixels += numPixels;
+		}
+	};
+} // namespace
+
+bool vtf::build_streamed(
+	CVTFFile* file, VTFImageFormat procFormat, int rowsPerBand, const RowSource& source, bool srgb,
+	bcn::Quality quality, int threads) {
+	MipFormat fmt;
+	if (!get_mip_format(procFormat, fmt) || file->GetFrameCount() != 1 ||
+		file->GetFaceCount() != 1 || file->GetDepth() != 1)
+		return false;
+
+	const int width = file->GetWidth();
+	const int height = file->GetHeight();
+	const int mipCount = file->GetMipmapCount();
+	rowsPerBand = std::clamp(rowsPerBand, 1, height);
+
+	// The thumbnail is made from the smallest level that still covers it, or the base if the image is smaller
+	int thumbLevel = -1;
+	std::vector<vlByte> thumbSource;
+	if (file->GetHasThumbnail()) {
+		thumbLevel = 0;
+		for (int level = 1; level < mipCount; ++level) {
+			vlUInt w, h, d;
+			CVTFFile::ComputeMipmapDimensions(width, height, 1, level, w, h, d);
+			if (w < file->GetThumbnailWidth() || h < file->GetThumbnailHeight())
+				break;
+			thumbLevel = level;
+		}
+	}
+
+	auto make_writer = [&](int level, int w, int h)
+	{
+		LevelWriter writer{file, level, w, h, procFormat, quality, imglib::pixel_size(fmt.type, fmt.comps) * w, {}};
+		if (level == thumbLevel)
+			writer.keep = &thumbSource;
+		return writer;
+	};
+
+	LevelWriter baseWriter = make_writer(0, width, height);
+	std::vector<StreamLevel> levels;
+	levels.reserve(mipCount);
+	vlUInt srcW = width, srcH = height;
+	for (int level = 1; level < mipCount; ++level) {
+		vlUInt dstW, dstH, dstD;
+		CVTFFile::ComputeMipmapDimensions(width, height, 1, level, dstW, dstH, dstD);
+		levels.push_back({
+			.m =
+				{
+					.file = file,
+					.fmt = fmt,
+					.srgb = srgb && !is_float(fmt.type),
+					.level = level,
+					.srcW = int(srcW),
+					.srcH = int(srcH),
+					.srcD = 1,
+					.dstW = int(dstW),
+					.dstH = int(dstH),
+					.dstD = 1,
+					.cx = make_contribs(srcW, dstW),
+					.cy = make_contribs(srcH, dstH),
+					.cz = make_contribs(1, 1),
+				},
+			.writer = make_writer(level, dstW, dstH),
+			.window = {},
+		});
+		srcW = dstW;
+		srcH = dstH;
+	}
+
+	Reflectivity reflectivity;
+	std::vector<vlByte> band(baseWriter.rowBytes * rowsPerBand);
+	std::vector<float> decoded;
+	for (int row = 0; row < height; row += rowsPerBand) {
+		const int numRows = std::min(rowsPerBand, height - row);
+		if (!source(row, numRows, band.data()))
+			return false;
+
+		reflectivity.add(band.data(), numRows * width, fmt);
+		if (!baseWriter.add(band.data(), numRows, threads))
+			return false;
+
+		if (!levels.empty()) {
+			const auto& m = levels[0].m;
+			decoded.resize(size_t(numRows) * width * fmt.comps);
+			for (int i = 0; i < numRows; ++i)
+				decode_row(m, band.data() + i * baseWriter.rowBytes, decoded.data() + size_t(i) * width * fmt.comps);
+			if (!feed_level(levels, 0, decoded.data(), row, numRows, threads))
+				return false;
+		}
+	}
+
+	const auto pixels = double(std::max<size_t>(reflectivity.pixels, 1));
+	file->SetReflectivity(
+		vlSingle(reflectivity.sum[0] / pixels), vlSingle(reflectivity.sum[1] / pixels),
+		vlSingle(reflectivity.sum[2] / pixels));
+
+	if (thumbLevel >= 0) {
+		vlUInt w, h, d;
+		CVTFFile::ComputeMipmapDimensions(width, height, 1, thumbLevel, w, h, d);
+		const int thumbW = file->GetThumbnailWidth(), thumbH = file->GetThumbnailHeight();
+		std::vector<vlByte> resized(imglib::bytes_for_image(thumbW, thumbH, fmt.type, fmt.comps));
+		std::vector<vlByte> thumbnail(CVTFFile::ComputeImageSize(thumbW, thumbH, 1, file->GetThumbnailFormat()));
+		if (!imglib::resize_into(thumbSource.data(), resized.data(), fmt.type, fmt.comps, w, h, thumbW, thumbH) ||
+			!CVTFFile::Convert(resized.data(), thumbnail.data(), thumbW, thumbH, procFormat, file->GetThumbnailFormat()))
+			return false;
+		file->SetThumbnailData(thumbnail.data());
+	}
+	return true;
+}
+
+//
+// Have VTFLib serialize file into out, as is
+//
+static bool save_raw(const CVTFFile* file, std::vector<std::uint8_t>& out) {
+	// VTFLib won't tell us the serialized size up front, but it can't be more than the raw image, thumbnail and
+	// resource data plus the largest possible header. DEFLATE compressed files only ever come out smaller
+	size_t size = 80 + VTF_RSRC_MAX_DICTIONARY_ENTRIES * 8 + size_t(file->GetSize());
+	if (file->GetHasThumbnail())
+		size += CVTFFile::ComputeImageSize(
+			file->GetThumbnailWidth(), file->GetThumbnailHeight(), 1, file->GetThumbnailFormat());
+	for (vlUInt i = 0; i < file->GetResourceCount(); ++i) {
+		vlUInt rsrcSize = 0;
+		if (file->GetResourceData(file->GetResourceType(i), rsrcSize))
+			size += sizeof(vlUInt) + rsrcSize;
+	}
+
+	out.resize(size);
+	vlUInt written = 0;
+	if (!file->Save(out.data(), vlUInt(out.size()), written)) {
+		out.clear();
+		return false;
+	}
+	out.resize(written);
 	return true;
-}
\ No newline at end of file
+}
+
+bool vtf::save_to_memory(CVTFFile* file, std::vector<std::uint8_t>& out, int threads) {
+	// VTFLib compresses one stream after the other, so have it write the file uncompressed and compress that instead.
+	// Should that fail for whatever reason, VTFLib can still do it
+	const int level = file->GetAuxCompressionLevel();
+	if (level > 0 && file->GetMajorVersion() == 7 && file->GetMinorVersion() >= 6) {
+		std::vector<std::uint8_t> raw;
+		file->SetAuxCompressionLevel(0);
+		const bool saved = save_raw(file, raw);
+		file->SetAuxCompressionLevel(level);
+
+		std::string err;
+		if (saved && vtf::deflate(raw.data(), raw.size(), level, out, err, threads))
+			return true;
+	}
+	return save_raw(file, out);
+}
+
+bool vtf::save(CVTFFile* file, const std::string& path, int threads) {
+	if (file->GetAuxCompressionLevel() <= 0)
+		return file->Save(path.c_str());
+
+	std::vector<std::uint8_t> data;
+	if (!save_to_memory(file, data, threads))
+		return false;
+
+	FILE* fp = fopen(path.c_str(), "wb");
+	if (!fp)
+		return false;
+	const bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+	return fclose(fp) == 0 && ok;
+}
+
+bool vtf::load(CVTFFile* file, const void* data, std::size_t size, bool headerOnly, int threads) {
+	// Header only loads never touch the image data, compressed or not
+	vtf::HeaderInfo info;
+	std::string err;
+	if (!headerOnly && vtf::read_header(data, size, info, err) && info.compressionLevel > 0) {
+		std::vector<std::uint8_t> raw;
+		int level = 0;
+		if (vtf::inflate(data, size, raw, level, err, threads)) {
+			if (!file->Load(raw.data(), vlUInt(raw.size()), vlFalse))
+				return false;
+			file->SetAuxCompressionLevel(level);
+			return true;
+		}
+	}
+	return file->Load(data, vlUInt(size), headerOnly);
+}
@@ -1,10 +1,15 @@
 
 #pragma once
 
-namespace VTFLib
-{
-	class CVTFFile;
-}
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "VTFLib.h"
+
+#include "bcn.hpp"
 
 namespace vtf
 {
@@ -13,8 +18,91 @@ namespace vtf
 	 * @param srcFile file to draw data from
 	 * @param newWidth New width
 	 * @param newHeight New height
-	 * @param file File to write data to
+	 * @param file File to write data to. Must already be initialized with the new size and the same format as srcFile
+	 * @param threads Max number of threads to use. <= 0 means use all hardware threads
 	 * @returns true if the resize passed
 	 */
-	bool resize(const VTFLib::CVTFFile* srcFile, int newWidth, int newHeight, VTFLib::CVTFFile* file);
+	bool resize(const VTFLib::CVTFFile* srcFile, int newWidth, int newHeight, VTFLib::CVTFFile* file, int threads = 0);
+
+	/**
+	 * Generate the full mip chain of file from its base level, for every frame, face and slice.
+	 * Each level is filtered down from the level before it with a Catmull-Rom filter, and written straight into the
+	 * file's mip slots. Volume textures are filtered along depth too.
+	 * Only uncompressed RGBA8888, RGB888, I8, IA88, RGBA16161616, RGBA16161616F, RGBA32323232F, RGB323232F and R32F
+	 * data is supported, for anything else this returns false without touching the file.
+	 * @param srgb If true, RGB is filtered in linear space. Alpha is always treated as linear
+	 * @param threads Max number of threads to use. <= 0 means use all hardware threads
+	 */
+	bool generate_mipmaps(VTFLib::CVTFFile* file, bool srgb, int threads = 0);
+
+	/**
+	 * Convert every frame, face, slice and mip of srcFile to format, split into bands of rows across threads.
+	 * DXT1/DXT3/DXT5/ATI1N/ATI2N/BC7 from RGBA8888 go through our own block encoder at the requested quality,
+	 * everything else goes through VTFLib's converters. quality has no effect on those.
+	 * @param threads Max number of threads to use. <= 0 means use all hardware threads
+	 * @returns A new file with all of srcFile's properties and resources carried over, or nullptr on failure
+	 */
+	std::unique_ptr<VTFLib::CVTFFile>
+	convert(const VTFLib::CVTFFile* srcFile, VTFImageFormat format, bcn::Quality quality, int threads = 0);
+
+	/**
+	 * Returns every slice of one frame, face and mip of a source, in the source's format. The data only has to stay
+	 * valid while the returned pointer is held. nullptr on failure
+	 */
+	using ImageSource = std::function<std::shared_ptr<const vlByte>(int frame, int face, int mip)>;
+
+	/**
+	 * Convert like above, but read the image data from source one frame, face and mip at a time instead of from
+	 * srcFile, which only has to provide the properties (ie. a header only load). Each image is converted in bands
+	 * across threads and let go of before the next one is fetched, so only one source image is held at a time.
+	 * Images already in format are copied as is.
+	 * @returns A new file with all of srcFile's properties and resources carried over, or nullptr on failure
+	 */
+	std::unique_ptr<VTFLib::CVTFFile> convert(
+		const VTFLib::CVTFFile* srcFile, const ImageSource& source, VTFImageFormat format, bcn::Quality quality,
+		int threads = 0);
+
+	/**
+	 * Produces rows [firstRow, firstRow + numRows) of a base level image into out, tightly packed
+	 */
+	using RowSource = std::function<bool(int firstRow, int numRows, void* out)>;
+
+	/**
+	 * Fill in the base level and full mip chain of file one band of rows at a time, instead of building the whole
+	 * image in procFormat, generating mips and converting it in one go. Every band is filtered down the mip chain and
+	 * converted to file's format as soon as it's ready, so only a few dozen rows of each level ever exist uncompressed.
+	 * The image data matches what generate_mipmaps followed by convert would give. The reflectivity and thumbnail
+	 * (if the file has one) are computed along the way, since VTFLib would need the full uncompressed image for them.
+	 * Only single frame, face and slice files are supported.
+	 * @param file Initialized in its final format, with the size and mip count wanted
+	 * @param procFormat Format source produces rows in. Any uncompressed format generate_mipmaps supports
+	 * @param rowsPerBand Number of rows requested from source at a time
+	 * @param srgb If true, mips are filtered in linear space (see generate_mipmaps)
+	 * @param threads Max number of threads to use. <= 0 means use all hardware threads
+	 */
+	bool build_streamed(
+		VTFLib::CVTFFile* file, VTFImageFormat procFormat, int rowsPerBand, const RowSource& source, bool srgb,
+		bcn::Quality quality, int threads = 0);
+
+	/**
+	 * Serialize file to an in-memory VTF, for writing somewhere other than a file on disk
+	 * If the file has a DEFLATE compression level set, the image data is compressed across threads by vtf::deflate
+	 * rather than by VTFLib
+	 * @param out Receives the complete VTF file
+	 * @param threads Max number of threads to use. <= 0 means use all hardware threads
+	 */
+	bool save_to_memory(VTFLib::CVTFFile* file, std::vector<std::uint8_t>& out, int threads = 0);
+
+	/**
+	 * Save file to path. Same as CVTFFile::Save, with DEFLATE compression done like save_to_memory
+	 * @param threads Max number of threads to use. <= 0 means use all hardware threads
+	 */
+	bool save(VTFLib::CVTFFile* file, const std::string& path, int threads = 0);
+
+	/**
+	 * Load a VTF from memory. Same as CVTFFile::Load, except that DEFLATE compressed image data is decompressed
+	 * across threads by vtf::inflate first. The file keeps its compression level, so it's compressed again on save
+	 * @param threads Max number of threads to use. <= 0 means use all hardware threads
+	 */
+	bool load(VTFLib::CVTFFile* file, const void* data, std::size_t size, bool headerOnly = false, int threads = 0);
 } // namespace vtf
\ No newline at end of file
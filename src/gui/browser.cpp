@@ -0,0 +1,155 @@
+#include "browser.hpp"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QImage>
+#include <QLabel>
+#include <QListWidget>
+#include <QPixmap>
+#include <QStandardPaths>
+#include <QVBoxLayout>
+
+#include <algorithm>
+
+#include "VTFLib.h"
+
+#include "common/vtfheader.hpp"
+
+using namespace vtfview;
+using namespace VTFLib;
+
+BrowserWidget::BrowserWidget(QWidget* parent)
+	: QWidget(parent),
+	  generation_(std::make_shared<std::atomic<int>>(0)) {
+	cacheDir_ = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/thumbnails";
+	QDir().mkpath(cacheDir_);
+	setup_ui();
+}
+
+BrowserWidget::~BrowserWidget() {
+	// Tasks post results back to us, so they all have to be done before we go. A failed thumbnail has nowhere to go now
+	cancel();
+	try {
+		tasks_.wait();
+	}
+	catch (...) {
+	}
+}
+
+void BrowserWidget::setup_ui() {
+	auto* layout = new QVBoxLayout(this);
+
+	list_ = new QListWidget(this);
+	list_->setViewMode(QListView::IconMode);
+	list_->setIconSize(QSize(THUMBNAIL_SIZE, THUMBNAIL_SIZE));
+	list_->setGridSize(QSize(THUMBNAIL_SIZE + 24, THUMBNAIL_SIZE + 32));
+	list_->setResizeMode(QListView::Adjust);
+	list_->setMovement(QListView::Static);
+	list_->setUniformItemSizes(true);
+	list_->setWordWrap(true);
+	connect(
+		list_, &QListWidget::itemActivated,
+		[this](QListWidgetItem* item)
+		{
+			emit fileActivated(item->data(Qt::UserRole).toString());
+		});
+	layout->addWidget(list_);
+
+	status_ = new QLabel(this);
+	layout->addWidget(status_);
+}
+
+void BrowserWidget::cancel() {
+	++*generation_;
+	tasks_.cancel();
+}
+
+//
+// Load a thumbnail from the disk cache, or build it from the VTF and add it to the cache
+// Runs on the pool
+//
+static QImage load_thumbnail(const QString& path, const QString& cacheDir) {
+	const QFileInfo info(path);
+	const auto key = QCryptographicHash::hash(
+						 (info.absoluteFilePath() + "|" + QString::number(info.lastModified().toMSecsSinceEpoch()) +
+						  "|" + QString::number(BrowserWidget::THUMBNAIL_SIZE))
+							 .toUtf8(),
+						 QCryptographicHash::Sha1)
+						 .toHex();
+	const auto cachePath = cacheDir + "/" + key + ".png";
+
+	QImage image(cachePath);
+	if (!image.isNull())
+		return image;
+
+	vtf::PreviewImage preview;
+	std::string err;
+	if (!vtf::read_preview(path.toStdString(), BrowserWidget::THUMBNAIL_SIZE, preview, err))
+		return {};
+
+	image = QImage(preview.width, preview.height, QImage::Format_RGBA8888);
+	if (image.isNull() || !CVTFFile::Convert(
+							  preview.data.data(), image.bits(), preview.width, preview.height, preview.format,
+							  IMAGE_FORMAT_RGBA8888))
+		return {};
+
+	if (std::max(image.width(), image.height()) > BrowserWidget::THUMBNAIL_SIZE)
+		image = image.scaled(
+			BrowserWidget::THUMBNAIL_SIZE, BrowserWidget::THUMBNAIL_SIZE, Qt::KeepAspectRatio,
+			Qt::SmoothTransformation);
+
+	image.save(cachePath, "PNG");
+	return image;
+}
+
+void BrowserWidget::set_directory(const QString& dir) {
+	cancel();
+	list_->clear();
+	numLoaded_ = 0;
+
+	QStringList files;
+	QDirIterator it(dir, {"*.vtf"}, QDir::Files, QDirIterator::Subdirectories);
+	while (it.hasNext())
+		files.push_back(it.next());
+	files.sort(Qt::CaseInsensitive);
+
+	// Blank placeholder, so every item takes up its spot in the grid straight away
+	QPixmap placeholder(THUMBNAIL_SIZE, THUMBNAIL_SIZE);
+	placeholder.fill(Qt::transparent);
+	const QIcon placeholderIcon(placeholder);
+
+	const QDir base(dir);
+	const int generation = *generation_;
+	for (int row = 0; row < files.size(); ++row) {
+		auto* item = new QListWidgetItem(placeholderIcon, base.relativeFilePath(files[row]), list_);
+		item->setData(Qt::UserRole, files[row]);
+		item->setToolTip(files[row]);
+
+		tasks_.run(
+			[this, token = generation_, generation, row, path = files[row], cacheDir = cacheDir_]
+			{
+				if (*token != generation)
+					return;
+				auto image = load_thumbnail(path, cacheDir);
+				QMetaObject::invokeMethod(
+					this, [this, generation, row, image] { thumbnail_loaded(generation, row, image); },
+					Qt::QueuedConnection);
+			});
+	}
+
+	status_->setText(tr("%1 file(s)").arg(files.size()));
+}
+
+void BrowserWidget::thumbnail_loaded(int generation, int row, const QImage& image) {
+	if (generation != *generation_)
+		return;
+
+	if (!image.isNull())
+		list_->item(row)->setIcon(QIcon(QPixmap::fromImage(image)));
+
+	++numLoaded_;
+	status_->setText(tr("%1 of %2 file(s) loaded").arg(numLoaded_).arg(list_->count()));
+}
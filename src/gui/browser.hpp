@@ -0,0 +1,56 @@
+#pragma once
+
+#include <QWidget>
+#include <QString>
+
+#include <atomic>
+#include <memory>
+
+#include "common/parallel.hpp"
+
+class QListWidget;
+class QLabel;
+
+namespace vtfview
+{
+
+	/**
+	 * Grid of thumbnails for every VTF in a folder
+	 * Only the header and a single small image are read for each file, on a thread pool. Results are kept in an
+	 * on-disk cache keyed by path and modification time, so revisiting a folder doesn't read the VTFs at all.
+	 */
+	class BrowserWidget : public QWidget {
+		Q_OBJECT;
+
+	public:
+		static constexpr int THUMBNAIL_SIZE = 96;
+
+		BrowserWidget(QWidget* parent = nullptr);
+		~BrowserWidget() override;
+
+		/**
+		 * List all VTFs in dir and its subdirectories, and start loading their thumbnails
+		 */
+		void set_directory(const QString& dir);
+
+	signals:
+		/**
+		 * Invoked when a file is double clicked
+		 */
+		void fileActivated(const QString& path);
+
+	private:
+		void setup_ui();
+		void cancel();
+		void thumbnail_loaded(int generation, int row, const QImage& image);
+
+		QListWidget* list_ = nullptr;
+		QLabel* status_ = nullptr;
+
+		util::TaskGroup tasks_; // Shares the process wide pool with imglib
+		std::shared_ptr<std::atomic<int>> generation_; // Bumped on every change of directory, shared with the tasks
+		QString cacheDir_;
+		int numLoaded_ = 0;
+	};
+
+} // namespace vtfview
@@ -0,0 +1,171 @@
+#include "decoder.hpp"
+#include "document.hpp"
+
+#include <iostream>
+
+using namespace vtfview;
+using namespace VTFLib;
+
+DecodeCache::DecodeCache(std::function<void()> onDecoded)
+	: onDecoded_(std::move(onDecoded)) {
+	thread_ = std::thread([this] { worker(); });
+}
+
+DecodeCache::~DecodeCache() {
+	{
+		std::lock_guard lock(mutex_);
+		quit_ = true;
+	}
+	wake_.notify_all();
+	thread_.join();
+}
+
+void DecodeCache::set_file(const CVTFFile* file, Document* doc) {
+	std::unique_lock lock(mutex_);
+	queue_.clear();
+
+	// The worker might still be reading from the old file
+	idle_.wait(lock, [this] { return !busy_; });
+
+	file_ = file;
+	doc_ = file ? doc : nullptr;
+	++generation_;
+	lru_.clear();
+	entries_.clear();
+	used_ = 0;
+}
+
+void DecodeCache::set_budget(std::size_t bytes) {
+	std::lock_guard lock(mutex_);
+	budget_ = bytes;
+}
+
+QImage DecodeCache::find(const Key& key) {
+	std::lock_guard lock(mutex_);
+	auto it = entries_.find(key);
+	if (it == entries_.end())
+		return {};
+
+	lru_.splice(lru_.begin(), lru_, it->second);
+	return it->second->image;
+}
+
+QImage DecodeCache::find_nearest(const Key& key) {
+	std::lock_guard lock(mutex_);
+	if (!file_)
+		return {};
+
+	const int mipCount = file_->GetMipmapCount();
+	for (int dist = 1; dist < mipCount; ++dist) {
+		for (int mip : {key.mip + dist, key.mip - dist}) {
+			auto it = entries_.find({key.frame, key.face, mip});
+			if (it != entries_.end())
+				return it->second->image;
+		}
+	}
+	return {};
+}
+
+void DecodeCache::request(const Key& key) {
+	{
+		std::lock_guard lock(mutex_);
+		if (!file_)
+			return;
+
+		// The requested image first, then whatever the user is likely to look at next. Smaller mips are cheap, and
+		// double as a placeholder for anything larger that's still pending
+		queue_.clear();
+		const Key candidates[] = {
+			key,
+			{key.frame, key.face, key.mip + 1},
+			{key.frame + 1, key.face, key.mip},
+			{key.frame - 1, key.face, key.mip},
+			{key.frame, key.face, key.mip - 1},
+			{key.frame + 2, key.face, key.mip},
+			{key.frame, key.face + 1, key.mip},
+		};
+		for (auto& k : candidates) {
+			if (in_range(k) && entries_.find(k) == entries_.end())
+				queue_.push_back(k);
+		}
+	}
+	wake_.notify_one();
+}
+
+bool DecodeCache::in_range(const Key& key) const {
+	return key.frame >= 0 && key.frame < int(file_->GetFrameCount()) && key.face >= 0 &&
+		   key.face < int(file_->GetFaceCount()) && key.mip >= 0 && key.mip < int(file_->GetMipmapCount());
+}
+
+void DecodeCache::worker() {
+	std::unique_lock lock(mutex_);
+	while (true) {
+		wake_.wait(lock, [this] { return quit_ || !queue_.empty(); });
+		if (quit_)
+			return;
+
+		const auto key = queue_.front();
+		queue_.pop_front();
+		if (entries_.find(key) != entries_.end())
+			continue;
+
+		// Decode without holding the lock, so the GUI thread can keep painting from the cache in the meantime.
+		// set_file() waits for busy_ to clear before the file goes away
+		const auto generation = generation_;
+		busy_ = true;
+		lock.unlock();
+
+		auto image = decode(key);
+
+		lock.lock();
+		busy_ = false;
+		idle_.notify_all();
+
+		if (image.isNull() || generation != generation_)
+			continue;
+
+		insert(key, image);
+
+		lock.unlock();
+		onDecoded_();
+		lock.lock();
+	}
+}
+
+QImage DecodeCache::decode(const Key& key) const {
+	vlUInt width, height, depth;
+	CVTFFile::ComputeMipmapDimensions(
+		file_->GetWidth(), file_->GetHeight(), file_->GetDepth(), key.mip, width, height, depth);
+
+	// Always decode to 4 channels, so there's no scanline padding to deal with. QImage owns the buffer
+	const bool hasAlpha = CVTFFile::GetImageFormatInfo(file_->GetFormat()).uiAlphaBitsPerPixel > 0;
+	QImage image(int(width), int(height), hasAlpha ? QImage::Format_RGBA8888 : QImage::Format_RGBX8888);
+	if (image.isNull())
+		return {};
+
+	// Only this one image is read in (or decompressed), not the whole file
+	const auto data = doc_ ? doc_->image_data(key.frame, key.face, key.mip) : nullptr;
+	if (!data)
+		return {};
+
+	if (!CVTFFile::Convert(
+			const_cast<vlByte*>(data.get()), image.bits(), width, height, file_->GetFormat(), IMAGE_FORMAT_RGBA8888)) {
+		std::cerr << "Could not convert image for display.\n";
+		return {};
+	}
+	return image;
+}
+
+void DecodeCache::insert(const Key& key, const QImage& image) {
+	lru_.push_front({key, image});
+	entries_[key] = lru_.begin();
+	used_ += image.sizeInBytes();
+
+	// Evict the least recently used images until we're back in budget, but always keep the one we just decoded
+	while (used_ > budget_ && lru_.size() > 1) {
+		auto& last = lru_.back();
+		used_ -= last.image.sizeInBytes();
+		entries_.erase(last.key);
+		lru_.pop_back();
+	}
+}
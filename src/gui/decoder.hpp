@@ -0,0 +1,115 @@
+#pragma once
+
+#include <QImage>
+
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <unordered_map>
+
+#include "VTFLib.h"
+
+namespace vtfview
+{
+	class Document;
+
+	/**
+	 * Decodes VTF images to displayable QImages on a background thread, and keeps the results around in an LRU cache
+	 * with a memory budget. Neighbouring frames and mips are prefetched, so scrubbing through a texture mostly hits
+	 * the cache.
+	 */
+	class DecodeCache {
+	public:
+		struct Key {
+			int frame = 0;
+			int face = 0;
+			int mip = 0;
+
+			bool operator==(const Key& other) const {
+				return frame == other.frame && face == other.face && mip == other.mip;
+			}
+		};
+
+		/**
+		 * @param onDecoded Invoked on the worker thread whenever an image lands in the cache
+		 */
+		explicit DecodeCache(std::function<void()> onDecoded);
+		~DecodeCache();
+
+		DecodeCache(const DecodeCache&) = delete;
+		DecodeCache& operator=(const DecodeCache&) = delete;
+
+		/**
+		 * Switch to a different file, or nullptr for none. Drops the cache and all pending work, and waits for an
+		 * in-flight decode of the old file to finish. Once this returns, the old file is no longer touched.
+		 * Image data is fetched through doc, which file belongs to
+		 */
+		void set_file(const VTFLib::CVTFFile* file, Document* doc = nullptr);
+
+		/**
+		 * Max amount of decoded image data to keep around, in bytes
+		 */
+		void set_budget(std::size_t bytes);
+
+		/**
+		 * Returns the decoded image for key, or a null image if it's not in the cache
+		 */
+		QImage find(const Key& key);
+
+		/**
+		 * Returns the closest decoded mip of the same frame and face, or a null image if there's none yet.
+		 * Smaller mips are preferred over larger ones, since they are what finishes first
+		 */
+		QImage find_nearest(const Key& key);
+
+		/**
+		 * Queue key for decoding, followed by its neighbours. Replaces whatever was queued up before, so the image
+		 * that's actually on screen always comes first
+		 */
+		void request(const Key& key);
+
+	private:
+		struct KeyHash {
+			std::size_t operator()(const Key& key) const {
+				return std::hash<std::uint64_t>()(
+					(std::uint64_t(key.frame) << 32) | (std::uint64_t(key.face) << 16) | std::uint64_t(key.mip));
+			}
+		};
+
+		struct Entry {
+			Key key;
+			QImage image;
+		};
+
+		void worker();
+		QImage decode(const Key& key) const;
+		void insert(const Key& key, const QImage& image);
+		bool in_range(const Key& key) const;
+
+		std::function<void()> onDecoded_;
+
+		const VTFLib::CVTFFile* file_ = nullptr;
+		Document* doc_ = nullptr;
+		std::uint64_t generation_ = 0; // Bumped on every file change, so stale decodes are thrown away
+		std::size_t budget_ = 256 * 1024 * 1024;
+		std::size_t used_ = 0;
+
+		// Most recently used at the front
+		std::list<Entry> lru_;
+		std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> entries_;
+
+		std::deque<Key> queue_;
+		bool busy_ = false;
+		bool quit_ = false;
+
+		std::mutex mutex_;
+		std::condition_variable wake_;
+		std::condition_variable idle_;
+		std::thread thread_;
+	};
+
+} // namespace vtfview
@@ -2,17 +2,33 @@
 #include <QFileDialog>
 #include <QMessageBox>
 
+#include <algorithm>
+#include <cstdlib>
+
 #include <fmt/format.h>
 #include "nameof.hpp"
 
 #include "document.hpp"
 #include "common/util.hpp"
+#include "common/mapped_file.hpp"
 #include "common/enums.hpp"
+#include "common/vtftools.hpp"
+#include "common/vtfdeflate.hpp"
 
 using namespace vtfview;
 
+//
+// Decompressed image data cached per document, unless VTFVIEW_MEMORY_BUDGET says otherwise (in MiB)
+//
+static std::size_t default_budget() {
+	if (const char* env = std::getenv("VTFVIEW_MEMORY_BUDGET"); env && *env)
+		return std::size_t(std::max(std::atoll(env), 1LL)) * 1024 * 1024;
+	return std::size_t(512) * 1024 * 1024;
+}
+
 Document::Document(QObject* parent)
-	: QObject(parent) {
+	: QObject(parent),
+	  budget_(default_budget()) {
 }
 
 void Document::new_file() {
@@ -40,30 +56,65 @@ bool Document::save(const std::string& path) {
 	if (!dirty_)
 		return true;
 
-	// Image needs converting
-	if (format_ != IMAGE_FORMAT_NONE) {
-		fmt::print(
-			"Converting image from {} to {} on save...\n", NAMEOF_ENUM(file_->GetFormat()), NAMEOF_ENUM(format_));
-		if (!file_->ConvertInPlace(format_))
+	const auto outPath = path.empty() ? path_ : path;
+	const auto format = format_ != IMAGE_FORMAT_NONE ? format_ : file_->GetFormat();
+
+	// Header only files have to be filled in from the source, and conversions are done a frame, face and mip at a
+	// time so the source is never decoded in full. Either way a new file is built while the source is still around
+	const bool rebuild = lazy_ || format != file_->GetFormat();
+	if (rebuild) {
+		if (format != file_->GetFormat())
+			fmt::print(
+				"Converting image from {} to {} on save...\n", NAMEOF_ENUM(file_->GetFormat()), NAMEOF_ENUM(format));
+		emit vtfFileAboutToChange();
+		auto converted = vtf::convert(
+			file_, [this](int frame, int face, int mip) { return image_data(frame, face, mip); }, format,
+			bcn::Quality::Normal);
+
+		// Header only loads don't bring the thumbnail along either
+		vtf::ImageLocation thumbnail;
+		std::string err;
+		if (converted && lazy_ && converted->GetHasThumbnail() &&
+			converted->GetThumbnailFormat() == info_.thumbnailFormat &&
+			int(converted->GetThumbnailWidth()) == info_.thumbnailWidth &&
+			int(converted->GetThumbnailHeight()) == info_.thumbnailHeight &&
+			vtf::locate_thumbnail(source_size(), info_, thumbnail, err))
+			converted->SetThumbnailData(const_cast<vlByte*>(source_data() + thumbnail.offset));
+
+		if (converted) {
+			// The source may be the file we're about to overwrite, so let go of it first
+			release_source();
+			delete file_;
+			file_ = converted.release();
+			format_ = IMAGE_FORMAT_NONE;
+		}
+		emit vtfFileChanged(path_, file_);
+		if (!converted)
 			return false;
 	}
 
-	if (!file_->Save(path.empty() ? path_.c_str() : path.c_str())) {
+	if (!vtf::save(file_, outPath)) {
 		return false;
 	}
 
+	// The images are on disk now, go back to reading them from there instead of holding all of them
+	if (rebuild) {
+		util::MappedFile mapped;
+		if (mapped.open(outPath) && load_file_internal(std::move(mapped), {}))
+			emit vtfFileChanged(path_, file_);
+	}
+
 	unmark_modified();
 	return true;
 }
 
 bool Document::load_file(const char* path) {
-	std::uint8_t* buffer;
-	auto numRead = util::read_file(path, buffer);
-	if (!numRead)
+	util::MappedFile mapped;
+	if (!mapped.open(path))
 		return false;
 
-	bool ok = load_file_internal(buffer, numRead);
-	delete[] buffer;
+	// The mapping stays open, image data is read out of it as needed
+	bool ok = load_file_internal(std::move(mapped), {});
 
 	path_ = path;
 	emit vtfFileChanged(path_, file_);
@@ -71,13 +122,17 @@ bool Document::load_file(const char* path) {
 }
 
 bool Document::load_file(const void* data, size_t size) {
-	if (!load_file_internal(data, size))
+	const auto* bytes = static_cast<const std::uint8_t*>(data);
+	if (!load_file_internal({}, std::vector<std::uint8_t>(bytes, bytes + size)))
 		return false;
 	emit vtfFileChanged("", file_);
 	return true;
 }
 
 bool Document::load_file(VTFLib::CVTFFile* file) {
+	emit vtfFileAboutToChange();
+	release_source();
+	delete file_;
 	file_ = file;
 	emit vtfFileChanged("", file);
 	path_ = "";
@@ -87,7 +142,9 @@ bool Document::load_file(VTFLib::CVTFFile* file) {
 void Document::unload_file() {
 	if (!file_)
 		return;
+	emit vtfFileAboutToChange();
 	emit vtfFileChanged("", nullptr);
+	release_source();
 	delete file_;
 	file_ = nullptr;
 	path_ = "";
@@ -95,18 +152,125 @@ void Document::unload_file() {
 	format_ = IMAGE_FORMAT_NONE;
 }
 
-bool Document::load_file_internal(const void* data, size_t size) {
-	auto* oldFile = file_;
-	file_ = new VTFLib::CVTFFile();
-	if (!file_->Load(data, size)) {
-		delete file_;
-		file_ = oldFile;
+bool Document::load_file_internal(util::MappedFile mapped, std::vector<std::uint8_t> bytes) {
+	const auto* data = mapped ? mapped.data() : bytes.data();
+	const std::size_t size = mapped ? mapped.size() : bytes.size();
+
+	// Only the header and resources are loaded. The base mip of the last frame and face comes last in the file, so
+	// if that's there, so is everything else
+	vtf::HeaderInfo info;
+	vtf::ImageLocation last;
+	std::string err;
+	auto* file = new VTFLib::CVTFFile();
+	if (!vtf::read_header(data, size, info, err) ||
+		!vtf::locate_image(data, size, info, info.frames - 1, info.faces - 1, 0, last, err) ||
+		!vtf::load(file, data, size, true)) {
+		delete file;
 		return false;
 	}
+
+	auto* oldFile = file_;
+	if (oldFile)
+		emit vtfFileAboutToChange();
+	release_source();
 	delete oldFile;
+
+	file_ = file;
+	mapped_ = std::move(mapped);
+	bytes_ = std::move(bytes);
+	info_ = std::move(info);
+	lazy_ = true;
 	return true;
 }
 
+void Document::release_source() {
+	std::lock_guard lock(cacheMutex_);
+	lru_.clear();
+	entries_.clear();
+	used_ = 0;
+	mapped_.close();
+	bytes_ = {};
+	info_ = {};
+	lazy_ = false;
+}
+
+const std::uint8_t* Document::source_data() const {
+	return mapped_ ? mapped_.data() : bytes_.data();
+}
+
+std::size_t Document::source_size() const {
+	return mapped_ ? mapped_.size() : bytes_.size();
+}
+
+std::shared_ptr<const vlByte> Document::image_data(int frame, int face, int mip) {
+	if (!file_ || frame < 0 || frame >= int(file_->GetFrameCount()) || face < 0 ||
+		face >= int(file_->GetFaceCount()) || mip < 0 || mip >= int(file_->GetMipmapCount()))
+		return nullptr;
+
+	// Held in full, so there's nothing to manage. The pointer doesn't own anything
+	if (!lazy_)
+		return std::shared_ptr<const vlByte>(std::shared_ptr<const vlByte>(), file_->GetData(frame, face, 0, mip));
+	return read_image(frame, face, mip);
+}
+
+std::shared_ptr<const vlByte> Document::read_image(int frame, int face, int mip) {
+	vtf::ImageLocation loc;
+	std::string err;
+	if (!vtf::locate_image(source_data(), source_size(), info_, frame, face, mip, loc, err)) {
+		fmt::print(stderr, "Could not read image data: {}\n", err);
+		return nullptr;
+	}
+
+	// Uncompressed images are used right where they are, and the OS pages them in and out as needed
+	if (!loc.compressed)
+		return std::shared_ptr<const vlByte>(std::shared_ptr<const vlByte>(), source_data() + loc.offset);
+
+	const std::uint64_t key = (std::uint64_t(frame) << 32) | (std::uint64_t(face) << 16) | std::uint64_t(mip);
+	{
+		std::lock_guard lock(cacheMutex_);
+		if (auto it = entries_.find(key); it != entries_.end()) {
+			lru_.splice(lru_.begin(), lru_, it->second);
+			auto data = it->second->data;
+			return std::shared_ptr<const vlByte>(data, data->data());
+		}
+	}
+
+	// Decompress without holding the lock, so other threads can keep hitting the cache in the meantime
+	auto data = std::make_shared<std::vector<vlByte>>(loc.imageSize);
+	if (!vtf::inflate_chunk(source_data() + loc.offset, loc.size, data->data(), data->size())) {
+		fmt::print(stderr, "Could not decompress image data\n");
+		return nullptr;
+	}
+
+	std::lock_guard lock(cacheMutex_);
+	if (entries_.find(key) == entries_.end()) {
+		lru_.push_front({key, data});
+		entries_[key] = lru_.begin();
+		used_ += data->size();
+		evict();
+	}
+	return std::shared_ptr<const vlByte>(data, data->data());
+}
+
+void Document::set_budget(std::size_t bytes) {
+	std::lock_guard lock(cacheMutex_);
+	budget_ = bytes;
+	evict();
+}
+
+//
+// Drop the least recently used images until we're back in budget, but always keep the newest one. Anyone still
+// holding an evicted image keeps it alive until they're done with it
+//
+void Document::evict() {
+	while (used_ > budget_ && lru_.size() > 1) {
+		auto& last = lru_.back();
+		used_ -= last.data->size();
+		entries_.erase(last.key);
+		lru_.pop_back();
+	}
+}
+
 void Document::set_format(VTFImageFormat format) {
 	if (!file_)
 		return;
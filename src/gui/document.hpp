@@ -3,14 +3,29 @@
 
 #include <QObject>
 
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
 #include "VTFLib.h"
 
+#include "common/mapped_file.hpp"
+#include "common/vtfheader.hpp"
+
 namespace vtfview
 {
 
 	/**
 	 * Represents a VTF file document
 	 * Handles saving, loading, etc
+	 *
+	 * VTFs opened from disk or memory are loaded header only: file() carries the properties and resources, and the
+	 * image data stays in the source until image_data asks for it. Uncompressed images are read straight out of the
+	 * mapped file, DEFLATE compressed ones are decompressed one frame, face and mip at a time and cached under a memory
+	 * budget. Files built in memory (imports, new files) are held in full as usual.
 	 */
 	class Document : public QObject {
 		Q_OBJECT;
@@ -50,6 +65,19 @@ namespace vtfview
 
 		void set_format(VTFImageFormat format);
 
+		/**
+		 * Every slice of one frame, face and mip, in the file's format. Stays valid while it's held, even once it
+		 * has been evicted, but not past vtfFileAboutToChange.
+		 * Safe to call from any thread. Returns nullptr if there's no such image or it couldn't be read
+		 */
+		std::shared_ptr<const vlByte> image_data(int frame, int face, int mip);
+
+		/**
+		 * Max amount of decompressed image data to keep cached, in bytes. The default is 512 MiB, or
+		 * VTFVIEW_MEMORY_BUDGET MiB if that's set
+		 */
+		void set_budget(std::size_t bytes);
+
 	signals:
 		/**
 		 * Invoked whenever the vtf changes
@@ -58,6 +86,12 @@ namespace vtfview
 		 */
 		void vtfFileChanged(const std::string& path, VTFLib::CVTFFile* file);
 
+		/**
+		 * Invoked right before the current vtf is freed or its image data is rewritten
+		 * Anything still reading from it, like a background decode, must be done with it once this returns
+		 */
+		void vtfFileAboutToChange();
+
 		/**
 		 * Invoked when the modification state of the VTF changed
 		 * @param modified True if file is modified, false if not
@@ -65,13 +99,37 @@ namespace vtfview
 		void vtfFileModified(bool modified);
 
 	protected:
-		bool load_file_internal(const void* bytes, size_t size);
+		bool load_file_internal(util::MappedFile mapped, std::vector<std::uint8_t> bytes);
 
 	private:
+		struct CachedImage {
+			std::uint64_t key;
+			std::shared_ptr<const std::vector<vlByte>> data;
+		};
+
+		void release_source();
+		const std::uint8_t* source_data() const;
+		std::size_t source_size() const;
+		std::shared_ptr<const vlByte> read_image(int frame, int face, int mip);
+		void evict();
+
 		VTFLib::CVTFFile* file_ = nullptr;
 		bool dirty_ = false;
 		std::string path_;
 		VTFImageFormat format_ = IMAGE_FORMAT_NONE;
+
+		// Where the image data of a header only file_ comes from. One or the other
+		util::MappedFile mapped_;
+		std::vector<std::uint8_t> bytes_;
+		vtf::HeaderInfo info_;
+		bool lazy_ = false;
+
+		// Decompressed images, most recently used at the front
+		std::mutex cacheMutex_;
+		std::size_t budget_;
+		std::size_t used_ = 0;
+		std::list<CachedImage> lru_;
+		std::unordered_map<std::uint64_t, std::list<CachedImage>::iterator> entries_;
 	};
 
 } // namespace vtfview
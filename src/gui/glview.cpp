@@ -0,0 +1,400 @@
+#include "glview.hpp"
+
+#include <QMouseEvent>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QWheelEvent>
+
+#include <cstdlib>
+#include <iostream>
+
+using namespace vtfview;
+using namespace VTFLib;
+
+// Not every GL header has these, the values are fixed by the extension specs
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT	 0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT1_EXT 0x83F1
+#define GL_COMPRESSED_RGBA_S3TC_DXT3_EXT 0x83F2
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+#ifndef GL_COMPRESSED_RED_RGTC1
+#define GL_COMPRESSED_RED_RGTC1 0x8DBB
+#define GL_COMPRESSED_RG_RGTC2	0x8DBD
+#endif
+#ifndef GL_COMPRESSED_RGBA_BPTC_UNORM
+#define GL_COMPRESSED_RGBA_BPTC_UNORM 0x8E8C
+#endif
+#ifndef GL_RGBA16
+#define GL_RGBA16 0x805B
+#endif
+
+static const char* VERTEX_SHADER = R"(
+uniform vec4 u_rect; // Top left and bottom right corners, in NDC
+out vec2 v_uv;
+
+void main() {
+	vec2 corner = vec2(float(gl_VertexID & 1), float(gl_VertexID >> 1));
+	v_uv = corner;
+	gl_Position = vec4(mix(u_rect.xy, u_rect.zw, corner), 0.0, 1.0);
+}
+)";
+
+static const char* FRAGMENT_SHADER = R"(
+uniform sampler2D u_texture;
+uniform bool u_hdr;
+uniform float u_exposure;
+in vec2 v_uv;
+out vec4 o_color;
+
+void main() {
+	vec4 color = texture(u_texture, v_uv);
+	// Float formats are linear, bring them into a displayable range
+	if (u_hdr)
+		color.rgb = pow(clamp(color.rgb * u_exposure, 0.0, 1.0), vec3(1.0 / 2.2));
+	o_color = color;
+}
+)";
+
+GLImageView::GLImageView(Document* doc, QWidget* pParent)
+	: QOpenGLWidget(pParent),
+	  doc_(doc) {
+	setMinimumSize(256, 256);
+}
+
+GLImageView::~GLImageView() {
+	release_gl();
+}
+
+bool GLImageView::available() {
+	if (const char* env = std::getenv("VTFVIEW_SOFTWARE"); env && *env && *env != '0')
+		return false;
+
+	QOffscreenSurface surface;
+	surface.create();
+	QOpenGLContext context;
+	if (!context.create() || !context.makeCurrent(&surface))
+		return false;
+
+	const auto version = context.format().version();
+	const bool ok = context.isOpenGLES() ? version >= qMakePair(3, 0) : version >= qMakePair(3, 3);
+	context.doneCurrent();
+	return ok;
+}
+
+void GLImageView::set_vtf(CVTFFile* file) {
+	file_ = file;
+	frame_ = face_ = mip_ = 0;
+	zoom_ = 1.f;
+	pos_ = {0, 0};
+	needsUpload_ = true;
+	update();
+}
+
+void GLImageView::set_frame(int f) {
+	frame_ = (file_ ? util::clamp(f, 1, file_->GetFrameCount()) : 1) - 1;
+	needsUpload_ = true;
+	update();
+}
+
+void GLImageView::set_face(int f) {
+	face_ = (file_ ? util::clamp(f, 1, file_->GetFaceCount()) : 1) - 1;
+	needsUpload_ = true;
+	update();
+}
+
+void GLImageView::set_mip(int f) {
+	mip_ = (file_ ? util::clamp(f, 1, file_->GetMipmapCount()) : 1) - 1;
+	needsUpload_ = true;
+	update();
+}
+
+void GLImageView::set_exposure(float exposure) {
+	exposure_ = exposure;
+	update();
+}
+
+void GLImageView::zoom(float amount) {
+	if (amount == 0)
+		return;
+	zoom_ += amount;
+	if (zoom_ < 0.1f)
+		zoom_ = 0.1f;
+	update();
+}
+
+void GLImageView::wheelEvent(QWheelEvent* event) {
+	// One notch is 120 units
+	zoom(event->angleDelta().y() / 1200.f);
+	event->accept();
+}
+
+void GLImageView::mousePressEvent(QMouseEvent* event) {
+	dragStart_ = event->position() - pos_;
+	event->accept();
+}
+
+void GLImageView::mouseMoveEvent(QMouseEvent* event) {
+	if (!(event->buttons() & (Qt::LeftButton | Qt::MiddleButton)))
+		return;
+	pos_ = event->position() - dragStart_;
+	update();
+	event->accept();
+}
+
+void GLImageView::initializeGL() {
+	initializeOpenGLFunctions();
+	connect(context(), &QOpenGLContext::aboutToBeDestroyed, this, &GLImageView::release_gl, Qt::DirectConnection);
+
+	auto* ctx = context();
+	const bool es = ctx->isOpenGLES();
+	const auto version = ctx->format().version();
+
+	// RGTC is core since GL 3.0, BPTC since 4.2. ES needs extensions for all of them
+	hasS3TC_ = ctx->hasExtension("GL_EXT_texture_compression_s3tc");
+	hasRGTC_ = !es || ctx->hasExtension("GL_EXT_texture_compression_rgtc");
+	hasBPTC_ = (!es && version >= qMakePair(4, 2)) || ctx->hasExtension("GL_ARB_texture_compression_bptc") ||
+			   ctx->hasExtension("GL_EXT_texture_compression_bptc");
+	hasUnorm16_ = !es || ctx->hasExtension("GL_EXT_texture_norm16");
+
+	const QByteArray header = es ? "#version 300 es\nprecision highp float;\n" : "#version 330 core\n";
+	program_ = std::make_unique<QOpenGLShaderProgram>();
+	if (!program_->addShaderFromSourceCode(QOpenGLShader::Vertex, header + VERTEX_SHADER) ||
+		!program_->addShaderFromSourceCode(QOpenGLShader::Fragment, header + FRAGMENT_SHADER) || !program_->link()) {
+		std::cerr << "Could not compile display shaders: " << program_->log().toStdString() << "\n";
+		program_.reset();
+	}
+
+	// Core profile won't draw without a VAO bound, even though the quad is generated from gl_VertexID
+	vao_.create();
+
+	glGenTextures(1, &texture_);
+	needsUpload_ = true;
+}
+
+void GLImageView::release_gl() {
+	if (!texture_ && !program_)
+		return;
+	makeCurrent();
+	if (texture_)
+		glDeleteTextures(1, &texture_);
+	texture_ = 0;
+	vao_.destroy();
+	program_.reset();
+	doneCurrent();
+}
+
+//
+// Work out how to upload a format without touching the data, if we can
+//
+bool GLImageView::tex_format(VTFImageFormat format, TexFormat& out) const {
+	const auto setSwizzle = [&out](GLint r, GLint g, GLint b, GLint a)
+	{
+		out.swizzle[0] = r;
+		out.swizzle[1] = g;
+		out.swizzle[2] = b;
+		out.swizzle[3] = a;
+	};
+	const auto plain = [&out](GLenum internalFormat, GLenum fmt, GLenum type)
+	{
+		out.internalFormat = internalFormat;
+		out.format = fmt;
+		out.type = type;
+	};
+	const auto compressed = [&out](GLenum internalFormat)
+	{
+		out.compressed = true;
+		out.internalFormat = internalFormat;
+	};
+
+	switch (format) {
+		case IMAGE_FORMAT_RGBA8888:
+			plain(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+			return true;
+		case IMAGE_FORMAT_BGRA8888:
+			plain(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+			setSwizzle(GL_BLUE, GL_GREEN, GL_RED, GL_ALPHA);
+			return true;
+		case IMAGE_FORMAT_BGRX8888:
+			plain(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+			setSwizzle(GL_BLUE, GL_GREEN, GL_RED, GL_ONE);
+			return true;
+		case IMAGE_FORMAT_RGB888:
+			plain(GL_RGB8, GL_RGB, GL_UNSIGNED_BYTE);
+			return true;
+		case IMAGE_FORMAT_BGR888:
+			plain(GL_RGB8, GL_RGB, GL_UNSIGNED_BYTE);
+			setSwizzle(GL_BLUE, GL_GREEN, GL_RED, GL_ONE);
+			return true;
+		case IMAGE_FORMAT_I8:
+			plain(GL_R8, GL_RED, GL_UNSIGNED_BYTE);
+			setSwizzle(GL_RED, GL_RED, GL_RED, GL_ONE);
+			return true;
+		case IMAGE_FORMAT_IA88:
+			plain(GL_RG8, GL_RG, GL_UNSIGNED_BYTE);
+			setSwizzle(GL_RED, GL_RED, GL_RED, GL_GREEN);
+			return true;
+		case IMAGE_FORMAT_A8:
+			plain(GL_R8, GL_RED, GL_UNSIGNED_BYTE);
+			setSwizzle(GL_ONE, GL_ONE, GL_ONE, GL_RED);
+			return true;
+		case IMAGE_FORMAT_UV88:
+			plain(GL_RG8, GL_RG, GL_UNSIGNED_BYTE);
+			setSwizzle(GL_RED, GL_GREEN, GL_ZERO, GL_ONE);
+			return true;
+		case IMAGE_FORMAT_DXT1:
+			compressed(GL_COMPRESSED_RGB_S3TC_DXT1_EXT);
+			return hasS3TC_;
+		case IMAGE_FORMAT_DXT1_ONEBITALPHA:
+			compressed(GL_COMPRESSED_RGBA_S3TC_DXT1_EXT);
+			return hasS3TC_;
+		case IMAGE_FORMAT_DXT3:
+			compressed(GL_COMPRESSED_RGBA_S3TC_DXT3_EXT);
+			return hasS3TC_;
+		case IMAGE_FORMAT_DXT5:
+			compressed(GL_COMPRESSED_RGBA_S3TC_DXT5_EXT);
+			return hasS3TC_;
+		case IMAGE_FORMAT_ATI1N:
+			compressed(GL_COMPRESSED_RED_RGTC1);
+			setSwizzle(GL_RED, GL_RED, GL_RED, GL_ONE);
+			return hasRGTC_;
+		case IMAGE_FORMAT_ATI2N:
+			// ATI2 keeps green in the first half of the block, where RGTC2 has red
+			compressed(GL_COMPRESSED_RG_RGTC2);
+			setSwizzle(GL_GREEN, GL_RED, GL_ZERO, GL_ONE);
+			return hasRGTC_;
+		case IMAGE_FORMAT_BC7:
+			compressed(GL_COMPRESSED_RGBA_BPTC_UNORM);
+			return hasBPTC_;
+		case IMAGE_FORMAT_RGBA16161616:
+			plain(GL_RGBA16, GL_RGBA, GL_UNSIGNED_SHORT);
+			return hasUnorm16_;
+		case IMAGE_FORMAT_RGBA16161616F:
+			plain(GL_RGBA16F, GL_RGBA, GL_HALF_FLOAT);
+			out.hdr = true;
+			return true;
+		case IMAGE_FORMAT_RGBA32323232F:
+			plain(GL_RGBA32F, GL_RGBA, GL_FLOAT);
+			out.hdr = true;
+			out.filterable = false;
+			return true;
+		case IMAGE_FORMAT_RGB323232F:
+			plain(GL_RGB32F, GL_RGB, GL_FLOAT);
+			out.hdr = true;
+			out.filterable = false;
+			return true;
+		case IMAGE_FORMAT_R32F:
+			plain(GL_R32F, GL_RED, GL_FLOAT);
+			setSwizzle(GL_RED, GL_RED, GL_RED, GL_ONE);
+			out.hdr = true;
+			out.filterable = false;
+			return true;
+		default:
+			return false;
+	}
+}
+
+//
+// Upload the current frame/face/mip. Only this one image lives on the GPU, switching is just another upload
+//
+void GLImageView::upload() {
+	needsUpload_ = false;
+	if (!file_)
+		return;
+
+	vlUInt width, height, depth;
+	CVTFFile::ComputeMipmapDimensions(
+		file_->GetWidth(), file_->GetHeight(), file_->GetDepth(), mip_, width, height, depth);
+
+	// Only this one image is read in (or decompressed), not the whole file
+	const auto format = file_->GetFormat();
+	const auto image = doc_->image_data(frame_, face_, mip_);
+	if (!image)
+		return;
+	const vlByte* data = image.get();
+
+	TexFormat tex;
+	if (!tex_format(format, tex)) {
+		// Nothing native for this one, convert it on the CPU like the software view does
+		tex = TexFormat{};
+		tex.internalFormat = GL_RGBA8;
+		tex.format = GL_RGBA;
+		tex.type = GL_UNSIGNED_BYTE;
+
+		scratch_.resize(CVTFFile::ComputeImageSize(width, height, 1, IMAGE_FORMAT_RGBA8888));
+		if (!CVTFFile::Convert(
+				const_cast<vlByte*>(data), scratch_.data(), width, height, format, IMAGE_FORMAT_RGBA8888)) {
+			std::cerr << "Could not convert image for display.\n";
+			return;
+		}
+		data = scratch_.data();
+	}
+	else {
+		scratch_.clear();
+		scratch_.shrink_to_fit();
+	}
+
+	glBindTexture(GL_TEXTURE_2D, texture_);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	if (tex.compressed) {
+		glCompressedTexImage2D(
+			GL_TEXTURE_2D, 0, tex.internalFormat, width, height, 0, CVTFFile::ComputeImageSize(width, height, 1, format),
+			data);
+	}
+	else {
+		glTexImage2D(GL_TEXTURE_2D, 0, tex.internalFormat, width, height, 0, tex.format, tex.type, data);
+	}
+
+	// Nearest when magnifying so individual texels can be inspected, same as the software view
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, tex.filterable ? GL_LINEAR : GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_R, tex.swizzle[0]);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_G, tex.swizzle[1]);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, tex.swizzle[2]);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_A, tex.swizzle[3]);
+	hdr_ = tex.hdr;
+}
+
+void GLImageView::paintGL() {
+	const auto bg = palette().color(backgroundRole());
+	glClearColor(bg.redF(), bg.greenF(), bg.blueF(), 1.f);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	if (!file_ || !program_)
+		return;
+
+	if (needsUpload_)
+		upload();
+
+	vlUInt imageWidth, imageHeight, imageDepth;
+	CVTFFile::ComputeMipmapDimensions(
+		file_->GetWidth(), file_->GetHeight(), file_->GetDepth(), mip_, imageWidth, imageHeight, imageDepth);
+
+	// Centered like the software view, then panned. Everything here is in widget pixels until the NDC conversion
+	const float w = imageWidth * zoom_;
+	const float h = imageHeight * zoom_;
+	const float x0 = (width() - w) / 2 + pos_.x();
+	const float y0 = (height() - h) / 2 + pos_.y();
+	const auto ndcX = [this](float x) { return x / width() * 2 - 1; };
+	const auto ndcY = [this](float y) { return 1 - y / height() * 2; };
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	program_->bind();
+	program_->setUniformValue("u_rect", ndcX(x0), ndcY(y0), ndcX(x0 + w), ndcY(y0 + h));
+	program_->setUniformValue("u_texture", 0);
+	program_->setUniformValue("u_hdr", GLint(hdr_));
+	program_->setUniformValue("u_exposure", exposure_);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, texture_);
+
+	QOpenGLVertexArrayObject::Binder vaoBinder(&vao_);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+	program_->release();
+}
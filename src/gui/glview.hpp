@@ -0,0 +1,97 @@
+#pragma once
+
+#include <QOpenGLWidget>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLShaderProgram>
+#include <QOpenGLVertexArrayObject>
+
+#include <memory>
+#include <vector>
+
+#include "VTFLib.h"
+
+#include "viewer.hpp"
+
+namespace vtfview
+{
+
+	/**
+	 * Image view that hands the VTF's image data straight to the GPU
+	 * DXT, ATI1N/ATI2N and BC7 blocks are uploaded as-is and float formats are tonemapped in the shader, with
+	 * exposure control. Zoom and pan are just a transform, so they don't touch the image data at all.
+	 * Formats the GPU can't sample natively are converted to RGBA8888 on upload.
+	 */
+	class GLImageView : public QOpenGLWidget, public ImageView, protected QOpenGLExtraFunctions {
+		Q_OBJECT;
+
+	public:
+		GLImageView(Document* doc, QWidget* pParent = nullptr);
+		~GLImageView() override;
+
+		/**
+		 * Returns true if we can create an OpenGL 3.3 or OpenGL ES 3.0 context. Set VTFVIEW_SOFTWARE=1 in the
+		 * environment to always use the CPU view instead
+		 */
+		static bool available();
+
+		QWidget* widget() override {
+			return this;
+		}
+
+		void set_vtf(VTFLib::CVTFFile* file) override;
+		void set_frame(int f) override;
+		void set_face(int f) override;
+		void set_mip(int f) override;
+		void set_exposure(float exposure) override;
+		void zoom(float amount) override;
+
+	protected:
+		void initializeGL() override;
+		void paintGL() override;
+
+		void wheelEvent(QWheelEvent* event) override;
+		void mousePressEvent(QMouseEvent* event) override;
+		void mouseMoveEvent(QMouseEvent* event) override;
+
+	private:
+		// How a VTF format maps onto a GL texture
+		struct TexFormat {
+			bool compressed = false;
+			GLenum internalFormat = 0;
+			GLenum format = 0;
+			GLenum type = 0;
+			GLint swizzle[4] = {GL_RED, GL_GREEN, GL_BLUE, GL_ALPHA};
+			bool hdr = false;
+			bool filterable = true;
+		};
+
+		bool tex_format(VTFImageFormat format, TexFormat& out) const;
+		void upload();
+		void release_gl();
+
+		Document* doc_ = nullptr;
+		VTFLib::CVTFFile* file_ = nullptr;
+		int frame_ = 0;
+		int face_ = 0;
+		int mip_ = 0;
+		bool needsUpload_ = false;
+
+		float zoom_ = 1.0f;
+		float exposure_ = 1.0f;
+		QPointF pos_;
+		QPointF dragStart_;
+
+		// GL state, only valid while the context is
+		std::unique_ptr<QOpenGLShaderProgram> program_;
+		QOpenGLVertexArrayObject vao_;
+		GLuint texture_ = 0;
+		bool hdr_ = false;
+		bool hasS3TC_ = false;
+		bool hasRGTC_ = false;
+		bool hasBPTC_ = false;
+		bool hasUnorm16_ = false;
+
+		std::vector<vlByte> scratch_; // Conversion buffer for formats we can't upload directly
+	};
+
+} // namespace vtfview
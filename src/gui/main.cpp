@@ -1,8 +1,15 @@
 #include "viewer.hpp"
 #include <QApplication>
 #include <QStyleFactory>
+#include <QSurfaceFormat>
 
 int main(int argc, char** argv) {
+	// The GPU view needs 3.3 core. This has to be set before the application is created
+	QSurfaceFormat format;
+	format.setVersion(3, 3);
+	format.setProfile(QSurfaceFormat::CoreProfile);
+	QSurfaceFormat::setDefaultFormat(format);
+
 	QApplication app(argc, argv);
 
 	std::string file;
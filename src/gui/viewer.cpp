@@ -1,4 +1,6 @@
 #include "viewer.hpp"
+#include "glview.hpp"
+#include "browser.hpp"
 
 #include "common/vtex2_version.h"
 
@@ -10,6 +12,7 @@
 #include <QApplication>
 #include <QCheckBox>
 #include <QCloseEvent>
+#include <QDoubleSpinBox>
 #include <QDockWidget>
 #include <QFileDialog>
 #include <QGridLayout>
@@ -29,6 +32,7 @@
 #include <QToolBar>
 
 #include <iostream>
+#include <cmath>
 
 using namespace vtfview;
 using namespace VTFLib;
@@ -86,10 +90,21 @@ void ViewerMainWindow::setup_ui() {
 	resDock->setWidget(resList);
 	addDockWidget(Qt::RightDockWidgetArea, resDock);
 
-	// Main image viewer
-	auto* scroller = new QScrollArea(this);
-	viewer_ = new ImageViewWidget(doc_, this);
-	scroller->setAlignment(Qt::AlignCenter);
+	// Main image viewer. The GPU one pans and zooms itself, the software one needs a scroll area for that
+	if (GLImageView::available()) {
+		auto* glView = new GLImageView(doc_, this);
+		viewer_ = glView;
+		setCentralWidget(glView);
+	}
+	else {
+		auto* scroller = new QScrollArea(this);
+		auto* imageView = new ImageViewWidget(doc_, this);
+		viewer_ = imageView;
+		scroller->setAlignment(Qt::AlignCenter);
+		scroller->setVisible(true);
+		scroller->setWidget(imageView);
+		setCentralWidget(scroller);
+	}
 
 	connect(
 		document(), &Document::vtfFileChanged,
@@ -97,10 +112,8 @@ void ViewerMainWindow::setup_ui() {
 		{
 			viewer_->set_vtf(file);
 		});
-	scroller->setVisible(true);
-	scroller->setWidget(viewer_);
-
-	setCentralWidget(scroller);
+	// The viewer decodes in the background, so it has to let go of the file before it's freed or converted
+	connect(document(), &Document::vtfFileAboutToChange, [this] { viewer_->set_vtf(nullptr); });
 
 	// Viewer settings
 	auto* viewerDock = new QDockWidget(tr("Viewer Settings"), this);
@@ -121,6 +134,25 @@ void ViewerMainWindow::setup_ui() {
 	viewerDock->setWidget(viewSettings);
 	addDockWidget(Qt::LeftDockWidgetArea, viewerDock);
 
+	// Folder browser, hidden until a folder is picked
+	browserDock_ = new QDockWidget(tr("Browser"), this);
+	browser_ = new BrowserWidget(this);
+	connect(
+		browser_, &BrowserWidget::fileActivated,
+		[this](const QString& path)
+		{
+			if (!ask_save())
+				return;
+			if (!document()->load_file(path.toUtf8().data())) {
+				QMessageBox::warning(
+					this, tr("Could not open file"),
+					tr("The file '%1' could not be opened. Make sure it's readable and a valid VTF.").arg(path));
+			}
+		});
+	browserDock_->setWidget(browser_);
+	addDockWidget(Qt::BottomDockWidgetArea, browserDock_);
+	browserDock_->hide();
+
 	// Tabify the docks
 	tabifyDockWidget(infoDock, resDock);
 	infoDock->raise();
@@ -229,6 +261,8 @@ void ViewerMainWindow::setup_menubar() {
 	fileMenu->addAction(
 		QIcon::fromTheme("document-import", style()->standardIcon(QStyle::SP_ArrowUp)), "Import File", this,
 		&ViewerMainWindow::on_import_file);
+	fileMenu->addAction(
+		style()->standardIcon(QStyle::SP_DirOpenIcon), "Browse Folder", this, &ViewerMainWindow::on_browse_folder);
 	fileMenu->addSeparator();
 	fileMenu->addAction(
 		"Exit",
@@ -322,6 +356,16 @@ void ViewerMainWindow::on_open_file() {
 	}
 }
 
+void ViewerMainWindow::on_browse_folder() {
+	auto dir = QFileDialog::getExistingDirectory(this, tr("Browse Folder"));
+	if (dir.isEmpty())
+		return;
+
+	browser_->set_directory(dir);
+	browserDock_->show();
+	browserDock_->raise();
+}
+
 // Promps the user for save if dirty
 // Returns true if you should continue processing whatever request you were before calling this
 bool ViewerMainWindow::ask_save() {
@@ -570,8 +614,15 @@ void InfoWidget::setup_ui() {
 // ImageViewWidget
 //////////////////////////////////////////////////////////////////////////////////
 
-ImageViewWidget::ImageViewWidget(Document*, QWidget* pParent)
-	: QWidget(pParent) {
+ImageViewWidget::ImageViewWidget(Document* doc, QWidget* pParent)
+	: QWidget(pParent),
+	  doc_(doc),
+	  decoder_(
+		  [this]
+		  {
+			  // Called from the decode thread, repaint on ours. Qt drops this if we're gone by then
+			  QMetaObject::invokeMethod(this, [this] { update(); }, Qt::QueuedConnection);
+		  }) {
 	setMinimumSize(256, 256);
 }
 
@@ -582,9 +633,9 @@ void ImageViewWidget::set_pixmap(const QImage& pixmap) {
 void ImageViewWidget::set_vtf(VTFLib::CVTFFile* file) {
 	file_ = file;
 	// Force refresh of data
-	currentFrame_ = -1;
-	currentFace_ = -1;
-	currentMip_ = -1;
+	decoder_.set_file(file, doc_);
+	requested_ = {-1, -1, -1};
+	image_ = {};
 
 	zoom_ = 1.f;
 	pos_ = {0, 0};
@@ -606,35 +657,25 @@ void ImageViewWidget::paintEvent(QPaintEvent* event) {
 	vlUInt imageWidth, imageHeight, imageDepth;
 	CVTFFile::ComputeMipmapDimensions(
 		file_->GetWidth(), file_->GetHeight(), file_->GetDepth(), mip_, imageWidth, imageHeight, imageDepth);
-	// Needs decode
-	if (frame_ != currentFrame_ || mip_ != currentMip_ || face_ != currentFace_) {
-		const bool hasAlpha = CVTFFile::GetImageFormatInfo(file_->GetFormat()).uiAlphaBitsPerPixel > 0;
-		const VTFImageFormat format = hasAlpha ? IMAGE_FORMAT_RGBA8888 : IMAGE_FORMAT_RGB888;
-		auto size = CVTFFile::ComputeMipmapSize(file_->GetWidth(), file_->GetHeight(), 1, mip_, format);
-		if (imgBuf_) {
-			free(imgBuf_);
-		}
-		// This buffer needs to persist- QImage does not own the mem you give it
-		imgBuf_ = static_cast<vlByte*>(malloc(size));
-
-		bool ok = CVTFFile::Convert(
-			file_->GetData(frame_, face_, 0, mip_), (vlByte*)imgBuf_, imageWidth, imageHeight, file_->GetFormat(),
-			format);
-		if (!ok) {
-			std::cerr << "Could not convert image for display.\n";
-			return;
-		}
 
-		image_ = QImage(
-			(uchar*)imgBuf_, imageWidth, imageHeight, hasAlpha ? QImage::Format_RGBA8888 : QImage::Format_RGB888);
-		currentFace_ = face_;
-		currentFrame_ = frame_;
-		currentMip_ = mip_;
+	// Kick off the decode (and prefetch around it) once per change, not once per paint
+	const DecodeCache::Key key{frame_, face_, mip_};
+	auto image = decoder_.find(key);
+	if (!(key == requested_)) {
+		decoder_.request(key);
+		requested_ = key;
 	}
 
+	// Not decoded yet, stretch the nearest mip we do have over the same area until it is
+	if (image.isNull())
+		image = decoder_.find_nearest(key);
+	if (image.isNull())
+		return;
+	image_ = image;
+
 	QPoint destpt =
 		QPoint(width() / 2, height() / 2) - QPoint((imageWidth * zoom_) / 2, (imageHeight * zoom_) / 2) + pos_;
-	QRect target = QRect(destpt.x(), destpt.y(), image_.width() * zoom_, image_.height() * zoom_);
+	QRect target = QRect(destpt.x(), destpt.y(), imageWidth * zoom_, imageHeight * zoom_);
 
 	painter.drawImage(target, image_, QRect(0, 0, image_.width(), image_.height()));
 }
@@ -759,12 +800,12 @@ constexpr struct TextureFlag {
 //////////////////////////////////////////////////////////////////////////////////
 // ImageSettingsWidget
 //////////////////////////////////////////////////////////////////////////////////
-ImageSettingsWidget::ImageSettingsWidget(Document*, ImageViewWidget* viewer, QWidget* parent)
+ImageSettingsWidget::ImageSettingsWidget(Document*, ImageView* viewer, QWidget* parent)
 	: QWidget(parent) {
 	setup_ui(viewer);
 }
 
-void ImageSettingsWidget::setup_ui(ImageViewWidget* viewer) {
+void ImageSettingsWidget::setup_ui(ImageView* viewer) {
 	auto* layout = new QGridLayout(this);
 
 	int row = 0;
@@ -815,6 +856,21 @@ void ImageSettingsWidget::setup_ui(ImageViewWidget* viewer) {
 	layout->addWidget(startFrame_, row, 1);
 	layout->addWidget(new QLabel("Start Frame:"), row, 0);
 
+	// Exposure in stops, for HDR formats
+	++row;
+	exposure_ = new QDoubleSpinBox(this);
+	exposure_->setRange(-16, 16);
+	exposure_->setSingleStep(0.5);
+	exposure_->setValue(0);
+	connect(
+		exposure_, &QDoubleSpinBox::valueChanged,
+		[viewer](double value)
+		{
+			viewer->set_exposure(std::exp2(float(value)));
+		});
+	layout->addWidget(exposure_, row, 1);
+	layout->addWidget(new QLabel("Exposure:"), row, 0);
+
 	// Flags list box
 	++row;
 	auto* flagsScroll = new QScrollArea(this);
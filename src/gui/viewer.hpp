@@ -13,16 +13,20 @@
 #include "VTFLib.h"
 
 #include "document.hpp"
+#include "decoder.hpp"
 #include "common/util.hpp"
 
 class QSpinBox;
+class QDoubleSpinBox;
 class QCheckBox;
 class QComboBox;
 class QShortcut;
+class QDockWidget;
 
 namespace vtfview
 {
-	class ImageViewWidget;
+	class ImageView;
+	class BrowserWidget;
 
 	/**
 	 * Main window container for the VTF viewer
@@ -46,6 +50,7 @@ namespace vtfview
 		void on_new_file();
 		void on_reload_file();
 		void on_import_file();
+		void on_browse_folder();
 
 	public:
 		bool load_file(const char* path) {
@@ -83,8 +88,10 @@ namespace vtfview
 		bool ask_save();
 
 	private:
-		ImageViewWidget* viewer_ = nullptr;
+		ImageView* viewer_ = nullptr;
 		Document* doc_ = nullptr;
+		BrowserWidget* browser_ = nullptr;
+		QDockWidget* browserDock_ = nullptr;
 
 		std::vector<QShortcut*> shortcuts_;
 	};
@@ -114,17 +121,53 @@ namespace vtfview
 		Document* doc_ = nullptr;
 	};
 
+	/**
+	 * Common interface for the image views, so the rest of the UI doesn't care which one it's talking to
+	 * Frame, face and mip are in the range 1-count, in vtflib they're 0-based indices
+	 */
+	class ImageView {
+	public:
+		virtual ~ImageView() = default;
+
+		virtual QWidget* widget() = 0;
+
+		virtual void set_vtf(VTFLib::CVTFFile* file) = 0;
+		virtual void set_frame(int f) = 0;
+		virtual void set_face(int f) = 0;
+		virtual void set_mip(int f) = 0;
+
+		/**
+		 * Exposure multiplier for HDR (float) formats. Views that can't do HDR ignore this
+		 */
+		virtual void set_exposure(float exposure) {
+		}
+
+		virtual void zoom(float amount) = 0;
+		inline void zoomIn(float amount = 0.1f) {
+			zoom(amount);
+		}
+
+		inline void zoomOut(float amount = 0.1f) {
+			zoom(amount * -1);
+		}
+	};
+
 	/**
 	 * Simple image viewer widget
+	 * Decodes on the CPU and draws with QPainter. Used when OpenGL isn't available
 	 */
-	class ImageViewWidget : public QWidget {
+	class ImageViewWidget : public QWidget, public ImageView {
 		Q_OBJECT;
 
 	public:
 		ImageViewWidget(Document* doc, QWidget* pParent = nullptr);
 
+		QWidget* widget() override {
+			return this;
+		}
+
 		void set_pixmap(const QImage& pixmap);
-		void set_vtf(VTFLib::CVTFFile* file);
+		void set_vtf(VTFLib::CVTFFile* file) override;
 
 		inline const QImage& pixmap() const {
 			return image_;
@@ -135,40 +178,31 @@ namespace vtfview
 
 		void paintEvent(QPaintEvent* event) override;
 
-		void set_frame(int f) {
+		void set_frame(int f) override {
 			frame_ = file_ ? util::clamp(f, 1, file_->GetFrameCount()) : 1;
 			frame_--;
 			repaint();
 		}
 
-		void set_face(int f) {
+		void set_face(int f) override {
 			face_ = file_ ? util::clamp(f, 1, file_->GetFaceCount()) : 1;
 			face_--;
 			repaint();
 		}
 
-		// Sets the current mip
-		// This is in the range 1-mipcount, in vtflib it's 0-based index
-		void set_mip(int f) {
+		void set_mip(int f) override {
 			mip_ = file_ ? util::clamp(f, 1, file_->GetMipmapCount()) : 1;
 			mip_--;
 			repaint();
 		}
 
-		void zoom(float amount);
-		inline void zoomIn(float amount = 0.1f) {
-			zoom(amount);
-		}
-
-		inline void zoomOut(float amount = 0.1f) {
-			zoom(amount * -1);
-		}
+		void zoom(float amount) override;
 
 	private:
 		void update_size();
 
 		QImage image_;
-		void* imgBuf_ = nullptr;
+		Document* doc_ = nullptr;
 		VTFLib::CVTFFile* file_ = nullptr;
 
 		float zoom_ = 1.0f;
@@ -178,9 +212,9 @@ namespace vtfview
 		int face_ = 0;
 		int mip_ = 0;
 
-		int currentFrame_ = 0;
-		int currentFace_ = 0;
-		int currentMip_ = 0;
+		// Decoding happens in the background, we paint whatever is closest until it's done
+		DecodeCache decoder_;
+		DecodeCache::Key requested_ = {-1, -1, -1};
 	};
 
 	/**
@@ -208,7 +242,7 @@ namespace vtfview
 		Q_OBJECT;
 
 	public:
-		ImageSettingsWidget(Document* doc, ImageViewWidget* viewer, QWidget* parent = nullptr);
+		ImageSettingsWidget(Document* doc, ImageView* viewer, QWidget* parent = nullptr);
 
 		void set_vtf(VTFLib::CVTFFile* file);
 
@@ -220,12 +254,13 @@ namespace vtfview
 		void fileModified();
 
 	private:
-		void setup_ui(ImageViewWidget* viewer);
+		void setup_ui(ImageView* viewer);
 
 		QSpinBox* frame_ = nullptr;
 		QSpinBox* face_ = nullptr;
 		QSpinBox* mip_ = nullptr;
 		QSpinBox* startFrame_ = nullptr;
+		QDoubleSpinBox* exposure_ = nullptr;
 		VTFLib::CVTFFile* file_ = nullptr;
 		std::unordered_map<uint32_t, QCheckBox*> flagChecks_;
 		bool settingFile_ = false;
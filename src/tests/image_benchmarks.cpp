@@ -0,0 +1,347 @@
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <type_traits>
+
+#include "benchmark/benchmark.h"
+#include "VTFLib.h"
+
+#include "common/lwiconv.hpp"
+#include "common/image.hpp"
+#include "common/pack.hpp"
+#include "common/bcn.hpp"
+#include "common/vtftools.hpp"
+
+using namespace lwiconv;
+
+// Every benchmark covers these, so the numbers scale with something real
+static const int RESOLUTIONS[] = {256, 1024, 2048};
+
+//
+// Deterministic noise, so runs are comparable and the encoders don't get to shortcut solid colors
+//
+template <typename T>
+static void fill_noise(T* buf, std::size_t count) {
+	std::uint32_t state = 0x12345678;
+	for (std::size_t i = 0; i < count; ++i) {
+		state = state * 1664525u + 1013904223u;
+		const auto v = state >> 24;
+		if constexpr (std::is_floating_point_v<T>)
+			buf[i] = v / 255.f;
+		else
+			buf[i] = T(v * (std::numeric_limits<T>::max() / 255));
+	}
+}
+
+static std::vector<std::uint8_t> read_asset(const char* name) {
+	std::ifstream stream(std::string(VTEX2_TEST_ASSETS) + "/" + name, std::ios::binary);
+	return {std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>()};
+}
+
+static void set_pixels_processed(benchmark::State& state, int w, int h, std::size_t bytesPerPixel) {
+	state.SetItemsProcessed(state.iterations() * std::int64_t(w) * h);
+	state.SetBytesProcessed(state.iterations() * std::int64_t(w) * h * bytesPerPixel);
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// lwiconv::convert_generic
+//////////////////////////////////////////////////////////////////////////////////
+
+template <typename Tin, typename Tout>
+static void BM_ConvertGeneric(benchmark::State& state, int inC, int outC) {
+	const int size = state.range(0);
+	std::vector<Tin> in(std::size_t(size) * size * inC);
+	std::vector<Tout> out(std::size_t(size) * size * outC);
+	fill_noise(in.data(), in.size());
+
+	for (auto _ : state) {
+		convert_generic<Tin, Tout>(in.data(), out.data(), size, size, inC, outC, -1, -1, {0, 0, 0, 1});
+		benchmark::DoNotOptimize(out.data());
+		benchmark::ClobberMemory();
+	}
+	set_pixels_processed(state, size, size, inC * sizeof(Tin));
+}
+
+template <typename Tin, typename Tout>
+static void register_convert(const char* inName, const char* outName) {
+	for (int inC = 1; inC <= 4; ++inC) {
+		for (int outC = 1; outC <= 4; ++outC) {
+			const auto name = std::string("ConvertGeneric/") + inName + "x" + std::to_string(inC) + "_to_" + outName +
+							  "x" + std::to_string(outC);
+			auto* bm = benchmark::RegisterBenchmark(name.c_str(), BM_ConvertGeneric<Tin, Tout>, inC, outC);
+			for (int res : RESOLUTIONS)
+				bm->Arg(res);
+		}
+	}
+}
+
+template <typename Tin>
+static void register_convert_from(const char* inName) {
+	register_convert<Tin, std::uint8_t>(inName, "u8");
+	register_convert<Tin, std::uint16_t>(inName, "u16");
+	register_convert<Tin, float>(inName, "f32");
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// pack::pack_image
+//////////////////////////////////////////////////////////////////////////////////
+
+// MRAO style pack: three RGBA sources into one RGBA image, alpha from a constant
+static void BM_PackImage(benchmark::State& state) {
+	const int size = state.range(0);
+	std::vector<std::uint8_t> m(std::size_t(size) * size * 4), r(m.size()), ao(m.size());
+	fill_noise(m.data(), m.size());
+	fill_noise(r.data(), r.size());
+	fill_noise(ao.data(), ao.size());
+
+	pack::ChannelPack_t channels[] = {
+		{.srcChan = 0, .dstChan = 0, .srcData = m.data(), .comps = 4},
+		{.srcChan = 0, .dstChan = 1, .srcData = r.data(), .comps = 4},
+		{.srcChan = 0, .dstChan = 2, .srcData = ao.data(), .comps = 4},
+		{.srcChan = 0, .dstChan = 3, .srcData = nullptr, .comps = 4, .constant = 1.f},
+	};
+
+	for (auto _ : state) {
+		auto image = pack::pack_image(4, channels, 4, size, size);
+		benchmark::DoNotOptimize(image);
+	}
+	set_pixels_processed(state, size, size, 4);
+}
+BENCHMARK(BM_PackImage)->Arg(256)->Arg(1024)->Arg(2048);
+
+//////////////////////////////////////////////////////////////////////////////////
+// imglib::resize
+//////////////////////////////////////////////////////////////////////////////////
+
+template <typename T>
+static void BM_Resize(benchmark::State& state, bool upscale) {
+	const int size = state.range(0);
+	const int newSize = upscale ? size * 2 : size / 2;
+	const auto type = std::is_same_v<T, float> ? imglib::ChannelType::Float
+					: std::is_same_v<T, std::uint16_t> ? imglib::ChannelType::UInt16
+													   : imglib::ChannelType::UInt8;
+
+	std::vector<T> in(std::size_t(size) * size * 4);
+	std::vector<T> out(std::size_t(newSize) * newSize * 4);
+	fill_noise(in.data(), in.size());
+
+	for (auto _ : state) {
+		if (!imglib::resize_into(in.data(), out.data(), type, 4, size, size, newSize, newSize)) {
+			state.SkipWithError("resize failed");
+			return;
+		}
+		benchmark::DoNotOptimize(out.data());
+	}
+	set_pixels_processed(state, newSize, newSize, 4 * sizeof(T));
+}
+// BENCHMARK_CAPTURE pastes the function name into an identifier, so templates need a plain wrapper
+static void BM_ResizeU8(benchmark::State& state, bool upscale) {
+	BM_Resize<std::uint8_t>(state, upscale);
+}
+static void BM_ResizeU16(benchmark::State& state, bool upscale) {
+	BM_Resize<std::uint16_t>(state, upscale);
+}
+static void BM_ResizeF32(benchmark::State& state, bool upscale) {
+	BM_Resize<float>(state, upscale);
+}
+BENCHMARK_CAPTURE(BM_ResizeU8, down, false)->Arg(256)->Arg(1024)->Arg(2048);
+BENCHMARK_CAPTURE(BM_ResizeU8, up, true)->Arg(256)->Arg(1024);
+BENCHMARK_CAPTURE(BM_ResizeU16, down, false)->Arg(256)->Arg(1024)->Arg(2048);
+BENCHMARK_CAPTURE(BM_ResizeF32, down, false)->Arg(256)->Arg(1024)->Arg(2048);
+
+//////////////////////////////////////////////////////////////////////////////////
+// Image::load / Image::save
+//////////////////////////////////////////////////////////////////////////////////
+
+struct FileFormatCase {
+	const char* name;
+	imglib::FileFormat format;
+};
+
+static const FileFormatCase FILE_FORMATS[] = {
+	{"png", imglib::FileFormat::Png}, {"jpeg", imglib::FileFormat::Jpeg}, {"tga", imglib::FileFormat::Tga},
+	{"bmp", imglib::FileFormat::Bmp}, {"hdr", imglib::FileFormat::Hdr},
+};
+
+//
+// The source photo, loaded once. Float for the HDR case, since that's what stb writes HDR from
+//
+static std::shared_ptr<imglib::Image> source_image(imglib::FileFormat format) {
+	static auto asset = read_asset("funny-cat-2.jpg");
+	return imglib::Image::load(
+		asset.data(), asset.size(),
+		format == imglib::FileFormat::Hdr ? imglib::ChannelType::Float : imglib::ChannelType::UInt8);
+}
+
+static bool encode(imglib::Image& image, imglib::FileFormat format, std::vector<std::uint8_t>& out) {
+	out.clear();
+	return image.save(
+		[&out](const void* data, std::size_t size)
+		{
+			auto* p = static_cast<const std::uint8_t*>(data);
+			out.insert(out.end(), p, p + size);
+		},
+		format);
+}
+
+static void BM_ImageSave(benchmark::State& state, imglib::FileFormat format) {
+	auto image = source_image(format);
+	if (!image) {
+		state.SkipWithError("could not load test asset");
+		return;
+	}
+
+	std::vector<std::uint8_t> encoded;
+	encoded.reserve(imglib::bytes_for_image(image->width(), image->height(), image->type(), image->channels()));
+	for (auto _ : state) {
+		if (!encode(*image, format, encoded)) {
+			state.SkipWithError("save failed");
+			return;
+		}
+		benchmark::DoNotOptimize(encoded.data());
+	}
+	set_pixels_processed(state, image->width(), image->height(), image->channels() * imglib::channel_size(image->type()));
+}
+
+static void BM_ImageLoad(benchmark::State& state, imglib::FileFormat format) {
+	auto image = source_image(format);
+	std::vector<std::uint8_t> encoded;
+	if (!image || !encode(*image, format, encoded)) {
+		state.SkipWithError("could not encode test asset");
+		return;
+	}
+
+	for (auto _ : state) {
+		auto loaded = imglib::Image::load(encoded.data(), encoded.size());
+		if (!loaded) {
+			state.SkipWithError("load failed");
+			return;
+		}
+		benchmark::DoNotOptimize(loaded);
+	}
+	state.SetBytesProcessed(state.iterations() * std::int64_t(encoded.size()));
+}
+
+static void register_file_formats() {
+	for (auto& f : FILE_FORMATS) {
+		benchmark::RegisterBenchmark((std::string("ImageSave/") + f.name).c_str(), BM_ImageSave, f.format);
+		benchmark::RegisterBenchmark((std::string("ImageLoad/") + f.name).c_str(), BM_ImageLoad, f.format);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// Mip generation and block compression
+//////////////////////////////////////////////////////////////////////////////////
+
+static std::unique_ptr<VTFLib::CVTFFile> make_vtf(int size, VTFImageFormat format) {
+	auto file = std::make_unique<VTFLib::CVTFFile>();
+	if (!file->Init(size, size, 1, 1, 1, format, vlFalse, VTFLib::CVTFFile::ComputeMipmapCount(size, size, 1)))
+		return nullptr;
+
+	const auto bytes = VTFLib::CVTFFile::ComputeImageSize(size, size, 1, format);
+	if (format == IMAGE_FORMAT_RGBA32323232F)
+		fill_noise(reinterpret_cast<float*>(file->GetData(0, 0, 0, 0)), bytes / sizeof(float));
+	else
+		fill_noise(file->GetData(0, 0, 0, 0), bytes);
+	return file;
+}
+
+static void BM_GenerateMipmaps(benchmark::State& state, VTFImageFormat format, bool srgb) {
+	const int size = state.range(0);
+	auto file = make_vtf(size, format);
+	if (!file) {
+		state.SkipWithError("could not create VTF");
+		return;
+	}
+
+	for (auto _ : state) {
+		if (!vtf::generate_mipmaps(file.get(), srgb, state.range(1))) {
+			state.SkipWithError("mip generation failed");
+			return;
+		}
+	}
+	set_pixels_processed(state, size, size, VTFLib::CVTFFile::GetImageFormatInfo(format).uiBytesPerPixel);
+}
+BENCHMARK_CAPTURE(BM_GenerateMipmaps, rgba8888, IMAGE_FORMAT_RGBA8888, false)
+	->ArgsProduct({{256, 1024, 2048}, {1, 0}})
+	->ArgNames({"size", "threads"});
+BENCHMARK_CAPTURE(BM_GenerateMipmaps, rgba8888_srgb, IMAGE_FORMAT_RGBA8888, true)
+	->ArgsProduct({{256, 1024, 2048}, {1, 0}})
+	->ArgNames({"size", "threads"});
+BENCHMARK_CAPTURE(BM_GenerateMipmaps, rgba32323232f, IMAGE_FORMAT_RGBA32323232F, false)
+	->ArgsProduct({{256, 1024}, {1, 0}})
+	->ArgNames({"size", "threads"});
+
+// Raw single threaded encoder throughput
+static void BM_EncodeBlocks(benchmark::State& state, bcn::Format format, bcn::Quality quality) {
+	const int size = state.range(0);
+	std::vector<std::uint8_t> rgba(std::size_t(size) * size * 4);
+	std::vector<std::uint8_t> out(std::size_t(size / 4) * (size / 4) * bcn::block_size(format));
+	fill_noise(rgba.data(), rgba.size());
+
+	for (auto _ : state) {
+		bcn::encode_block_rows(format, quality, rgba.data(), size, size, 0, size / 4, out.data());
+		benchmark::DoNotOptimize(out.data());
+	}
+	set_pixels_processed(state, size, size, 4);
+}
+BENCHMARK_CAPTURE(BM_EncodeBlocks, dxt1_fast, bcn::Format::BC1, bcn::Quality::Fast)->Arg(256)->Arg(1024)->Arg(2048);
+BENCHMARK_CAPTURE(BM_EncodeBlocks, dxt1_normal, bcn::Format::BC1, bcn::Quality::Normal)->Arg(256)->Arg(1024)->Arg(2048);
+BENCHMARK_CAPTURE(BM_EncodeBlocks, dxt1_best, bcn::Format::BC1, bcn::Quality::Best)->Arg(256)->Arg(1024);
+BENCHMARK_CAPTURE(BM_EncodeBlocks, dxt5_fast, bcn::Format::BC3, bcn::Quality::Fast)->Arg(256)->Arg(1024)->Arg(2048);
+BENCHMARK_CAPTURE(BM_EncodeBlocks, dxt5_normal, bcn::Format::BC3, bcn::Quality::Normal)->Arg(256)->Arg(1024)->Arg(2048);
+BENCHMARK_CAPTURE(BM_EncodeBlocks, dxt5_best, bcn::Format::BC3, bcn::Quality::Best)->Arg(256)->Arg(1024);
+BENCHMARK_CAPTURE(BM_EncodeBlocks, bc7_fast, bcn::Format::BC7, bcn::Quality::Fast)->Arg(256)->Arg(1024);
+BENCHMARK_CAPTURE(BM_EncodeBlocks, bc7_normal, bcn::Format::BC7, bcn::Quality::Normal)->Arg(256)->Arg(1024);
+BENCHMARK_CAPTURE(BM_EncodeBlocks, bc7_best, bcn::Format::BC7, bcn::Quality::Best)->Arg(256);
+
+// Whole file conversion, as convert does it
+static void BM_ConvertVTF(benchmark::State& state, VTFImageFormat format, bcn::Quality quality) {
+	const int size = state.range(0);
+	auto file = make_vtf(size, IMAGE_FORMAT_RGBA8888);
+	if (!file || !vtf::generate_mipmaps(file.get(), false)) {
+		state.SkipWithError("could not create VTF");
+		return;
+	}
+
+	for (auto _ : state) {
+		auto converted = vtf::convert(file.get(), format, quality, state.range(1));
+		if (!converted) {
+			state.SkipWithError("conversion failed");
+			return;
+		}
+		benchmark::DoNotOptimize(converted);
+	}
+	set_pixels_processed(state, size, size, 4);
+}
+BENCHMARK_CAPTURE(BM_ConvertVTF, dxt1, IMAGE_FORMAT_DXT1, bcn::Quality::Normal)
+	->ArgsProduct({{256, 1024, 2048}, {1, 0}})
+	->ArgNames({"size", "threads"});
+BENCHMARK_CAPTURE(BM_ConvertVTF, dxt5, IMAGE_FORMAT_DXT5, bcn::Quality::Normal)
+	->ArgsProduct({{256, 1024, 2048}, {1, 0}})
+	->ArgNames({"size", "threads"});
+BENCHMARK_CAPTURE(BM_ConvertVTF, bc7, IMAGE_FORMAT_BC7, bcn::Quality::Normal)
+	->ArgsProduct({{256, 1024}, {1, 0}})
+	->ArgNames({"size", "threads"})
+	->Unit(benchmark::kMillisecond);
+
+int main(int argc, char** argv) {
+	register_convert_from<std::uint8_t>("u8");
+	register_convert_from<std::uint16_t>("u16");
+	register_convert_from<float>("f32");
+	register_file_formats();
+
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv))
+		return 1;
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	return 0;
+}
@@ -2,10 +2,32 @@
 #include <cstdint>
 #include <cstddef>
 #include <climits>
+#include <cmath>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include <type_traits>
+#include <algorithm>
+#include <filesystem>
+#include <atomic>
+#include <thread>
+#include <stdexcept>
 
 #include "gtest/gtest.h"
 
 #include "common/lwiconv.hpp"
+#include "common/image.hpp"
+#include "common/pipeline.hpp"
+#include "common/pack.hpp"
+#include "common/bufferpool.hpp"
+#include "common/bcn.hpp"
+#include "common/mapped_file.hpp"
+#include "common/vtfdeflate.hpp"
+#include "common/vtfheader.hpp"
+#include "common/parallel.hpp"
+#include "common/batchio.hpp"
+#include "common/metrics.hpp"
+#include "cli/action.hpp"
 
 using namespace lwiconv;
 
@@ -118,3 +140,1072 @@ TEST(ImageTests, Basic8To8)
 	runTest<uint8_t, uint8_t>(32, 32, 4, 4, {128, 0, 0xFF, 99}, {128, 0, 0xFF, 99});
 }
 
+//
+// Every half converts to float and back unchanged, and float values round to the nearest half
+//
+TEST(ImageTests, HalfConversion)
+{
+	for (uint32_t bits = 0; bits <= 0xFFFF; ++bits) {
+		const half h{uint16_t(bits)};
+		const float f = half_to_float(h);
+		if (f != f) {
+			ASSERT_EQ(float_to_half(f).bits & 0x7C00, 0x7C00); // NaN stays NaN
+			ASSERT_NE(float_to_half(f).bits & 0x3FF, 0);
+		}
+		else
+			ASSERT_EQ(float_to_half(f).bits, bits);
+	}
+
+	EXPECT_EQ(float_to_half(1.0f).bits, 0x3C00);
+	EXPECT_EQ(float_to_half(-2.0f).bits, 0xC000);
+	EXPECT_EQ(float_to_half(65504.f).bits, 0x7BFF);
+	EXPECT_EQ(float_to_half(70000.f).bits, 0x7C00);		 // Out of range goes to infinity
+	EXPECT_EQ(float_to_half(1.0f + 1.f / 2048).bits, 0x3C00); // Halfway, ties to even
+	EXPECT_EQ(float_to_half(1.0f + 3.f / 2048).bits, 0x3C02);
+	EXPECT_EQ(float_to_half(std::ldexp(1.f, -24)).bits, 0x0001); // Smallest denormal
+	EXPECT_EQ(float_to_half(std::ldexp(1.f, -26)).bits, 0x0000);
+
+	// Half images go through convert_formats like everything else, without clamping
+	const float src[4] = {0.25f, 4.f, -1.f, 1.f};
+	half mid[4];
+	float dst[4];
+	ASSERT_TRUE(imglib::convert_formats(
+		src, mid, imglib::ChannelType::Float, imglib::ChannelType::Half, 1, 1, 4, 4, sizeof(src), sizeof(mid)));
+	ASSERT_TRUE(imglib::convert_formats(
+		mid, dst, imglib::ChannelType::Half, imglib::ChannelType::Float, 1, 1, 4, 4, sizeof(mid), sizeof(dst)));
+	for (int i = 0; i < 4; ++i)
+		EXPECT_EQ(dst[i], src[i]);
+}
+
+//
+// SIMD kernels must produce exactly the same output as the scalar path
+//
+
+template<typename T>
+static void fillRandom(T* buf, size_t count, uint32_t seed) {
+	for (size_t i = 0; i < count; ++i) {
+		seed = seed * 1664525u + 1013904223u;
+		if constexpr (std::is_same_v<T, float>)
+			buf[i] = float(int32_t(seed >> 8) & 0xFFFF) / 0x7FFF - 0.5f; // Deliberately includes out of range values
+		else
+			buf[i] = T(seed >> 8);
+	}
+}
+
+template<typename Tin, typename Tout>
+static void compareSimd(int inC, int outC) {
+	static const int sizes[][2] = {{1, 1}, {3, 5}, {16, 1}, {17, 3}, {64, 64}, {31, 33}, {1023, 7}};
+	for (auto& sz : sizes) {
+		const size_t pixels = size_t(sz[0]) * sz[1];
+		std::vector<Tin> in(pixels * inC);
+		std::vector<Tout> expected(pixels * outC), actual(pixels * outC);
+		fillRandom(in.data(), in.size(), uint32_t(pixels * 31 + inC));
+
+		convert_scalar<Tin, Tout>(in.data(), expected.data(), sz[0], sz[1], inC, outC, -1, -1, {0, 0, 0, 1});
+		convert_generic<Tin, Tout>(in.data(), actual.data(), sz[0], sz[1], inC, outC, -1, -1, {0, 0, 0, 1});
+		ASSERT_EQ(memcmp(expected.data(), actual.data(), expected.size() * sizeof(Tout)), 0)
+			<< simd::level_name(simd::level()) << " " << sz[0] << "x" << sz[1] << " " << inC << "->" << outC;
+	}
+}
+
+TEST(ImageTests, SimdMatchesScalar)
+{
+	const auto prev = simd::level();
+	for (auto level : {simd::Level::SSE2, simd::Level::AVX2, simd::Level::NEON}) {
+		if (!simd::supported(level))
+			continue;
+		simd::set_level(level);
+		for (int c = 1; c <= 4; ++c) {
+			compareSimd<uint8_t, uint16_t>(c, c);
+			compareSimd<uint16_t, uint8_t>(c, c);
+			compareSimd<uint8_t, float>(c, c);
+			compareSimd<float, uint8_t>(c, c);
+			compareSimd<uint16_t, float>(c, c);
+			compareSimd<float, uint16_t>(c, c);
+		}
+		compareSimd<uint8_t, uint8_t>(3, 4);
+		compareSimd<uint8_t, uint8_t>(4, 3);
+	}
+	simd::set_level(prev);
+}
+
+//
+// The fused pipeline must match running the individual steps one after the other
+//
+
+TEST(ImageTests, PipelineMatchesSteps)
+{
+	const int w = 301, h = 203, nw = 150, nh = 100;
+	std::vector<uint8_t> src(w * h * 3);
+	fillRandom(src.data(), src.size(), 1234);
+	imglib::Image image(src.data(), imglib::ChannelType::UInt8, 3, w, h, true);
+
+	// No resize: convert + process straight into the output
+	{
+		auto result = imglib::Pipeline()
+						  .convert(imglib::ChannelType::UInt16, 4)
+						  .process(imglib::PROC_GL_TO_DX_NORM)
+						  .run(image);
+		ASSERT_TRUE(result);
+
+		std::vector<uint16_t> expected(w * h * 4);
+		convert_scalar<uint8_t, uint16_t>(src.data(), expected.data(), w, h, 3, 4, -1, -1, {0, 0, 0, 1});
+		for (size_t i = 0; i < expected.size(); i += 4)
+			expected[i + 1] = UINT16_MAX - expected[i + 1];
+		ASSERT_EQ(memcmp(result->data(), expected.data(), expected.size() * sizeof(uint16_t)), 0);
+	}
+
+	// Resize in the source format, then convert
+	{
+		auto result = imglib::Pipeline().resize(nw, nh).convert(imglib::ChannelType::Float, 4).run(image);
+		ASSERT_TRUE(result);
+		ASSERT_EQ(result->width(), nw);
+		ASSERT_EQ(result->height(), nh);
+
+		void* resized = nullptr;
+		ASSERT_TRUE(imglib::resize(src.data(), &resized, imglib::ChannelType::UInt8, 3, w, h, nw, nh));
+		std::vector<float> expected(nw * nh * 4);
+		convert_scalar<uint8_t, float>(resized, expected.data(), nw, nh, 3, 4, -1, -1, {0, 0, 0, 1});
+		imglib::pool::release(resized);
+		ASSERT_EQ(memcmp(result->data(), expected.data(), expected.size() * sizeof(float)), 0);
+	}
+
+	// Convert down, resize in the output format, and only then process. Renormalizing before the resize would
+	// leave averaged, shorter vectors in the output
+	{
+		std::vector<uint16_t> src16(w * h * 4);
+		fillRandom(src16.data(), src16.size(), 99);
+		imglib::Image image16(src16.data(), imglib::ChannelType::UInt16, 4, w, h, true);
+
+		auto result = imglib::Pipeline()
+						  .resize(nw, nh)
+						  .convert(imglib::ChannelType::UInt8, 3)
+						  .process(imglib::PROC_RENORMALIZE)
+						  .run(image16);
+		ASSERT_TRUE(result);
+
+		std::vector<uint8_t> converted(w * h * 3);
+		convert_scalar<uint16_t, uint8_t>(src16.data(), converted.data(), w, h, 4, 3, -1, -1, {0, 0, 0, 1});
+		void* resized = nullptr;
+		ASSERT_TRUE(imglib::resize(converted.data(), &resized, imglib::ChannelType::UInt8, 3, w, h, nw, nh));
+		ASSERT_TRUE(
+			imglib::process(resized, imglib::ChannelType::UInt8, 3, size_t(nw) * nh, imglib::PROC_RENORMALIZE));
+		ASSERT_EQ(memcmp(result->data(), resized, size_t(nw) * nh * 3), 0);
+		imglib::pool::release(resized);
+	}
+}
+
+//
+// Running the pipeline band by band must produce the same rows as running it on the whole image
+//
+
+TEST(ImageTests, PipelineRowsMatchRun)
+{
+	const int w = 301, h = 203, nw = 150, nh = 100, band = 7;
+	std::vector<uint8_t> src(w * h * 3);
+	fillRandom(src.data(), src.size(), 4321);
+	imglib::Image image(src.data(), imglib::ChannelType::UInt8, 3, w, h, true);
+
+	for (auto& pipeline : {imglib::Pipeline().convert(imglib::ChannelType::UInt16, 4),
+						   imglib::Pipeline().resize(nw, nh).convert(imglib::ChannelType::Float, 4)}) {
+		auto expected = pipeline.run(image);
+		ASSERT_TRUE(expected);
+
+		const size_t rowBytes = expected->width() * expected->pixel_size();
+		std::vector<uint8_t> rows(rowBytes * expected->height());
+		for (int row = 0; row < expected->height(); row += band) {
+			const int numRows = std::min(band, expected->height() - row);
+			ASSERT_TRUE(pipeline.run_rows(image, row, numRows, rows.data() + row * rowBytes));
+		}
+		ASSERT_EQ(memcmp(rows.data(), expected->data(), rows.size()), 0);
+	}
+}
+
+//
+// Processing ops, alone and combined in a single pass
+//
+TEST(ImageTests, ProcessOps)
+{
+	// Swizzle and invert are exact
+	uint8_t px[8] = {10, 20, 30, 40, 0, 128, 255, 7};
+	ASSERT_TRUE(imglib::process(
+		px, imglib::ChannelType::UInt8, 4, 2, imglib::proc_swizzle(2, 1, 0, 3) | imglib::PROC_GL_TO_DX_NORM));
+	const uint8_t expected[8] = {30, 235, 10, 40, 255, 127, 0, 7};
+	for (int i = 0; i < 8; ++i)
+		EXPECT_EQ(px[i], expected[i]) << i;
+
+	// Premultiplying by full alpha doesn't change anything, zero alpha zeroes the colour
+	std::vector<uint8_t> src(256 * 4);
+	for (int i = 0; i < 256; ++i)
+		src[i * 4] = src[i * 4 + 1] = src[i * 4 + 2] = uint8_t(i), src[i * 4 + 3] = 255;
+	auto data = src;
+	ASSERT_TRUE(imglib::process(data.data(), imglib::ChannelType::UInt8, 4, 256, imglib::PROC_PREMULTIPLY_ALPHA));
+	EXPECT_EQ(data, src);
+	uint8_t clear[4] = {200, 100, 50, 0};
+	ASSERT_TRUE(imglib::process(clear, imglib::ChannelType::UInt8, 4, 1, imglib::PROC_PREMULTIPLY_ALPHA));
+	EXPECT_EQ(clear[0] + clear[1] + clear[2], 0);
+
+	// Renormalized vectors are unit length, and the green flip happens before it
+	float n[3] = {0.9f, 0.8f, 0.5f};
+	ASSERT_TRUE(
+		imglib::process(n, imglib::ChannelType::Float, 3, 1, imglib::PROC_RENORMALIZE | imglib::PROC_GL_TO_DX_NORM));
+	const float x = n[0] * 2 - 1, y = n[1] * 2 - 1, z = n[2] * 2 - 1;
+	EXPECT_NEAR(x * x + y * y + z * z, 1.f, 1e-5f);
+	EXPECT_LT(y, 0.f);
+
+	// sRGB -> linear -> sRGB round trips, through half too
+	half h[4] = {float_to_half(0.2f), float_to_half(0.5f), float_to_half(0.9f), float_to_half(0.3f)};
+	ASSERT_TRUE(imglib::process(h, imglib::ChannelType::Half, 4, 1, imglib::PROC_SRGB_TO_LINEAR));
+	EXPECT_NEAR(half_to_float(h[1]), 0.214f, 1e-3f);
+	EXPECT_EQ(half_to_float(h[3]), half_to_float(float_to_half(0.3f))); // Alpha is left alone
+	ASSERT_TRUE(imglib::process(h, imglib::ChannelType::Half, 4, 1, imglib::PROC_LINEAR_TO_SRGB));
+	EXPECT_NEAR(half_to_float(h[0]), 0.2f, 1e-3f);
+	EXPECT_NEAR(half_to_float(h[2]), 0.9f, 1e-3f);
+}
+
+//
+// Packing straight from the sources must match resizing and converting each of them first
+//
+
+TEST(ImageTests, PackResamplesSources)
+{
+	const int w = 301, h = 203, nw = 150, nh = 130;
+	std::vector<uint8_t> normal(w * h * 3);
+	fillRandom(normal.data(), normal.size(), 777);
+	imglib::Image normalImage(normal.data(), imglib::ChannelType::UInt8, 3, w, h, true);
+
+	// Height is resampled in one case and read in place in the other
+	for (auto [hw, hh] : {std::pair{75, 65}, std::pair{nw, nh}}) {
+		std::vector<uint8_t> height(hw * hh);
+		fillRandom(height.data(), height.size(), 888);
+		imglib::Image heightImage(height.data(), imglib::ChannelType::UInt8, 1, hw, hh, true);
+
+		pack::ImagePack_t channels[] = {
+			{.srcChan = 0, .dstChan = 0, .src = &normalImage, .constant = 0, .flags = imglib::PROC_GL_TO_DX_NORM},
+			{.srcChan = 1, .dstChan = 1, .src = &normalImage, .constant = 0, .flags = imglib::PROC_GL_TO_DX_NORM},
+			{.srcChan = 2, .dstChan = 2, .src = &normalImage, .constant = 0, .flags = imglib::PROC_GL_TO_DX_NORM},
+			{.srcChan = 0, .dstChan = 3, .src = &heightImage, .constant = 0},
+		};
+		auto result = pack::pack_images(4, channels, 4, nw, nh);
+		ASSERT_TRUE(result);
+		ASSERT_EQ(result->width(), nw);
+		ASSERT_EQ(result->height(), nh);
+
+		auto n = imglib::Pipeline().resize(nw, nh).process(imglib::PROC_GL_TO_DX_NORM).run(normalImage);
+		auto hm = imglib::Pipeline().resize(nw, nh).run(heightImage);
+		ASSERT_TRUE(n && hm);
+		pack::ChannelPack_t expected[] = {
+			{.srcChan = 0, .dstChan = 0, .srcData = n->data<uint8_t>(), .comps = 3, .constant = 0},
+			{.srcChan = 1, .dstChan = 1, .srcData = n->data<uint8_t>(), .comps = 3, .constant = 0},
+			{.srcChan = 2, .dstChan = 2, .srcData = n->data<uint8_t>(), .comps = 3, .constant = 0},
+			{.srcChan = 0, .dstChan = 3, .srcData = hm->data<uint8_t>(), .comps = 1, .constant = 0},
+		};
+		auto expectedImage = pack::pack_image(4, expected, 4, nw, nh);
+		ASSERT_TRUE(expectedImage);
+		ASSERT_EQ(memcmp(result->data(), expectedImage->data(), size_t(nw) * nh * 4), 0);
+	}
+
+	// Constants fill, bad source channels are rejected
+	pack::ImagePack_t constant[] = {{.srcChan = 0, .dstChan = 0, .src = nullptr, .constant = 1}};
+	auto filled = pack::pack_images(1, constant, 1, 8, 8);
+	ASSERT_TRUE(filled);
+	for (int i = 0; i < 64; ++i)
+		ASSERT_EQ(filled->data<uint8_t>()[i], 255);
+
+	pack::ImagePack_t bad[] = {{.srcChan = 3, .dstChan = 0, .src = &normalImage, .constant = 0}};
+	ASSERT_FALSE(pack::pack_images(1, bad, 1, 8, 8));
+}
+
+//
+// Block compression
+//
+
+// Decode the color half of a BC1/BC2/BC3 block into 16 RGBA pixels, alpha untouched
+static void decodeColorBlock(const uint8_t* block, uint8_t* rgba) {
+	const uint16_t c[2] = {uint16_t(block[0] | (block[1] << 8)), uint16_t(block[2] | (block[3] << 8))};
+	int pal[4][3];
+	for (int i = 0; i < 2; ++i) {
+		const int r = (c[i] >> 11) & 31, g = (c[i] >> 5) & 63, b = c[i] & 31;
+		pal[i][0] = (r << 3) | (r >> 2);
+		pal[i][1] = (g << 2) | (g >> 4);
+		pal[i][2] = (b << 3) | (b >> 2);
+	}
+	for (int j = 0; j < 3; ++j) {
+		pal[2][j] = (2 * pal[0][j] + pal[1][j]) / 3;
+		pal[3][j] = (pal[0][j] + 2 * pal[1][j]) / 3;
+	}
+	const uint32_t indices = block[4] | (block[5] << 8) | (block[6] << 16) | (uint32_t(block[7]) << 24);
+	for (int i = 0; i < 16; ++i) {
+		for (int j = 0; j < 3; ++j)
+			rgba[i * 4 + j] = uint8_t(pal[(indices >> (i * 2)) & 3][j]);
+	}
+}
+
+static long blockError(const uint8_t* a, const uint8_t* b, int channels) {
+	long err = 0;
+	for (int i = 0; i < 16; ++i) {
+		for (int j = 0; j < channels; ++j)
+			err += (a[i * 4 + j] - b[i * 4 + j]) * (a[i * 4 + j] - b[i * 4 + j]);
+	}
+	return err;
+}
+
+TEST(ImageTests, BC1Quality)
+{
+	uint8_t rgba[64], decoded[64], block[8];
+
+	// Solid blocks should only ever be off by the 565 quantization
+	for (int v = 0; v < 256; v += 5) {
+		for (int i = 0; i < 16; ++i) {
+			rgba[i * 4] = uint8_t(v);
+			rgba[i * 4 + 1] = uint8_t(255 - v);
+			rgba[i * 4 + 2] = uint8_t(v / 2);
+			rgba[i * 4 + 3] = 255;
+		}
+		for (auto q : {bcn::Quality::Fast, bcn::Quality::Normal, bcn::Quality::Best}) {
+			bcn::encode_block(bcn::Format::BC1, q, rgba, block);
+			decodeColorBlock(block, decoded);
+			ASSERT_LE(blockError(rgba, decoded, 3), 16 * (4 * 4 + 2 * 2 + 4 * 4));
+		}
+	}
+
+	// Higher tiers should never do worse in total on noisy gradients
+	long total[3] = {0, 0, 0};
+	uint32_t seed = 99;
+	for (int n = 0; n < 2000; ++n) {
+		for (int i = 0; i < 16; ++i) {
+			seed = seed * 1664525u + 1013904223u;
+			const int noise = int(seed >> 28) - 8;
+			rgba[i * 4] = uint8_t(std::clamp(n % 200 + i * 3 + noise, 0, 255));
+			rgba[i * 4 + 1] = uint8_t(std::clamp(255 - i * 7 + noise, 0, 255));
+			rgba[i * 4 + 2] = uint8_t(std::clamp(n % 97 + (i % 4) * 20, 0, 255));
+			rgba[i * 4 + 3] = 255;
+		}
+		int t = 0;
+		for (auto q : {bcn::Quality::Fast, bcn::Quality::Normal, bcn::Quality::Best}) {
+			bcn::encode_block(bcn::Format::BC1, q, rgba, block);
+			decodeColorBlock(block, decoded);
+			total[t++] += blockError(rgba, decoded, 3);
+		}
+	}
+	ASSERT_LE(total[2], total[1]);
+	ASSERT_LE(total[1], total[0]);
+}
+
+TEST(ImageTests, BC3Alpha)
+{
+	uint8_t rgba[64], block[16];
+	for (int i = 0; i < 16; ++i) {
+		rgba[i * 4] = rgba[i * 4 + 1] = rgba[i * 4 + 2] = 128;
+		rgba[i * 4 + 3] = uint8_t(i * 17); // 0..255 ramp, exactly representable in 8 value mode
+	}
+	bcn::encode_block(bcn::Format::BC3, bcn::Quality::Normal, rgba, block);
+
+	int pal[8] = {block[0], block[1]};
+	ASSERT_GT(pal[0], pal[1]);
+	for (int k = 1; k < 7; ++k)
+		pal[k + 1] = ((7 - k) * pal[0] + k * pal[1] + 3) / 7;
+
+	uint64_t indices = 0;
+	for (int i = 0; i < 6; ++i)
+		indices |= uint64_t(block[2 + i]) << (i * 8);
+	for (int i = 0; i < 16; ++i)
+		ASSERT_NEAR(pal[(indices >> (i * 3)) & 7], rgba[i * 4 + 3], 19);
+}
+
+// Decode an interpolated alpha block (BC3 alpha, BC4/BC5 channels) into one channel of 16 RGBA pixels
+static void decodeAlphaBlock(const uint8_t* block, uint8_t* rgba, int channel) {
+	int pal[8] = {block[0], block[1]};
+	if (pal[0] > pal[1]) {
+		for (int k = 1; k < 7; ++k)
+			pal[k + 1] = ((7 - k) * pal[0] + k * pal[1] + 3) / 7;
+	}
+	else {
+		for (int k = 1; k < 5; ++k)
+			pal[k + 1] = ((5 - k) * pal[0] + k * pal[1] + 2) / 5;
+		pal[6] = 0;
+		pal[7] = 255;
+	}
+	uint64_t indices = 0;
+	for (int i = 0; i < 6; ++i)
+		indices |= uint64_t(block[2 + i]) << (i * 8);
+	for (int i = 0; i < 16; ++i)
+		rgba[i * 4 + channel] = uint8_t(pal[(indices >> (i * 3)) & 7]);
+}
+
+// Decode a BC7 block into 16 RGBA pixels. Only modes 5 and 6, the ones our encoder writes
+static bool decodeBC7Block(const uint8_t* block, uint8_t* rgba) {
+	int pos = 0;
+	auto bits = [&](int n)
+	{
+		int v = 0;
+		for (int i = 0; i < n; ++i, ++pos)
+			v |= ((block[pos >> 3] >> (pos & 7)) & 1) << i;
+		return v;
+	};
+	auto lerp = [](int e0, int e1, int w) { return ((64 - w) * e0 + w * e1 + 32) >> 6; };
+	static constexpr int w2[4] = {0, 21, 43, 64};
+	static constexpr int w4[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+	if ((block[0] & 0x7F) == 0x40) {
+		bits(7);
+		int e[2][4];
+		for (int c = 0; c < 4; ++c) {
+			e[0][c] = bits(7);
+			e[1][c] = bits(7);
+		}
+		const int p[2] = {bits(1), bits(1)};
+		for (int c = 0; c < 4; ++c) {
+			e[0][c] = (e[0][c] << 1) | p[0];
+			e[1][c] = (e[1][c] << 1) | p[1];
+		}
+		for (int i = 0; i < 16; ++i) {
+			const int index = bits(i == 0 ? 3 : 4);
+			for (int c = 0; c < 4; ++c)
+				rgba[i * 4 + c] = uint8_t(lerp(e[0][c], e[1][c], w4[index]));
+		}
+		return true;
+	}
+
+	if ((block[0] & 0x3F) == 0x20) {
+		bits(6);
+		const int rotation = bits(2);
+		int e[2][4];
+		for (int c = 0; c < 3; ++c) {
+			for (int k = 0; k < 2; ++k) {
+				const int v = bits(7);
+				e[k][c] = (v << 1) | (v >> 6);
+			}
+		}
+		e[0][3] = bits(8);
+		e[1][3] = bits(8);
+		for (int i = 0; i < 16; ++i) {
+			const int index = bits(i == 0 ? 1 : 2);
+			for (int c = 0; c < 3; ++c)
+				rgba[i * 4 + c] = uint8_t(lerp(e[0][c], e[1][c], w2[index]));
+		}
+		for (int i = 0; i < 16; ++i)
+			rgba[i * 4 + 3] = uint8_t(lerp(e[0][3], e[1][3], w2[bits(i == 0 ? 1 : 2)]));
+		if (rotation) {
+			for (int i = 0; i < 16; ++i)
+				std::swap(rgba[i * 4 + rotation - 1], rgba[i * 4 + 3]);
+		}
+		return true;
+	}
+	return false;
+}
+
+TEST(ImageTests, BC5Channels)
+{
+	uint8_t rgba[64], decoded[64] = {}, block[16], bc4[8];
+	for (int n = 0; n < 200; ++n) {
+		for (int i = 0; i < 16; ++i) {
+			rgba[i * 4] = uint8_t(std::clamp(n + i * 5, 0, 255));
+			rgba[i * 4 + 1] = uint8_t(std::clamp(255 - n - (i % 4) * 9, 0, 255));
+			rgba[i * 4 + 2] = uint8_t(n * 3);  // Not encoded
+			rgba[i * 4 + 3] = uint8_t(i * 17); // Not encoded
+		}
+		bcn::encode_block(bcn::Format::BC5, bcn::Quality::Normal, rgba, block);
+		decodeAlphaBlock(block, decoded, 0);
+		decodeAlphaBlock(block + 8, decoded, 1);
+		for (int i = 0; i < 16; ++i) {
+			ASSERT_NEAR(decoded[i * 4], rgba[i * 4], 6);
+			ASSERT_NEAR(decoded[i * 4 + 1], rgba[i * 4 + 1], 6);
+		}
+
+		// BC4 is the red half of BC5
+		bcn::encode_block(bcn::Format::BC4, bcn::Quality::Normal, rgba, bc4);
+		ASSERT_EQ(std::memcmp(bc4, block, 8), 0);
+	}
+	ASSERT_EQ(bcn::block_size(bcn::Format::BC4), 8u);
+	ASSERT_EQ(bcn::block_size(bcn::Format::BC5), 16u);
+}
+
+TEST(ImageTests, BC7Quality)
+{
+	uint8_t rgba[64], decoded[64], block[16];
+
+	// Solid blocks land within a step of the 7-bit + p-bit endpoints
+	for (int v = 0; v < 256; v += 5) {
+		for (int i = 0; i < 16; ++i) {
+			rgba[i * 4] = uint8_t(v);
+			rgba[i * 4 + 1] = uint8_t(255 - v);
+			rgba[i * 4 + 2] = uint8_t(v / 2);
+			rgba[i * 4 + 3] = uint8_t(v < 128 ? 255 : v);
+		}
+		for (auto q : {bcn::Quality::Fast, bcn::Quality::Normal, bcn::Quality::Best}) {
+			bcn::encode_block(bcn::Format::BC7, q, rgba, block);
+			ASSERT_TRUE(decodeBC7Block(block, decoded));
+			for (int i = 0; i < 64; ++i)
+				ASSERT_NEAR(decoded[i], rgba[i], 2);
+		}
+	}
+
+	// Higher tiers should never do worse in total, and BC7 should beat BC3 at the same tier. Alpha runs against the
+	// color, so mode 5 has something to win
+	long total[3] = {0, 0, 0}, bc3Total = 0;
+	uint32_t seed = 7;
+	for (int n = 0; n < 2000; ++n) {
+		for (int i = 0; i < 16; ++i) {
+			seed = seed * 1664525u + 1013904223u;
+			const int noise = int(seed >> 28) - 8;
+			rgba[i * 4] = uint8_t(std::clamp(n % 200 + i * 3 + noise, 0, 255));
+			rgba[i * 4 + 1] = uint8_t(std::clamp(255 - i * 7 + noise, 0, 255));
+			rgba[i * 4 + 2] = uint8_t(std::clamp(n % 97 + (i % 4) * 20, 0, 255));
+			rgba[i * 4 + 3] = uint8_t(std::clamp((n % 3) * 100 + (i / 4) * 30 - noise, 0, 255));
+		}
+		int t = 0;
+		for (auto q : {bcn::Quality::Fast, bcn::Quality::Normal, bcn::Quality::Best}) {
+			bcn::encode_block(bcn::Format::BC7, q, rgba, block);
+			ASSERT_TRUE(decodeBC7Block(block, decoded));
+			total[t++] += blockError(rgba, decoded, 4);
+		}
+
+		bcn::encode_block(bcn::Format::BC3, bcn::Quality::Normal, rgba, block);
+		decodeColorBlock(block + 8, decoded);
+		decodeAlphaBlock(block, decoded, 3);
+		bc3Total += blockError(rgba, decoded, 4);
+	}
+	ASSERT_LE(total[2], total[1]);
+	ASSERT_LE(total[1], total[0]);
+	ASSERT_LT(total[1], bc3Total);
+}
+
+//
+// ATI2N is green first, unlike BC5. Checked against a block worked out by hand, so the layout can't drift
+//
+
+TEST(ImageTests, ATI2Layout)
+{
+	// Green is a flat 96, red is 0 in the left two columns and 255 in the right two
+	uint8_t rgba[64];
+	for (int i = 0; i < 16; ++i) {
+		rgba[i * 4] = i % 4 < 2 ? 0 : 255;
+		rgba[i * 4 + 1] = 96;
+		rgba[i * 4 + 2] = 0;
+		rgba[i * 4 + 3] = 255;
+	}
+
+	// Green: both endpoints 96, every index 0. Red: 255 and 0 in 8 value mode, so index 1 for the left two pixels of
+	// each row and 0 for the right two, 3 bits each
+	static constexpr uint8_t expected[16] = {96, 96, 0, 0, 0, 0, 0, 0, 255, 0, 0x09, 0x90, 0x00, 0x09, 0x90, 0x00};
+
+	uint8_t block[16], bc5[16];
+	for (auto q : {bcn::Quality::Fast, bcn::Quality::Normal, bcn::Quality::Best}) {
+		bcn::encode_block(bcn::Format::ATI2, q, rgba, block);
+		ASSERT_EQ(std::memcmp(block, expected, 16), 0);
+
+		bcn::encode_block(bcn::Format::BC5, q, rgba, bc5);
+		ASSERT_EQ(std::memcmp(bc5, expected + 8, 8), 0);
+		ASSERT_EQ(std::memcmp(bc5 + 8, expected, 8), 0);
+	}
+	ASSERT_EQ(bcn::block_size(bcn::Format::ATI2), 16u);
+}
+
+TEST(ImageTests, MemoryRoundTrip)
+{
+	constexpr int W = 37, H = 21;
+	imglib::Image image(imglib::ChannelType::UInt8, 4, W, H, false);
+	auto* px = image.data<uint8_t>();
+	for (int i = 0; i < W * H * 4; ++i)
+		px[i] = uint8_t(i * 7);
+
+	for (auto fmt : {imglib::Png, imglib::Tga, imglib::Bmp}) {
+		std::vector<uint8_t> encoded;
+		ASSERT_TRUE(image.save(
+			[&encoded](const void* data, size_t size)
+			{
+				encoded.insert(encoded.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+			},
+			fmt));
+
+		auto loaded = imglib::Image::load(encoded.data(), encoded.size());
+		ASSERT_TRUE(loaded);
+		ASSERT_EQ(loaded->width(), W);
+		ASSERT_EQ(loaded->height(), H);
+		ASSERT_EQ(loaded->type(), imglib::ChannelType::UInt8);
+
+		// BMP drops alpha, so only compare what survived
+		const int comps = loaded->channels();
+		for (int i = 0; i < W * H; ++i)
+			for (int c = 0; c < std::min(comps, 4); ++c)
+				ASSERT_EQ(loaded->data<uint8_t>()[i * comps + c], px[i * 4 + c]);
+	}
+}
+
+//
+// The header probe must agree with what the decoder ends up producing
+//
+
+TEST(ImageTests, InfoMatchesLoad)
+{
+	std::vector<std::vector<uint8_t>> files;
+	for (auto* name : {"/ao.png", "/normal.png", "/funny-cat-2.jpg"}) {
+		util::MappedFile file;
+		ASSERT_TRUE(file.open(std::string(VTEX2_TEST_ASSETS) + name));
+		files.emplace_back(file.data(), file.data() + file.size());
+	}
+
+	imglib::Image rgba(imglib::ChannelType::UInt8, 4, 13, 7);
+	imglib::Image hdr(imglib::ChannelType::Float, 3, 13, 7);
+	for (auto [image, fmt] : {std::pair{&rgba, imglib::Tga}, {&rgba, imglib::Bmp}, {&hdr, imglib::Hdr}}) {
+		auto& encoded = files.emplace_back();
+		ASSERT_TRUE(image->save(
+			[&encoded](const void* data, size_t size)
+			{
+				encoded.insert(encoded.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+			},
+			fmt));
+	}
+
+	for (auto& file : files) {
+		imglib::ImageInfo_t info;
+		ASSERT_TRUE(imglib::image_info(file.data(), file.size(), info));
+		auto loaded = imglib::Image::load(file.data(), file.size());
+		ASSERT_TRUE(loaded);
+		ASSERT_EQ(info.w, loaded->width());
+		ASSERT_EQ(info.h, loaded->height());
+		ASSERT_EQ(info.comps, loaded->channels());
+		ASSERT_EQ(info.type, loaded->type());
+	}
+	ASSERT_EQ(imglib::Image::load(files.back().data(), files.back().size())->type(), imglib::ChannelType::Float);
+
+	imglib::ImageInfo_t info;
+	const uint8_t junk[] = {1, 2, 3, 4, 5, 6, 7, 8};
+	ASSERT_FALSE(imglib::image_info(junk, sizeof(junk), info));
+}
+
+//
+// Animated GIFs load as one image per frame, and the header probe counts them without decoding
+//
+
+TEST(ImageTests, GifFrames)
+{
+	// Two 1x1 frames with a white and black palette, the first set to white and the second to black
+	const uint8_t gif[] = {
+		'G', 'I', 'F', '8', '9', 'a', 1, 0, 1, 0, 0x80, 0, 0, 0xFF, 0xFF, 0xFF, 0, 0, 0,
+		0x21, 0xF9, 4, 0, 0, 0, 0, 0, 0x2C, 0, 0, 0, 0, 1, 0, 1, 0, 0, 2, 2, 0x44, 0x01, 0,
+		0x21, 0xF9, 4, 0, 0, 0, 0, 0, 0x2C, 0, 0, 0, 0, 1, 0, 1, 0, 0, 2, 2, 0x4C, 0x01, 0,
+		0x3B,
+	};
+
+	imglib::ImageInfo_t info;
+	ASSERT_TRUE(imglib::image_info(gif, sizeof(gif), info));
+	ASSERT_EQ(info.frames, 2);
+
+	auto frames = imglib::Image::load_frames(gif, sizeof(gif));
+	ASSERT_EQ(frames.size(), 2);
+	for (int i = 0; i < 2; ++i) {
+		ASSERT_EQ(frames[i]->width(), 1);
+		ASSERT_EQ(frames[i]->channels(), 4);
+		const auto* px = frames[i]->data<uint8_t>();
+		ASSERT_EQ(px[0], i == 0 ? 0xFF : 0);
+		ASSERT_EQ(px[3], 0xFF);
+	}
+
+	// Anything else is a single frame
+	util::MappedFile png;
+	ASSERT_TRUE(png.open(VTEX2_TEST_ASSETS "/ao.png"));
+	ASSERT_EQ(imglib::Image::load_frames(png.data(), png.size()).size(), 1);
+}
+
+TEST(ImageTests, QualityMetrics)
+{
+	// Odd sizes, so the last band and the edge windows are partial
+	constexpr int W = 37, H = 21, OFFSET = 5;
+	std::vector<uint8_t> ref(W * H * 3), test;
+	for (size_t i = 0; i < ref.size(); ++i)
+		ref[i] = uint8_t((i * 7919) % 251);
+
+	imglib::ErrorStats same;
+	ASSERT_TRUE(imglib::compare(ref.data(), ref.data(), imglib::ChannelType::UInt8, 3, W, H, same));
+	ASSERT_EQ(same.pixels, W * H);
+	for (int c = 0; c < 3; ++c) {
+		ASSERT_TRUE(std::isinf(same.psnr(c)));
+		ASSERT_NEAR(same.mean_ssim(c), 1.0, 1e-6);
+	}
+
+	// A constant offset in red gives an exact PSNR, and only SSIM's luminance term drops
+	test = ref;
+	for (size_t i = 0; i < test.size(); i += 3)
+		test[i] += OFFSET;
+
+	imglib::ErrorStats stats;
+	ASSERT_TRUE(imglib::compare(ref.data(), test.data(), imglib::ChannelType::UInt8, 3, W, H, stats));
+	ASSERT_NEAR(stats.psnr(0), -20.0 * std::log10(OFFSET / 255.0), 1e-3);
+	ASSERT_TRUE(std::isinf(stats.psnr(1)));
+	ASSERT_LT(stats.mean_ssim(0), 1.0);
+	ASSERT_GT(stats.mean_ssim(0), 0.9);
+	ASSERT_NEAR(stats.mean_ssim(2), 1.0, 1e-6);
+
+	// Same result on one thread, and from RGBA float data measured in place
+	imglib::ErrorStats single;
+	ASSERT_TRUE(imglib::compare(ref.data(), test.data(), imglib::ChannelType::UInt8, 3, W, H, single, 1));
+	ASSERT_EQ(single.sse[0], stats.sse[0]);
+	ASSERT_EQ(single.ssim[0], stats.ssim[0]);
+
+	std::vector<float> refF(W * H * 4), testF(W * H * 4);
+	ASSERT_TRUE(imglib::convert_formats(
+		ref.data(), refF.data(), imglib::ChannelType::UInt8, imglib::ChannelType::Float, W, H, 3, 4, -1, -1));
+	ASSERT_TRUE(imglib::convert_formats(
+		test.data(), testF.data(), imglib::ChannelType::UInt8, imglib::ChannelType::Float, W, H, 3, 4, -1, -1));
+	imglib::ErrorStats floats;
+	ASSERT_TRUE(imglib::compare(refF.data(), testF.data(), imglib::ChannelType::Float, 4, W, H, floats));
+	ASSERT_NEAR(floats.psnr(0), stats.psnr(0), 1e-6);
+	ASSERT_NEAR(floats.mean_ssim(0), stats.mean_ssim(0), 1e-6);
+
+	// Images smaller than a window are one window
+	imglib::ErrorStats tiny;
+	ASSERT_TRUE(imglib::compare(ref.data(), test.data(), imglib::ChannelType::UInt8, 3, 3, 2, tiny));
+	ASSERT_EQ(tiny.windows, 1);
+}
+
+TEST(ImageTests, BufferPoolReuse)
+{
+	namespace pool = imglib::pool;
+	pool::trim();
+
+	// Both of these land in the 1 MiB class, so the second one gets the first one's buffer back
+	void* a = pool::alloc(1024 * 1024);
+	ASSERT_TRUE(a);
+	ASSERT_EQ(uintptr_t(a) % pool::ALIGNMENT, 0);
+	std::memset(a, 0xAB, 1024 * 1024);
+	pool::release(a);
+
+	const auto before = pool::stats();
+	void* b = pool::alloc(1000 * 1000);
+	ASSERT_EQ(a, b);
+	ASSERT_EQ(pool::stats().reused, before.reused + 1);
+
+	// Growing within the class keeps the buffer, growing past it moves the contents
+	ASSERT_EQ(pool::realloc(b, 1024 * 1024), b);
+	void* c = pool::realloc(b, 3 * 1024 * 1024);
+	ASSERT_TRUE(c);
+	ASSERT_EQ(static_cast<uint8_t*>(c)[1000 * 1000 - 1], 0xAB);
+	pool::release(c);
+
+	// Huge pages may or may not be available, but the buffer must work either way
+	pool::set_huge_pages(true);
+	void* d = pool::alloc(8 * 1024 * 1024);
+	ASSERT_TRUE(d);
+	ASSERT_EQ(uintptr_t(d) % pool::ALIGNMENT, 0);
+	std::memset(d, 1, 8 * 1024 * 1024);
+	pool::release(d);
+	pool::set_huge_pages(false);
+
+	pool::trim();
+	ASSERT_EQ(pool::stats().cachedBytes, 0);
+}
+
+//
+// Nested parallel_for must cover every item exactly once, and a group must still work after being cancelled
+//
+
+TEST(ParallelTests, NestedAndTaskGroups)
+{
+	std::vector<std::atomic<int>> hits(64 * 64);
+	util::parallel_for(
+		64,
+		[&](std::size_t i)
+		{
+			util::parallel_for(64, [&](std::size_t j) { ++hits[i * 64 + j]; });
+		});
+	for (auto& h : hits)
+		ASSERT_EQ(h.load(), 1);
+
+	std::atomic<int> ran = 0;
+	{
+		util::TaskGroup tasks;
+		for (int i = 0; i < 100; ++i)
+			tasks.run([&] { ++ran; });
+		tasks.wait();
+		ASSERT_EQ(ran.load(), 100);
+
+		// Cancelling only drops what's queued at the time
+		tasks.cancel();
+		ran = 0;
+		for (int i = 0; i < 100; ++i)
+			tasks.run([&] { ++ran; });
+		tasks.wait();
+		ASSERT_EQ(ran.load(), 100);
+	}
+}
+
+//
+// Options take their value either as the next argument or after an =
+//
+
+namespace
+{
+	class ArgsAction : public vtex2::BaseAction {
+	public:
+		ArgsAction() {
+			using namespace vtex2;
+			m_opts.add(ActionOption().short_opt("-w").long_opt("--width").type(OptType::Int).value(-1));
+			m_opts.add(ActionOption().short_opt("-s").long_opt("--scale").type(OptType::Float).value(1.f));
+			m_opts.add(ActionOption().long_opt("--srgb").type(OptType::Bool).value(false));
+		}
+
+		std::string get_name() const override { return "args"; }
+		std::string get_help() const override { return ""; }
+		const vtex2::OptionList& get_options() const override { return m_opts; }
+		int exec(const vtex2::OptionList&) override { return 0; }
+		void cleanup() override {}
+
+	private:
+		vtex2::OptionList m_opts;
+	};
+} // namespace
+
+TEST(ArgTests, ValueForms)
+{
+	ArgsAction action;
+	for (auto& args : std::vector<std::vector<std::string>>{
+			 {"--width=256", "--scale=0.5", "--srgb=true"},
+			 {"--width", "256", "--scale", "0.5", "--srgb"},
+			 {"-w=256", "-s", "0.5", "--srgb"}}) {
+		vtex2::OptionList opts;
+		ASSERT_EQ(vtex2::parse_action_args(&action, args, opts), vtex2::ParseResult::Ok);
+		ASSERT_EQ(opts.get<int>(0), 256);
+		ASSERT_EQ(opts.get<float>(1), 0.5f);
+		ASSERT_TRUE(opts.get<bool>(2));
+	}
+
+	vtex2::OptionList opts;
+	ASSERT_EQ(vtex2::parse_action_args(&action, {"--srgb=false"}, opts), vtex2::ParseResult::Ok);
+	ASSERT_FALSE(opts.get<bool>(2));
+
+	// The whole value has to be a number
+	ASSERT_EQ(vtex2::parse_action_args(&action, {"--width=256px"}, opts), vtex2::ParseResult::BadArgs);
+	ASSERT_EQ(vtex2::parse_action_args(&action, {"--width", ""}, opts), vtex2::ParseResult::BadArgs);
+}
+
+//
+// An exception from any thread must come out of the call that started the work, and leave the pool usable
+//
+
+TEST(ParallelTests, ExceptionsPropagate)
+{
+	EXPECT_THROW(
+		util::parallel_for(
+			10000,
+			[](std::size_t i)
+			{
+				if (i == 5000)
+					throw std::runtime_error("item failed");
+			},
+			4),
+		std::runtime_error);
+
+	std::atomic<int> hits = 0;
+	util::parallel_for(1000, [&](std::size_t) { ++hits; }, 4);
+	ASSERT_EQ(hits.load(), 1000);
+
+	util::TaskGroup tasks;
+	for (int i = 0; i < 10; ++i)
+		tasks.run(
+			[i]
+			{
+				if (i == 3)
+					throw std::runtime_error("task failed");
+			});
+	EXPECT_THROW(tasks.wait(), std::runtime_error);
+
+	// Reported once
+	tasks.run([&] { ++hits; });
+	tasks.wait();
+	ASSERT_EQ(hits.load(), 1001);
+}
+
+//
+// Prefetched files must come back intact in any order, and write-behind must report the writes that failed
+//
+
+TEST(BatchIoTests, PrefetchAndWriteBehind)
+{
+	const auto dir = std::filesystem::temp_directory_path() / "vtex2_batchio_test";
+	std::filesystem::create_directories(dir);
+
+	std::vector<std::filesystem::path> paths;
+	{
+		util::WriteBehind writer(2, 1024);
+		for (int i = 0; i < 8; ++i) {
+			paths.push_back(dir / ("file" + std::to_string(i)));
+			writer.write(paths.back(), std::vector<std::uint8_t>(1000 + i, std::uint8_t(i)));
+		}
+		paths.insert(paths.begin() + 3, dir / "missing");
+
+		auto failures = writer.flush();
+		ASSERT_TRUE(failures.empty());
+		writer.write(dir / "missing" / "file", {1, 2, 3});
+		failures = writer.flush();
+		ASSERT_EQ(failures.size(), 1);
+	}
+
+	util::Prefetcher prefetcher(paths, 2, 1024);
+	const auto check = [&](std::size_t index)
+	{
+		std::vector<std::uint8_t> data;
+		const bool ok = prefetcher.take(index, data);
+		ASSERT_EQ(ok, paths[index].filename() != "missing");
+		if (!ok)
+			return;
+		const int n = std::stoi(paths[index].filename().string().substr(4));
+		ASSERT_EQ(data.size(), 1000 + n);
+		ASSERT_TRUE(std::all_of(data.begin(), data.end(), [n](std::uint8_t b) { return b == n; }));
+	};
+
+	// Swapped pairs, out of order but within the window
+	for (std::size_t i = 0; i + 1 < paths.size(); i += 2) {
+		check(i + 1);
+		check(i);
+	}
+	if (paths.size() % 2)
+		check(paths.size() - 1);
+
+	std::filesystem::remove_all(dir);
+}
+
+//
+// Parallel DEFLATE must round trip VTFLib's compressed files, and produce plain zlib streams
+//
+
+TEST(VtfTests, DeflateRoundTrip)
+{
+	util::MappedFile file;
+	ASSERT_TRUE(file.open(VTEX2_TEST_ASSETS "/deflatecat.vtf"));
+
+	std::vector<std::uint8_t> raw, compressed, raw2;
+	std::string err;
+	int level = 0;
+	ASSERT_TRUE(vtf::inflate(file.data(), file.size(), raw, level, err)) << err;
+	ASSERT_EQ(level, 9);
+
+	ASSERT_TRUE(vtf::deflate(raw.data(), raw.size(), 6, compressed, err, 4)) << err;
+	ASSERT_LT(compressed.size(), raw.size());
+	ASSERT_TRUE(vtf::inflate(compressed.data(), compressed.size(), raw2, level, err, 4)) << err;
+	ASSERT_EQ(level, 6);
+	ASSERT_EQ(raw, raw2);
+
+	// Already uncompressed
+	ASSERT_FALSE(vtf::inflate(raw.data(), raw.size(), raw2, level, err));
+	ASSERT_FALSE(vtf::deflate(compressed.data(), compressed.size(), 6, raw2, err));
+}
+
+//
+// Every image located in a compressed file must decompress to the same bytes as in the decompressed file
+//
+
+TEST(VtfTests, LocateImage)
+{
+	util::MappedFile file;
+	ASSERT_TRUE(file.open(VTEX2_TEST_ASSETS "/deflatecat.vtf"));
+
+	std::vector<std::uint8_t> raw;
+	std::string err;
+	int level = 0;
+	ASSERT_TRUE(vtf::inflate(file.data(), file.size(), raw, level, err)) << err;
+
+	vtf::HeaderInfo info, rawInfo;
+	ASSERT_TRUE(vtf::read_header(file.data(), file.size(), info, err)) << err;
+	ASSERT_TRUE(vtf::read_header(raw.data(), raw.size(), rawInfo, err)) << err;
+
+	std::uint64_t total = 0;
+	for (int mip = 0; mip < info.mips; ++mip) {
+		for (int frame = 0; frame < info.frames; ++frame) {
+			for (int face = 0; face < info.faces; ++face) {
+				vtf::ImageLocation loc, rawLoc;
+				ASSERT_TRUE(vtf::locate_image(file.data(), file.size(), info, frame, face, mip, loc, err)) << err;
+				ASSERT_TRUE(vtf::locate_image(raw.data(), raw.size(), rawInfo, frame, face, mip, rawLoc, err)) << err;
+				ASSERT_TRUE(loc.compressed);
+				ASSERT_FALSE(rawLoc.compressed);
+				ASSERT_EQ(loc.imageSize, rawLoc.size);
+
+				std::vector<std::uint8_t> image(loc.imageSize);
+				ASSERT_TRUE(vtf::inflate_chunk(file.data() + loc.offset, loc.size, image.data(), image.size()));
+				ASSERT_TRUE(std::equal(image.begin(), image.end(), raw.begin() + rawLoc.offset));
+				total += rawLoc.size;
+			}
+		}
+	}
+	ASSERT_EQ(total, rawInfo.imageSize);
+
+	vtf::ImageLocation loc;
+	ASSERT_FALSE(vtf::locate_image(file.data(), file.size(), info, info.frames, 0, 0, loc, err));
+	ASSERT_FALSE(vtf::locate_image(file.data(), file.size() / 2, info, 0, 0, 0, loc, err));
+
+	// A cut off stream only passes for the tiny mips older VTFLib versions truncate
+	std::vector<std::uint8_t> image;
+	ASSERT_TRUE(vtf::locate_image(file.data(), file.size(), info, 0, 0, 0, loc, err)) << err;
+	image.resize(loc.imageSize);
+	ASSERT_FALSE(vtf::inflate_chunk(file.data() + loc.offset, loc.size / 2, image.data(), image.size()));
+	ASSERT_TRUE(vtf::locate_image(file.data(), file.size(), info, 0, 0, info.mips - 1, loc, err)) << err;
+	image.resize(loc.imageSize);
+	ASSERT_TRUE(vtf::inflate_chunk(file.data() + loc.offset, loc.size - 1, image.data(), image.size()));
+}
+
+//
+// Patching the header must leave the image data readable, including when a CRC resource gets added
+//
+
+TEST(VtfTests, PatchHeader)
+{
+	util::MappedFile file;
+	ASSERT_TRUE(file.open(VTEX2_TEST_ASSETS "/deflatecat.vtf"));
+	std::vector<std::uint8_t> src(file.data(), file.data() + file.size());
+
+	vtf::HeaderInfo info;
+	std::string err;
+	ASSERT_TRUE(vtf::read_header(src.data(), src.size(), info, err)) << err;
+
+	// Turn its CRC into an LOD resource, so a new CRC entry has to be added. The directory starts at byte 80
+	for (std::size_t i = 0; i < info.resources.size(); ++i) {
+		if (info.resources[i].type == VTF_RSRC_CRC) {
+			const std::uint32_t type = VTF_RSRC_TEXTURE_LOD_SETTINGS;
+			std::memcpy(src.data() + 80 + i * 8, &type, sizeof(type));
+		}
+	}
+	ASSERT_TRUE(vtf::read_header(src.data(), src.size(), info, err)) << err;
+	ASSERT_FALSE(info.hasCrc);
+
+	vtf::HeaderPatch patch;
+	patch.minorVersion = info.minorVersion;
+	patch.flags = info.flags | TEXTUREFLAGS_CLAMPS;
+	patch.startFrame = 0;
+	patch.bumpScale = 2.5f;
+	patch.setCrc = true;
+	patch.crc = 0x12345678;
+
+	std::vector<std::uint8_t> header;
+	ASSERT_TRUE(vtf::patch_header(src.data(), src.size(), patch, header, err)) << err;
+	ASSERT_EQ(header.size(), info.headerSize + 8);
+
+	std::vector<std::uint8_t> patched = header;
+	patched.insert(patched.end(), src.data() + info.headerSize, src.data() + src.size());
+
+	vtf::HeaderInfo patchedInfo;
+	ASSERT_TRUE(vtf::read_header(patched.data(), patched.size(), patchedInfo, err)) << err;
+	ASSERT_EQ(patchedInfo.flags, patch.flags);
+	ASSERT_EQ(patchedInfo.bumpScale, 2.5f);
+	ASSERT_TRUE(patchedInfo.hasCrc);
+	ASSERT_EQ(patchedInfo.crc, 0x12345678u);
+	ASSERT_EQ(patchedInfo.resources.size(), info.resources.size() + 1);
+	ASSERT_EQ(patchedInfo.compressionLevel, info.compressionLevel);
+
+	// Same image data once decompressed, which only works if every offset moved along with it
+	std::vector<std::uint8_t> raw, patchedRaw;
+	int level = 0;
+	ASSERT_TRUE(vtf::inflate(src.data(), src.size(), raw, level, err)) << err;
+	ASSERT_TRUE(vtf::inflate(patched.data(), patched.size(), patchedRaw, level, err)) << err;
+	ASSERT_EQ(patchedRaw.size(), raw.size() + 8);
+	ASSERT_TRUE(std::equal(raw.end() - info.imageSize, raw.end(), patchedRaw.end() - info.imageSize));
+
+	// Replacing the CRC keeps the header the same size
+	patch.crc = 0xCAFE;
+	ASSERT_TRUE(vtf::patch_header(patched.data(), patched.size(), patch, header, err)) << err;
+	ASSERT_EQ(header.size(), patchedInfo.headerSize);
+
+	// The header layout can't change
+	patch.minorVersion = 2;
+	ASSERT_FALSE(vtf::patch_header(src.data(), src.size(), patch, header, err));
+}